@@ -17,27 +17,44 @@
  * Every memory block has therefore a size that is
  * a multiple of MINSIZE. 
  *
- * The available memory is split into two halves:
- * - the first half (which is a power of two) is used as main heap
- * - the second half contains the bookkeeping structures and
- *   an emergency heap used, when the main heap runs out of memory.
- *   The emergency heap uses the simpler (and slightly less efficient)
- *   First-Fit algorithm.
+ * The available memory is split into
+ * - the main heap,
+ * - an optional emergency heap used, when the main heap runs out
+ *   of memory. The emergency heap uses the simpler
+ *   (and slightly less efficient) First-Fit algorithm.
+ * - the bookkeeping structures.
+ * By default, the main heap is one half of the memory and
+ * the emergency heap and bookkeeping share the other half.
+ * The user may instead choose the size of the emergency heap
+ * (or go without), the main heap then takes what remains.
  *
- * Bookkeeping consists of two memory regions:
+ * The main heap needs not be a power of two. It is composed of
+ * top-level blocks of decreasing powers of two, e.g.
+ * 2^20 + 2^18 + 2^12. Since each top-level block starts
+ * at a multiple of its own size, the buddy relation holds
+ * within each of them. Its buddy to the right is either beyond
+ * the main heap or lies in the smaller top-level blocks,
+ * which cannot contain an available block of the same size,
+ * so top-level blocks are never joined.
+ *
+ * Bookkeeping consists of three memory regions:
  * - the "avalable" area
  * - the "size" area
+ * - the "free" area
  *
  * The available area contains pointers to lists of available blocks.
  * There is one list per exponent, i.e. 2^3, 2^4, ... 2^max
- * where 2^max = size of the main heap and assuming that MINSIZE = 8.
+ * where 2^max = size of the largest top-level block
+ * and assuming that MINSIZE = 8.
  * 
  * The list of available blocks is stored in the main heap itself.
  * Available blocks are seen as MINSIZE blocks each part of a
  * doubly linked list. The next and previous pointers in each block
- * are 32bit pseudo pointers (only considering the heap).
- * The max size of the main heap is therefore 4 GiB.
- * This also implies that MINSIZE must be at leat 8 bytes.
+ * are pseudo pointers (offsets into the heap) of type memoff_t,
+ * which has 32 bits or, with MEMMAN_OFFSET64, 64 bits (see memoff.h).
+ * The max size of the main heap is therefore 4 GiB (8 EiB).
+ * This also implies that MINSIZE must hold two offsets,
+ * i.e. 8 bytes (16 bytes).
  *
  * When a block of size n is allocated we search in the available
  * lists with index >= log2(n). If we don't find a block
@@ -55,15 +72,31 @@
  *
  *  ((HeapSize / MINSIZE) * 6) / 8
  *
+ * Packing the codes costs shifts, masks and, for codes crossing
+ * a byte boundary, two memory accesses per operation.
+ * Compiled with BUDDY_BYTEMAP, each code is stored in a byte of its own
+ * instead, which makes every access a single aligned load or store
+ * at the price of 33% more bookkeeping:
+ *
+ *  HeapSize / MINSIZE
+ *
+ * The free area has exactly the same layout as the size area.
+ * But it stores the exponent of available blocks, i.e. of those
+ * blocks that are currently in one of the available lists.
+ * The entry is set whenever a block is inserted into a list
+ * and erased whenever it is removed. We can therefore decide
+ * in constant time if a block is available with a given size
+ * without searching the available list.
+ *
  * The following diagram shows the memory layout:
  *
- *     +---------------+--------+--+----+    
+ *     +---------------+--------+--+----+----+
+ *     |               |        |  |    |    |
+ *     +---------------+--------+--+----+----+
+ *     ^               ^        ^  ^    ^
  *     |               |        |  |    |
- *     +---------------+--------+--+----+
- *     ^               ^        ^  ^
- *     |               |        |  |
- *     main heap      emergency |  size area
- *                    heap      |
+ *     main heap      emergency |  |    free area
+ *                    heap      |  size area
  *                            available area
  *
  *
@@ -78,16 +111,47 @@
  *
  * -----------------------------------------------------------------------
  */
+#define _GNU_SOURCE
 #include <buddy.h>
+#include <memtrace.h>
+#include <meminst.h>
+#include <mempers.h>
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
+#include <sys/mman.h>
 
 /* -----------------------------------------------------------------------
  * MINSIZE: minimal allocation size
+ *          (an available block holds two offsets)
+ * -----------------------------------------------------------------------
+ */
+#define MINSIZE ((memoff_t)1 << BUDDY_MINORDER)
+
+/* -----------------------------------------------------------------------
+ * CODEBITS: bits per code in the size and the free area
  * -----------------------------------------------------------------------
  */
-#define MINSIZE     8
+#ifdef BUDDY_BYTEMAP
+#define CODEBITS    8
+#else
+#define CODEBITS    6
+#endif
+
+/* -----------------------------------------------------------------------
+ * Pages of large available blocks are released in PAGESIZE units.
+ * MADV_DONTNEED drops them at once, so that the resident set shrinks
+ * immediately; compiled with BUDDY_MADV_FREE, the cheaper MADV_FREE
+ * is used and the kernel reclaims the pages only under memory pressure.
+ * -----------------------------------------------------------------------
+ */
+#define PAGESIZE 4096
+
+#if defined(BUDDY_MADV_FREE) && defined(MADV_FREE)
+#define RELEASE MADV_FREE
+#else
+#define RELEASE MADV_DONTNEED
+#endif
 
 /* ------------------------------------------------------------------------
  * Some shortcuts
@@ -112,61 +176,82 @@ static inline char found(char rc) {
  * - Dereference such a pointer
  * ------------------------------------------------------------------------
  */
-#define NOBLOCK 0xffffffff
+#define NOBLOCK MEMOFF_NONE
 #define REFBLOCK(n) ((block_list_t*)block2ptr(h,n))
 
 /* --------------------------------------------------------------------------
- * Convert pseudo block address (uint32_t) to real pointer
+ * Convert pseudo block address (memoff_t) to real pointer
  * --------------------------------------------------------------------------
  */
-static inline void *block2ptr(buddy_heap_t *h, uint32_t add) {
+static inline void *block2ptr(buddy_heap_t *h, memoff_t add) {
 	return (add == NOBLOCK ? NULL :
-                ((void*)((uintptr_t)(add) + (uintptr_t)h->mh)));
+                ((void*)((uintptr_t)(add) + (uintptr_t)h->hb)));
 }
 
 /* --------------------------------------------------------------------------
- * Convert real pointer into pseudo block address (uint32_t)
+ * Convert real pointer into pseudo block address (memoff_t)
  * --------------------------------------------------------------------------
  */
-static inline uint32_t ptr2block(buddy_heap_t *h, void *ptr) {
+static inline memoff_t ptr2block(buddy_heap_t *h, void *ptr) {
 	return (ptr == NULL ? NOBLOCK :
-	        (uint32_t)((uintptr_t)(ptr) - (uintptr_t)h->mh));
+	        (memoff_t)((uintptr_t)(ptr) - (uintptr_t)h->hb));
 }
 
 /* --------------------------------------------------------------------------
  * Convert pseudo block address to size address
  * --------------------------------------------------------------------------
  */
-static inline uint32_t block2size(uint32_t add) {
-	return (add>>3);
+static inline memoff_t block2size(memoff_t add) {
+	return (add/MINSIZE);
 }
 
 /* --------------------------------------------------------------------------
- * count leading zeros (clz)
+ * count leading zeros (clz) of an offset
+ * --------------------------------------------------------------------------
+ */
+#define clz memoff_clz
+
+/* --------------------------------------------------------------------------
+ * count trailing zeros (ctz) of an offset
+ * --------------------------------------------------------------------------
+ */
+#define ctz memoff_ctz
+
+/* --------------------------------------------------------------------------
+ * count trailing zeros 64bit (ctzll)
  * --------------------------------------------------------------------------
  */
 #ifdef __GNUC__
-#define clz __builtin_clz
+#define ctzll __builtin_ctzll
 #endif
 
 /* --------------------------------------------------------------------------
  * log2
  * based on the formula for 32bit integers:
  * log2 = 32 - (1 + clz)
+ * (64 for 64bit offsets)
  * --------------------------------------------------------------------------
  */
-static inline uint8_t buddy_log2(uint32_t n) {
-	return (8*sizeof(uint32_t) - 1 - clz(n));
+static inline uint8_t buddy_log2(memoff_t n) {
+	return (MEMOFF_BITS - 1 - clz(n));
 }
 
 /* --------------------------------------------------------------------------
  * modulus division by power of 2
  * --------------------------------------------------------------------------
  */
-static inline uint32_t modpow2(uint32_t n, uint32_t d) {
+static inline memoff_t modpow2(memoff_t n, memoff_t d) {
 	return (n & (d-1));
 }
 
+/* --------------------------------------------------------------------------
+ * round up to the next multiple of a power of two
+ * --------------------------------------------------------------------------
+ */
+static inline uintptr_t alignup(uintptr_t n, uintptr_t a) {
+	return ((n + a - 1) & ~(a - 1));
+}
+
 /* --------------------------------------------------------------------------
  * get next power of 2, i.e.:
  * if sz == 0: 1
@@ -181,16 +266,45 @@ static inline uint32_t modpow2(uint32_t n, uint32_t d) {
  * 1000 (8)
  * --------------------------------------------------------------------------
  */
-static inline uint32_t nextpow2(uint32_t sz) {
+static inline memoff_t nextpow2(memoff_t sz) {
 	sz--;
 	sz |= sz >> 1;
 	sz |= sz >> 2;
 	sz |= sz >> 4;
 	sz |= sz >> 8;
 	sz |= sz >> 16;
+#ifdef MEMMAN_OFFSET64
+	sz |= sz >> 32;
+#endif
 	return (sz+1);
 }
 
+/* --------------------------------------------------------------------------
+ * block size for a request of sz bytes:
+ * the next power of 2, at least MINSIZE;
+ * requests greater than the largest top-level block yield msize
+ * (and fail, since blocks are smaller than the main heap)
+ * --------------------------------------------------------------------------
+ */
+static inline memoff_t blocksize(buddy_heap_t *h, size_t sz) {
+	if (sz < MINSIZE) return MINSIZE;
+	if (sz > ((memoff_t)1 << h->AMAX)) return h->msize;
+	return nextpow2((memoff_t)sz);
+}
+
+/* --------------------------------------------------------------------------
+ * routing: a request of sz bytes in a block of s bytes
+ * goes to the emergency heap first if it wastes
+ * more than wr per mille of the block and more than ws bytes
+ * --------------------------------------------------------------------------
+ */
+static inline char routed(buddy_heap_t *h, size_t sz, memoff_t s) {
+	if (!h->e || (h->wr == 0 && h->ws == 0)) return 0;
+	size_t w = s > sz ? s - sz : 0;
+	return ((h->wr == 0 || w * 1000 > (size_t)h->wr * s) &&
+	        (h->ws == 0 || w > h->ws));
+}
+
 /* --------------------------------------------------------------------------
  * find the buddy for a given block address
  * buddy = block + 2^k if block = 0 (mod 2^(k+1)) and
@@ -198,8 +312,8 @@ static inline uint32_t nextpow2(uint32_t sz) {
  * where 2^k is the size of the block
  * --------------------------------------------------------------------------
  */
-static inline uint32_t findbuddy(uint32_t block, uint8_t s) {
-	uint32_t k = 1 << s;
+static inline memoff_t findbuddy(memoff_t block, uint8_t s) {
+	memoff_t k = (memoff_t)1 << s;
 	return ((block & ((k << 1) - 1)) == 0 ? block + k
 	                                      : block - k);
 }
@@ -208,54 +322,115 @@ static inline uint32_t findbuddy(uint32_t block, uint8_t s) {
  * Block size interface
  * --------------------------------------------------------------------------
  */
+static inline memoff_t init_codes(memoff_t n);
 static inline void init_size(buddy_heap_t *h);
-static inline void putsize(buddy_heap_t *h, int i, char c);
-static inline void erasesize(buddy_heap_t *h, int i);
-static inline char getsize(buddy_heap_t *h, int i);
-static inline uint32_t block2size(uint32_t add);
+static inline memoff_t nextcode(uint8_t *a, memoff_t i, memoff_t n);
+static inline void putsize(buddy_heap_t *h, memoff_t i, char c);
+static inline void erasesize(buddy_heap_t *h, memoff_t i);
+static inline char getsize(buddy_heap_t *h, memoff_t i);
+static inline memoff_t block2size(memoff_t add);
+
+/* --------------------------------------------------------------------------
+ * Free block interface
+ * --------------------------------------------------------------------------
+ */
+static inline void putfree(buddy_heap_t *h, memoff_t i, char c);
+static inline void erasefree(buddy_heap_t *h, memoff_t i);
+static inline char getfree(buddy_heap_t *h, memoff_t i);
 
 /* --------------------------------------------------------------------------
  * Block list interface
  * --------------------------------------------------------------------------
  */
 static inline void init_avail(buddy_heap_t *h);
-static inline void block_insert(buddy_heap_t *h, uint32_t list,
-                                                 uint32_t add);
-static inline uint32_t block_remove(buddy_heap_t *h, uint32_t list,
-                                                     uint32_t add);
-static inline char block_is_in(buddy_heap_t *h, uint32_t list,
-                                                uint32_t add);
-static inline void block_clean(buddy_heap_t *h, uint32_t add);
+static inline void block_insert(buddy_heap_t *h, memoff_t list,
+                                                 memoff_t add);
+static inline memoff_t block_remove(buddy_heap_t *h, memoff_t list,
+                                                     memoff_t add);
+static inline void block_clean(buddy_heap_t *h, memoff_t add);
+static inline void block_append(buddy_heap_t *h, memoff_t tail,
+                                                 memoff_t add);
+static inline void block_push(buddy_heap_t *h, memoff_t *list,
+                                               memoff_t add);
+static inline memoff_t block_next(buddy_heap_t *h, memoff_t add);
+static inline memoff_t block_prev(buddy_heap_t *h, memoff_t add);
 
 /* --------------------------------------------------------------------------
  * "High level" interface
  * ----------------------
- * binsert: insert a block into the available list of size 2^sz
+ * binsert: insert a block into the available list of size 2^sz,
+ *          remember the size in the free area and
+ *          mark the list as non-empty in the available mask
  * --------------------------------------------------------------------------
  */
-static inline void binsert(buddy_heap_t *h, uint32_t add, uint8_t sz) {
+static inline void binsert(buddy_heap_t *h, memoff_t add, uint8_t sz) {
+	if (h->ah[sz] == NOBLOCK) h->at[sz] = add;
 	block_insert(h, h->ah[sz], add);
 	h->ah[sz] = add; // we always insert at the head
 	assert(h->ah[sz] < h->msize || h->ah[sz] == NOBLOCK);
+	putfree(h, block2size(add), sz);
+	h->am |= ((memoff_t)1 << sz);
+	h->fc[sz]++;
+}
+
+/* --------------------------------------------------------------------------
+ * bappend: insert a block at the tail of the available list of size 2^sz
+ *          (deferred blocks in lazy mode, see bfree)
+ * --------------------------------------------------------------------------
+ */
+static inline void bappend(buddy_heap_t *h, memoff_t add, uint8_t sz) {
+	block_append(h, h->at[sz], add);
+	if (h->ah[sz] == NOBLOCK) h->ah[sz] = add;
+	h->at[sz] = add;
+	putfree(h, block2size(add), sz);
+	h->am |= ((memoff_t)1 << sz);
+	h->fc[sz]++;
 }
 
 /* --------------------------------------------------------------------------
- * bremove: remove a block from the available list of size 2^sz
+ * bremove: remove a block from the available list of size 2^sz,
+ *          erase the size from the free area and,
+ *          if the list is now empty, clear it in the available mask
  * --------------------------------------------------------------------------
  */
-static inline void bremove(buddy_heap_t *h, uint32_t add, uint8_t sz) {
+static inline void bremove(buddy_heap_t *h, memoff_t add, uint8_t sz) {
+	assert(getfree(h, block2size(add)) == sz);
+	if (h->at[sz] == add) h->at[sz] = block_prev(h, add);
 	h->ah[sz] = block_remove(h, h->ah[sz], add);
 	assert(h->ah[sz] < h->msize || h->ah[sz] == NOBLOCK);
+	erasefree(h, block2size(add));
+	if (h->ah[sz] == NOBLOCK) h->am &= ~((memoff_t)1 << sz);
+	h->fc[sz]--;
 }
 
 /* --------------------------------------------------------------------------
  * bisin: check if a block is in available list of size 2^sz
  * 1 if it is in
  * 0 if not
+ * The free area tells us without searching the list.
  * --------------------------------------------------------------------------
  */
-static inline char bisin(buddy_heap_t *h, uint32_t add, uint8_t sz) {
-	return block_is_in(h, h->ah[sz], add);	
+static inline char bisin(buddy_heap_t *h, memoff_t add, uint8_t sz) {
+	MEMINST_COUNT(MEMINST_STEPS_FIND, 1);
+	return (add < h->msize && getfree(h, block2size(add)) == sz);
+}
+
+/* --------------------------------------------------------------------------
+ * Statistics: count a block of size sz as used or freed
+ * --------------------------------------------------------------------------
+ */
+static inline void countused(buddy_heap_t *h, memoff_t sz) {
+	h->st.usd += sz; h->st.blks++;
+	if (h->st.usd > h->st.wmark) h->st.wmark = h->st.usd;
+}
+
+static inline void countfreed(buddy_heap_t *h, memoff_t sz) {
+	h->st.usd -= sz; h->st.blks--;
+}
+
+static inline void countresized(buddy_heap_t *h, memoff_t o, memoff_t n) {
+	h->st.usd = h->st.usd - o + n;
+	if (h->st.usd > h->st.wmark) h->st.wmark = h->st.usd;
 }
 
 /* --------------------------------------------------------------------------
@@ -264,9 +439,10 @@ static inline char bisin(buddy_heap_t *h, uint32_t add, uint8_t sz) {
  * insert the block and block + 2^(sz/2) into the next available list
  * --------------------------------------------------------------------------
  */
-static inline void bsplit(buddy_heap_t *h, uint32_t add, uint8_t sz) {
-	uint32_t s;
-	bremove(h, add, sz); sz--; s = 1<<sz;
+static inline void bsplit(buddy_heap_t *h, memoff_t add, uint8_t sz) {
+	memoff_t s;
+	MEMINST_COUNT(MEMINST_SPLITS, 1);
+	bremove(h, add, sz); sz--; s = (memoff_t)1<<sz;
 	binsert(h, add+s, sz);
 	binsert(h, add, sz);
 }
@@ -278,66 +454,161 @@ static inline void bsplit(buddy_heap_t *h, uint32_t add, uint8_t sz) {
  * - compute the address of the joined block (= the lower address)
  * - insert the joined block in the next smaller available list
  * - repeat...
- * if the original block was joined, return 1 else return 0
+ * if the original block was joined, return 1 else return 0;
+ * add and sz are set to the joined block
  * --------------------------------------------------------------------------
  */
-static inline char bjoin(buddy_heap_t *h, uint32_t add, uint8_t sz) {
+static inline char bjoin(buddy_heap_t *h, memoff_t *add, uint8_t *sz) {
 	char rc = 0;
-	uint32_t b = add;
+	memoff_t b = *add;
+	uint8_t s = *sz;
 
-	for(uint8_t s = sz; s < h->AMAX; s++) {
-		uint32_t buddy = findbuddy(b,s);
+	for(; s < h->AMAX; s++) {
+		memoff_t buddy = findbuddy(b,s);
 
 		if (bisin(h, buddy, s)) {
 			bremove(h, buddy, s);
 			if (rc != 0) bremove(h, b, s);
 			b = b < buddy ? b : buddy;
 			binsert(h, b,s+1);
+			MEMINST_COUNT(MEMINST_JOINS, 1);
 			if (rc == 0) rc = 1;
 		} else break;
 	}
+	*add = b; *sz = s;
 	return rc;
 }
 
+/* --------------------------------------------------------------------------
+ * bcoalesce: join the last k blocks in the available list of sz
+ *            whose buddies are available, too (lazy coalescing)
+ * - deferred blocks are appended to the list, so the blocks
+ *   deferred since the last join are among the last k
+ * - each block removed by a join is either the block itself
+ *   or its buddy, which may be the previous one in the list
+ * --------------------------------------------------------------------------
+ */
+static inline void brelease(buddy_heap_t *h, memoff_t add, uint8_t sz);
+
+static void bcoalesce(buddy_heap_t *h, uint8_t sz, uint32_t k) {
+	if (sz >= h->AMAX) return;
+	memoff_t b = h->at[sz];
+	for(; k > 0 && b != NOBLOCK; k--) {
+		memoff_t p = block_prev(h, b);
+		memoff_t buddy = findbuddy(b, sz);
+		if (bisin(h, buddy, sz)) {
+			if (p == buddy) p = block_prev(h, buddy);
+			uint8_t s = sz;
+			bremove(h, b, s);
+			bjoin(h, &b, &s);
+			brelease(h, b, s);
+		}
+		b = p;
+	}
+}
+
+/* --------------------------------------------------------------------------
+ * bcoalesceall: join all blocks deferred since the last time,
+ *               smaller sizes first (joined blocks are joined
+ *               with their buddies in the larger sizes by bjoin)
+ * --------------------------------------------------------------------------
+ */
+static void bcoalesceall(buddy_heap_t *h) {
+	if (h->ld == 0) return;
+	for(uint8_t i=buddy_log2(MINSIZE); i<h->AMAX; i++) {
+		if (h->lf[i] > 0) bcoalesce(h, i, h->lf[i]);
+	}
+	memset(h->lf, 0, sizeof(h->lf));
+	h->ld = 0;
+}
+
+/* --------------------------------------------------------------------------
+ * bfree: insert a block that is no longer in use
+ *        joining it with its buddies and releasing its pages
+ * In lazy mode (lt > 0), the block is appended without joining.
+ * Once its size has more than lt available blocks and lt blocks
+ * of that size were deferred, the deferred blocks are joined;
+ * blocks whose buddies are in use are not visited again,
+ * but joined when their buddies are freed.
+ * Each free thus walks at most one block on average.
+ * --------------------------------------------------------------------------
+ */
+static inline void bfree(buddy_heap_t *h, memoff_t add, uint8_t sz) {
+	if (h->lt > 0) {
+		bappend(h,add,sz);
+		brelease(h, add, sz);
+		h->ld++;
+		h->lf[sz]++;
+		if (h->fc[sz] > h->lt && h->lf[sz] >= h->lt) {
+			h->ld -= h->lf[sz];
+			bcoalesce(h, sz, h->lf[sz]);
+			h->lf[sz] = 0;
+		}
+		return;
+	}
+	if (!bjoin(h, &add, &sz)) binsert(h,add,sz);
+	brelease(h, add, sz);
+}
+
+/* --------------------------------------------------------------------------
+ * brelease: return the pages of an available block to the OS
+ *           if the block is at least rt bytes.
+ * The first page holds the list pointers and stays;
+ * the other pages are zero-filled on the next access.
+ * --------------------------------------------------------------------------
+ */
+static inline void brelease(buddy_heap_t *h, memoff_t add, uint8_t sz) {
+	memoff_t s = (memoff_t)1 << sz;
+	if (h->rt == 0 || s < h->rt) return;
+
+	uintptr_t a = alignup(h->hb + add + MINSIZE, PAGESIZE);
+	uintptr_t z = (h->hb + add + s) & ~((uintptr_t)PAGESIZE - 1);
+	if (z > a) madvise((void*)a, z - a, RELEASE);
+}
+
 /* --------------------------------------------------------------------------
  * bextend: try to extend the current block
  *          parameters: block address,
  *                      current size,
  *                      intended size.
- *          returns 1 on success and 0 otherwise.
+ *          returns the address of the extended block
+ *          or NOBLOCK if it cannot be extended.
  *
  * - tries to extend the given block by adding buddies
- * - the buddies need to be at the "right" of the block
- *   (i.e. the address must be greater)
- * - there must be a buddy for each step up to size s/2
+ * - there must be an available buddy for each step up to size s/2;
+ *   buddies on the left move the start of the block down
  * - we make a "dry run" to test the conditions and,
- *   if ok, we perform a real run, removing the buddies
+ *   if ok, we perform a real run, removing the buddies,
+ *   moving the data down to the new start (if it changed)
  *   and changing the block size.
  * --------------------------------------------------------------------------
  */
-static inline char bextend(buddy_heap_t *h, uint32_t b, uint8_t c, uint8_t s)
+static inline memoff_t bextend(buddy_heap_t *h, memoff_t b,
+                                      uint8_t c, uint8_t s)
 {
-	char rc = 0;
+	memoff_t n = b;
 	uint8_t i = c;
 
 	// dry run
 	for(; i<s; i++) {
-		uint32_t buddy = findbuddy(b,i);
-		if (buddy < b) break;
+		memoff_t buddy = findbuddy(n,i);
 		if (!bisin(h,buddy,i)) break;
+		if (buddy < n) n = buddy;
 	}
+	if (i < s) return NOBLOCK;
+
 	// real run
-	if (i == s) {
-		for(i=c; i<s; i++) {
-			uint32_t buddy = findbuddy(b,i);
-			bremove(h,buddy, i);
-		}
-		uint32_t k = block2size(b);
-		erasesize(h,k);
-		putsize(h,k,s);
-		rc = 1;
+	n = b;
+	for(i=c; i<s; i++) {
+		memoff_t buddy = findbuddy(n,i);
+		bremove(h,buddy, i);
+		if (buddy < n) n = buddy;
 	}
-	return rc;
+	erasesize(h,block2size(b));
+	if (n != b) memmove(block2ptr(h,n), block2ptr(h,b), (memoff_t)1 << c);
+	putsize(h,block2size(n),s);
+	countresized(h, (memoff_t)1 << c, (memoff_t)1 << s);
+	return n;
 }
 
 /* --------------------------------------------------------------------------
@@ -348,38 +619,26 @@ static inline char bextend(buddy_heap_t *h, uint32_t b, uint8_t c, uint8_t s)
  *          The function always succeeds.
  *
  * - We first change the size
- * - Then we cut off the block with the intended size
- * - Then we proceed as follows until the remain is 0:
- *   - If the remainder is a power of two
- *     we insert the remainder and we are done.
- *   - Otherwise we split the the remainder into two parts:
- *     + the half of the next power of two
- *     + the difference of the remainder and that half                           
- *   - The half is inserted
- *   - The remainder is set to the second part
+ * - Then we insert the right halves that are cut off
+ *   when the block is split down to the intended size:
+ *   the buddies of size 2^s, 2^(s+1), ..., 2^(c-1)
+ *   at b + 2^s, b + 2^(s+1), ..., b + 2^(c-1).
+ *   Their buddies contain the block, so none of them can be joined.
  *
  * This always works and never leaves a remainder < minsize
  * because all block sizes are multiples of minsize.
  * (All powers of 2 >= minsize are multiples of minsize.)
  * --------------------------------------------------------------------------
  */
-static inline void bshrink(buddy_heap_t *h, uint32_t b, uint8_t c, uint8_t s)
+static inline void bshrink(buddy_heap_t *h, memoff_t b, uint8_t c, uint8_t s)
 {
-	uint32_t cz = 1 << c;
-	uint32_t sz = 1 << s;
-
-	uint32_t k = block2size(b);
+	memoff_t k = block2size(b);
 	erasesize(h,k); putsize(h,k,s);
+	countresized(h, (memoff_t)1 << c, (memoff_t)1 << s);
 
-	b += sz; binsert(h,b,s); b += sz;
-
-	cz -= sz << 1;
-	
-	while (cz > 0) {
-		k = nextpow2(cz);
-		if (cz != k) k >>= 2;
-		binsert(h, b, buddy_log2(k));
-		cz -= k; b += k;
+	for(uint8_t i=s; i<c; i++) {
+		binsert(h, b + ((memoff_t)1 << i), i);
+		brelease(h, b + ((memoff_t)1 << i), i);
 	}
 }
 
@@ -387,22 +646,29 @@ static inline void bshrink(buddy_heap_t *h, uint32_t b, uint8_t c, uint8_t s)
  * malloc:
  * - find an available block starting with the exact size
  * - going up to AMAX
+ *   (the available mask gives us the smallest non-empty list
+ *    greater or equal to the exact size in one step)
  * - if a block was found split it until we reach the exact size
  * - remove the block from the available list
  * - remember the size
  * --------------------------------------------------------------------------
  */
-static uint32_t getblock(buddy_heap_t *h, uint32_t sz) {
-	uint32_t b = NOBLOCK;
+static memoff_t getblock(buddy_heap_t *h, memoff_t sz) {
+	memoff_t b = NOBLOCK;
 	uint8_t s = buddy_log2(sz);
 	uint8_t i;
 
 	// find available block, such that sz <= i <= AMAX
-	for (i=s; i<=h->AMAX; i++) {
-		if (h->ah[i] != NOBLOCK) {
-			b = h->ah[i]; break;
-		}
+	// (in lazy mode, join deferred blocks first if there is none)
+	memoff_t m = h->am & ~(((memoff_t)1 << s) - 1);
+	if (m == 0 && h->ld > 0) {
+		bcoalesceall(h);
+		m = h->am & ~(((memoff_t)1 << s) - 1);
 	}
+	if (m != 0) {
+		i = ctz(m); b = h->ah[i];
+		MEMINST_COUNT(MEMINST_STEPS_FIT, 1);
+	} else i = h->AMAX+1;
 
 	// get available block
 	if (i <= h->AMAX) {
@@ -420,11 +686,64 @@ static uint32_t getblock(buddy_heap_t *h, uint32_t sz) {
 		assert(getsize(h, block2size(b)) == 0);
 		bremove(h,b,s);
 		putsize(h,block2size(b),s);
+		countused(h,sz);
 	} else b = NOBLOCK;
 
 	return b;
 }
 
+/* --------------------------------------------------------------------------
+ * bcarve: turn the used block b of size 2^c into the used block x
+ *         of size 2^s within b (x is a multiple of 2^s):
+ * - halve the block repeatedly, keeping the half containing x
+ * - insert the other half into its available list
+ * The buddies of the inserted halves are on the path to x,
+ * so none of them can be joined.
+ * --------------------------------------------------------------------------
+ */
+static inline void bcarve(buddy_heap_t *h, memoff_t b, uint8_t c,
+                                          memoff_t x, uint8_t s) {
+	erasesize(h, block2size(b));
+	countresized(h, (memoff_t)1 << c, (memoff_t)1 << s);
+	while (c > s) {
+		c--;
+		memoff_t half = (memoff_t)1 << c;
+		if (x < b + half) binsert(h, b + half, c);
+		else {
+			binsert(h, b, c); b += half;
+		}
+	}
+	putsize(h, block2size(x), s);
+}
+
+/* --------------------------------------------------------------------------
+ * aligned malloc:
+ * Blocks are aligned to their size relative to hb:
+ * - if hb is aligned to a, any block of size >= a is aligned;
+ *   we take a block of size max(sz, a) and carve
+ *   its first 2^sz bytes out of it
+ * - otherwise, a block of size sz < a is aligned
+ *   if hb is aligned to sz; we take a block of size a
+ *   and carve the one aligned block out of it
+ * - otherwise, there is no aligned block in the heap
+ * --------------------------------------------------------------------------
+ */
+static memoff_t getaligned(buddy_heap_t *h, memoff_t a, memoff_t sz) {
+	memoff_t r = (memoff_t)(h->hb & (a - 1));
+	if (r != 0 && (sz >= a || modpow2(r, sz) != 0)) return NOBLOCK;
+
+	memoff_t s = sz > a ? sz : a;
+	if (s > ((memoff_t)1 << h->AMAX)) return NOBLOCK;
+
+	memoff_t b = getblock(h, s);
+	if (b != NOBLOCK && s > sz) {
+		memoff_t x = r == 0 ? b : b + a - r;
+		bcarve(h, b, buddy_log2(s), x, buddy_log2(sz));
+		b = x;
+	}
+	return b;
+}
+
 /* --------------------------------------------------------------------------
  * free:
  * - if block is not a multiple of MINSIZE: it's not ours!
@@ -436,7 +755,7 @@ static uint32_t getblock(buddy_heap_t *h, uint32_t sz) {
  *   just insert it in available list of the exact size
  * --------------------------------------------------------------------------
  */
-static int freeblock(buddy_heap_t *h, uint32_t block) {
+static int freeblock(buddy_heap_t *h, memoff_t block) {
 	int rc = NOTFOUND;
 
 	// check if block is multiple of minsize (otherwise error)
@@ -446,28 +765,134 @@ static int freeblock(buddy_heap_t *h, uint32_t block) {
 		if (s != 0) {
 			// printf("size: %hhu\n", s);
 			erasesize(h, block2size(block));
-			if (!bjoin(h, block, s)) binsert(h,block,s);
+			countfreed(h, (memoff_t)1 << s);
+			bfree(h, block, s);
 			rc = OK;
 		}
 	}
 	return rc;
 }
 
+/* --------------------------------------------------------------------------
+ * sized free: the caller tells us the size
+ * - the block must be aligned to its size (otherwise error)
+ * - in debug builds, the size must be the one in the size area
+ * - erase the size and join as freeblock does
+ * --------------------------------------------------------------------------
+ */
+static int freesized(buddy_heap_t *h, memoff_t block, uint8_t s) {
+	if (modpow2(block, (memoff_t)1 << s) != 0) return NOTFOUND;
+#ifndef NDEBUG
+	if (getsize(h, block2size(block)) != s) return NOTFOUND;
+#endif
+	erasesize(h, block2size(block));
+	countfreed(h, (memoff_t)1 << s);
+	bfree(h, block, s);
+	return OK;
+}
+
+/* --------------------------------------------------------------------------
+ * batch malloc: get n blocks of size sz
+ * - get the largest block that holds all remaining blocks
+ *   (or as many as possible) and cut it into contiguous blocks
+ *   (blocks of the same size that fill a larger block are aligned
+ *    and therefore valid blocks of their own)
+ * - repeat until all blocks are served or there is no block left
+ * returns the number of blocks stored in out
+ * --------------------------------------------------------------------------
+ */
+static size_t getblocks(buddy_heap_t *h, memoff_t sz, size_t n, void **out) {
+	uint8_t s = buddy_log2(sz);
+	size_t k = 0;
+
+	while (k < n) {
+		size_t r = n - k;
+		uint8_t j = s + ((r >> (h->AMAX - s)) > 0 ? h->AMAX - s :
+		                 (uint8_t)(8*sizeof(size_t) - 1 - __builtin_clzl(r)));
+		memoff_t b = NOBLOCK;
+		for(; j >= s; j--) {
+			b = getblock(h, (memoff_t)1 << j);
+			if (b != NOBLOCK || j == s) break;
+		}
+		if (b == NOBLOCK) break;
+
+		erasesize(h, block2size(b));
+		countfreed(h, (memoff_t)1 << j);
+		for(memoff_t i=0; i < ((memoff_t)1 << (j-s)); i++) {
+			memoff_t c = b + (i << s);
+			putsize(h, block2size(c), s);
+			countused(h, sz);
+			out[k++] = block2ptr(h, c);
+		}
+	}
+	return k;
+}
+
+/* --------------------------------------------------------------------------
+ * batch free: free the blocks in ptrs (sorted by address)
+ * - erase the sizes of all valid blocks
+ * - coalesce adjacent blocks that are buddies on a stack
+ *   before they touch the available lists
+ *   (a sequence of blocks is reduced like a binary counter)
+ * - when the sequence breaks, insert the coalesced blocks
+ *   and join them with their buddies in the heap
+ * returns the first error
+ * --------------------------------------------------------------------------
+ */
+#define BATCHSTACK (2*MEMOFF_BITS)
+
+static int freeblocks(buddy_heap_t *h, void **ptrs, size_t n) {
+	memoff_t sb[BATCHSTACK];
+	uint8_t  ss[BATCHSTACK];
+	int rc = OK;
+	int t = 0;
+
+	for(size_t i=0; i<n; i++) {
+		memoff_t b = ptr2block(h, ptrs[i]);
+		uint8_t s = modpow2(b, MINSIZE) == 0 ?
+		            getsize(h, block2size(b)) : 0;
+		if (s == 0) {
+			if (rc == OK) rc = NOTFOUND;
+			continue;
+		}
+		erasesize(h, block2size(b));
+		countfreed(h, (memoff_t)1 << s);
+
+		// not adjacent to the top or stack full: flush
+		if (t > 0 && (t == BATCHSTACK ||
+		    sb[t-1] + ((memoff_t)1 << ss[t-1]) != b)) {
+			for(; t>0; t--) bfree(h, sb[t-1], ss[t-1]);
+		}
+		sb[t] = b; ss[t] = s; t++;
+
+		// coalesce buddies
+		while (t > 1 && ss[t-1] == ss[t-2] && ss[t-1] < h->AMAX &&
+		       findbuddy(sb[t-2], ss[t-2]) == sb[t-1]) {
+			t--; ss[t-1]++;
+		}
+	}
+	for(; t>0; t--) bfree(h, sb[t-1], ss[t-1]);
+	return rc;
+}
+
 /* --------------------------------------------------------------------------
  * realloc:
  * - if b is not a multiple of MINSIZE or the size of b is not found:
  *   b was not allocated by us
  * - if size of b equals the requested size: we are done
  * - if requested size is greater:
- *   + if extend block works we are done
+ *   + if extend block works (with buddies right or left) we are done
+ *   + otherwise, if we may not move the block (mv = 0), we fail
  *   + otherwise get a new block of the requested size
+ *     in the main heap or else in the emergency heap
+ *     (which is protected by the main lock or by its own)
  *   + copy the content
  *   + free the original block
  * --------------------------------------------------------------------------
  */
-static uint32_t extendblock(buddy_heap_t *h,
-           uint32_t b, uint32_t sz, int *rc) {
-	uint32_t ret = NOBLOCK;
+static void *extendblock(buddy_heap_t *h,
+           memoff_t b, memoff_t sz, size_t rq, int *rc, char mv) {
+	void *ret = NULL;
 
 	if (modpow2(b, MINSIZE) != 0) *rc = NOTFOUND; else {
 
@@ -475,26 +900,36 @@ static uint32_t extendblock(buddy_heap_t *h,
 		uint8_t cs = getsize(h, block2size(b));
 
 		if (cs == 0) *rc = NOTFOUND; else {
-			uint32_t csz = 1 << cs;
+			memoff_t csz = (memoff_t)1 << cs;
 
-			if (csz == sz) ret = b;
+			if (csz == sz) ret = block2ptr(h,b);
 			else if (csz < sz) {
-				if (bextend(h, b, cs, buddy_log2(sz))) 
-					ret = b;
-				else {
-					ret = getblock(h, sz);
-					if (ret != NOBLOCK) {
-						memcpy(block2ptr(h,ret),
-						       block2ptr(h,b),csz);
-						*rc = freeblock(h,b);
-						assert(((*rc) & NOTFOUND) == 0);
-						assert((*rc) >= 0);
-						*rc = OK;
-					}
+				memoff_t n = bextend(h, b, cs, buddy_log2(sz));
+				if (n != NOBLOCK) {
+					MEMINST_COUNT(MEMINST_INPLACE, 1);
+					b = NOBLOCK;
+				} else if (!mv) {
+					return NULL;
+				} else if (routed(h, rq, sz)) {
+					ret = ffit_get_block(&h->ffh, rq);
+				}
+				if (n == NOBLOCK && ret == NULL) n = getblock(h, sz);
+				if (n != NOBLOCK) ret = block2ptr(h,n);
+				else if (ret == NULL && h->e) {
+					ret = ffit_get_block(&h->ffh, rq);
+				}
+				if (ret != NULL && b != NOBLOCK) {
+					memcpy(ret, block2ptr(h,b), csz);
+					MEMINST_COUNT(MEMINST_MOVED, 1);
+					*rc = freeblock(h,b);
+					assert(((*rc) & NOTFOUND) == 0);
+					assert((*rc) >= 0);
+					*rc = OK;
 				}
 			} else if (csz > sz) {
 				bshrink(h, b, cs, buddy_log2(sz));
-				ret = b;
+				MEMINST_COUNT(MEMINST_INPLACE, 1);
+				ret = block2ptr(h,b);
 			}
 		}
 	}
@@ -505,15 +940,15 @@ static uint32_t extendblock(buddy_heap_t *h,
  * printBlock: Print one block with colour
  * --------------------------------------------------------------------------
  */
-static inline void printBlock(uint32_t add, uint32_t csz, char *prfx) {
-	printf("%s%u\033[0m|", prfx, csz);
+static inline void printBlock(memoff_t add, memoff_t csz, char *prfx) {
+	printf("%s%zu\033[0m|", prfx, (size_t)csz);
 }
 
 /* --------------------------------------------------------------------------
  * printUsed: Print a block in use
  * --------------------------------------------------------------------------
  */
-static void printUsed(uint32_t add, uint32_t csz) {
+static void printUsed(memoff_t add, memoff_t csz) {
 	printBlock(add, csz, "\033[31m");
 }
 
@@ -521,7 +956,7 @@ static void printUsed(uint32_t add, uint32_t csz) {
  * printFree: Print a free block
  * --------------------------------------------------------------------------
  */
-static void printFree(uint32_t add, uint32_t csz) {
+static void printFree(memoff_t add, memoff_t csz) {
 	printBlock(add, csz, "\033[32m");
 }
 
@@ -537,29 +972,33 @@ static void printFree(uint32_t add, uint32_t csz) {
  * - green, if it is available
  * --------------------------------------------------------------------------
  */
-static void printBlocks(buddy_heap_t *h, char p, uint32_t *sum,
-		                                 uint32_t *usd,
-						 uint32_t *fre) {
-	uint32_t block = 0;
+static void printBlocks(buddy_heap_t *h, char p, memoff_t *sum,
+		                                 memoff_t *usd,
+						 memoff_t *fre) {
+	memoff_t block = 0;
 	do {
 		// if the block is used, we find its size in the size area
 		uint8_t f = 1;
 		uint8_t s = getsize(h, block2size(block));
 
-		// otherwise we need to search it in the available area
+		// otherwise we find it in the free area
 		if (s == 0) {
 			f = 0;
-			for(; s<=h->AMAX; s++) {
-				if (bisin(h, block, s)) break;
-			}
-			if (s > h->AMAX) {
-				if (p) printf("LOST BLOCK: %u\n", block);
-				break;
+			s = getfree(h, block2size(block));
+			if (s == 0) {
+				if (p) printf("LOST BLOCK: %zu\n", (size_t)block);
+				// continue with the next block we know of
+				memoff_t n = block2size(h->msize);
+				memoff_t i = block2size(block);
+				memoff_t k = nextcode(h->sh, i, n);
+				memoff_t j = nextcode(h->fh, i, k);
+				block = (j < k ? j : k) * MINSIZE;
+				continue;
 			}
 		}
 
 		// compute the effective size
-		uint32_t sz = 1 << s;
+		memoff_t sz = (memoff_t)1 << s;
 
 		// print used or free
 		if (f) {
@@ -574,61 +1013,181 @@ static void printBlocks(buddy_heap_t *h, char p, uint32_t *sum,
 	} while (block < h->msize);
 }
 
+/* ------------------------------------------------------------------------
+ * Main heap size:
+ * the greatest multiple of MINSIZE addressable by offsets,
+ * such that the main heap and its size and free areas
+ * fit into avail bytes. 8 blocks of MINSIZE need
+ * 8 x MINSIZE bytes plus CODEBITS bytes in each area.
+ * ------------------------------------------------------------------------
+ */
+static inline size_t init_msize(size_t avail) {
+	size_t m = (avail / (8*MINSIZE + 2*CODEBITS)) * 8 * MINSIZE;
+	if (m > MEMOFF_NONE - (MINSIZE - 1)) m = MEMOFF_NONE - (MINSIZE - 1);
+	while (m > 0 && m + 2*init_codes(m/MINSIZE+1) > avail) m -= MINSIZE;
+	return m;
+}
+
 /* ------------------------------------------------------------------------
  * Public Interface
  * ------------------------------------------------------------------------
  * Init   : set non-constant global vars
  * --------
- * eh     : set to main heap + main heap size
- * AMAX   : log2 of msize (the entire heap)
  * asize  : size of all available lists
- *          from 0 - AMAX (note that are more than we need:
- *                         1, 2 and 4 are not used!)
+ *          (one list for each exponent an offset can have,
+ *           more than we need)
+ * msize  : with the default emergency heap (e = 1 and es = 0)
+ *          half of hs, otherwise the greatest size, such that
+ *          the main heap, its bookkeeping and es fit into hs
+ *          (see init_msize); in any case a multiple of MINSIZE
+ * eh     : set to main heap + main heap size
+ * AMAX   : log2 of the largest top-level block
  * ssize  : ssize is set to msize / 8 (8 is the miminal block size)
  *          multiplied by 6 (because each size block has 6 bits)
  *          divided by 8 (8 bits per byte)
  *          add one byte
- * esize  : size of the emergency heap is half of hs (=msize)
- *          - the size for book keeping (asize + ssize)
+ *          (one byte per block with BUDDY_BYTEMAP;
+ *           the free area has the same size)
+ * esize  : size of the emergency heap:
+ *          0 without emergency heap,
+ *          es rounded down to a multiple of 8, if given, and
+ *          what remains of hs after main heap and bookkeeping otherwise
  * ah     : available area starts after emergency heap
  * sh     : size area starts after available area
+ * fh     : free area starts after size area
  * ------------------------------------------------------------------------
- * - set all bytes in the the main heap to 0xff (NOBLOCK)
- *   this is initialises the lists in the blocks to empty
- * - init the size area
- * - init the avail area
+ * - the main heap itself is not touched:
+ *   the list pointers of a block are written when the block
+ *   is inserted into an available list, so only the top-level
+ *   blocks are written here and pages are faulted in when first used
+ * - init the size and the free area
+ * - init the avail area (inserting the top-level blocks)
+ * - with BUDDY_VERBOSE, print the layout to stdout
+ * - init the lock and, if there is an emergency heap,
+ *   the lock of the emergency heap: if it is not locked
+ *   independently (el), it is protected by the main lock
+ *   and does not lock itself.
  * ------------------------------------------------------------------------
  */
 int buddy_init(buddy_heap_t *h) {
-	if (h->mh != 0 && h->hs != 0) {
-		int rc = OK;
-		h->msize = h->hs / 2;
-		h->eh = h->mh + h->msize;
-		h->AMAX = buddy_log2(h->msize);
-		h->asize = (h->AMAX+1)*sizeof(uint32_t);
-		h->ssize = h->msize / 8 + 1;
-		h->ssize *= 6;
-		h->ssize /= 8;
-		h->esize = h->msize - (h->asize + h->ssize);
-		h->ah = (uint32_t*)((uintptr_t)h->eh + h->esize);
-		h->sh = (uint8_t*)((uintptr_t)h->ah + h->asize);
-		memset((void*)h->mh, 0xff, h->msize);
-		printf("HEAP : %p\n", (void*)h->mh);
-		printf("EHEAP: %p\n", (void*)h->eh);
-		printf("AVAIL: %p\n", (void*)h->ah);
-		printf("SIZE : %p\n", (void*)h->sh);
-		printf("AMAX : %u\n", h->AMAX);
-		printf("BOOK : %u%%\n", ((h->asize+h->ssize)*100)/h->msize);
-		init_size(h);
-		init_avail(h);
-		if (h->e) {
-			h->ffh.mh = h->eh;
-			h->ffh.hs = h->esize;
-			rc = ffit_init(&h->ffh);
-		}
-		return rc;
+	if (h->mh == 0 || h->hs == 0) return -1;
+
+	// align the heap in memory (up to a page, losing at most 1/64),
+	// so that blocks are aligned absolutely, not only relative to hb;
+	// mh and hs remain as given by the user
+	uintptr_t a = PAGESIZE;
+	while (a > MINSIZE && 64*a > h->hs) a >>= 1;
+	size_t d = alignup(h->mh, a) - h->mh;
+	if (d >= h->hs) return -1;
+	h->hb = h->mh + d;
+	size_t hs = h->hs - d;
+
+	int rc = OK;
+	size_t asize = MEMOFF_BITS*sizeof(memoff_t);
+	size_t esize = h->e ? (h->es & ~(size_t)7) : 0;
+	size_t msize;
+
+	if (h->e && esize == 0) {
+		msize = (h->hs / 2) & ~(size_t)(MINSIZE - 1);
+		if (msize > MEMOFF_NONE - (MINSIZE - 1)) return -1;
+	} else {
+		if (hs <= esize + asize) return -1;
+		msize = init_msize(hs - esize - asize);
+	}
+	if (msize < 2*MINSIZE) return -1;
+
+	h->msize = (memoff_t)msize;
+	h->eh = h->hb + h->msize;
+	h->AMAX = buddy_log2(h->msize);
+	h->asize = (memoff_t)asize;
+	h->ssize = init_codes(h->msize / MINSIZE + 1);
+	if (h->e && esize == 0) {
+		size_t book = h->asize + 2*(size_t)h->ssize;
+		if (hs <= msize + book) return -1;
+		esize = (hs - msize - book) & ~(size_t)7;
+	}
+	if (msize + esize + asize + 2*(size_t)h->ssize > hs) return -1;
+	h->esize = (memoff_t)esize;
+	h->ah = (memoff_t*)((uintptr_t)h->eh + h->esize);
+	h->sh = (uint8_t*)((uintptr_t)h->ah + h->asize);
+	h->fh = h->sh + h->ssize;
+#ifdef BUDDY_VERBOSE
+	printf("HEAP : %p\n", (void*)h->hb);
+	printf("EHEAP: %p\n", (void*)h->eh);
+	printf("AVAIL: %p\n", (void*)h->ah);
+	printf("SIZE : %p\n", (void*)h->sh);
+	printf("FREE : %p\n", (void*)h->fh);
+	printf("AMAX : %u\n", h->AMAX);
+	printf("BOOK : %zu%%\n",
+	       (size_t)(((h->asize+2*h->ssize)*100)/h->msize));
+#endif
+	init_size(h);
+	init_avail(h);
+	h->pf = NOBLOCK;
+	h->ld = 0;
+	memset(h->lf, 0, sizeof(h->lf));
+	h->ph = 0;
+	memset(&h->st, 0, sizeof(h->st));
+	if (memlock_init(&h->lck) != 0) return -1;
+	if (h->e) {
+		h->ffh.mh = h->eh;
+		h->ffh.hs = h->esize;
+		h->ffh.lck = h->lck;
+		if (!h->el) h->ffh.lck.t = MEMLOCK_NONE;
+		rc = ffit_init(&h->ffh);
 	}
-	return -1;
+	return rc;
+}
+
+/* --------------------------------------------------------------------------
+ * Pending frees
+ * -------------
+ * Blocks freed by other threads (remote frees) are pushed onto
+ * the pending list without taking the lock. The pending list is
+ * a lock-free stack linked through the nxt word of the blocks.
+ * The blocks keep their size, i.e. they are still in use,
+ * until the list is drained under the lock by the next get.
+ * Since the list is always drained as a whole, there is no ABA problem.
+ * --------------------------------------------------------------------------
+ */
+static inline char pending(buddy_heap_t *h) {
+	return (__atomic_load_n(&h->pf, __ATOMIC_RELAXED) != NOBLOCK);
+}
+
+// pending frees of the emergency heap (pf is pushed with CAS)
+static inline char epending(buddy_heap_t *h) {
+	return (h->e &&
+	        __atomic_load_n(&h->ffh.pf, __ATOMIC_RELAXED) != NOBLOCK);
+}
+
+/* --------------------------------------------------------------------------
+ * drain the pending list (the lock must be held)
+ * --------------------------------------------------------------------------
+ */
+static int drainpending(buddy_heap_t *h) {
+	int rc = OK;
+	memoff_t a = __atomic_exchange_n(&h->pf, NOBLOCK, __ATOMIC_ACQUIRE);
+	while (a != NOBLOCK) {
+		memoff_t n = block_next(h, a);
+		MEMINST_COUNT(MEMINST_STEPS_PENDING, 1);
+		int x = freeblock(h, a);
+		if (x != OK && rc == OK) rc = x;
+		a = n;
+	}
+	return rc;
+}
+
+/* --------------------------------------------------------------------------
+ * Locking the emergency heap:
+ * if it is not locked independently, we use the main lock
+ * --------------------------------------------------------------------------
+ */
+static inline void elock(buddy_heap_t *h) {
+	if (!h->el) memlock_acquire(&h->lck);
+}
+
+static inline void eunlock(buddy_heap_t *h) {
+	if (!h->el) memlock_release(&h->lck);
 }
 
 /* --------------------------------------------------------------------------
@@ -637,18 +1196,157 @@ int buddy_init(buddy_heap_t *h) {
  */
 void *buddy_get_block(buddy_heap_t *h, size_t sz) {
 	void *ret = NULL;
+	MEMTRACE_ENTER();
+	MEMINST_CLOCK(t0);
 	if (sz > 0) {
-		uint32_t s = sz < MINSIZE ? MINSIZE : nextpow2(sz);
-		if (s < h->msize) {
-			// lock
-			uint32_t b = getblock(h, s);
+		memoff_t s = blocksize(h, sz);
+		if (s < h->msize && routed(h, sz, s)) {
+			elock(h);
+			ret = ffit_get_block(&h->ffh, sz);
+			eunlock(h);
+		}
+		if (s < h->msize && ret == NULL) {
+			memlock_acquire(&h->lck);
+			if (pending(h)) drainpending(h);
+			memoff_t b = getblock(h, s);
+			if (b != NOBLOCK) {
+				h->st.rqst += sz; h->st.grnt += s;
+			}
+			memlock_release(&h->lck);
+			if (epending(h)) {
+				elock(h);
+				ffit_free_pending(&h->ffh);
+				eunlock(h);
+			}
 			if (b != NOBLOCK) ret = block2ptr(h, b);
-			else if (h->e) {
+			else if (h->e && !routed(h, sz, s)) {
+				elock(h);
 				ret = ffit_get_block(&h->ffh, sz);
+				eunlock(h);
+			}
+		}
+	}
+	MEMINST_TIME(MEMINST_BUDDY, MEMINST_GET, t0);
+	MEMTRACE_LEAVE(MEMTRACE_GET, ret, NULL, sz);
+	return ret;
+}
+
+/* --------------------------------------------------------------------------
+ * batch malloc
+ * --------------------------------------------------------------------------
+ */
+size_t buddy_get_blocks(buddy_heap_t *h, size_t sz, size_t n, void **out) {
+	size_t k = 0;
+	MEMTRACE_ENTER();
+	MEMINST_CLOCK(t0);
+	if (sz > 0 && n > 0) {
+		memoff_t s = blocksize(h, sz);
+		char r = s < h->msize && routed(h, sz, s);
+		if (r) {
+			elock(h);
+			k = ffit_get_blocks(&h->ffh, sz, n, out);
+			eunlock(h);
+		}
+		if (s < h->msize && k < n) {
+			memlock_acquire(&h->lck);
+			if (pending(h)) drainpending(h);
+			size_t x = getblocks(h, s, n - k, out + k);
+			h->st.rqst += x * sz; h->st.grnt += x * s;
+			memlock_release(&h->lck);
+			k += x;
+		}
+		if (k < n && h->e && !r) {
+			elock(h);
+			k += ffit_get_blocks(&h->ffh, sz, n - k, out + k);
+			eunlock(h);
+		}
+	}
+	MEMINST_TIME(MEMINST_BUDDY, MEMINST_GET, t0);
+	MEMTRACE_LEAVEN(MEMTRACE_GET, out, k, sz);
+	return k;
+}
+
+/* --------------------------------------------------------------------------
+ * sort pointers by address
+ * --------------------------------------------------------------------------
+ */
+static int cmpptr(const void *a, const void *b) {
+	uintptr_t x = (uintptr_t)*(void**)a;
+	uintptr_t y = (uintptr_t)*(void**)b;
+	return (x < y ? -1 : x > y);
+}
+
+/* --------------------------------------------------------------------------
+ * batch free:
+ * after sorting, the blocks of the main heap come first
+ * followed by those of the emergency heap and unknown addresses
+ * --------------------------------------------------------------------------
+ */
+int buddy_free_blocks(buddy_heap_t *h, void **ptrs, size_t n) {
+	int rc = OK;
+	size_t i = 0, k = 0;
+
+	MEMTRACE_ENTER();
+	MEMINST_CLOCK(t0);
+	qsort(ptrs, n, sizeof(void*), cmpptr);
+	while (i < n && (uintptr_t)ptrs[i] < h->hb) i++;
+	if (i > 0) rc = NOTFOUND;
+	for(k=i; k < n && (uintptr_t)ptrs[k] < h->eh; k++);
+
+	if (k > i) {
+		memlock_acquire(&h->lck);
+		int x = freeblocks(h, ptrs+i, k-i);
+		memlock_release(&h->lck);
+		if (rc == OK) rc = x;
+	}
+	if (k < n) {
+		int x = NOTFOUND;
+		if (h->e) {
+			elock(h);
+			x = ffit_free_blocks(&h->ffh, ptrs+k, n-k);
+			eunlock(h);
+		}
+		if (rc == OK) rc = x;
+	}
+	MEMINST_TIME(MEMINST_BUDDY, MEMINST_FREE, t0);
+	MEMTRACE_LEAVEN(MEMTRACE_FREE, ptrs, n, 0);
+	return rc;
+}
+
+/* --------------------------------------------------------------------------
+ * aligned malloc
+ * --------------------------------------------------------------------------
+ */
+void *buddy_get_aligned_block(buddy_heap_t *h, size_t align, size_t sz) {
+	void *ret = NULL;
+	MEMTRACE_ENTER();
+	MEMINST_CLOCK(t0);
+	if (sz > 0 && align > 0 && (align & (align - 1)) == 0) {
+		memoff_t s = blocksize(h, sz);
+		char r = s < h->msize && routed(h, sz, s);
+		if (r) {
+			elock(h);
+			ret = ffit_get_aligned_block(&h->ffh, align, sz);
+			eunlock(h);
+		}
+		if (ret == NULL && s < h->msize && align < h->msize) {
+			memlock_acquire(&h->lck);
+			if (pending(h)) drainpending(h);
+			memoff_t b = getaligned(h, (memoff_t)align, s);
+			if (b != NOBLOCK) {
+				h->st.rqst += sz; h->st.grnt += s;
 			}
-			// unlock
+			memlock_release(&h->lck);
+			if (b != NOBLOCK) ret = block2ptr(h, b);
+		}
+		if (ret == NULL && h->e && !r) {
+			elock(h);
+			ret = ffit_get_aligned_block(&h->ffh, align, sz);
+			eunlock(h);
 		}
 	}
+	MEMINST_TIME(MEMINST_BUDDY, MEMINST_ALIGNED, t0);
+	MEMTRACE_LEAVE(MEMTRACE_ALIGNED, ret, (void*)align, sz);
 	return ret;
 }
 
@@ -658,164 +1356,838 @@ void *buddy_get_block(buddy_heap_t *h, size_t sz) {
  */
 int buddy_free_block(buddy_heap_t *h, void *ptr) {
 	int rc = NOTFOUND;
-	if ((uintptr_t)ptr < h->mh ||
-	    (uintptr_t)ptr >= h->mh+h->msize+h->esize) {
+	MEMTRACE_ENTER();
+	MEMINST_CLOCK(t0);
+	if ((uintptr_t)ptr < h->hb ||
+	    (uintptr_t)ptr >= h->hb+h->msize+h->esize) {
 		// error
 	} else if ((uintptr_t)ptr >= h->eh) {
 		if (h->e) {
+			elock(h);
 			rc = ffit_free_block(&h->ffh, ptr);
+			eunlock(h);
 		}
 		// else error
 	} else {
-		// lock
+		memlock_acquire(&h->lck);
 		rc = freeblock(h,ptr2block(h,ptr));
-		// unlock
+		memlock_release(&h->lck);
 		if ((rc & NOTFOUND) == NOTFOUND) rc = NOTFOUND;
 		else if (rc < 0) rc = INTERNAL; else rc = OK;
 	}
+	MEMINST_TIME(MEMINST_BUDDY, MEMINST_FREE, t0);
+	MEMTRACE_LEAVE(MEMTRACE_FREE, rc == OK ? ptr : NULL, NULL, 0);
 	return rc;
 }
 
 /* --------------------------------------------------------------------------
- * realloc
+ * sized free
  * --------------------------------------------------------------------------
  */
-void *buddy_extend_block(buddy_heap_t *h,
-           void *ptr, size_t sz, int *rc) {
+int buddy_free_sized(buddy_heap_t *h, void *ptr, size_t sz) {
+	int rc = NOTFOUND;
+	if (sz == 0) return buddy_free_block(h, ptr);
+	MEMTRACE_ENTER();
+	MEMINST_CLOCK(t0);
+	if ((uintptr_t)ptr < h->hb ||
+	    (uintptr_t)ptr >= h->hb+h->msize+h->esize) {
+		// error
+	} else if ((uintptr_t)ptr >= h->eh) {
+		if (h->e) {
+			elock(h);
+			rc = ffit_free_block(&h->ffh, ptr);
+			eunlock(h);
+		}
+		// else error
+	} else {
+		memoff_t s = blocksize(h, sz);
+		if (s < h->msize) {
+			memlock_acquire(&h->lck);
+			rc = freesized(h, ptr2block(h,ptr), buddy_log2(s));
+			memlock_release(&h->lck);
+		}
+	}
+	MEMINST_TIME(MEMINST_BUDDY, MEMINST_FREE, t0);
+	MEMTRACE_LEAVE(MEMTRACE_FREE, rc == OK ? ptr : NULL, NULL, 0);
+	return rc;
+}
+
+/* --------------------------------------------------------------------------
+ * get and free by order: the caller knows the block size
+ * --------------------------------------------------------------------------
+ */
+void *buddy_get_order(buddy_heap_t *h, uint8_t k) {
 	void *ret = NULL;
+	if (k < BUDDY_MINORDER || k > h->AMAX) return NULL;
+	memoff_t s = (memoff_t)1 << k;
+	if (s >= h->msize) return NULL;
+	MEMTRACE_ENTER();
+	MEMINST_CLOCK(t0);
+	memlock_acquire(&h->lck);
+	if (pending(h)) drainpending(h);
+	memoff_t b = getblock(h, s);
+	if (b != NOBLOCK) {
+		h->st.rqst += s; h->st.grnt += s;
+	}
+	memlock_release(&h->lck);
+	if (epending(h)) {
+		elock(h);
+		ffit_free_pending(&h->ffh);
+		eunlock(h);
+	}
+	if (b != NOBLOCK) ret = block2ptr(h, b);
+	else if (h->e) {
+		elock(h);
+		ret = ffit_get_block(&h->ffh, s);
+		eunlock(h);
+	}
+	MEMINST_TIME(MEMINST_BUDDY, MEMINST_GET, t0);
+	MEMTRACE_LEAVE(MEMTRACE_GET, ret, NULL, s);
+	return ret;
+}
 
-	// rc is only relevant for free, i.e. sz == 0
-	*rc = OK;
+int buddy_free_order(buddy_heap_t *h, void *ptr, uint8_t k) {
+	int rc = NOTFOUND;
+	MEMTRACE_ENTER();
+	MEMINST_CLOCK(t0);
+	if ((uintptr_t)ptr < h->hb ||
+	    (uintptr_t)ptr >= h->hb+h->msize+h->esize) {
+		// error
+	} else if ((uintptr_t)ptr >= h->eh) {
+		if (h->e) {
+			elock(h);
+			rc = ffit_free_block(&h->ffh, ptr);
+			eunlock(h);
+		}
+		// else error
+	} else if (k >= BUDDY_MINORDER && k <= h->AMAX &&
+	           ((memoff_t)1 << k) < h->msize) {
+		memlock_acquire(&h->lck);
+		rc = freesized(h, ptr2block(h,ptr), k);
+		memlock_release(&h->lck);
+	}
+	MEMINST_TIME(MEMINST_BUDDY, MEMINST_FREE, t0);
+	MEMTRACE_LEAVE(MEMTRACE_FREE, rc == OK ? ptr : NULL, NULL, 0);
+	return rc;
+}
 
-	// if pointer is null: malloc
-	if (ptr == NULL) ret = buddy_get_block(h,sz);
+/* --------------------------------------------------------------------------
+ * usable size:
+ * the block belongs to the caller, its size code does not change
+ * while we read it, so we do not need the lock
+ * --------------------------------------------------------------------------
+ */
+size_t buddy_usable_size(buddy_heap_t *h, void *ptr) {
+	size_t sz = 0;
+	if ((uintptr_t)ptr < h->hb ||
+	    (uintptr_t)ptr >= h->hb+h->msize+h->esize) {
+		// error
+	} else if ((uintptr_t)ptr >= h->eh) {
+		if (h->e) sz = ffit_usable_size(&h->ffh, ptr);
+	} else {
+		memoff_t b = ptr2block(h,ptr);
+		if (modpow2(b, MINSIZE) == 0) {
+			uint8_t s = getsize(h, block2size(b));
+			if (s != 0) sz = (size_t)1 << s;
+		}
+	}
+	return sz;
+}
 
-	// if size is 0 free
-	else if (sz == 0) *rc = buddy_free_block(h,ptr);
+/* --------------------------------------------------------------------------
+ * remote free:
+ * verify the block as freeblock does and push it onto the pending list
+ * --------------------------------------------------------------------------
+ */
+int buddy_free_remote(buddy_heap_t *h, void *ptr) {
+	int rc = NOTFOUND;
+	MEMTRACE_ENTER();
+	MEMINST_CLOCK(t0);
+	if ((uintptr_t)ptr < h->hb ||
+	    (uintptr_t)ptr >= h->hb+h->msize+h->esize) {
+		// error
+	} else if ((uintptr_t)ptr >= h->eh) {
+		if (h->e) rc = ffit_free_remote(&h->ffh, ptr);
+		// else error
+	} else {
+		memoff_t b = ptr2block(h,ptr);
+		if (modpow2(b,MINSIZE) == 0 &&
+		    getsize(h, block2size(b)) != 0) {
+			block_push(h, &h->pf, b);
+			rc = OK;
+		}
+	}
+	MEMINST_TIME(MEMINST_BUDDY, MEMINST_FREE, t0);
+	MEMTRACE_LEAVE(MEMTRACE_FREE, rc == OK ? ptr : NULL, NULL, 0);
+	return rc;
+}
+
+/* --------------------------------------------------------------------------
+ * free pending blocks
+ * --------------------------------------------------------------------------
+ */
+int buddy_free_pending(buddy_heap_t *h) {
+	int rc = OK;
+	if (pending(h)) {
+		memlock_acquire(&h->lck);
+		rc = drainpending(h);
+		memlock_release(&h->lck);
+	}
+	if (h->e) {
+		elock(h);
+		int x = ffit_free_pending(&h->ffh);
+		eunlock(h);
+		if (rc == OK) rc = x;
+	}
+	return rc;
+}
+
+/* --------------------------------------------------------------------------
+ * resize or move (if mv) the block at ptr to sz bytes
+ * in the main heap or in the emergency heap
+ * --------------------------------------------------------------------------
+ */
+static void *resizeblock(buddy_heap_t *h,
+           void *ptr, size_t sz, int *rc, char mv) {
+	void *ret = NULL;
 
 	// check if pointer is valid
-	else if ((uintptr_t)ptr >= h->mh+h->hs) {
+	if ((uintptr_t)ptr >= h->mh+h->hs) {
 		// error
 
 	// check if pointer is in the main heap
 	// and handle in the emergency heap otherwise
 	} else if ((uintptr_t)ptr >= h->eh) {
 		if (h->e) {
-			ret = ffit_extend_block(&h->ffh, ptr, sz, rc);
+			elock(h);
+			ret = mv ? ffit_extend_block(&h->ffh, ptr, sz, rc)
+			         : ffit_resize_block(&h->ffh, ptr, sz, rc);
+			eunlock(h);
 		}
 		// error 
 
 	// handle in main heap
 	} else {
 		// compute effective size
-		uint32_t s = sz < MINSIZE ? MINSIZE : nextpow2(sz);
+		memoff_t s = blocksize(h, sz);
 
 		if (s < h->msize) {
-			// lock
-			ret = block2ptr(h,extendblock(h,
-			                  ptr2block(h,ptr),s,rc));
-			// unlock
+			memlock_acquire(&h->lck);
+			if (pending(h)) drainpending(h);
+			ret = extendblock(h, ptr2block(h,ptr), s, sz, rc, mv);
+			if (ret != NULL && (uintptr_t)ret < h->eh) {
+				h->st.rqst += sz; h->st.grnt += s;
+			}
+			memlock_release(&h->lck);
 		}
 	}
 	return ret;
-} 
+}
+
+/* --------------------------------------------------------------------------
+ * realloc
+ * --------------------------------------------------------------------------
+ */
+void *buddy_extend_block(buddy_heap_t *h,
+           void *ptr, size_t sz, int *rc) {
+	void *ret = NULL;
+
+	// rc is only relevant for free, i.e. sz == 0
+	*rc = OK;
+	MEMTRACE_ENTER();
+	MEMINST_CLOCK(t0);
+
+	// if pointer is null: malloc
+	if (ptr == NULL) ret = buddy_get_block(h,sz);
+
+	// if size is 0 free
+	else if (sz == 0) *rc = buddy_free_block(h,ptr);
+
+	else ret = resizeblock(h, ptr, sz, rc, 1);
+
+	MEMINST_TIME(MEMINST_BUDDY, MEMINST_EXTEND, t0);
+	MEMTRACE_LEAVE(MEMTRACE_EXTEND, ret, ptr, sz);
+	return ret;
+}
+
+/* --------------------------------------------------------------------------
+ * resize a block without moving it
+ * --------------------------------------------------------------------------
+ */
+void *buddy_resize_block(buddy_heap_t *h,
+           void *ptr, size_t sz, int *rc) {
+	void *ret = NULL;
+
+	*rc = OK;
+	if (ptr == NULL || sz == 0) return NULL;
+
+	MEMTRACE_ENTER();
+	MEMINST_CLOCK(t0);
+	ret = resizeblock(h, ptr, sz, rc, 0);
+	MEMINST_TIME(MEMINST_BUDDY, MEMINST_EXTEND, t0);
+	MEMTRACE_LEAVE(MEMTRACE_EXTEND, ret, ptr, sz);
+	return ret;
+}
 
 /* --------------------------------------------------------------------------
  * print (debug)
  * --------------------------------------------------------------------------
  */
 void buddy_print_heap(buddy_heap_t *h) {
-	uint32_t mem = 0;
-	uint32_t usd = 0;
-	uint32_t fre = 0;
+	memoff_t mem = 0;
+	memoff_t usd = 0;
+	memoff_t fre = 0;
 
+	buddy_free_pending(h);
+	memlock_acquire(&h->lck);
 	printBlocks(h, 1, &mem, &usd, &fre);
-	printf("\nTotal    : %09u\n", mem);
-	printf("\033[31mUsed     : %09u\033[0m", usd);
-	printf("\033[31m (%u%%)\033[0m", (100*usd)/mem);
+	memlock_release(&h->lck);
+	printf("\nTotal    : %09zu\n", (size_t)mem);
+	printf("\033[31mUsed     : %09zu\033[0m", (size_t)usd);
+	printf("\033[31m (%zu%%)\033[0m", (size_t)((100*usd)/mem));
 	printf("\n");
-	printf("\033[32mFree     : %09u\033[0m\n", fre);
+	printf("\033[32mFree     : %09zu\033[0m\n", (size_t)fre);
 	if (fre + usd != mem) {
-		printf("\033[31mmissing: %09u\033[0m\n",
-		                       mem - (usd+fre));
+		printf("\033[31mmissing: %09zu\033[0m\n",
+		                       (size_t)(mem - (usd+fre)));
+	}
+	if (usd != h->st.usd) {
+		printf("\033[31mcounted: %09zu\033[0m\n", h->st.usd);
 	}
 	if (h->e) {
 		printf("### EMERGENCY ##############\n");
+		elock(h);
 		ffit_print_heap(&h->ffh);
+		eunlock(h);
 	}
 }
 
+/* --------------------------------------------------------------------------
+ * 32-bit statistics saturate at UINT32_MAX
+ * --------------------------------------------------------------------------
+ */
+static inline uint32_t sat32(size_t n) {
+	return n > UINT32_MAX ? UINT32_MAX : (uint32_t)n;
+}
+
 /* --------------------------------------------------------------------------
  * Get statistics (we support only mem, used and free,
- *                 there is no watermark and no steps)
+ *                 there is no watermark and no steps;
+ *                 steps are counted with MEMMAN_INSTRUMENT,
+ *                 see meminst.h)
  * --------------------------------------------------------------------------
  */
 void  buddy_get_stats(buddy_heap_t *h,
 		      uint32_t *mem,  // heap size
                       uint32_t *usd,  // used memory 
-                      uint32_t *fre)  // average search steps
+                      uint32_t *fre)  // available memory
 {
+	buddy_stats_t st;
+	buddy_get_counters(h, &st);
+	*mem = sat32(st.mem);
+	*usd = sat32(st.usd);
+	*fre = sat32(st.fre);
+}
 
-	printBlocks(h, 0, mem, usd, fre);
+/* --------------------------------------------------------------------------
+ * counters
+ * --------------------------------------------------------------------------
+ */
+void  buddy_get_counters(buddy_heap_t *h, buddy_stats_t *st) {
+	buddy_free_pending(h);
+	memlock_acquire(&h->lck);
+	*st = h->st;
+	memlock_release(&h->lck);
+	st->mem = h->msize;
+	st->fre = h->msize - st->usd;
+}
+
+/* --------------------------------------------------------------------------
+ * fragmentation:
+ * the largest available block is given by the available mask
+ * --------------------------------------------------------------------------
+ */
+void  buddy_get_frag_info(buddy_heap_t *h, buddy_frag_t *fi) {
+	memset(fi, 0, sizeof(buddy_frag_t));
+	buddy_free_pending(h);
+	memlock_acquire(&h->lck);
+	for(uint8_t i=0; i<=h->AMAX; i++) {
+		fi->cnt[i] = h->fc[i];
+		fi->blks += h->fc[i];
+		fi->fre += (size_t)h->fc[i] << i;
+	}
+	if (h->am != 0) {
+		fi->lrg = (size_t)1 << (MEMOFF_BITS - 1 - memoff_clz(h->am));
+	}
+	memlock_release(&h->lck);
+	if (fi->fre > 0) {
+		fi->frag = (uint32_t)(1000 - (fi->lrg * 1000) / fi->fre);
+	}
+}
+
+/* --------------------------------------------------------------------------
+ * Check the main heap:
+ * walk the size and the free area together, skipping empty slots
+ * a word at a time (see nextcode), and check that the blocks
+ * neither overlap nor leave gaps, are aligned to their size
+ * and add up to the counters (st, fc).
+ * --------------------------------------------------------------------------
+ */
+int buddy_check_heap(buddy_heap_t *h) {
+	memoff_t fc[MEMOFF_BITS];
+	size_t usd = 0;
+	uint32_t blks = 0;
+	int rc = OK;
+
+	memset(fc, 0, sizeof(fc));
+	buddy_free_pending(h);
+	memlock_acquire(&h->lck);
+
+	memoff_t n = block2size(h->msize);
+	memoff_t u = nextcode(h->sh, 0, n);
+	memoff_t f = nextcode(h->fh, 0, n);
+	memoff_t end = 0;
+	while (u < n || f < n) {
+		if (u == f) { rc = INTERNAL; break; }
+		memoff_t i = u < f ? u : f;
+		uint8_t s = u < f ? getsize(h, i) : getfree(h, i);
+		memoff_t add = i * MINSIZE;
+		if (add != end || s >= MEMOFF_BITS ||
+		    modpow2(add, (memoff_t)1 << s) != 0) {
+			rc = INTERNAL; break;
+		}
+		end = add + ((memoff_t)1 << s);
+		if (u < f) {
+			usd += (size_t)1 << s; blks++;
+			u = nextcode(h->sh, i+1, n);
+		} else {
+			fc[s]++;
+			f = nextcode(h->fh, i+1, n);
+		}
+	}
+	if (rc == OK && (end != h->msize || usd != h->st.usd ||
+	                 blks != h->st.blks)) rc = INTERNAL;
+	for(uint8_t i=0; rc == OK && i<MEMOFF_BITS; i++) {
+		if (fc[i] != h->fc[i]) rc = INTERNAL;
+	}
+	memlock_release(&h->lck);
+	return rc;
+}
+
+/* --------------------------------------------------------------------------
+ * Persistent heaps:
+ * the checksum covers the snapshot and the bookkeeping in the region
+ * (available lists, size and free area, which follow each other);
+ * on attach, the addresses in the snapshot are moved by the distance
+ * between the old and the new region.
+ * --------------------------------------------------------------------------
+ */
+#define PHSIZE mempers_size(sizeof(buddy_heap_t))
+
+#ifdef BUDDY_BYTEMAP
+#define PHFLAGS 1
+#else
+#define PHFLAGS 0
+#endif
+
+static uint64_t persum(buddy_heap_t *s, uintptr_t d) {
+	uint64_t x = mempers_sum(0, s, sizeof(buddy_heap_t));
+	return mempers_sum(x, (void*)((uintptr_t)s->ah + d),
+	                   s->asize + 2*(size_t)s->ssize);
+}
+
+int buddy_format(buddy_heap_t *h) {
+	uintptr_t r = h->mh;
+	size_t sz = h->hs;
+	if (r == 0 || sz <= PHSIZE) return -1;
+	h->mh += PHSIZE; h->hs -= PHSIZE;
+	if (buddy_init(h) != OK) return -1;
+	mempers_format((mempers_hdr_t*)r, MEMPERS_BUDDY, MEMOFF_BITS, PHFLAGS,
+	                                            sz, sizeof(buddy_heap_t));
+	h->ph = r;
+	return OK;
+}
+
+int buddy_detach(buddy_heap_t *h) {
+	mempers_hdr_t *p = (mempers_hdr_t*)h->ph;
+	if (p == NULL || p->state != MEMPERS_OPEN) return -1;
+	buddy_free_pending(h);
+	buddy_heap_t *s = mempers_snapshot(p);
+	memcpy(s, h, sizeof(buddy_heap_t));
+	s->ph = 0;
+	p->base = (uint64_t)h->ph;
+	p->sum = persum(s, 0);
+	p->state = MEMPERS_CLOSED;
+	h->ph = 0;
+	return OK;
+}
+
+int buddy_attach(buddy_heap_t *h, void *region) {
+	mempers_hdr_t *p = region;
+	if (p == NULL || !mempers_valid(p, MEMPERS_BUDDY, MEMOFF_BITS, PHFLAGS,
+	                                 h->hs, sizeof(buddy_heap_t)))
+		return -1;
+	buddy_heap_t *s = mempers_snapshot(p);
+	uintptr_t d = (uintptr_t)region - (uintptr_t)p->base;
+
+	// the bookkeeping must lie within the region
+	uintptr_t e = (uintptr_t)region + p->size;
+	uintptr_t a = (uintptr_t)s->ah + d;
+	if (s->mh - p->base < PHSIZE || s->asize != MEMOFF_BITS*sizeof(memoff_t) ||
+	    a < (uintptr_t)region + PHSIZE || a > e ||
+	    s->asize + 2*(size_t)s->ssize > e - a) return -1;
+	if (persum(s, d) != p->sum) return -1;
+
+	buddy_heap_t u = *h;
+	memcpy(h, s, sizeof(buddy_heap_t));
+	h->mh += d; h->hb += d; h->eh += d;
+	h->ah = (memoff_t*)((uintptr_t)h->ah + d);
+	h->sh += d; h->fh += d;
+	h->el = u.el; h->rt = u.rt; h->lt = u.lt;
+	h->wr = u.wr; h->ws = u.ws;
+	h->lck = u.lck;
+	if (memlock_init(&h->lck) != 0) return -1;
+	if (h->e) {
+		h->ffh.mh += d;
+		h->ffh.lck = h->lck;
+		if (!h->el) h->ffh.lck.t = MEMLOCK_NONE;
+		if (memlock_init(&h->ffh.lck) != 0) return -1;
+	}
+	h->ph = (uintptr_t)region;
+	p->state = MEMPERS_OPEN;
+	return OK;
+}
+
+void buddy_set_root(buddy_heap_t *h, void *ptr) {
+	mempers_hdr_t *p = (mempers_hdr_t*)h->ph;
+	if (p != NULL) p->root = ptr == NULL ? 0 : (uintptr_t)ptr - h->ph;
+}
+
+void *buddy_get_root(buddy_heap_t *h) {
+	mempers_hdr_t *p = (mempers_hdr_t*)h->ph;
+	if (p == NULL || p->root == 0) return NULL;
+	return (void*)(h->ph + p->root);
+}
+
+/* --------------------------------------------------------------------------
+ * Block cache
+ * -----------
+ * The cache keeps one singly linked list of blocks per exponent
+ * from log2(MINSIZE) to cmax. The link is stored in the first
+ * bytes of the block itself. Blocks are taken from the heap
+ * (refill) and returned to it (flush) in batches of depth/2.
+ * --------------------------------------------------------------------------
+ */
+#define CACHEMIN buddy_log2(MINSIZE)
+
+/* --------------------------------------------------------------------------
+ * cachepush: add block to list k
+ * --------------------------------------------------------------------------
+ */
+static inline void cachepush(buddy_cache_t *c, uint8_t k, void *ptr) {
+	*(void**)ptr = c->lst[k];
+	c->lst[k] = ptr;
+	c->cnt[k]++;
+	c->used += (size_t)1 << (k + CACHEMIN);
+}
+
+/* --------------------------------------------------------------------------
+ * cachepop: remove the first block from list k
+ * --------------------------------------------------------------------------
+ */
+static inline void *cachepop(buddy_cache_t *c, uint8_t k) {
+	void *ptr = c->lst[k];
+	if (ptr != NULL) {
+		c->lst[k] = *(void**)ptr;
+		c->cnt[k]--;
+		c->used -= (size_t)1 << (k + CACHEMIN);
+	}
+	return ptr;
+}
+
+/* --------------------------------------------------------------------------
+ * cacherefill: get up to depth/2 blocks for list k from the heap
+ *              respecting the limit of cached bytes
+ * --------------------------------------------------------------------------
+ */
+static void cacherefill(buddy_cache_t *c, uint8_t k) {
+	buddy_heap_t *h = c->h;
+	uint8_t  s = k + CACHEMIN;
+	uint32_t n = c->depth > 1 ? c->depth/2 : 1;
+
+	memlock_acquire(&h->lck);
+	for(; n>0 && c->used + ((size_t)1 << s) <= c->bytes; n--) {
+		memoff_t b = getblock(h, (memoff_t)1 << s);
+		if (b == NOBLOCK) break;
+		cachepush(c, k, block2ptr(h, b));
+	}
+	memlock_release(&h->lck);
+}
+
+/* --------------------------------------------------------------------------
+ * cacheflush: return n blocks of list k to the heap
+ * --------------------------------------------------------------------------
+ */
+static void cacheflush(buddy_cache_t *c, uint8_t k, uint32_t n) {
+	buddy_heap_t *h = c->h;
+
+	memlock_acquire(&h->lck);
+	for(; n>0; n--) {
+		void *ptr = cachepop(c, k);
+		if (ptr == NULL) break;
+		int rc = freeblock(h, ptr2block(h, ptr));
+		assert(rc == OK);
+	}
+	memlock_release(&h->lck);
+}
+
+/* --------------------------------------------------------------------------
+ * cache init
+ * --------------------------------------------------------------------------
+ */
+int buddy_cache_init(buddy_cache_t *c) {
+	if (c->h == NULL || c->h->AMAX == 0) return -1;
+	if (c->cmax > CACHEMIN + BUDDY_CACHE_LISTS - 1) {
+		c->cmax = CACHEMIN + BUDDY_CACHE_LISTS - 1;
+	}
+	if (c->cmax >= c->h->AMAX) c->cmax = c->h->AMAX - 1;
+	c->used = 0;
+	memset(c->cnt, 0, sizeof(c->cnt));
+	memset(c->lst, 0, sizeof(c->lst));
+	return OK;
+}
+
+/* --------------------------------------------------------------------------
+ * cache malloc:
+ * - serve small blocks from the cache
+ * - refill the cache if it is empty
+ * - otherwise, or if the cache cannot be refilled, use the heap
+ * --------------------------------------------------------------------------
+ */
+void *buddy_cache_get_block(buddy_cache_t *c, size_t sz) {
+	void *ret = NULL;
+	if (sz > 0 && c->cmax >= CACHEMIN &&
+	    sz <= ((size_t)1 << c->cmax)) {
+		memoff_t s = sz < MINSIZE ? MINSIZE : nextpow2(sz);
+		uint8_t  k = buddy_log2(s) - CACHEMIN;
+		if (c->lst[k] == NULL) cacherefill(c, k);
+		ret = cachepop(c, k);
+	}
+	if (ret == NULL) ret = buddy_get_block(c->h, sz);
+	return ret;
+}
+
+/* --------------------------------------------------------------------------
+ * cache free:
+ * - blocks not in the main heap or too large are passed on to the heap
+ * - verify the block as freeblock does
+ * - if the list is full or the byte limit is reached,
+ *   flush half of the list
+ * - if there is still no room, free the block in the heap
+ * --------------------------------------------------------------------------
+ */
+int buddy_cache_free_block(buddy_cache_t *c, void *ptr) {
+	buddy_heap_t *h = c->h;
+	int rc = NOTFOUND;
+
+	if ((uintptr_t)ptr < h->hb || (uintptr_t)ptr >= h->eh) {
+		return buddy_free_block(h, ptr);
+	}
+
+	memoff_t b = ptr2block(h, ptr);
+	if (modpow2(b, MINSIZE) == 0) {
+		uint8_t s = getsize(h, block2size(b));
+		if (s != 0 && (s > c->cmax || s < CACHEMIN)) {
+			rc = buddy_free_block(h, ptr);
+		} else if (s != 0) {
+			uint8_t k = s - CACHEMIN;
+			if (c->cnt[k] >= c->depth ||
+			    c->used + ((size_t)1 << s) > c->bytes) {
+				cacheflush(c, k, c->cnt[k] - c->cnt[k]/2);
+			}
+			if (c->cnt[k] < c->depth &&
+			    c->used + ((size_t)1 << s) <= c->bytes) {
+				cachepush(c, k, ptr);
+				rc = OK;
+			} else {
+				rc = buddy_free_block(h, ptr);
+			}
+		}
+	}
+	return rc;
+}
+
+/* --------------------------------------------------------------------------
+ * cache flush (all lists)
+ * --------------------------------------------------------------------------
+ */
+void buddy_cache_flush(buddy_cache_t *c) {
+	for(uint8_t k=0; k<BUDDY_CACHE_LISTS; k++) {
+		if (c->cnt[k] > 0) cacheflush(c, k, c->cnt[k]);
+	}
 }
 
 /* --------------------------------------------------------------------------
  * Block size interface
- * init size: set all bytes in the size area to 0
+ * init codes: bytes needed for n codes
+ * --------------------------------------------------------------------------
+ */
+static inline memoff_t init_codes(memoff_t n) {
+	return (n * CODEBITS) / 8;
+}
+
+/* --------------------------------------------------------------------------
+ * init size: set all bytes in the size area and the free area to 0
  * --------------------------------------------------------------------------
  */
 static inline void init_size(buddy_heap_t *h) {
 	memset(h->sh, 0, h->ssize);
+	memset(h->fh, 0, h->ssize);
 }
 
 /* --------------------------------------------------------------------------
- * pusize:
+ * putcode:
  * p is the index * 6, because each block has 6 bits
  * y is the corresponding byte
  * b is the bit in byte y
  * --------------------------------------------------------------------------
  */
-static inline void putsize(buddy_heap_t *h, int i, char c) {
-	uint32_t p = i*6;
-	uint32_t y = p/8;
-	uint32_t b = modpow2(p,8);
-	h->sh[y] |= ((c<<2) >> b);
-	h->sh[y+1] |= ((c<<2) << (8-b));
+static inline void putcode(uint8_t *a, memoff_t i, char c) {
+#ifdef BUDDY_BYTEMAP
+	a[i] |= c;
+#else
+	memoff_t p = i*6;
+	memoff_t y = p/8;
+	memoff_t b = modpow2(p,8);
+	a[y] |= ((c<<2) >> b);
+	a[y+1] |= ((c<<2) << (8-b));
+#endif
 }
 
 /* --------------------------------------------------------------------------
- * getsize:
+ * getcode:
  * p is the index * 6, because each block has 6 bits
  * y is the corresponding byte
  * b is the bit in byte y
  * --------------------------------------------------------------------------
  */
-static inline char getsize(buddy_heap_t *h, int i) {
-	uint32_t p = i*6;
-	uint32_t y = p/8;
-	uint32_t b = modpow2(p,8);
-	uint8_t x = (h->sh[y] << b);
-	x |= (h->sh[y+1] >> (8-b));
+static inline char getcode(uint8_t *a, memoff_t i) {
+#ifdef BUDDY_BYTEMAP
+	return a[i];
+#else
+	memoff_t p = i*6;
+	memoff_t y = p/8;
+	memoff_t b = modpow2(p,8);
+	uint8_t x = (a[y] << b);
+	x |= (a[y+1] >> (8-b));
 	return (x>>2);
+#endif
 }
 
 /* --------------------------------------------------------------------------
- * erasesize:
+ * erasecode:
  * p is the index * 6, because each block has 6 bits
  * y is the corresponding byte
  * b is the bit in byte y
  * --------------------------------------------------------------------------
  */
-static inline void erasesize(buddy_heap_t *h, int i) {
-	uint32_t p = i*6;
-	uint32_t y = p/8;
-	uint32_t b = modpow2(p,8);
+static inline void erasecode(uint8_t *a, memoff_t i) {
+#ifdef BUDDY_BYTEMAP
+	a[i] = 0;
+#else
+	memoff_t p = i*6;
+	memoff_t y = p/8;
+	memoff_t b = modpow2(p,8);
 	if (b == 0) {
-	   h->sh[y] &= 0xff>>6;
+	   a[y] &= 0xff>>6;
 	} else {
-	   h->sh[y] &= 0xff<<(8-b);
-	   h->sh[y+1] &= 0xff>>(b-2);
+	   a[y] &= 0xff<<(8-b);
+	   a[y+1] &= 0xff>>(b-2);
 	}
+#endif
+}
+
+/* --------------------------------------------------------------------------
+ * nextbyte: first byte in a[i..n-1] that is not 0 (or n)
+ * Bytes are tested 8 at a time (SWAR) once i is aligned to a word;
+ * on little endian machines, the first non-zero byte of a word
+ * is found with ctz.
+ * --------------------------------------------------------------------------
+ */
+static inline memoff_t nextbyte(uint8_t *a, memoff_t i, memoff_t n) {
+	for(; i<n && modpow2(i,8) != 0; i++) {
+		if (a[i] != 0) return i;
+	}
+	for(; i+8 <= n; i+=8) {
+		uint64_t w;
+		memcpy(&w, a+i, 8);
+		if (w != 0) {
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+			return i + ctzll(w) / 8;
+#else
+			break;
+#endif
+		}
+	}
+	for(; i<n; i++) {
+		if (a[i] != 0) return i;
+	}
+	return n;
+}
+
+/* --------------------------------------------------------------------------
+ * nextcode: first code in a[i..n-1] that is not 0 (or n)
+ * Runs of empty slots are skipped bytewise (see nextbyte);
+ * in the packed layout, a non-zero byte holds bits of (at most)
+ * two codes, which are then tested one by one.
+ * --------------------------------------------------------------------------
+ */
+static inline memoff_t nextcode(uint8_t *a, memoff_t i, memoff_t n) {
+#ifdef BUDDY_BYTEMAP
+	return nextbyte(a, i, n);
+#else
+	while (i < n) {
+		memoff_t y = nextbyte(a, (i*6)/8, (n*6+7)/8);
+		memoff_t k = (y*8)/6;
+		if (k > i) i = k;
+		for(; i<n && (i*6)/8 <= y; i++) {
+			if (getcode(a, i) != 0) return i;
+		}
+	}
+	return n;
+#endif
+}
+
+/* --------------------------------------------------------------------------
+ * putsize, getsize, erasesize: the size area
+ * --------------------------------------------------------------------------
+ */
+static inline void putsize(buddy_heap_t *h, memoff_t i, char c) {
+	putcode(h->sh, i, c);
+}
+
+static inline char getsize(buddy_heap_t *h, memoff_t i) {
+	return getcode(h->sh, i);
+}
+
+static inline void erasesize(buddy_heap_t *h, memoff_t i) {
+	erasecode(h->sh, i);
+}
+
+/* --------------------------------------------------------------------------
+ * putfree, getfree, erasefree: the free area
+ * --------------------------------------------------------------------------
+ */
+static inline void putfree(buddy_heap_t *h, memoff_t i, char c) {
+	putcode(h->fh, i, c);
+}
+
+static inline char getfree(buddy_heap_t *h, memoff_t i) {
+	return getcode(h->fh, i);
+}
+
+static inline void erasefree(buddy_heap_t *h, memoff_t i) {
+	erasecode(h->fh, i);
 }
 
 /* --------------------------------------------------------------------------
@@ -823,87 +2195,126 @@ static inline void erasesize(buddy_heap_t *h, int i) {
  * --------------------------------------------------------------------------
  */
 typedef struct {
-	uint32_t nxt;
-	uint32_t prv;
+	memoff_t nxt;
+	memoff_t prv;
 } block_list_t;
 
 /* ------------------------------------------------------------------------
  * init available lists:
  * - set all bytes in the available area to 0xff
  *   this sets each block to NOBLOCK (0xffffffff)
- * - insert address 0 into the available list for msize (entire heap)
+ * - clear the available mask
+ * - insert the top-level blocks, i.e. the greatest power of two
+ *   fitting into the rest of the main heap, starting at address 0
  * ------------------------------------------------------------------------
  */
 static inline void init_avail(buddy_heap_t *h) {
 	memset((void*)h->ah, 0xff, h->asize);
-	binsert(h, 0, buddy_log2(h->msize));
+	memset(h->at, 0xff, sizeof(h->at));
+	memset(h->fc, 0, sizeof(h->fc));
+	h->am = 0;
+	for(memoff_t b=0; b<h->msize;) {
+		uint8_t s = buddy_log2(h->msize - b);
+		binsert(h, b, s);
+		b += (memoff_t)1 << s;
+	}
 }
 
 /* ------------------------------------------------------------------------
  * insert a block
  * ------------------------------------------------------------------------
  */
-static inline void block_insert(buddy_heap_t *h, uint32_t list,
-                                                 uint32_t add) {
+static inline void block_insert(buddy_heap_t *h, memoff_t list,
+                                                 memoff_t add) {
 	block_list_t *tmp = block2ptr(h, add);
 	tmp->nxt = list;
 	tmp->prv = NOBLOCK;
+	MEMINST_COUNT(MEMINST_STEPS_INSERT, 1);
 	if (list != NOBLOCK) {
 		tmp = block2ptr(h, list);
 		tmp->prv = add;
+		MEMINST_COUNT(MEMINST_STEPS_INSERT, 1);
 	}
 }
 
 /* ------------------------------------------------------------------------
- * remove a block
+ * remove a block:
+ * the block knows its neighbours, so we unlink it directly;
+ * if it was the head of the list, its successor is the new head.
  * ------------------------------------------------------------------------
  */
-static inline uint32_t block_remove(buddy_heap_t *h, uint32_t list,
-                                                     uint32_t add) {
-	block_list_t *tmp = block2ptr(h, list);
-	uint32_t head = list;
-	if (list == add) {
-		if (list != NOBLOCK) {
-			head = tmp->nxt;
-			block_clean(h, list);
+static inline memoff_t block_remove(buddy_heap_t *h, memoff_t list,
+                                                     memoff_t add) {
+	block_list_t *node = block2ptr(h, add);
+	memoff_t head = list;
+	if (node != NULL) {
+		MEMINST_COUNT(MEMINST_STEPS_REMOVE, 1);
+		if (node->prv != NOBLOCK) {
+			REFBLOCK(node->prv)->nxt = node->nxt;
+			MEMINST_COUNT(MEMINST_STEPS_REMOVE, 1);
+		} else {
+			assert(list == add);
+			head = node->nxt;
 		}
-	} else {
-		while(tmp != NULL && tmp->nxt != add) {
-			tmp = block2ptr(h, tmp->nxt);
-		}
-		if (tmp != NULL) {
-			block_list_t *node = block2ptr(h, tmp->nxt);
-			tmp->nxt = node->nxt;
-			if (node->nxt != NOBLOCK) {
-				REFBLOCK(node->nxt)->prv = node->prv;
-			}
-			block_clean(h, ptr2block(h, node));
+		if (node->nxt != NOBLOCK) {
+			REFBLOCK(node->nxt)->prv = node->prv;
+			MEMINST_COUNT(MEMINST_STEPS_REMOVE, 1);
 		}
+		block_clean(h, add);
 	}
 	return head;
 }
 
 /* ------------------------------------------------------------------------
- * check if block 'add' is in list
+ * append a block to the list ending in tail
  * ------------------------------------------------------------------------
  */
-static inline char block_is_in(buddy_heap_t *h, uint32_t list, uint32_t add)
-{
-	char rc = 0;
-	block_list_t *tmp = block2ptr(h, list);
-	if (list == add) rc = 1; else {
-		while(tmp != NULL && tmp->nxt != add) {
-			tmp = block2ptr(h, tmp->nxt);
-		}
-		if (tmp != NULL) rc = 1;
+static inline void block_append(buddy_heap_t *h, memoff_t tail,
+                                                 memoff_t add) {
+	block_list_t *tmp = block2ptr(h, add);
+	tmp->nxt = NOBLOCK;
+	tmp->prv = tail;
+	MEMINST_COUNT(MEMINST_STEPS_INSERT, 1);
+	if (tail != NOBLOCK) {
+		REFBLOCK(tail)->nxt = add;
+		MEMINST_COUNT(MEMINST_STEPS_INSERT, 1);
 	}
-	return rc;
+}
+
+/* ------------------------------------------------------------------------
+ * push a block onto a lock-free stack (e.g. the pending list)
+ * ------------------------------------------------------------------------
+ */
+static inline void block_push(buddy_heap_t *h, memoff_t *list,
+                                               memoff_t add) {
+	block_list_t *tmp = block2ptr(h, add);
+	memoff_t head = __atomic_load_n(list, __ATOMIC_RELAXED);
+	do tmp->nxt = head;
+	while (!__atomic_compare_exchange_n(list, &head, add, 1,
+	                                    __ATOMIC_RELEASE,
+	                                    __ATOMIC_RELAXED));
+}
+
+/* ------------------------------------------------------------------------
+ * the successor of a block
+ * ------------------------------------------------------------------------
+ */
+static inline memoff_t block_next(buddy_heap_t *h, memoff_t add) {
+	return REFBLOCK(add)->nxt;
+}
+
+/* ------------------------------------------------------------------------
+ * the predecessor of a block
+ * ------------------------------------------------------------------------
+ */
+static inline memoff_t block_prev(buddy_heap_t *h, memoff_t add) {
+	return REFBLOCK(add)->prv;
 }
 
 /* ------------------------------------------------------------------------
  * Clean a block (set the list bytes to NOBLOCK)
  * ------------------------------------------------------------------------
  */
-static inline void block_clean(buddy_heap_t *h, uint32_t add) {
-	memset(block2ptr(h, add), 0xff, 8); // if security: erase all!
+static inline void block_clean(buddy_heap_t *h, memoff_t add) {
+	memset(block2ptr(h, add), 0xff, sizeof(block_list_t)); // if security: erase all!
 }
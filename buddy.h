@@ -13,9 +13,10 @@
  * allocates large chunks that lie in between two powers of two.
  * But it is in the user's hand to opimise her code.
  *
- * Max address space  : 4 GiB
- * Max allocation unit: 2 GiB
- * Min allocation unit: 8 Byte
+ * Max address space  : 4 GiB  (MEMMAN_OFFSET64: 8 EiB)
+ * Max allocation unit: 2 GiB  (MEMMAN_OFFSET64: 4 EiB)
+ * Min allocation unit: 8 Byte (MEMMAN_OFFSET64: 16 Byte)
+ * (see memoff.h)
  * -----------------------------------------------------------------------
  */
 #ifndef __BUDDY_H__
@@ -23,6 +24,7 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <memoff.h>
 #include <ffit.h>
 
 #define BUDDY_HEAP_FOUND    0x0
@@ -30,6 +32,55 @@
 #define BUDDY_HEAP_INTERNAL -1
 #define BUDDY_HEAP_OK 0x0
 
+/* ------------------------------------------------------------------------
+ * The smallest block is 2^BUDDY_MINORDER bytes
+ * (an available block holds two offsets)
+ * ------------------------------------------------------------------------
+ */
+#ifdef MEMMAN_OFFSET64
+#define BUDDY_MINORDER 4
+#else
+#define BUDDY_MINORDER 3
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* ------------------------------------------------------------------------
+ * Heap Statistics
+ * Running counters of the main heap maintained on each
+ * get, free and extend, so that retrieving them does not
+ * walk the heap. Sizes are block sizes (powers of two).
+ * The emergency heap keeps its own counters (ffh.st).
+ * ------------------------------------------------------------------------
+ */
+typedef struct {
+  size_t      mem; // heap size
+  size_t      usd; // used memory
+  size_t      fre; // available memory
+  size_t    wmark; // high watermark of used memory
+  uint64_t   rqst; // bytes requested (accumulated)
+  uint64_t   grnt; // bytes granted (accumulated)
+  uint32_t   blks; // blocks in use
+} buddy_stats_t;
+
+/* ------------------------------------------------------------------------
+ * Fragmentation Information
+ * The number of available blocks per exponent is maintained
+ * on each insert into and removal from the available lists,
+ * so that retrieving it does not walk the heap.
+ * ------------------------------------------------------------------------
+ */
+typedef struct {
+  size_t      fre; // available memory
+  size_t      lrg; // largest available block
+  uint32_t   frag; // external fragmentation in per mille:
+                   // 1000 * (1 - lrg / fre), 0 if fre is 0
+  size_t     blks; // available blocks
+  size_t cnt[MEMOFF_BITS]; // available blocks of size 2^i
+} buddy_frag_t;
+
 /* ------------------------------------------------------------------------
  * Main Heap Structure
  * ------------------------------------------------------------------------
@@ -38,24 +89,143 @@ typedef struct {
   uintptr_t    mh; // main heap address         (set by user)
   size_t       hs; // overall heap size         (set by user)
   uint8_t       e; // with emergency heap, 0/1  (set by user)
+  uint8_t      el; // lock emergency heap       (set by user)
+                   // independently, 0/1
+  size_t       es; // emergency heap size       (set by user)
+                   // or 0 for the default
+  size_t       rt; // release available blocks  (set by user)
+                   // of rt bytes or more to the OS
+                   // or 0 to keep all pages
+  uint16_t     wr; // route requests wasting   (set by user)
+                   // more than wr per mille
+  size_t       ws; // and more than ws bytes   (set by user)
+                   // to the emergency heap first
+                   // (see buddy_init)
+  uint32_t     lt; // lazy coalescing:         (set by user)
+                   // available blocks per size
+                   // before joining, and frees per
+                   // size between joins, 0: join at once
+  memlock_t   lck; // lock (type set by user)
+  uintptr_t    hb; // main heap (mh aligned)    (computed internally)
   uintptr_t    eh; // emergency heap            (computed internally)                              
-  uint32_t    *ah; // available lists           (computed internally)
+  memoff_t    *ah; // available lists           (computed internally)
   uint8_t     *sh; // size area                 (computed internally)
-  uint32_t  msize; // size of main heap         (computed internally)
-  uint32_t  asize; // size of available lists   (computed internally)
-  uint32_t  ssize; // size of size area         (computed internally)
-  uint32_t  esize; // size of emergency heap    (computed internally)
+  uint8_t     *fh; // free area                 (computed internally)
+  memoff_t  msize; // size of main heap         (computed internally)
+  memoff_t  asize; // size of available lists   (computed internally)
+  memoff_t  ssize; // size of size area         (computed internally)
+  memoff_t  esize; // size of emergency heap    (computed internally)
+  memoff_t     am; // non-empty available lists (computed internally)
+  memoff_t fc[MEMOFF_BITS]; // available blocks per exponent (internal)
+  memoff_t at[MEMOFF_BITS]; // tails of available lists     (internal)
+  memoff_t     pf; // pending frees             (computed internally)
+  memoff_t     ld; // deferred joins            (computed internally)
+  uint32_t lf[MEMOFF_BITS]; // deferred joins per exponent (internal)
   uint8_t    AMAX; // max available list        (computed internally)
   ffit_heap_t ffh; // emergency heap descriptor (computed internally)
+  buddy_stats_t st; // statistics               (computed internally)
+  uintptr_t    ph; // persistent header or 0    (computed internally)
 } buddy_heap_t;
 
+/* ------------------------------------------------------------------------
+ * Block Cache Structure
+ * A block cache holds recently freed small blocks per exponent.
+ * It is meant to be used by one thread only (e.g. thread-local),
+ * so that most get and free requests are served without
+ * touching the heap. Blocks are taken from and returned to
+ * the heap in batches.
+ * Blocks in the cache are used from the heap's point of view.
+ * ------------------------------------------------------------------------
+ */
+#define BUDDY_CACHE_LISTS 16
+
+typedef struct {
+  buddy_heap_t  *h; // the heap                  (set by user)
+  uint8_t     cmax; // max exponent cached       (set by user)
+  uint16_t   depth; // max blocks per exponent   (set by user)
+  size_t     bytes; // max bytes cached          (set by user)
+  size_t      used; // bytes cached              (computed internally)
+  uint16_t cnt[BUDDY_CACHE_LISTS]; // blocks per exponent (internal)
+  void    *lst[BUDDY_CACHE_LISTS]; // cached blocks       (internal)
+} buddy_cache_t;
+
 /* ------------------------------------------------------------------------
  * Heap Initialisation
+ * The lock is initialised according to the type in lck.t
+ * (see memlock.h); lck.acqs and lck.cont count acquisitions
+ * and contended acquisitions.
+ * With el = 0, the emergency heap is protected by the main lock;
+ * with el = 1, the emergency heap gets its own lock (ffh.lck)
+ * of the same type, so that traffic on the emergency heap
+ * does not block the main heap. User lock callbacks can tell
+ * the locks apart by the descriptor they receive.
+ * Only the bookkeeping structures and the first bytes
+ * of the main heap are written; compiled with BUDDY_VERBOSE,
+ * the layout of the heap is printed to stdout.
+ * The start of the heap is rounded up to a multiple of the page size
+ * (or of a smaller power of two for small heaps) in hb;
+ * mh and hs are not changed. Blocks are thus aligned to their size
+ * up to the page size.
+ * The main heap needs not be a power of two.
+ * Without emergency heap (e = 0), the main heap takes
+ * the whole region but the bookkeeping. With an emergency heap,
+ * es bytes are reserved for it and the main heap takes the rest;
+ * if es is 0, the main heap is one half of hs and the emergency heap
+ * and the bookkeeping share the other half.
+ * With rt > 0, blocks of rt bytes or more that become available
+ * (freed or joined with their buddies) return their pages
+ * but the first one to the OS (madvise); this only makes sense
+ * for private anonymous mappings and rt should be at least
+ * two pages, since each release is a system call.
+ * With an emergency heap and wr > 0 or ws > 0, requests that
+ * would waste more than wr per mille of their buddy block
+ * (if wr > 0) and more than ws bytes (if ws > 0) are served
+ * by the emergency heap first, all others by the main heap first;
+ * in either case, the other heap serves what the first cannot.
+ * (E.g. wr = 250 routes 5000 bytes, which waste 39% of 8 KiB,
+ *  and ws prevents small requests from being routed.)
+ * With lt > 0 (lazy coalescing), freed blocks are not joined
+ * with their buddies at once. Once their size has more than lt
+ * available blocks, every lt-th free of that size joins the blocks
+ * of that size deferred since the last join (those whose buddies
+ * are in use are joined later when the buddies are freed);
+ * a request that finds no block large enough joins all deferred
+ * blocks before it fails. Hot sizes thus avoid joining blocks
+ * that are split again soon after.
+ * Returns 0 on success and -1 on error.
  * Must be called once per process
  * ------------------------------------------------------------------------
  */
 int buddy_init(buddy_heap_t *h);
 
+/* ------------------------------------------------------------------------
+ * Persistent heaps (see mempers.h)
+ * buddy_format initialises a persistent heap in the region
+ * at mh of hs bytes (set by user with e, es, ... as for buddy_init),
+ * which starts with the header; the heap itself (mh and hs)
+ * is what remains behind the header.
+ * buddy_detach frees pending blocks, writes the snapshot
+ * of the descriptor and closes the header;
+ * the heap must not be used anymore.
+ * buddy_set_root stores one block in the header (e.g. the root
+ * of the user's data), buddy_get_root returns it after attaching.
+ * buddy_attach opens the heap in the region again
+ * (at the same or another address) without initialising it.
+ * The layout (hs, e and es) is that of the snapshot;
+ * el, rt, wr, ws, lt and the lock type are set by the user.
+ * If hs is not 0, it must be the size of the region.
+ * Fails if the header, the sizes or the checksum do not match
+ * or if the heap was not detached.
+ * All return 0 on success and -1 on error.
+ * ------------------------------------------------------------------------
+ */
+int buddy_format(buddy_heap_t *h);
+int buddy_detach(buddy_heap_t *h);
+int buddy_attach(buddy_heap_t *h, void *region);
+
+void  buddy_set_root(buddy_heap_t *h, void *ptr);
+void *buddy_get_root(buddy_heap_t *h);
+
 /* ------------------------------------------------------------------------
  * Get a block of size sz
  * Returns a pointer on success and NULL on failure
@@ -63,6 +233,22 @@ int buddy_init(buddy_heap_t *h);
  */
 void *buddy_get_block(buddy_heap_t *h, size_t sz);
 
+/* ------------------------------------------------------------------------
+ * Get a block of size sz aligned to align (a power of two).
+ * Blocks are aligned to their size relative to hb. If hb is aligned
+ * to align, the block is just as large as the one buddy_get_block
+ * would return (but at least align). Otherwise, blocks smaller than
+ * align are still found, if hb is aligned to their size,
+ * without keeping more than that size.
+ * If the main heap cannot serve the request, the block is taken
+ * from the emergency heap (see ffit_get_aligned_block).
+ * The block is freed with buddy_free_block;
+ * buddy_extend_block does not preserve the alignment.
+ * Returns a pointer on success and NULL on failure
+ * ------------------------------------------------------------------------
+ */
+void *buddy_get_aligned_block(buddy_heap_t *h, size_t align, size_t sz);
+
 /* ------------------------------------------------------------------------
  * Free the block indicated by ptr
  * Returns 0 on success -1 or 4 on error.
@@ -72,6 +258,88 @@ void *buddy_get_block(buddy_heap_t *h, size_t sz);
  */
 int  buddy_free_block(buddy_heap_t *h, void *ptr);
 
+/* ------------------------------------------------------------------------
+ * Free the block indicated by ptr of size sz
+ * (the size passed to buddy_get_block or buddy_extend_block).
+ * The block is joined according to the size given by the caller;
+ * only builds with assertions (without NDEBUG) verify it
+ * against the size area. Blocks of the emergency heap are freed
+ * as with buddy_free_block.
+ * Returns 0 on success and 4 if the address is unknown
+ * or is not aligned to the size.
+ * ------------------------------------------------------------------------
+ */
+int  buddy_free_sized(buddy_heap_t *h, void *ptr, size_t sz);
+
+/* ------------------------------------------------------------------------
+ * Get a block of 2^k bytes, i.e. of order k, where
+ * BUDDY_MINORDER <= k <= AMAX. The caller computes the order
+ * once (e.g. at compile time), so that no size is rounded.
+ * The request is not routed (the waste is not known);
+ * if the main heap is full, it goes to the emergency heap.
+ * Returns NULL if there is no such block or k is out of range.
+ * ------------------------------------------------------------------------
+ */
+void *buddy_get_order(buddy_heap_t *h, uint8_t k);
+
+/* ------------------------------------------------------------------------
+ * Free the block indicated by ptr of order k
+ * (the order passed to buddy_get_order), as buddy_free_sized.
+ * Returns 0 on success and 4 if the address is unknown
+ * or is not aligned to the order.
+ * ------------------------------------------------------------------------
+ */
+int  buddy_free_order(buddy_heap_t *h, void *ptr, uint8_t k);
+
+/* ------------------------------------------------------------------------
+ * Retrieve the usable size of the block indicated by ptr,
+ * i.e. the size granted, which is at least the size requested.
+ * The caller may use all of it.
+ * Returns 0 if the address is unknown.
+ * ------------------------------------------------------------------------
+ */
+size_t buddy_usable_size(buddy_heap_t *h, void *ptr);
+
+/* ------------------------------------------------------------------------
+ * Get up to n blocks of size sz at once and store them in out.
+ * The lock is taken once; the blocks are cut from as few
+ * large blocks as possible and are thus adjacent in memory.
+ * Blocks the main heap cannot serve are taken from the
+ * emergency heap (see ffit_get_blocks).
+ * Returns the number of blocks stored in out.
+ * ------------------------------------------------------------------------
+ */
+size_t buddy_get_blocks(buddy_heap_t *h, size_t sz, size_t n, void **out);
+
+/* ------------------------------------------------------------------------
+ * Free the n blocks in ptrs at once.
+ * The array is sorted by address; adjacent buddies
+ * are joined before they are inserted into the available lists.
+ * Unknown addresses are skipped, all other blocks are freed.
+ * Returns 0 on success and the first error otherwise
+ * (see buddy_free_block).
+ * ------------------------------------------------------------------------
+ */
+int  buddy_free_blocks(buddy_heap_t *h, void **ptrs, size_t n);
+
+/* ------------------------------------------------------------------------
+ * Free the block indicated by ptr from another thread.
+ * The block is put on a lock-free list of pending frees
+ * without taking the heap lock and is released by the next
+ * buddy_get_block (or buddy_free_pending).
+ * Returns 0 on success and 4 if the address is unknown.
+ * Corruption can only be detected when the block is released.
+ * ------------------------------------------------------------------------
+ */
+int  buddy_free_remote(buddy_heap_t *h, void *ptr);
+
+/* ------------------------------------------------------------------------
+ * Release all pending frees now.
+ * Returns 0 on success and the first error otherwise.
+ * ------------------------------------------------------------------------
+ */
+int  buddy_free_pending(buddy_heap_t *h);
+
 /* ------------------------------------------------------------------------
  * Extend the block indicated by ptr to size sz.
  * If ptr is NULL, the function behaves exactly like buddy_get_block.
@@ -97,6 +365,54 @@ int  buddy_free_block(buddy_heap_t *h, void *ptr);
 void *buddy_extend_block(buddy_heap_t *h,
            void *ptr, size_t sz, int *rc);
 
+/* ------------------------------------------------------------------------
+ * Resize the block indicated by ptr to size sz without taking
+ * a new block, as buddy_extend_block does if the block can be
+ * shrunk or extended with its buddies (in the emergency heap
+ * see ffit_resize_block). With buddies on the left, the data
+ * move down and the returned pointer differs from ptr.
+ * Otherwise, NULL is returned and the block is unchanged
+ * (e.g. the caller may move it itself);
+ * rc is set as by buddy_extend_block.
+ * If ptr is NULL or sz is 0, NULL is returned.
+ * ------------------------------------------------------------------------
+ */
+void *buddy_resize_block(buddy_heap_t *h,
+           void *ptr, size_t sz, int *rc);
+
+/* ------------------------------------------------------------------------
+ * Block Cache Initialisation
+ * cmax is limited to the exponent 2+BUDDY_CACHE_LISTS
+ * and to the largest exponent smaller than the main heap.
+ * Returns 0 on success and -1 on error.
+ * ------------------------------------------------------------------------
+ */
+int buddy_cache_init(buddy_cache_t *c);
+
+/* ------------------------------------------------------------------------
+ * Get a block of size sz through the cache.
+ * Sizes greater than 2^cmax are passed on to buddy_get_block.
+ * Returns a pointer on success and NULL on failure
+ * ------------------------------------------------------------------------
+ */
+void *buddy_cache_get_block(buddy_cache_t *c, size_t sz);
+
+/* ------------------------------------------------------------------------
+ * Free the block indicated by ptr into the cache.
+ * Blocks greater than 2^cmax are passed on to buddy_free_block.
+ * Returns 0 on success -1 or 4 on error (as buddy_free_block).
+ * Note that a block freed twice into the cache is not detected.
+ * ------------------------------------------------------------------------
+ */
+int buddy_cache_free_block(buddy_cache_t *c, void *ptr);
+
+/* ------------------------------------------------------------------------
+ * Return all cached blocks to the heap
+ * (e.g. when the thread terminates)
+ * ------------------------------------------------------------------------
+ */
+void buddy_cache_flush(buddy_cache_t *c);
+
 /* ------------------------------------------------------------------------
  * Print a visualisation of the current usage of the heap to stdout
  * indicating the size of each block in
@@ -107,13 +423,51 @@ void *buddy_extend_block(buddy_heap_t *h,
 void  buddy_print_heap(buddy_heap_t *h);
 
 /* ------------------------------------------------------------------------
- * Retriev heap statistics.
- * Note that wmark (watermark) and stps (steps)
- * are not computed.
+ * Retrieve statistics of the main heap.
+ * The values are read from the running counters
+ * in constant time (pending frees are released first).
+ * Blocks held by block caches and slabs count as used.
+ * The values are 32-bit and saturate at UINT32_MAX;
+ * heaps beyond 4 GiB need buddy_get_counters.
  * ------------------------------------------------------------------------
  */
 void  buddy_get_stats(buddy_heap_t  *h,
                       uint32_t    *mem,  // heap size 
                       uint32_t    *usd,  // used memory 
                       uint32_t    *fre); // available memory
+
+/* ------------------------------------------------------------------------
+ * Retrieve all counters of the main heap (see buddy_stats_t).
+ * rqst and grnt accumulate the sizes requested from
+ * and granted by buddy_get_block and buddy_extend_block
+ * since initialisation; their ratio is the waste caused
+ * by rounding up to powers of two.
+ * ------------------------------------------------------------------------
+ */
+void  buddy_get_counters(buddy_heap_t *h, buddy_stats_t *st);
+
+/* ------------------------------------------------------------------------
+ * Retrieve the fragmentation of the main heap (see buddy_frag_t)
+ * in O(AMAX). Pending frees are freed first.
+ * A request of more than lrg bytes fails in the main heap,
+ * however much memory is available. The emergency heap
+ * is described by ffit_get_frag_info(&h->ffh, ...).
+ * ------------------------------------------------------------------------
+ */
+void  buddy_get_frag_info(buddy_heap_t *h, buddy_frag_t *fi);
+
+/* ------------------------------------------------------------------------
+ * Check the consistency of the main heap:
+ * the blocks in the size and free area must cover the heap
+ * without overlap, be aligned to their size and agree with
+ * the statistics and the available counts.
+ * Pending frees are freed first. The walk is O(heap size / 8 MINSIZE);
+ * it is meant for tests and debugging.
+ * Returns 0 if the heap is consistent and -1 otherwise.
+ * ------------------------------------------------------------------------
+ */
+int buddy_check_heap(buddy_heap_t *h);
+#ifdef __cplusplus
+}
+#endif
 #endif
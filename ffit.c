@@ -29,36 +29,64 @@
  * - the struct ffit_heap_t and
  * - the memory blocks themselves.
  *
- * To refer to memory blocks internally a 4-byte pointer type
- * is used; this limits the heap size to 4 GiB. Furthermore,
- * the size of each block is stored as a 31-bit unsigned integer
- * (see below). This limits the greatest allocation possible to
- * 2 GiB. 
+ * To refer to memory blocks internally an offset type (memoff_t)
+ * is used, which has 32 bits or, with MEMMAN_OFFSET64, 64 bits
+ * (see memoff.h); this limits the heap size to 4 GiB (8 EiB).
+ * Furthermore, the size of each block is stored in an offset
+ * without its top bit (see below). This limits the greatest
+ * allocation possible to 2 GiB (8 EiB).
  *
- * The main component is the available list (avail), a doubly linked
- * list that contains all available blocks in the order of their size.
- * The allocator will grab the first block which is equal to or greater
- * than the requested size (therefore: first fit).
+ * The main component are the available lists (bins). Available blocks
+ * are segregated by size into doubly linked lists following the
+ * "two-level segregated fit" scheme: the first level is the power of two
+ * of the block size (log2), the second level divides the range
+ * between two powers of two linearly into SLN classes.
+ * A bitmap for the first level and one bitmap per first level class
+ * for the second level tell us which lists are non-empty.
+ * Blocks are always inserted at the head of their list.
+ *
+ * To allocate n bytes, n is rounded up to the next class boundary,
+ * such that every block in the class and in all classes above is
+ * large enough. Using the bitmaps, the first non-empty list
+ * of these classes is found with two ctz operations and the allocator
+ * will grab the first block in that list (therefore: first fit
+ * among the lists). Only if there is no such list, the list of the
+ * class of n itself is searched for a block that is large enough.
+ * Insertion and removal are constant time operations.
  *
  * The size of each block is stored as a 31-bit integer in the first
- * four bytes of that block. The 32-nd bit and the last byte of the
+ * four bytes of that block (63 bits in eight bytes with MEMMAN_OFFSET64).
+ * The top bit and the last byte of the
  * block are used to store a 1-bit tag: if the block is currently
  * used the tag is 1; otherwise it is 0. When a block is freed
  * it is merged with its neighbours if the corresponding tag is 0;
  * note that <block address>-1 and <block address>+<block size>
  * refer to the tag corresponding to the preceding and following
- * neighbour respectively. The merged neighbours are removed from
- * the available list and the resulting block (which, if both neighbours
- * are in use, is just the original block) is inserted in the list
- * respecting the order by block size.
+ * neighbour respectively.
+ *
+ * Available blocks additionally store their size in the offset
+ * immediately before the last byte (Knuth's boundary tags).
+ * The preceding neighbour of an available block, hence,
+ * is found at <block address> minus the size stored at
+ * <block address>-1-sizeof(memoff_t) without searching
+ * the available lists.
+ * Since this space is used only when the block is available,
+ * it costs nothing for blocks in use.
+ *
+ * The merged neighbours are removed from their available lists and
+ * the resulting block (which, if both neighbours are in use,
+ * is just the original block) is inserted in the list
+ * corresponding to its size.
  *
  * Here is a sketch of the block layout:
  * 
- *   +----+----+----+-------------+-+
- *   |    |    |    | ...         | |
- *   +----+----+----+-------------+-+
- *   ^    ^    ^    ^             ^
- *   |    |    |    |             |_ tag
+ *   +----+----+----+-------------+----+-+
+ *   |    |    |    | ...         |    | |
+ *   +----+----+----+-------------+----+-+
+ *   ^    ^    ^    ^             ^    ^
+ *   |    |    |    |             |    |_ tag
+ *   |    |    |    |             |
+ *   |    |    |    |             |_ size (4 bytes)
  *   |    |    |    |
  *   |    |    |    |_ n bytes
  *   |    |    |   
@@ -68,19 +96,27 @@
  *   |
  *   |_ size and tag (4 bytes)
  *
- * Note that the next and previous pointers are needed only
- * when the block is available; when the block is used, these 8 bytes
- * are available for application use.
+ * Note that the next and previous pointers and the trailing size
+ * are needed only when the block is available; when the block is used,
+ * these 12 bytes are available for application use.
  *
- * The data structure implemented in the block (size, pointers, tag)
- * requires at least 4 + 2 x 4 + 1 = 13 byte. The minimal allocation
+ * The data structure implemented in the block (size, pointers, size, tag)
+ * requires at least 4 + 2 x 4 + 4 + 1 = 17 byte. The minimal allocation
  * size is chosen as 32 byte. This also reflects the fact that
  * for each allocation, 5 bytes are wasted. For a 32-byte block,
  * the overhead is ~15%. 
+ *
+ * Compiled with MEMMAN_OFFSET64 (see memoff.h), sizes and pointers
+ * take 8 bytes each. The block then requires 8 + 2 x 8 + 8 + 1 = 33 byte,
+ * the minimal allocation size is 48 byte and 9 bytes are wasted
+ * per allocation.
  * -----------------------------------------------------------------------
  */
 
 #include <ffit.h>
+#include <memtrace.h>
+#include <meminst.h>
+#include <mempers.h>
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
@@ -89,7 +125,31 @@
  * MINSIZE: minimal allocation size
  * -----------------------------------------------------------------------
  */
+#ifdef MEMMAN_OFFSET64
+#define MINSIZE 48
+#else
 #define MINSIZE 32
+#endif
+
+/* -----------------------------------------------------------------------
+ * HDRSIZE : the size (and tag) in front of user memory
+ * OVERHEAD: bytes per block not available for the user
+ *           (the size in front and the tag at the end)
+ * -----------------------------------------------------------------------
+ */
+#define HDRSIZE  sizeof(memoff_t)
+#define OVERHEAD (HDRSIZE+1)
+
+/* -----------------------------------------------------------------------
+ * Segregated lists:
+ * - FLN: number of first level classes
+ * - SLI: log2 of the number of second level classes
+ * - SLN: number of second level classes per first level class
+ * -----------------------------------------------------------------------
+ */
+#define FLN FFIT_FLN
+#define SLI FFIT_SLI
+#define SLN FFIT_SLN
 
 /* ------------------------------------------------------------------------
  * Helpers:
@@ -97,34 +157,69 @@
  * - Dereference such a pointer
  * ------------------------------------------------------------------------
  */
-#define NOBLOCK 0xffffffff
+#define NOBLOCK MEMOFF_NONE
 #define REFBLOCK(n) ((block_t*)block2ptr(h->mh, n))
 
 /* --------------------------------------------------------------------------
- * Convert pseudo block address (uint32_t) to real pointer
+ * Convert pseudo block address (memoff_t) to real pointer
  * --------------------------------------------------------------------------
  */
-static inline void *block2ptr(uintptr_t mh, uint32_t add) {
+static inline void *block2ptr(uintptr_t mh, memoff_t add) {
 	return (add == NOBLOCK ? NULL :
                 ((void*)((uintptr_t)(add) + (uintptr_t)mh)));
 }
 
 /* --------------------------------------------------------------------------
- * Convert real pointer into pseudo block address (uint32_t)
+ * Convert real pointer into pseudo block address (memoff_t)
  * --------------------------------------------------------------------------
  */
-static inline uint32_t ptr2block(uintptr_t mh, void *ptr) {
+static inline memoff_t ptr2block(uintptr_t mh, void *ptr) {
 	return (ptr == NULL ? NOBLOCK :
-	        (uint32_t)((uintptr_t)(ptr) - (uintptr_t)mh));
+	        (memoff_t)((uintptr_t)(ptr) - (uintptr_t)mh));
 }
 
 #define NOTFOUND 4
 
+/* --------------------------------------------------------------------------
+ * count leading and trailing zeros (clz, ctz)
+ * --------------------------------------------------------------------------
+ */
+#define clz memoff_clz
+#define ctz memoff_ctz
+
+/* --------------------------------------------------------------------------
+ * log2 (see buddy.c)
+ * --------------------------------------------------------------------------
+ */
+static inline uint8_t ffit_log2(memoff_t n) {
+	return (MEMOFF_BITS - 1 - clz(n));
+}
+
+/* --------------------------------------------------------------------------
+ * All bits from bit i upwards
+ * --------------------------------------------------------------------------
+ */
+static inline memoff_t bitsfrom(uint8_t i) {
+	return (i >= MEMOFF_BITS ? 0 : (MEMOFF_NONE << i));
+}
+
+/* --------------------------------------------------------------------------
+ * Block size for a request of sz bytes:
+ * sz plus overhead, at least MINSIZE;
+ * requests that do not fit into the heap yield hs (and fail)
+ * --------------------------------------------------------------------------
+ */
+static inline memoff_t blocksize(ffit_heap_t *h, size_t sz) {
+	if (sz >= h->hs - OVERHEAD) return (memoff_t)h->hs;
+	if (sz + OVERHEAD < MINSIZE) return MINSIZE;
+	return (memoff_t)(sz + OVERHEAD);
+}
+
 /* --------------------------------------------------------------------------
  * Get size 
  * --------------------------------------------------------------------------
  */
-static inline uint32_t getsize(uint32_t sz) {
+static inline memoff_t getsize(memoff_t sz) {
 	return (sz>>1);
 }
 
@@ -132,7 +227,7 @@ static inline uint32_t getsize(uint32_t sz) {
  * Set size 
  * --------------------------------------------------------------------------
  */
-static inline uint32_t setsize(uint32_t sz) {
+static inline memoff_t setsize(memoff_t sz) {
 	return (sz<<1);
 }
 
@@ -140,7 +235,7 @@ static inline uint32_t setsize(uint32_t sz) {
  * Get tag
  * --------------------------------------------------------------------------
  */
-static inline uint8_t gettag(uint32_t sz) {
+static inline uint8_t gettag(memoff_t sz) {
 	return (uint8_t)(sz & 1);
 }
 
@@ -151,9 +246,9 @@ static inline uint8_t gettag(uint32_t sz) {
  * --------------------------------------------------------------------------
  */
 typedef struct {
-	uint32_t sze;
-	uint32_t nxt;
-	uint32_t prv;
+	memoff_t sze;
+	memoff_t nxt;
+	memoff_t prv;
 } block_t;
 
 /* --------------------------------------------------------------------------
@@ -173,22 +268,33 @@ typedef ffit_heap_t heap_t;
  * --------------------------------------------------------------------------
  */
 static inline void tag(block_t *b) {
-        uint32_t s = b->sze >> 1;
-	b->sze |= (uint32_t)1;
+        memoff_t s = b->sze >> 1;
+	b->sze |= (memoff_t)1;
         *(((char*)b)+s-1) = 1;
 }
 
 /* --------------------------------------------------------------------------
- * Untag block
+ * Untag block and store the size in front of the tag
  * --------------------------------------------------------------------------
  */
 static inline void untag(block_t *b) {
-        uint32_t s = b->sze >> 1;
-	if ((b->sze & (uint32_t)1) == 1)
-		b->sze = 0xffffffff & (b->sze^(uint32_t)1);
+        memoff_t s = b->sze >> 1;
+	if ((b->sze & (memoff_t)1) == 1)
+		b->sze = b->sze^(memoff_t)1;
+	memcpy(((char*)b)+s-OVERHEAD, &s, sizeof(memoff_t));
         *(((char*)b)+s-1) = 0;
 }
 
+/* --------------------------------------------------------------------------
+ * Get the size stored in front of the tag at w
+ * --------------------------------------------------------------------------
+ */
+static inline memoff_t tagsize(uint8_t *w) {
+	memoff_t s;
+	memcpy(&s, w-HDRSIZE, sizeof(memoff_t));
+	return s;
+}
+
 /* --------------------------------------------------------------------------
  * Check if byte is tagged
  * --------------------------------------------------------------------------
@@ -197,132 +303,257 @@ static inline char tagged(uint8_t *w) {
 	return (((*w) && (uint8_t)1) == 1);
 }
 
+/* --------------------------------------------------------------------------
+ * Compute the list (first and second level) for size sz
+ * --------------------------------------------------------------------------
+ */
+static inline void mapping(memoff_t sz, uint8_t *f, uint8_t *s) {
+	assert(sz >= SLN);
+	*f = ffit_log2(sz);
+	*s = (uint8_t)((sz >> (*f - SLI)) - SLN);
+}
+
 /* --------------------------------------------------------------------------
  * Remove from available list
  * --------------------------------------------------------------------------
  */
 static void bremove(heap_t *h, block_t *p) {
+	uint8_t f, s;
+	mapping(getsize(p->sze), &f, &s);
+
+	MEMINST_COUNT(MEMINST_STEPS_REMOVE, 1 + (p->prv != NOBLOCK)
+	                                      + (p->nxt != NOBLOCK));
 	if (p->prv != NOBLOCK)
 		REFBLOCK(p->prv)->nxt = p->nxt;
-	else h->first = p->nxt;
+	else h->bins[f][s] = p->nxt;
 	
 	if (p->nxt != NOBLOCK)
 		REFBLOCK(p->nxt)->prv = p->prv;
-	else h->last = p->prv;
+
+	if (h->bins[f][s] == NOBLOCK) {
+		h->sl[f] &= ~((uint32_t)1 << s);
+		if (h->sl[f] == 0) h->fl &= ~((memoff_t)1 << f);
+	}
+	h->fc[f]--;
 }
 
 /* --------------------------------------------------------------------------
- * Insert q before p in available list
+ * Insert b at the head of its available list
  * --------------------------------------------------------------------------
  */
-static void binsert(heap_t *h, block_t *p, block_t *q) {
-	if (p->prv != NOBLOCK)
-		REFBLOCK(p->prv)->nxt = P2B(q);
-	else h->first = P2B(q);
-	q->prv = p->prv;
-	p->prv = P2B(q);
-	q->nxt = P2B(p);
+static void binsert(heap_t *h, block_t *b) {
+	uint8_t f, s;
+	mapping(getsize(b->sze), &f, &s);
+
+	b->prv = NOBLOCK;
+	b->nxt = h->bins[f][s];
+	MEMINST_COUNT(MEMINST_STEPS_INSERT, 1 + (b->nxt != NOBLOCK));
+	if (b->nxt != NOBLOCK) REFBLOCK(b->nxt)->prv = P2B(b);
+	h->bins[f][s] = P2B(b);
+
+	h->sl[f] |= ((uint32_t)1 << s);
+	h->fl |= ((memoff_t)1 << f);
+	h->fc[f]++;
 }
 
 /* --------------------------------------------------------------------------
- * Find block immediately before address "end" in available list
+ * Find the available block immediately before address "end"
+ * using the size in front of its tag
  * --------------------------------------------------------------------------
  */
-static block_t *bfind(heap_t *h, uint32_t end) {
-	block_t *b = B2P(h->first);
-	uint32_t a = h->first;
-	char found = 0;
-
-	for(;;) {
-		if (b == NULL) break;
-		uint32_t s = getsize(b->sze);
-		if (a+s == end) {
-			found=1; break;
-		}
-		a = b->nxt;
-		b = B2P(a);
+static block_t *bfind(heap_t *h, memoff_t end) {
+	block_t *b = NULL;
+	memoff_t s = tagsize((uint8_t*)(B2P(end-1)));
+	MEMINST_COUNT(MEMINST_STEPS_FIND, 1);
+	if (s >= MINSIZE && s <= end) {
+		b = B2P(end-s);
+		if (b->sze != setsize(s)) b = NULL;
 	}
-	if (!found) b = NULL;
 	return b;
 }
 
 /* --------------------------------------------------------------------------
- * Insert b into available list maintaining order by size
+ * Find an available block with at least "sz":
+ * - round sz up to the next class, such that any block
+ *   in that class is large enough
+ * - find the first non-empty list at or above that class
+ * - if there is none, search the class of sz itself
  * --------------------------------------------------------------------------
  */
-static void binssort(heap_t *h, block_t *b) {
-	if (h->first == NOBLOCK) {
-		h->first = P2B(b);
-		h->last =  h->first;
-		b->nxt = NOBLOCK;
-		b->prv = NOBLOCK;
+static block_t *bfindfit(heap_t *h, memoff_t sz) {
+	block_t *b = NULL;
+	uint8_t f, s;
+
+	mapping(sz + ((memoff_t)1 << (ffit_log2(sz) - SLI)) - 1, &f, &s);
+
+	memoff_t m = h->sl[f] & bitsfrom(s);
+	if (m == 0) {
+		m = h->fl & bitsfrom(f+1);
+		if (m != 0) {
+			f = ctz(m); m = h->sl[f];
+		}
+	}
+	MEMINST_COUNT(MEMINST_STEPS_FIT, 1);
+	if (m != 0) {
+		s = ctz(m); b = B2P(h->bins[f][s]);
 	} else {
-		block_t *p = B2P(h->first);
-		uint32_t s = getsize(b->sze);
-		for(;;) {
-			uint32_t sz = getsize(p->sze);
-			if (sz >= s) {
-				binsert(h, p, b); break;
+		mapping(sz, &f, &s);
+		memoff_t a = h->bins[f][s];
+		while (a != NOBLOCK) {
+			block_t *p = B2P(a);
+			MEMINST_COUNT(MEMINST_STEPS_FIT, 1);
+			if (getsize(p->sze) >= sz) {
+				b = p; break;
 			}
-			if (p->nxt == NOBLOCK) {
-				p->nxt = P2B(b);
-				b->prv = P2B(p);
-				b->nxt = NOBLOCK;
-				h->last = p->nxt;
-				break;
-			}
-			p = B2P(p->nxt);
+			a = p->nxt;
 		}
 	}
+	return b;
 }
 
 /* --------------------------------------------------------------------------
- * Replace p by q in available list
+ * Statistics: count a block of size sz as used or freed
  * --------------------------------------------------------------------------
  */
-static void breplace(heap_t *h, block_t *p, block_t *q) {
-	bremove(h, p);
-	binssort(h, q);
+static inline void countused(heap_t *h, memoff_t sz) {
+	h->st.usd += sz; h->st.blks++;
+	if (h->st.usd > h->st.wmark) h->st.wmark = h->st.usd;
+}
+
+static inline void countfreed(heap_t *h, memoff_t sz) {
+	h->st.usd -= sz; h->st.blks--;
+}
+
+static inline void countresized(heap_t *h, memoff_t o, memoff_t n) {
+	h->st.usd = h->st.usd - o + n;
+	if (h->st.usd > h->st.wmark) h->st.wmark = h->st.usd;
 }
 
 /* --------------------------------------------------------------------------
- * Find first block with at least "sz" in available list
+ * Use the block p (removed from its list) for "sz" bytes
+ * and insert the remainder, if any, as a new available block
  * --------------------------------------------------------------------------
  */
-static uint32_t getblock(heap_t *h, uint32_t sz) {
-	uint32_t b = NOBLOCK;
-	block_t *p = B2P(h->first);
-	while (p != NULL) {
-		uint32_t s = getsize(p->sze);
-		if (s >= sz) {
-			// append new block
-			if (s > sz + MINSIZE) {
-				block_t *q = block2ptr(h->mh,
-				             ptr2block(h->mh, p)+sz);
-				q->sze = setsize(s-sz);
-				untag(q);
-				p->sze = setsize(sz);
-				breplace(h,p,q);
-			// remove
-			} else {
-				p->sze = setsize(getsize(p->sze));
-				bremove(h,p);
-			}
-			tag(p); b = P2B(p); break;
-		}
-		p = B2P(p->nxt);
+static memoff_t takeblock(heap_t *h, block_t *p, memoff_t sz) {
+	memoff_t s = getsize(p->sze);
+	// append new block
+	if (s > sz + MINSIZE) {
+		block_t *q = block2ptr(h->mh,
+		             ptr2block(h->mh, p)+sz);
+		q->sze = setsize(s-sz);
+		untag(q);
+		p->sze = setsize(sz);
+		binsert(h,q);
+		MEMINST_COUNT(MEMINST_SPLITS, 1);
+	// remove
+	} else {
+		p->sze = setsize(getsize(p->sze));
+	}
+	tag(p);
+	countused(h, getsize(p->sze));
+	return P2B(p);
+}
+
+/* --------------------------------------------------------------------------
+ * Get a block with at least "sz" from the available lists
+ * --------------------------------------------------------------------------
+ */
+static memoff_t getblock(heap_t *h, memoff_t sz) {
+	memoff_t b = NOBLOCK;
+	block_t *p = bfindfit(h, sz);
+	if (p != NULL) {
+		bremove(h,p);
+		b = takeblock(h, p, sz);
 	}
 	return b;
 }
 
+/* --------------------------------------------------------------------------
+ * Get up to n blocks with "sz" bytes each:
+ * - find a block for all remaining blocks
+ *   (or for half of them, a quarter, ...)
+ * - cut the blocks one after the other from its beginning
+ *   and handle the last one (and the remainder) like getblock
+ * returns the number of blocks stored in out
+ * --------------------------------------------------------------------------
+ */
+static size_t getblocks(heap_t *h, memoff_t sz, size_t n, void **out) {
+	size_t k = 0;
+	while (k < n) {
+		size_t r = n - k;
+		if (r > (h->hs / sz)) r = h->hs / sz;
+
+		block_t *p = NULL;
+		for(; r > 0; r >>= 1) {
+			p = bfindfit(h, (memoff_t)(r * sz));
+			if (p != NULL) break;
+		}
+		if (p == NULL) break;
+
+		bremove(h,p);
+		for(; r > 1; r--) {
+			memoff_t s = getsize(p->sze);
+			p->sze = setsize(sz);
+			tag(p);
+			countused(h, sz);
+			out[k++] = B2P(P2B(p)+HDRSIZE);
+			p = block2ptr(h->mh, ptr2block(h->mh, p)+sz);
+			p->sze = setsize(s-sz);
+		}
+		out[k++] = B2P(takeblock(h, p, sz)+HDRSIZE);
+	}
+	return k;
+}
+
+/* --------------------------------------------------------------------------
+ * Bytes to skip at the beginning of block p,
+ * such that the user memory is aligned to "a":
+ * either 0 or enough for an available block (at least MINSIZE)
+ * --------------------------------------------------------------------------
+ */
+static inline memoff_t leading(block_t *p, memoff_t a) {
+	uintptr_t u = (uintptr_t)p + HDRSIZE;
+	memoff_t l = (memoff_t)(((u + a - 1) & ~((uintptr_t)a - 1)) - u);
+	while (l != 0 && l < MINSIZE) l += a;
+	return l;
+}
+
+/* --------------------------------------------------------------------------
+ * Get a block with at least "sz" whose user memory is aligned to "a":
+ * - take the first fit, if it happens to be aligned
+ * - otherwise find a block with room for the leading remainder
+ * - split off the leading remainder as an available block
+ *   (no merge needed: the preceding neighbour of an available block
+ *    is always in use)
+ * - use the rest like any other block
+ * --------------------------------------------------------------------------
+ */
+static memoff_t getaligned(heap_t *h, memoff_t a, memoff_t sz) {
+	block_t *p = bfindfit(h, sz);
+	if (p != NULL && leading(p, a) != 0) p = bfindfit(h, sz + a + MINSIZE);
+	if (p == NULL) return NOBLOCK;
+
+	memoff_t l = leading(p, a);
+	bremove(h,p);
+	if (l > 0) {
+		memoff_t s = getsize(p->sze);
+		p->sze = setsize(l);
+		untag(p);
+		binsert(h,p);
+		p = block2ptr(h->mh, ptr2block(h->mh, p)+l);
+		p->sze = setsize(s-l);
+	}
+	return takeblock(h, p, sz);
+}
+
 /* --------------------------------------------------------------------------
  * Add memory block at "add" into available list
  * --------------------------------------------------------------------------
  */
-static int freeblock(heap_t *h, uint32_t add) {
+static int freeblock(heap_t *h, memoff_t add) {
 	int rc = 0;
 	block_t *b = block2ptr(h->mh, add);
-	uint32_t s = getsize(b->sze);
+	memoff_t s = getsize(b->sze);
 	uint8_t  t = gettag(b->sze);
 
 	if (!t) {rc = NOTFOUND;} else {
@@ -333,9 +564,10 @@ static int freeblock(heap_t *h, uint32_t add) {
 			block_t *p = bfind(h, add);
 			// merge with previous
 			if (p == NULL) {rc = -1;} else {
-				p->sze = setsize(getsize(p->sze) + s);
 				bremove(h,p);
+				p->sze = setsize(getsize(p->sze) + s);
 				b = p;
+				MEMINST_COUNT(MEMINST_JOINS, 1);
 			}
         	}
 		// the block immediately following 'add'
@@ -343,33 +575,143 @@ static int freeblock(heap_t *h, uint32_t add) {
 			block_t *q = block2ptr(h->mh, add+s);
 			// merge with next
 			if (add+s < h->hs && !gettag(q->sze)) {
-				uint32_t ns = getsize(q->sze);
-				b->sze = setsize(getsize(b->sze) + ns);
+				memoff_t ns = getsize(q->sze);
 				bremove(h,q);
+				b->sze = setsize(getsize(b->sze) + ns);
+				MEMINST_COUNT(MEMINST_JOINS, 1);
 			} 
 
 			// remove tag and insert
-			untag(b); binssort(h,b);
+			untag(b); binsert(h,b);
+			countfreed(h, s);
 		}
 	}
 	return rc;
 }
 
+/* --------------------------------------------------------------------------
+ * Free the n blocks in ptrs (sorted by address):
+ * blocks in use that are adjacent are merged into one
+ * before the merged block is freed (and joined with its neighbours)
+ * returns the first error
+ * --------------------------------------------------------------------------
+ */
+static int freeblocks(heap_t *h, void **ptrs, size_t n) {
+	int rc = 0;
+	for(size_t i=0; i<n; i++) {
+		memoff_t add = P2B(ptrs[i]-HDRSIZE);
+		block_t *b = B2P(add);
+		if (!gettag(b->sze)) {
+			if (rc == 0) rc = NOTFOUND;
+			continue;
+		}
+		memoff_t s = getsize(b->sze);
+		uint32_t m = 0;
+		while (i+1 < n && P2B(ptrs[i+1]-HDRSIZE) == add+s &&
+		       add+s < h->hs) {
+			block_t *q = B2P(add+s);
+			if (!gettag(q->sze)) break;
+			s += getsize(q->sze); m++; i++;
+			// freeblock counts the merged block once
+			h->st.blks--;
+		}
+		if (m > 0) b->sze = setsize(s) | (memoff_t)1;
+		int x = freeblock(h, add);
+		if (x != 0 && rc == 0) rc = x;
+	}
+	return rc;
+}
+
+/* --------------------------------------------------------------------------
+ * Resize the block at "add" to "sz" in place:
+ * - to shrink, split off the tail (if it is at least MINSIZE)
+ *   and free it, which merges it with the following block
+ * - to grow, merge the following block, if it is available
+ *   and large enough, and split off what is not needed
+ * returns 1 on success and 0 if the block must be moved
+ * --------------------------------------------------------------------------
+ */
+static int resizeblock(heap_t *h, memoff_t add, memoff_t sz) {
+	block_t *b = B2P(add);
+	memoff_t os = getsize(b->sze);
+
+	if (sz <= os) {
+		if (os - sz >= MINSIZE) {
+			block_t *q = B2P(add+sz);
+			b->sze = setsize(sz); tag(b);
+			q->sze = setsize(os-sz); tag(q);
+			// freeblock counts the tail as a block of its own
+			h->st.blks++;
+			freeblock(h, add+sz);
+		}
+		return 1;
+	}
+	if (add+os >= h->hs) return 0;
+
+	block_t *q = B2P(add+os);
+	if (gettag(q->sze)) return 0;
+
+	memoff_t ns = os + getsize(q->sze);
+	if (ns < sz) return 0;
+
+	bremove(h,q);
+	if (ns - sz > MINSIZE) {
+		q = B2P(add+sz);
+		q->sze = setsize(ns-sz);
+		untag(q);
+		binsert(h,q);
+		ns = sz;
+	}
+	b->sze = setsize(ns); tag(b);
+	countresized(h, os, ns);
+	return 1;
+}
+
+/* --------------------------------------------------------------------------
+ * Pending frees (see buddy.c):
+ * a lock-free stack of blocks freed by other threads
+ * linked through the next pointer of the blocks,
+ * drained as a whole under the lock.
+ * --------------------------------------------------------------------------
+ */
+static inline char pending(heap_t *h) {
+	return (__atomic_load_n(&h->pf, __ATOMIC_RELAXED) != NOBLOCK);
+}
+
+static int drainpending(heap_t *h) {
+	int rc = 0;
+	memoff_t a = __atomic_exchange_n(&h->pf, NOBLOCK, __ATOMIC_ACQUIRE);
+	while (a != NOBLOCK) {
+		memoff_t n = REFBLOCK(a)->nxt;
+		MEMINST_COUNT(MEMINST_STEPS_PENDING, 1);
+		int x = freeblock(h, a);
+		if (x != 0 && rc == 0) rc = x;
+		a = n;
+	}
+	return rc;
+}
+
 /* --------------------------------------------------------------------------
  * External interface: init heap 
  * --------------------------------------------------------------------------
  */
 int ffit_init(ffit_heap_t *h) {
 	int rc = -1;
-	h->first = 0;
-	h->last  = 0;
+	h->fl = 0;
+	memset(h->sl, 0, sizeof(h->sl));
+	memset(h->bins, 0xff, sizeof(h->bins));
+	memset(h->fc, 0, sizeof(h->fc));
+	h->pf = NOBLOCK;
+	h->ph = 0;
+	memset(&h->st, 0, sizeof(h->st));
 	block_t *b = (block_t*)h->mh;
-	if (h->hs > 32) {
+	// the size (without tag) must fit into an offset
+	if (h->hs > MINSIZE && h->hs <= (MEMOFF_NONE >> 1) &&
+	    memlock_init(&h->lck) == 0) {
 		rc = 0;
-        	b->sze = setsize((uint32_t)h->hs);
+        	b->sze = setsize((memoff_t)h->hs);
                 untag(b);
-		b->nxt = NOBLOCK;
-		b->prv = NOBLOCK;
+		binsert(h,b);
 	}
 	return rc;
 }
@@ -380,17 +722,114 @@ int ffit_init(ffit_heap_t *h) {
  */
 void *ffit_get_block(ffit_heap_t *h, size_t sz) {
 	void *ret = NULL;
+	MEMTRACE_ENTER();
+	MEMINST_CLOCK(t0);
 	if (sz > 0) {
-		// compute size: + 5 at least MINSIZE
-		uint32_t s = (uint32_t)sz+5;
-		if (s < MINSIZE) s = MINSIZE;
+		// compute size: + overhead at least MINSIZE
+		memoff_t s = blocksize(h, sz);
 		if (s < h->hs) {
-			// lock
-			uint32_t b = getblock(h,s);
-			if (b != NOBLOCK) ret = B2P(b+4);
-			// unlock
+			memlock_acquire(&h->lck);
+			if (pending(h)) drainpending(h);
+			memoff_t b = getblock(h,s);
+			if (b != NOBLOCK) {
+				h->st.rqst += sz;
+				h->st.grnt += getsize(REFBLOCK(b)->sze);
+			}
+			memlock_release(&h->lck);
+			if (b != NOBLOCK) ret = B2P(b+HDRSIZE);
 		}
 	}
+	MEMINST_TIME(MEMINST_FFIT, MEMINST_GET, t0);
+	MEMTRACE_LEAVE(MEMTRACE_GET, ret, NULL, sz);
+	return ret;
+}
+
+/* --------------------------------------------------------------------------
+ * External interface: get n blocks of size 'sz'
+ * --------------------------------------------------------------------------
+ */
+size_t ffit_get_blocks(ffit_heap_t *h, size_t sz, size_t n, void **out) {
+	size_t k = 0;
+	MEMTRACE_ENTER();
+	MEMINST_CLOCK(t0);
+	if (sz > 0 && n > 0) {
+		memoff_t s = blocksize(h, sz);
+		if (s < h->hs) {
+			memlock_acquire(&h->lck);
+			if (pending(h)) drainpending(h);
+			k = getblocks(h, s, n, out);
+			h->st.rqst += k * sz;
+			h->st.grnt += k * s;
+			memlock_release(&h->lck);
+		}
+	}
+	MEMINST_TIME(MEMINST_FFIT, MEMINST_GET, t0);
+	MEMTRACE_LEAVEN(MEMTRACE_GET, out, k, sz);
+	return k;
+}
+
+/* --------------------------------------------------------------------------
+ * sort pointers by address
+ * --------------------------------------------------------------------------
+ */
+static int cmpptr(const void *a, const void *b) {
+	uintptr_t x = (uintptr_t)*(void**)a;
+	uintptr_t y = (uintptr_t)*(void**)b;
+	return (x < y ? -1 : x > y);
+}
+
+/* --------------------------------------------------------------------------
+ * External interface: free n blocks
+ * --------------------------------------------------------------------------
+ */
+int ffit_free_blocks(ffit_heap_t *h, void **ptrs, size_t n) {
+	int rc = 0;
+	size_t i = 0, k = 0;
+
+	MEMTRACE_ENTER();
+	MEMINST_CLOCK(t0);
+	qsort(ptrs, n, sizeof(void*), cmpptr);
+	while (i < n && (uintptr_t)(ptrs[i]-HDRSIZE) < h->mh) i++;
+	for(k=i; k < n && (uintptr_t)(ptrs[k]+OVERHEAD) < h->mh + h->hs; k++);
+	if (i > 0 || k < n) rc = NOTFOUND;
+
+	if (k > i) {
+		memlock_acquire(&h->lck);
+		int x = freeblocks(h, ptrs+i, k-i);
+		memlock_release(&h->lck);
+		if (rc == 0) rc = x;
+	}
+	MEMINST_TIME(MEMINST_FFIT, MEMINST_FREE, t0);
+	MEMTRACE_LEAVEN(MEMTRACE_FREE, ptrs, n, 0);
+	return rc;
+}
+
+/* --------------------------------------------------------------------------
+ * External interface: get block of size 'sz' aligned to 'align'
+ * (a.k.a. memalign)
+ * --------------------------------------------------------------------------
+ */
+void *ffit_get_aligned_block(ffit_heap_t *h, size_t align, size_t sz) {
+	void *ret = NULL;
+	MEMTRACE_ENTER();
+	MEMINST_CLOCK(t0);
+	if (sz > 0 && align > 0 && (align & (align - 1)) == 0 &&
+	    align < h->hs) {
+		memoff_t s = blocksize(h, sz);
+		if (s < h->hs - align - MINSIZE) {
+			memlock_acquire(&h->lck);
+			if (pending(h)) drainpending(h);
+			memoff_t b = getaligned(h, (memoff_t)align, s);
+			if (b != NOBLOCK) {
+				h->st.rqst += sz;
+				h->st.grnt += getsize(REFBLOCK(b)->sze);
+			}
+			memlock_release(&h->lck);
+			if (b != NOBLOCK) ret = B2P(b+HDRSIZE);
+		}
+	}
+	MEMINST_TIME(MEMINST_FFIT, MEMINST_ALIGNED, t0);
+	MEMTRACE_LEAVE(MEMTRACE_ALIGNED, ret, (void*)align, sz);
 	return ret;
 }
 
@@ -400,16 +839,111 @@ void *ffit_get_block(ffit_heap_t *h, size_t sz) {
  */
 int ffit_free_block(ffit_heap_t *h, void *ptr) {
 	int rc = 0;
-	if ((uintptr_t)(ptr-4) >= h->mh &&
-            (uintptr_t)(ptr+5) < h->mh + h->hs) {
-		uint32_t b = P2B(ptr-4);
-		// lock
+	MEMTRACE_ENTER();
+	MEMINST_CLOCK(t0);
+	if ((uintptr_t)(ptr-HDRSIZE) >= h->mh &&
+            (uintptr_t)(ptr+OVERHEAD) < h->mh + h->hs) {
+		memoff_t b = P2B(ptr-HDRSIZE);
+		memlock_acquire(&h->lck);
 		rc = freeblock(h, b);
-		// lock
+		memlock_release(&h->lck);
+	}
+	MEMINST_TIME(MEMINST_FFIT, MEMINST_FREE, t0);
+	MEMTRACE_LEAVE(MEMTRACE_FREE, rc == 0 ? ptr : NULL, NULL, 0);
+	return rc;
+}
+
+/* --------------------------------------------------------------------------
+ * External interface: usable size of the block identified by 'ptr'
+ * (the block belongs to the caller, so we do not need the lock)
+ * --------------------------------------------------------------------------
+ */
+size_t ffit_usable_size(ffit_heap_t *h, void *ptr) {
+	size_t sz = 0;
+	if ((uintptr_t)(ptr-HDRSIZE) >= h->mh &&
+            (uintptr_t)(ptr+OVERHEAD) < h->mh + h->hs) {
+		block_t *b = ptr-HDRSIZE;
+		if (gettag(b->sze)) sz = getsize(b->sze) - OVERHEAD;
+	}
+	return sz;
+}
+
+/* --------------------------------------------------------------------------
+ * External interface: free block from another thread
+ * --------------------------------------------------------------------------
+ */
+int ffit_free_remote(ffit_heap_t *h, void *ptr) {
+	int rc = NOTFOUND;
+	MEMTRACE_ENTER();
+	MEMINST_CLOCK(t0);
+	if ((uintptr_t)(ptr-HDRSIZE) >= h->mh &&
+            (uintptr_t)(ptr+OVERHEAD) < h->mh + h->hs) {
+		block_t *b = ptr-HDRSIZE;
+		if (gettag(b->sze)) {
+			memoff_t head = __atomic_load_n(&h->pf, __ATOMIC_RELAXED);
+			do b->nxt = head;
+			while (!__atomic_compare_exchange_n(&h->pf, &head, P2B(b), 1,
+			                                    __ATOMIC_RELEASE,
+			                                    __ATOMIC_RELAXED));
+			rc = 0;
+		}
 	}
+	MEMINST_TIME(MEMINST_FFIT, MEMINST_FREE, t0);
+	MEMTRACE_LEAVE(MEMTRACE_FREE, rc == 0 ? ptr : NULL, NULL, 0);
 	return rc;
 }
 
+/* --------------------------------------------------------------------------
+ * External interface: free pending blocks
+ * --------------------------------------------------------------------------
+ */
+int ffit_free_pending(ffit_heap_t *h) {
+	int rc = 0;
+	if (pending(h)) {
+		memlock_acquire(&h->lck);
+		rc = drainpending(h);
+		memlock_release(&h->lck);
+	}
+	return rc;
+}
+
+/* --------------------------------------------------------------------------
+ * resize or move (if mv) a block of sz bytes
+ * --------------------------------------------------------------------------
+ */
+static void *extendblock(ffit_heap_t *h, void *ptr, size_t sz, int *rc,
+                                                               char mv) {
+	void *ret = NULL;
+
+	// compute size: + overhead at least MINSIZE
+	memoff_t s = blocksize(h, sz);
+	if (s < h->hs) {
+		memoff_t add = P2B(ptr-HDRSIZE);
+		block_t *b = B2P(add);
+		memlock_acquire(&h->lck);
+		memoff_t os = getsize(b->sze);
+		if (!gettag(b->sze)) *rc = NOTFOUND;
+		else if (resizeblock(h, add, s)) {
+			h->st.rqst += sz;
+			h->st.grnt += getsize(b->sze);
+			MEMINST_COUNT(MEMINST_INPLACE, 1);
+			ret = ptr;
+		}
+		memlock_release(&h->lck);
+
+		// move the block
+		if (mv && ret == NULL && *rc == 0) {
+			ret = ffit_get_block(h,sz);
+			if (ret != NULL) {
+				memcpy(ret, ptr, os-OVERHEAD);
+				MEMINST_COUNT(MEMINST_MOVED, 1);
+				*rc = ffit_free_block(h,ptr);
+			}
+		}
+	}
+	return ret;
+}
+
 /* --------------------------------------------------------------------------
  * External interface: extend block (a.k.a. realloc)
  * --------------------------------------------------------------------------
@@ -419,6 +953,8 @@ void *ffit_extend_block(ffit_heap_t *h, void *ptr, size_t sz, int *rc) {
 
 	// rc is only relevant for free, i.e. sz == 0
 	*rc = 0;
+	MEMTRACE_ENTER();
+	MEMINST_CLOCK(t0);
 
 	// if pointer is null: malloc
 	if (ptr == NULL) ret = ffit_get_block(h,sz);
@@ -431,41 +967,46 @@ void *ffit_extend_block(ffit_heap_t *h, void *ptr, size_t sz, int *rc) {
 		// error
 
 	// handle in heap
-	} else {
-		// compute size: + 5 at least MINSIZE
-		uint32_t s = (uint32_t)sz+5;
-		if (s < MINSIZE) s = MINSIZE;
-		if (s < h->hs) {
-			uint32_t add = P2B(ptr-4);
-			block_t *b = B2P(add);
-			uint32_t os = getsize(b->sze);
-			if (os == s) ret = ptr; else {
-				ret = ffit_get_block(h,s);
-				if (ret != NULL) {
-					uint32_t k = os > s ? sz : os-5;
-					memcpy((char*)ret+4, (char*)ptr+4, k);
-					*rc = ffit_free_block(h,ptr);
-				}
-			
-			}
-		}
+	} else ret = extendblock(h, ptr, sz, rc, 1);
+
+	MEMINST_TIME(MEMINST_FFIT, MEMINST_EXTEND, t0);
+	MEMTRACE_LEAVE(MEMTRACE_EXTEND, ret, ptr, sz);
+	return ret;
+}
+
+/* --------------------------------------------------------------------------
+ * External interface: resize block in place
+ * --------------------------------------------------------------------------
+ */
+void *ffit_resize_block(ffit_heap_t *h, void *ptr, size_t sz, int *rc) {
+	void *ret = NULL;
+
+	*rc = 0;
+	if (ptr == NULL || sz == 0) return NULL;
+
+	MEMTRACE_ENTER();
+	MEMINST_CLOCK(t0);
+	if ((uintptr_t)ptr < h->mh+h->hs) {
+		ret = extendblock(h, ptr, sz, rc, 0);
 	}
+	MEMINST_TIME(MEMINST_FFIT, MEMINST_EXTEND, t0);
+	MEMTRACE_LEAVE(MEMTRACE_EXTEND, ret, ptr, sz);
 	return ret;
-} 
+}
 
 /* --------------------------------------------------------------------------
  * printBlock: Print one block with colour
  * --------------------------------------------------------------------------
  */
-static inline void printBlock(uint32_t add, uint32_t csz, char *prfx) {
-	printf("%s%u\033[0m|", prfx, csz);
+static inline void printBlock(memoff_t add, memoff_t csz, char *prfx) {
+	printf("%s%zu\033[0m|", prfx, (size_t)csz);
 }
 
 /* --------------------------------------------------------------------------
  * printUsed: Print a block in use
  * --------------------------------------------------------------------------
  */
-static void printUsed(uint32_t add, uint32_t csz) {
+static void printUsed(memoff_t add, memoff_t csz) {
 	printBlock(add, csz, "\033[31m");
 }
 
@@ -473,7 +1014,7 @@ static void printUsed(uint32_t add, uint32_t csz) {
  * printFree: Print a free block
  * --------------------------------------------------------------------------
  */
-static void printFree(uint32_t add, uint32_t csz) {
+static void printFree(memoff_t add, memoff_t csz) {
 	printBlock(add, csz, "\033[32m");
 }
 
@@ -481,12 +1022,12 @@ static void printFree(uint32_t add, uint32_t csz) {
  * printheap: print all blocks in the heap
  * --------------------------------------------------------------------------
  */
-void printheap(ffit_heap_t *h, char p, uint32_t *usd, uint32_t *fre) {
+void printheap(ffit_heap_t *h, char p, memoff_t *usd, memoff_t *fre) {
 	block_t *b = (block_t*)h->mh;
-	uint32_t add = 0;
+	memoff_t add = 0;
 
 	while (add < h->hs) {
-		uint32_t s = getsize(b->sze);
+		memoff_t s = getsize(b->sze);
 		uint8_t  t = gettag(b->sze);
 		if (t) {
 			if (p) printUsed(add, s); 
@@ -505,19 +1046,32 @@ void printheap(ffit_heap_t *h, char p, uint32_t *usd, uint32_t *fre) {
  * --------------------------------------------------------------------------
  */
 void  ffit_print_heap(ffit_heap_t *h) {
-	uint32_t usd = 0, fre = 0;
-	uint32_t mem = (uint32_t)h->hs;
+	memoff_t usd = 0, fre = 0;
+	memoff_t mem = (memoff_t)h->hs;
+	ffit_free_pending(h);
+	memlock_acquire(&h->lck);
 	printheap(h, 1, &usd, &fre);
-	printf("\nTotal    : %09u\n", mem);
-	printf("\033[31mUsed     : %09u\033[0m", usd);
-	printf("\033[31m (%u%%)\033[0m", (100*usd)/mem);
+	memlock_release(&h->lck);
+	printf("\nTotal    : %09zu\n", (size_t)mem);
+	printf("\033[31mUsed     : %09zu\033[0m", (size_t)usd);
+	printf("\033[31m (%zu%%)\033[0m", (size_t)((100*usd)/mem));
 	printf("\n");
-	printf("\033[32mFree     : %09u\033[0m\n", fre);
+	printf("\033[32mFree     : %09zu\033[0m\n", (size_t)fre);
 	if (fre + usd != mem) {
-		printf("\033[31mmissing: %09u\033[0m\n",
-		                       mem - (usd+fre));
+		printf("\033[31mmissing: %09zu\033[0m\n",
+		                       (size_t)(mem - (usd+fre)));
 	}
+	if (usd != h->st.usd) {
+		printf("\033[31mcounted: %09zu\033[0m\n", h->st.usd);
+	}
+}
 
+/* --------------------------------------------------------------------------
+ * 32-bit statistics saturate at UINT32_MAX
+ * --------------------------------------------------------------------------
+ */
+static inline uint32_t sat32(size_t n) {
+	return n > UINT32_MAX ? UINT32_MAX : (uint32_t)n;
 }
 
 /* --------------------------------------------------------------------------
@@ -529,6 +1083,110 @@ void  ffit_get_stats(ffit_heap_t *h,
                      uint32_t *usd,   // used memory 
                      uint32_t *fre)   // available memory
 {
-        *mem   = (uint32_t)h->hs;
-	printheap(h, 0, usd, fre);
+	ffit_stats_t st;
+	ffit_get_counters(h, &st);
+	*mem = sat32(st.mem);
+	*usd = sat32(st.usd);
+	*fre = sat32(st.fre);
+}
+
+/* --------------------------------------------------------------------------
+ * External interface: get counters
+ * --------------------------------------------------------------------------
+ */
+void  ffit_get_counters(ffit_heap_t *h, ffit_stats_t *st) {
+	ffit_free_pending(h);
+	memlock_acquire(&h->lck);
+	*st = h->st;
+	memlock_release(&h->lck);
+	st->mem = h->hs;
+	st->fre = h->hs - st->usd;
+}
+
+/* --------------------------------------------------------------------------
+ * External interface: fragmentation
+ * --------------------------------------------------------------------------
+ */
+void  ffit_get_frag_info(ffit_heap_t *h, ffit_frag_t *fi) {
+	memset(fi, 0, sizeof(ffit_frag_t));
+	ffit_free_pending(h);
+	memlock_acquire(&h->lck);
+	for(uint8_t i=0; i<FFIT_FLN; i++) {
+		fi->cnt[i] = h->fc[i];
+		fi->blks += h->fc[i];
+	}
+	fi->fre = h->hs - h->st.usd;
+	if (h->fl != 0) {
+		uint8_t f = (uint8_t)(MEMOFF_BITS - 1 - memoff_clz(h->fl));
+		uint8_t s = (uint8_t)(31 - __builtin_clz(h->sl[f]));
+		fi->lrg = (size_t)(SLN + s) << (f - SLI);
+	}
+	memlock_release(&h->lck);
+	if (fi->fre > 0) {
+		fi->frag = (uint32_t)(1000 - (fi->lrg * 1000) / fi->fre);
+	}
+}
+
+/* --------------------------------------------------------------------------
+ * External interface: persistent heaps
+ * The bookkeeping is all in the descriptor,
+ * so the checksum covers the snapshot only.
+ * --------------------------------------------------------------------------
+ */
+#define PHSIZE mempers_size(sizeof(ffit_heap_t))
+
+int ffit_format(ffit_heap_t *h) {
+	uintptr_t r = h->mh;
+	size_t sz = h->hs;
+	if (r == 0 || sz <= PHSIZE) return -1;
+	h->mh += PHSIZE; h->hs -= PHSIZE;
+	if (ffit_init(h) != 0) return -1;
+	mempers_format((mempers_hdr_t*)r, MEMPERS_FFIT, MEMOFF_BITS, 0,
+	                                      sz, sizeof(ffit_heap_t));
+	h->ph = r;
+	return 0;
+}
+
+int ffit_detach(ffit_heap_t *h) {
+	mempers_hdr_t *p = (mempers_hdr_t*)h->ph;
+	if (p == NULL || p->state != MEMPERS_OPEN) return -1;
+	ffit_free_pending(h);
+	ffit_heap_t *s = mempers_snapshot(p);
+	memcpy(s, h, sizeof(ffit_heap_t));
+	s->ph = 0;
+	p->base = (uint64_t)h->ph;
+	p->sum = mempers_sum(0, s, sizeof(ffit_heap_t));
+	p->state = MEMPERS_CLOSED;
+	h->ph = 0;
+	return 0;
+}
+
+int ffit_attach(ffit_heap_t *h, void *region) {
+	mempers_hdr_t *p = region;
+	if (p == NULL || !mempers_valid(p, MEMPERS_FFIT, MEMOFF_BITS, 0,
+	                                  h->hs, sizeof(ffit_heap_t)))
+		return -1;
+	ffit_heap_t *s = mempers_snapshot(p);
+	if (mempers_sum(0, s, sizeof(ffit_heap_t)) != p->sum) return -1;
+	if (s->mh - p->base != PHSIZE || s->hs + PHSIZE != p->size) return -1;
+
+	memlock_t l = h->lck;
+	memcpy(h, s, sizeof(ffit_heap_t));
+	h->mh = (uintptr_t)region + PHSIZE;
+	h->lck = l;
+	if (memlock_init(&h->lck) != 0) return -1;
+	h->ph = (uintptr_t)region;
+	p->state = MEMPERS_OPEN;
+	return 0;
+}
+
+void ffit_set_root(ffit_heap_t *h, void *ptr) {
+	mempers_hdr_t *p = (mempers_hdr_t*)h->ph;
+	if (p != NULL) p->root = ptr == NULL ? 0 : (uintptr_t)ptr - h->ph;
+}
+
+void *ffit_get_root(ffit_heap_t *h) {
+	mempers_hdr_t *p = (mempers_hdr_t*)h->ph;
+	if (p == NULL || p->root == 0) return NULL;
+	return (void*)(h->ph + p->root);
 }
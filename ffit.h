@@ -14,9 +14,14 @@
  * mainly used for large memory blocks, this overhead
  * is negligible.
  *
- * Max address space  :  4 GiB 
- * Max allocation unit:  2 GiB
- * Min allocation unit: 32 Byte
+ * Available blocks are kept in segregated lists
+ * (two-level segregated fit), so that getting and freeing
+ * a block does not depend on the number of available blocks.
+ *
+ * Max address space  :  4 GiB  (MEMMAN_OFFSET64: 8 EiB)
+ * Max allocation unit:  2 GiB  (MEMMAN_OFFSET64: 8 EiB)
+ * Min allocation unit: 32 Byte (MEMMAN_OFFSET64: 48 Byte)
+ * (see memoff.h)
  * -----------------------------------------------------------------------
  */
 
@@ -25,30 +30,113 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <memoff.h>
+#include <memlock.h>
 
 #define FFIT_HEAP_FOUND    0x0
 #define FFIT_HEAP_NOTFOUND 0x4
 #define FFIT_HEAP_INTERNAL -1
 #define FFIT_HEAP_OK 0x0
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* ------------------------------------------------------------------------
+ * Segregated available lists:
+ * one first level class per power of two,
+ * each divided into 2^FFIT_SLI second level classes
+ * ------------------------------------------------------------------------
+ */
+#define FFIT_FLN MEMOFF_BITS
+#define FFIT_SLI 4
+#define FFIT_SLN (1<<FFIT_SLI)
+
+/* ------------------------------------------------------------------------
+ * Heap Statistics
+ * Running counters maintained on each get, free and extend,
+ * so that retrieving them does not walk the heap.
+ * Sizes are block sizes including the overhead.
+ * ------------------------------------------------------------------------
+ */
+typedef struct {
+  size_t      mem; // heap size
+  size_t      usd; // used memory
+  size_t      fre; // available memory
+  size_t    wmark; // high watermark of used memory
+  uint64_t   rqst; // bytes requested (accumulated)
+  uint64_t   grnt; // bytes granted (accumulated)
+  uint32_t   blks; // blocks in use
+} ffit_stats_t;
+
+/* ------------------------------------------------------------------------
+ * Fragmentation Information
+ * The number of available blocks per first level class
+ * is maintained on each insert into and removal from
+ * the available lists, so that retrieving it does not walk the heap.
+ * ------------------------------------------------------------------------
+ */
+typedef struct {
+  size_t      fre; // available memory
+  size_t      lrg; // largest available block (lower bound)
+  uint32_t   frag; // external fragmentation in per mille:
+                   // 1000 * (1 - lrg / fre), 0 if fre is 0
+  size_t     blks; // available blocks
+  size_t cnt[FFIT_FLN]; // available blocks of size 2^i to 2^(i+1)-1
+} ffit_frag_t;
+
 /* ------------------------------------------------------------------------
  * Heap Structure
  * ------------------------------------------------------------------------
  */
 typedef struct {
-  uintptr_t mh;    // heap address
-  size_t    hs;    // heap size
-  uint32_t  first; // available list first
-  uint32_t  last;  // available list last
+  uintptr_t mh;                       // heap address
+  size_t    hs;                       // heap size
+  memoff_t  fl;                       // first level bitmap
+  uint32_t  sl[FFIT_FLN];             // second level bitmaps
+  memoff_t  bins[FFIT_FLN][FFIT_SLN]; // available lists
+  memoff_t  pf;                       // pending frees
+  memoff_t  fc[FFIT_FLN];             // available blocks per class
+  memlock_t lck;                      // lock (type set by user)
+  ffit_stats_t st;                    // statistics
+  uintptr_t ph;                       // persistent header or 0
 } ffit_heap_t;
 
 /* ------------------------------------------------------------------------
  * Heap Initialisation
+ * The lock is initialised according to the type in lck.t
+ * (see memlock.h); lck.acqs and lck.cont count acquisitions
+ * and contended acquisitions.
  * Must be called once per process
  * ------------------------------------------------------------------------
  */
 int ffit_init(ffit_heap_t *h);
 
+/* ------------------------------------------------------------------------
+ * Persistent heaps (see mempers.h)
+ * ffit_format initialises a persistent heap in the region
+ * at mh of hs bytes (set by user as for ffit_init),
+ * which starts with the header; the heap itself (mh and hs)
+ * is what remains behind the header.
+ * ffit_detach writes the snapshot of the descriptor and
+ * closes the header; the heap must not be used anymore.
+ * ffit_set_root stores one block in the header (e.g. the root
+ * of the user's data), ffit_get_root returns it after attaching.
+ * ffit_attach opens the heap in the region again
+ * (at the same or another address) without initialising it.
+ * The lock type is set by the user; if hs is not 0,
+ * it must be the size of the region. Fails if the header, the sizes
+ * or the checksum do not match or if the heap was not detached.
+ * All return 0 on success and -1 on error.
+ * ------------------------------------------------------------------------
+ */
+int ffit_format(ffit_heap_t *h);
+int ffit_detach(ffit_heap_t *h);
+int ffit_attach(ffit_heap_t *h, void *region);
+
+void  ffit_set_root(ffit_heap_t *h, void *ptr);
+void *ffit_get_root(ffit_heap_t *h);
+
 /* ------------------------------------------------------------------------
  * Get a block of size sz
  * Returns a pointer on success and NULL on failure
@@ -56,6 +144,19 @@ int ffit_init(ffit_heap_t *h);
  */
 void *ffit_get_block(ffit_heap_t *h, size_t sz);
 
+/* ------------------------------------------------------------------------
+ * Get a block of size sz whose user memory is aligned to align
+ * (a power of two). If the first fit is not aligned, a block
+ * with room for the alignment is taken and the bytes in front
+ * of the aligned address are split off as an available block;
+ * nothing is kept beyond what ffit_get_block would keep.
+ * The block is freed with ffit_free_block;
+ * ffit_extend_block does not preserve the alignment.
+ * Returns a pointer on success and NULL on failure
+ * ------------------------------------------------------------------------
+ */
+void *ffit_get_aligned_block(ffit_heap_t *h, size_t align, size_t sz);
+
 /* ------------------------------------------------------------------------
  * Free the block indicated by ptr
  * Returns 0 on success -1 or 4 on error.
@@ -65,14 +166,61 @@ void *ffit_get_block(ffit_heap_t *h, size_t sz);
  */
 int  ffit_free_block(ffit_heap_t *h, void *ptr);
 
+/* ------------------------------------------------------------------------
+ * Retrieve the usable size of the block indicated by ptr,
+ * i.e. the size of the block without overhead,
+ * which is at least the size requested.
+ * Returns 0 if the address is unknown.
+ * ------------------------------------------------------------------------
+ */
+size_t ffit_usable_size(ffit_heap_t *h, void *ptr);
+
+/* ------------------------------------------------------------------------
+ * Get up to n blocks of size sz at once and store them in out.
+ * The lock is taken once; the blocks are cut one after the other
+ * from as few available blocks as possible.
+ * Returns the number of blocks stored in out.
+ * ------------------------------------------------------------------------
+ */
+size_t ffit_get_blocks(ffit_heap_t *h, size_t sz, size_t n, void **out);
+
+/* ------------------------------------------------------------------------
+ * Free the n blocks in ptrs at once.
+ * The array is sorted by address; adjacent blocks are merged
+ * before they are inserted into the available lists.
+ * Unknown addresses are skipped, all other blocks are freed.
+ * Returns 0 on success and 4 or -1 for the first error
+ * (see ffit_free_block).
+ * ------------------------------------------------------------------------
+ */
+int  ffit_free_blocks(ffit_heap_t *h, void **ptrs, size_t n);
+
+/* ------------------------------------------------------------------------
+ * Free the block indicated by ptr from another thread.
+ * The block is put on a lock-free list of pending frees
+ * without taking the heap lock and is released by the next
+ * ffit_get_block (or ffit_free_pending).
+ * Returns 0 on success and 4 if the block is not in use.
+ * ------------------------------------------------------------------------
+ */
+int  ffit_free_remote(ffit_heap_t *h, void *ptr);
+
+/* ------------------------------------------------------------------------
+ * Release all pending frees now.
+ * Returns 0 on success and the first error otherwise.
+ * ------------------------------------------------------------------------
+ */
+int  ffit_free_pending(ffit_heap_t *h);
+
 /* ------------------------------------------------------------------------
  * Extend the block indicated by ptr to size sz.
  * If ptr is NULL, the function behaves exactly like ffit_get_block.
  * If sz is 0, the function behaves exactly like ffit_free_block.
  * If sz is greater than the current size of the block,
- *    the block is extended;
+ *    the block is extended, in place if the following block
+ *    is available and large enough, otherwise it is moved;
  * If sz is less than the current size of the block,
- *    the block is shrunk.
+ *    the block is shrunk in place and the tail is freed.
  * If the sz is equal to the current size of the block, ptr is returned.
  * On success, a valid pointer is returned.
  * The block indicated by that pointer contains the same data
@@ -88,6 +236,17 @@ int  ffit_free_block(ffit_heap_t *h, void *ptr);
  */
 void *ffit_extend_block(ffit_heap_t *h, void *ptr, size_t sz, int *rc);
 
+/* ------------------------------------------------------------------------
+ * Resize the block indicated by ptr to size sz in place,
+ * as ffit_extend_block does if it need not move the block.
+ * On success, ptr is returned. Otherwise, NULL is returned
+ * and the block is unchanged (e.g. the caller may move it itself);
+ * rc is set as by ffit_extend_block.
+ * If ptr is NULL or sz is 0, NULL is returned.
+ * ------------------------------------------------------------------------
+ */
+void *ffit_resize_block(ffit_heap_t *h, void *ptr, size_t sz, int *rc);
+
 /* ------------------------------------------------------------------------
  * Print a visualisation of the current usage of the heap to stdout
  * indicating the size of each block in
@@ -98,13 +257,38 @@ void *ffit_extend_block(ffit_heap_t *h, void *ptr, size_t sz, int *rc);
 void  ffit_print_heap(ffit_heap_t *h);
 
 /* ------------------------------------------------------------------------
- * Retriev heap statistics.
- * Note that wmark (watermark) and stps (steps)
- * are not computed.
+ * Retrieve heap statistics.
+ * The values are read from the running counters
+ * in constant time (pending frees are released first).
+ * The values are 32-bit and saturate at UINT32_MAX;
+ * heaps beyond 4 GiB need ffit_get_counters.
  * ------------------------------------------------------------------------
  */
 void  ffit_get_stats(ffit_heap_t  *h,
                      uint32_t   *mem,  // heap size 
                      uint32_t   *usd,  // used memory 
                      uint32_t   *fre); // available memory
+
+/* ------------------------------------------------------------------------
+ * Retrieve all counters (see ffit_stats_t).
+ * rqst and grnt accumulate the sizes requested from
+ * and granted by ffit_get_block and ffit_extend_block
+ * since initialisation; their ratio is the overhead per request.
+ * ------------------------------------------------------------------------
+ */
+void  ffit_get_counters(ffit_heap_t *h, ffit_stats_t *st);
+
+/* ------------------------------------------------------------------------
+ * Retrieve the fragmentation (see ffit_frag_t).
+ * Pending frees are freed first.
+ * Sizes are block sizes including the overhead.
+ * The largest block is given as the lower bound of the highest
+ * non-empty second level class, which the largest block exceeds
+ * by less than 1/FFIT_SLN; all values are read in O(FFIT_FLN).
+ * ------------------------------------------------------------------------
+ */
+void  ffit_get_frag_info(ffit_heap_t *h, ffit_frag_t *fi);
+#ifdef __cplusplus
+}
+#endif
 #endif
@@ -0,0 +1,425 @@
+/* -----------------------------------------------------------------------
+ * Drop-in malloc
+ * --------------
+ *
+ *  (c) Tobias Schoofs, 2010 -- 2020
+ *      This code is in the Public Domain.
+ *
+ * malloc, free, calloc, realloc, posix_memalign, aligned_alloc,
+ * memalign and malloc_usable_size on top of one buddy, ebuddy
+ * or ffit heap. Built into libmemman.so, the library replaces
+ * the allocator of the libc when preloaded:
+ *
+ *     LD_PRELOAD=./libmemman.so program
+ *
+ * The heap is mapped on the first request (without reserving
+ * swap, so pages are only committed when they are touched)
+ * and configured by environment variables:
+ * - MEMMAN_HEAP   : buddy, ebuddy (default) or ffit
+ * - MEMMAN_SIZE   : heap size in MiB (default 256)
+ * - MEMMAN_RELEASE: release threshold of the buddy heap in KiB
+ *                   (default 256, 0 to keep all pages; see buddy.h)
+ *
+ * Blocks are aligned to MALIGN, the alignment malloc guarantees.
+ * Buddy blocks of at least MALIGN bytes are aligned by construction;
+ * ffit blocks are obtained from the aligned services.
+ *
+ * Zero-aware calloc
+ * -----------------
+ * The mapping is zero initially. A bitmap with one bit per page
+ * remembers the pages that have been handed out to the user
+ * (dirty pages). calloc clears dirty pages in the block with memset;
+ * clean pages are zero, except for the list pointers and tags
+ * the heap itself may have written into them. They are only read
+ * and cleared where they are not zero. Reading a page that was
+ * never touched maps the shared zero page, so that the block
+ * is not committed before the user writes to it.
+ * The bitmap is a hint only: calloc is correct whatever it says.
+ * Pages released to the OS by the buddy heap are marked clean again.
+ *
+ * Compiled with MEMMAN_TRACE (libmemmantrace.so), all requests are
+ * recorded into the file named by MEMMAN_TRACE (see memtrace.h).
+ * -----------------------------------------------------------------------
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <buddy.h>
+#include <ffit.h>
+#include <memtrace.h>
+
+size_t malloc_usable_size(void *ptr);
+void *memalign(size_t align, size_t sz);
+
+/* ------------------------------------------------------------------------
+ * Defaults
+ * ------------------------------------------------------------------------
+ */
+#define PAGESIZE 4096
+#define MALIGN   16
+#define DEFSIZE  256
+#define DEFREL   256
+
+/* ------------------------------------------------------------------------
+ * Initialisation states
+ * ------------------------------------------------------------------------
+ */
+#define UNINIT 0
+#define INPROG 1
+#define READY  2
+#define FAILED 3
+
+/* ------------------------------------------------------------------------
+ * The heap
+ * ------------------------------------------------------------------------
+ */
+static uint32_t state = UNINIT;
+static uint8_t  isffit = 0;
+static uintptr_t base = 0;    // the heap
+static size_t    hsize = 0;   // its size
+static uint64_t *dirty = NULL; // page bitmap
+static buddy_heap_t bh;
+static ffit_heap_t  fh;
+
+static inline uintptr_t alignup(uintptr_t n, uintptr_t a) {
+	return ((n + a - 1) & ~(a - 1));
+}
+
+/* ------------------------------------------------------------------------
+ * Read a size from the environment without allocating memory
+ * ------------------------------------------------------------------------
+ */
+static size_t envsize(const char *name, size_t dflt) {
+	char *v = getenv(name);
+	if (v == NULL || *v == 0) return dflt;
+	size_t n = 0;
+	for(;*v >= '0' && *v <= '9'; v++) n = 10*n + (*v - '0');
+	return n;
+}
+
+/* ------------------------------------------------------------------------
+ * Fork: the heap locks are held across fork, so that the child
+ * does not inherit a lock held by a thread that does not exist there.
+ * The main lock is always taken before the lock of the emergency heap.
+ * ------------------------------------------------------------------------
+ */
+static void forkprepare(void) {
+	if (isffit) memlock_acquire(&fh.lck);
+	else {
+		memlock_acquire(&bh.lck);
+		if (bh.e) memlock_acquire(&bh.ffh.lck);
+	}
+}
+
+static void forkdone(void) {
+	if (isffit) memlock_release(&fh.lck);
+	else {
+		if (bh.e) memlock_release(&bh.ffh.lck);
+		memlock_release(&bh.lck);
+	}
+}
+
+/* ------------------------------------------------------------------------
+ * Init:
+ * - map the bitmap (one bit per page) and the heap behind it
+ * - init the heap according to MEMMAN_HEAP
+ * - install the fork handlers
+ * Concurrent first requests wait for the one initialising.
+ * ------------------------------------------------------------------------
+ */
+static int init(void) {
+	uint32_t s = UNINIT;
+	if (__atomic_compare_exchange_n(&state, &s, INPROG, 0,
+	                        __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+		char *t = getenv("MEMMAN_HEAP");
+		size_t mb = envsize("MEMMAN_SIZE", DEFSIZE);
+		size_t bm;
+		int rc = -1;
+
+		hsize = mb << 20;
+		bm = alignup(((hsize / PAGESIZE) + 63) / 8, PAGESIZE);
+
+		void *m = hsize == 0 ? MAP_FAILED :
+		          mmap(NULL, bm + hsize, PROT_READ | PROT_WRITE,
+		               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (m != MAP_FAILED) {
+			dirty = m;
+			base  = (uintptr_t)m + bm;
+			if (t != NULL && strcmp(t, "ffit") == 0) {
+				isffit = 1;
+				fh.mh = base;
+				fh.hs = hsize;
+				fh.lck.t = MEMLOCK_SPIN;
+				rc = ffit_init(&fh);
+			} else {
+				bh.mh = base;
+				bh.hs = hsize;
+				bh.e  = t == NULL || strcmp(t, "buddy") != 0;
+				bh.el = 0;
+				bh.rt = envsize("MEMMAN_RELEASE", DEFREL) << 10;
+				bh.lck.t = MEMLOCK_SPIN;
+				rc = buddy_init(&bh);
+			}
+		}
+		if (rc == 0) {
+			rc = pthread_atfork(forkprepare, forkdone, forkdone);
+		}
+		__atomic_store_n(&state, rc == 0 ? READY : FAILED,
+		                                  __ATOMIC_RELEASE);
+#ifdef MEMMAN_TRACE
+		// the tracer may use malloc, so the heap must be ready
+		char *f = getenv("MEMMAN_TRACE");
+		if (rc == 0 && f != NULL && *f != 0) memtrace_start(f);
+#endif
+		return rc;
+	}
+	while((s = __atomic_load_n(&state, __ATOMIC_ACQUIRE)) == INPROG);
+	return s == READY ? 0 : -1;
+}
+
+static inline int ready(void) {
+	if (__atomic_load_n(&state, __ATOMIC_ACQUIRE) == READY) return 1;
+	return init() == 0;
+}
+
+static inline int ours(void *ptr) {
+	return (uintptr_t)ptr >= base && (uintptr_t)ptr < base + hsize;
+}
+
+#ifdef MEMMAN_TRACE
+/* ------------------------------------------------------------------------
+ * Write the rest of the trace on exit
+ * ------------------------------------------------------------------------
+ */
+static void __attribute__((destructor)) stoptrace(void) {
+	uint64_t d = memtrace_stop();
+	if (d > 0) fprintf(stderr, "memtrace: %llu records dropped\n",
+	                                     (unsigned long long)d);
+}
+#endif
+
+/* ------------------------------------------------------------------------
+ * Page bitmap
+ * ------------------------------------------------------------------------
+ */
+static inline int isdirty(uintptr_t p) {
+	size_t i = (p - base) / PAGESIZE;
+	return (__atomic_load_n(&dirty[i/64], __ATOMIC_RELAXED) >> (i%64)) & 1;
+}
+
+static void markdirty(void *ptr, size_t sz) {
+	if (sz == 0) sz = 1;
+	size_t f = ((uintptr_t)ptr - base) / PAGESIZE;
+	size_t l = ((uintptr_t)ptr - base + sz - 1) / PAGESIZE;
+	for(size_t i=f; i<=l; i++) {
+		uint64_t m = (uint64_t)1 << (i%64);
+		if (!(__atomic_load_n(&dirty[i/64], __ATOMIC_RELAXED) & m)) {
+			__atomic_fetch_or(&dirty[i/64], m, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+/* ------------------------------------------------------------------------
+ * The buddy heap releases all pages of available blocks
+ * of at least rt bytes but the first (see buddy.c)
+ * ------------------------------------------------------------------------
+ */
+static void markclean(void *ptr, size_t sz) {
+	if (isffit || bh.rt == 0 || sz < bh.rt ||
+	    (uintptr_t)ptr >= bh.eh) return;
+	size_t f = ((uintptr_t)ptr - base) / PAGESIZE + 1;
+	size_t l = ((uintptr_t)ptr - base + sz) / PAGESIZE;
+	for(size_t i=f; i<l; i++) {
+		uint64_t m = (uint64_t)1 << (i%64);
+		if (__atomic_load_n(&dirty[i/64], __ATOMIC_RELAXED) & m) {
+			__atomic_fetch_and(&dirty[i/64], ~m, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+/* ------------------------------------------------------------------------
+ * Clear memory that is probably zero already:
+ * read it and write only if it is not zero
+ * ------------------------------------------------------------------------
+ */
+static void zeroclean(char *p, size_t sz) {
+	uint64_t acc = 0;
+	size_t h = (size_t)(alignup((uintptr_t)p, 8) - (uintptr_t)p);
+	if (h > sz) h = sz;
+	for(size_t i=0; i<h; i++) acc |= (uint8_t)p[i];
+	uint64_t *w = (uint64_t*)(p + h);
+	size_t n = (sz - h) / 8;
+	for(size_t i=0; i<n; i++) acc |= w[i];
+	for(size_t i=h+8*n; i<sz; i++) acc |= (uint8_t)p[i];
+	if (acc != 0) memset(p, 0, sz);
+}
+
+/* ------------------------------------------------------------------------
+ * Clear a new block page by page
+ * ------------------------------------------------------------------------
+ */
+static void zero(char *p, size_t sz) {
+	uintptr_t a = (uintptr_t)p;
+	uintptr_t e = a + sz;
+	while(a < e) {
+		uintptr_t x = alignup(a + 1, PAGESIZE);
+		if (x > e) x = e;
+		if (isdirty(a)) memset((void*)a, 0, x - a);
+		else zeroclean((char*)a, x - a);
+		a = x;
+	}
+}
+
+/* ------------------------------------------------------------------------
+ * Get and free without bookkeeping
+ * ------------------------------------------------------------------------
+ */
+static inline void *getblock(size_t align, size_t sz) {
+	if (align < MALIGN) align = MALIGN;
+	if (sz == 0) sz = 1;
+	if (isffit) return ffit_get_aligned_block(&fh, align, sz);
+	if (sz < MALIGN) sz = MALIGN;
+	return buddy_get_aligned_block(&bh, align, sz);
+}
+
+static inline size_t usablesize(void *ptr) {
+	if (isffit) return ffit_usable_size(&fh, ptr);
+	return buddy_usable_size(&bh, ptr);
+}
+
+static inline void freeblock(void *ptr) {
+	size_t sz = usablesize(ptr);
+	if (sz == 0) return;
+	if (isffit) ffit_free_block(&fh, ptr);
+	else if (buddy_free_sized(&bh, ptr, sz) == BUDDY_HEAP_OK) {
+		markclean(ptr, sz);
+	}
+}
+
+/* ------------------------------------------------------------------------
+ * malloc
+ * ------------------------------------------------------------------------
+ */
+void *malloc(size_t sz) {
+	if (!ready()) return NULL;
+	void *ret = getblock(MALIGN, sz);
+	if (ret == NULL) {
+		errno = ENOMEM; return NULL;
+	}
+	markdirty(ret, sz);
+	return ret;
+}
+
+/* ------------------------------------------------------------------------
+ * free
+ * ------------------------------------------------------------------------
+ */
+void free(void *ptr) {
+	if (ptr == NULL || !ours(ptr)) return;
+	freeblock(ptr);
+}
+
+/* ------------------------------------------------------------------------
+ * calloc:
+ * memset dirty pages, check clean pages
+ * ------------------------------------------------------------------------
+ */
+void *calloc(size_t n, size_t sz) {
+	if (sz != 0 && n > SIZE_MAX / sz) {
+		errno = ENOMEM; return NULL;
+	}
+	if (!ready()) return NULL;
+	sz *= n;
+	void *ret = getblock(MALIGN, sz);
+	if (ret == NULL) {
+		errno = ENOMEM; return NULL;
+	}
+	zero(ret, sz);
+	markdirty(ret, sz);
+	return ret;
+}
+
+/* ------------------------------------------------------------------------
+ * realloc:
+ * the block is resized in place if possible; otherwise it is moved
+ * here and not by extend, which may move it to a plain ffit block
+ * that is not aligned. If there is no block, ptr is still valid.
+ * ------------------------------------------------------------------------
+ */
+void *realloc(void *ptr, size_t sz) {
+	int rc = 0;
+	void *ret;
+
+	if (ptr == NULL) return malloc(sz);
+	if (sz == 0) {
+		free(ptr); return NULL;
+	}
+	if (!ours(ptr)) {
+		errno = ENOMEM; return NULL;
+	}
+	if (isffit) ret = ffit_resize_block(&fh, ptr, sz, &rc);
+	else ret = buddy_resize_block(&bh, ptr, sz, &rc);
+	if (ret == NULL && rc == 0) {
+		size_t os = usablesize(ptr);
+		ret = getblock(MALIGN, sz);
+		if (ret != NULL) {
+			memcpy(ret, ptr, os < sz ? os : sz);
+			freeblock(ptr);
+		}
+	}
+	if (ret == NULL) {
+		errno = ENOMEM; return NULL;
+	}
+	markdirty(ret, sz);
+	return ret;
+}
+
+/* ------------------------------------------------------------------------
+ * posix_memalign
+ * ------------------------------------------------------------------------
+ */
+int posix_memalign(void **ptr, size_t align, size_t sz) {
+	if (align < sizeof(void*) || (align & (align - 1)) != 0) {
+		return EINVAL;
+	}
+	if (!ready()) return ENOMEM;
+	void *ret = getblock(align, sz);
+	if (ret == NULL) return ENOMEM;
+	markdirty(ret, sz);
+	*ptr = ret;
+	return 0;
+}
+
+/* ------------------------------------------------------------------------
+ * aligned_alloc and memalign
+ * ------------------------------------------------------------------------
+ */
+void *aligned_alloc(size_t align, size_t sz) {
+	void *ret = NULL;
+	int rc = posix_memalign(&ret, align, sz);
+	if (rc != 0) {
+		errno = rc; return NULL;
+	}
+	return ret;
+}
+
+void *memalign(size_t align, size_t sz) {
+	return aligned_alloc(align < sizeof(void*) ? sizeof(void*) : align, sz);
+}
+
+/* ------------------------------------------------------------------------
+ * malloc_usable_size:
+ * the user may write to all of it, so the pages are dirty
+ * ------------------------------------------------------------------------
+ */
+size_t malloc_usable_size(void *ptr) {
+	if (ptr == NULL || !ours(ptr)) return 0;
+	size_t sz = usablesize(ptr);
+	if (sz > 0) markdirty(ptr, sz);
+	return sz;
+}
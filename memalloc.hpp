@@ -0,0 +1,225 @@
+/* -----------------------------------------------------------------------
+ * C++ Allocators
+ * --------------
+ *
+ *  (c) Tobias Schoofs, 2010 -- 2020
+ *      This code is in the Public Domain.
+ *
+ * Header-only C++17 layer over buddy and ffit heaps:
+ *   * memman::resource<H>, a std::pmr::memory_resource
+ *     (buddy_resource and ffit_resource), for pmr containers;
+ *   * memman::allocator<T,H>, a typed allocator for standard
+ *     containers.
+ *
+ * Neither owns the heap: the heap descriptor is initialised
+ * by the user and must outlive all blocks.
+ * Both free blocks with the size they were allocated with,
+ * so that the buddy system does not look up the size area.
+ * The allocator computes the order of a single T at compile time
+ * and uses buddy_get_order and buddy_free_order for single objects
+ * (e.g. the nodes of lists, sets and maps); the ffit heap has no
+ * orders, there it uses the generic services.
+ *
+ * Blocks of the emergency heap are only aligned to the size
+ * of an offset; if that is not enough, the block is replaced
+ * by an aligned one. Failure throws std::bad_alloc.
+ * -----------------------------------------------------------------------
+ */
+#ifndef __MEMALLOC_HPP__
+#define __MEMALLOC_HPP__
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <new>
+#include <memory_resource>
+#include <buddy.h>
+#include <ffit.h>
+
+namespace memman {
+
+/* ------------------------------------------------------------------------
+ * Order of a block of n bytes in the buddy system:
+ * log2 of the next power of two, but at least BUDDY_MINORDER
+ * ------------------------------------------------------------------------
+ */
+constexpr uint8_t order(size_t n) {
+	uint8_t k = BUDDY_MINORDER;
+	while (k < std::numeric_limits<size_t>::digits - 1 &&
+	       ((size_t)1 << k) < n) k++;
+	return k;
+}
+
+// buddy blocks are aligned to their size up to the page
+constexpr size_t PAGE = 4096;
+
+constexpr bool aligned(const void *p, size_t align) {
+	return ((uintptr_t)p & (align - 1)) == 0;
+}
+
+/* ------------------------------------------------------------------------
+ * Heap services used by resource and allocator
+ * ------------------------------------------------------------------------
+ */
+template <class H> struct heap_traits;
+
+template <> struct heap_traits<buddy_heap_t> {
+	// aligned by size: the block is as large as without alignment
+	static bool natural(size_t sz, size_t align) {
+		return align <= PAGE && align <= ((size_t)1 << order(sz));
+	}
+
+	static void *get(buddy_heap_t *h, size_t sz, size_t align) {
+		if (!natural(sz, align)) {
+			return buddy_get_aligned_block(h, align, sz);
+		}
+		void *p = buddy_get_block(h, sz);
+		if (p != nullptr && !aligned(p, align)) {
+			buddy_free_block(h, p);
+			p = buddy_get_aligned_block(h, align, sz);
+		}
+		return p;
+	}
+
+	static void release(buddy_heap_t *h, void *p, size_t sz, size_t align) {
+		if (natural(sz, align)) buddy_free_sized(h, p, sz);
+		else buddy_free_block(h, p);
+	}
+
+	template <size_t S, size_t A>
+	static void *get_one(buddy_heap_t *h) {
+		static_assert(A <= PAGE, "alignment beyond the page");
+		constexpr uint8_t k = order(S);
+		void *p = buddy_get_order(h, k);
+		if (p != nullptr && !aligned(p, A)) {
+			buddy_free_order(h, p, k);
+			p = buddy_get_aligned_block(h, A, S);
+		}
+		return p;
+	}
+
+	template <size_t S, size_t A>
+	static void release_one(buddy_heap_t *h, void *p) {
+		buddy_free_order(h, p, order(S));
+	}
+};
+
+template <> struct heap_traits<ffit_heap_t> {
+	static void *get(ffit_heap_t *h, size_t sz, size_t align) {
+		void *p = ffit_get_block(h, sz);
+		if (p != nullptr && !aligned(p, align)) {
+			ffit_free_block(h, p);
+			p = ffit_get_aligned_block(h, align, sz);
+		}
+		return p;
+	}
+
+	static void release(ffit_heap_t *h, void *p, size_t, size_t) {
+		ffit_free_block(h, p);
+	}
+
+	template <size_t S, size_t A>
+	static void *get_one(ffit_heap_t *h) {
+		return get(h, S, A);
+	}
+
+	template <size_t S, size_t A>
+	static void release_one(ffit_heap_t *h, void *p) {
+		ffit_free_block(h, p);
+	}
+};
+
+/* ------------------------------------------------------------------------
+ * Memory resource
+ * ------------------------------------------------------------------------
+ */
+template <class H>
+class resource : public std::pmr::memory_resource {
+public:
+	explicit resource(H *h) noexcept : h_(h) {}
+
+	H *heap() const noexcept { return h_; }
+
+private:
+	H *h_;
+
+	void *do_allocate(size_t bytes, size_t align) override {
+		void *p = heap_traits<H>::get(h_, bytes > 0 ? bytes : 1, align);
+		if (p == nullptr) throw std::bad_alloc();
+		return p;
+	}
+
+	void do_deallocate(void *p, size_t bytes, size_t align) override {
+		heap_traits<H>::release(h_, p, bytes > 0 ? bytes : 1, align);
+	}
+
+	bool do_is_equal(const std::pmr::memory_resource &o)
+	                                          const noexcept override {
+		const resource *r = dynamic_cast<const resource*>(&o);
+		return r != nullptr && r->h_ == h_;
+	}
+};
+
+typedef resource<buddy_heap_t> buddy_resource;
+typedef resource<ffit_heap_t>  ffit_resource;
+
+/* ------------------------------------------------------------------------
+ * Typed allocator
+ * ------------------------------------------------------------------------
+ */
+template <class T, class H = buddy_heap_t>
+class allocator {
+public:
+	typedef T value_type;
+
+	template <class U> struct rebind { typedef allocator<U,H> other; };
+
+	// order of a single T
+	static constexpr uint8_t K = order(sizeof(T));
+
+	explicit allocator(H *h) noexcept : h_(h) {}
+
+	template <class U>
+	allocator(const allocator<U,H> &o) noexcept : h_(o.heap()) {}
+
+	H *heap() const noexcept { return h_; }
+
+	T *allocate(size_t n) {
+		void *p;
+		if (n == 1) {
+			p = heap_traits<H>::template get_one<sizeof(T), alignof(T)>(h_);
+		} else {
+			if (n > std::numeric_limits<size_t>::max() / sizeof(T)) {
+				throw std::bad_array_new_length();
+			}
+			p = heap_traits<H>::get(h_, n > 0 ? n*sizeof(T) : 1, alignof(T));
+		}
+		if (p == nullptr) throw std::bad_alloc();
+		return static_cast<T*>(p);
+	}
+
+	void deallocate(T *p, size_t n) noexcept {
+		if (n == 1) {
+			heap_traits<H>::template release_one<sizeof(T), alignof(T)>(h_, p);
+		} else {
+			heap_traits<H>::release(h_, p, n > 0 ? n*sizeof(T) : 1,
+			                        alignof(T));
+		}
+	}
+
+private:
+	H *h_;
+};
+
+template <class T, class U, class H>
+bool operator==(const allocator<T,H> &a, const allocator<U,H> &b) noexcept {
+	return a.heap() == b.heap();
+}
+
+template <class T, class U, class H>
+bool operator!=(const allocator<T,H> &a, const allocator<U,H> &b) noexcept {
+	return a.heap() != b.heap();
+}
+
+}
+#endif
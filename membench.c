@@ -0,0 +1,422 @@
+/* -----------------------------------------------------------------------
+ * Throughput and Latency Benchmark
+ * --------------------------------
+ *
+ * (c) Tobias Schoofs, 2010 -- 2020
+ *     This code is in the Public Domain.
+ *
+ * Runs a set of workloads against buddy, ebuddy, ffit
+ * and the system malloc with 1, 2, 4, ... up to n threads
+ * sharing one heap:
+ * - churn   : a fixed size (64 bytes) is allocated and freed
+ *             randomly in a set of slots per thread
+ * - powerlaw: like churn, but sizes follow a power law
+ *             (many small, few large blocks)
+ * - prodcons: each thread allocates blocks and passes them
+ *             to the next thread, which frees them
+ * - realloc : blocks grow by half their size until they reach
+ *             a limit and are freed
+ * Each call is timed individually (clock_gettime) and recorded
+ * in a per-thread histogram with 16 buckets per power of two,
+ * i.e. the percentiles are accurate to about 6%.
+ * The time of the clock itself is included.
+ *
+ * Usage: membench [threads [ops]]
+ * (maximum number of threads, default: 4 or the number of cores,
+ *  operations per thread and workload, default: 100000)
+ *
+ * Output on stdout, one CSV line per allocator, workload,
+ * number of threads and operation (get, free, extend):
+ *     allocator,workload,threads,op,count,fails,ns_op,p50,p99,p999
+ * ns_op is the mean latency in nanoseconds, p50, p99 and p999
+ * are the percentiles in nanoseconds.
+ * -----------------------------------------------------------------------
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include <buddy.h>
+#include <ffit.h>
+
+/* ------------------------------------------------------------------------
+ * Parameters
+ * ------------------------------------------------------------------------
+ */
+#define HEAPSIZE  268435456
+#define SLOTS     1024
+#define RSLOTS    64
+#define FIXSIZE   64
+#define MAXPOWER  65536
+#define MAXGROW   16384
+#define RING      256
+#define MAXTHREADS 64
+
+/* ------------------------------------------------------------------------
+ * Allocators
+ * ------------------------------------------------------------------------
+ */
+#define BUDDY  0
+#define EBUDDY 1
+#define FFIT   2
+#define SYSTEM 3
+#define ALLOCATORS 4
+
+static const char *anames[ALLOCATORS] = {"buddy", "ebuddy", "ffit", "malloc"};
+
+static int a = BUDDY;
+static void *region = NULL;
+static buddy_heap_t bh;
+static ffit_heap_t  fh;
+
+static int heapinit(int t) {
+	a = t;
+	if (a == SYSTEM) return 0;
+	memset(&bh, 0, sizeof(bh));
+	memset(&fh, 0, sizeof(fh));
+	if (region != NULL) munmap(region, HEAPSIZE);
+	region = mmap(NULL, HEAPSIZE, PROT_READ | PROT_WRITE,
+	              MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (region == MAP_FAILED) {
+		region = NULL; return -1;
+	}
+	if (a == FFIT) {
+		fh.mh = (uintptr_t)region;
+		fh.hs = HEAPSIZE;
+		fh.lck.t = MEMLOCK_SPIN;
+		return ffit_init(&fh);
+	}
+	bh.mh = (uintptr_t)region;
+	bh.hs = HEAPSIZE;
+	bh.e  = a == EBUDDY;
+	bh.lck.t = MEMLOCK_SPIN;
+	return buddy_init(&bh);
+}
+
+static inline void *getblock(size_t sz) {
+	switch(a) {
+	case FFIT: return ffit_get_block(&fh, sz);
+	case SYSTEM: return malloc(sz);
+	default: return buddy_get_block(&bh, sz);
+	}
+}
+
+static inline void freeblock(void *ptr) {
+	switch(a) {
+	case FFIT: ffit_free_block(&fh, ptr); break;
+	case SYSTEM: free(ptr); break;
+	default: buddy_free_block(&bh, ptr);
+	}
+}
+
+static inline void *exblock(void *ptr, size_t sz) {
+	int rc;
+	switch(a) {
+	case FFIT: return ffit_extend_block(&fh, ptr, sz, &rc);
+	case SYSTEM: return realloc(ptr, sz);
+	default: return buddy_extend_block(&bh, ptr, sz, &rc);
+	}
+}
+
+/* ------------------------------------------------------------------------
+ * Latency histograms:
+ * values below 16 have a bucket of their own,
+ * above, each power of two is divided into 16 buckets
+ * ------------------------------------------------------------------------
+ */
+#define GET 0
+#define FREE 1
+#define EXTEND 2
+#define OPS 3
+#define BUCKETS (64*16)
+
+static const char *onames[OPS] = {"get", "free", "extend"};
+
+typedef struct {
+	uint64_t cnt;
+	uint64_t fails;
+	uint64_t sum;
+	uint64_t hist[BUCKETS];
+} lat_t;
+
+static inline int bucket(uint64_t v) {
+	if (v < 16) return (int)v;
+	int e = 63 - __builtin_clzll(v);
+	return (e - 3) * 16 + (int)((v >> (e - 4)) & 15);
+}
+
+static inline uint64_t bucketvalue(int b) {
+	if (b < 16) return (uint64_t)b;
+	int e = b / 16 + 3;
+	return ((uint64_t)1 << e) | ((uint64_t)(b % 16) << (e - 4));
+}
+
+static inline uint64_t now() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000ULL + (uint64_t)t.tv_nsec;
+}
+
+static inline void record(lat_t *l, uint64_t t0, uint64_t t1, int ok) {
+	uint64_t d = t1 - t0;
+	l->cnt++; l->sum += d;
+	l->hist[bucket(d)]++;
+	if (!ok) l->fails++;
+}
+
+static uint64_t percentile(lat_t *l, double p) {
+	uint64_t n = (uint64_t)ceil(p * (double)l->cnt);
+	uint64_t k = 0;
+	for(int b=0; b<BUCKETS; b++) {
+		k += l->hist[b];
+		if (k >= n && k > 0) return bucketvalue(b);
+	}
+	return 0;
+}
+
+/* ------------------------------------------------------------------------
+ * Per-thread state:
+ * own PRNG (xorshift), latencies and, for prodcons,
+ * the ring of blocks passed in by the previous thread
+ * ------------------------------------------------------------------------
+ */
+typedef struct {
+	uint64_t  rnd;
+	size_t    ops;
+	int       wl;
+	lat_t     lat[OPS];
+	void     *ring[RING];
+	uint32_t  head; // written by the consumer
+	uint32_t  tail; // written by the producer
+	void     *next; // the consumer
+	pthread_t tid;
+} thread_t;
+
+static inline uint64_t xrand(thread_t *t) {
+	t->rnd ^= t->rnd << 13;
+	t->rnd ^= t->rnd >> 7;
+	t->rnd ^= t->rnd << 17;
+	return t->rnd;
+}
+
+static inline size_t powersize(thread_t *t) {
+	double u = ((double)(xrand(t) >> 11) + 1.0) / 9007199254740993.0;
+	double s = 16.0 * pow(u, -1.0/1.2);
+	return s > MAXPOWER ? MAXPOWER : (size_t)s;
+}
+
+/* ------------------------------------------------------------------------
+ * Helpers: timed get and free
+ * ------------------------------------------------------------------------
+ */
+static inline void *timedget(thread_t *t, size_t sz) {
+	uint64_t t0 = now();
+	void *p = getblock(sz);
+	uint64_t t1 = now();
+	record(&t->lat[GET], t0, t1, p != NULL);
+	if (p != NULL) *(char*)p = 1;
+	return p;
+}
+
+static inline void timedfree(thread_t *t, void *p) {
+	uint64_t t0 = now();
+	freeblock(p);
+	uint64_t t1 = now();
+	record(&t->lat[FREE], t0, t1, 1);
+}
+
+/* ------------------------------------------------------------------------
+ * Workload: churn and powerlaw
+ * ------------------------------------------------------------------------
+ */
+#define CHURN    0
+#define POWERLAW 1
+#define PRODCONS 2
+#define REALLOC  3
+#define WORKLOADS 4
+
+static const char *wnames[WORKLOADS] = {"churn", "powerlaw",
+                                        "prodcons", "realloc"};
+
+static void churn(thread_t *t) {
+	void *slots[SLOTS];
+	memset(slots, 0, sizeof(slots));
+	for(size_t i=0; i<t->ops; i++) {
+		int k = (int)(xrand(t) % SLOTS);
+		if (slots[k] != NULL) {
+			timedfree(t, slots[k]); slots[k] = NULL;
+		} else {
+			size_t sz = t->wl == CHURN ? FIXSIZE : powersize(t);
+			slots[k] = timedget(t, sz);
+		}
+	}
+	for(int k=0; k<SLOTS; k++) {
+		if (slots[k] != NULL) freeblock(slots[k]);
+	}
+}
+
+/* ------------------------------------------------------------------------
+ * Workload: prodcons
+ * each thread frees what it finds in its ring
+ * and puts its new blocks into the ring of the next one;
+ * if the ring of the next one is full, the block is freed locally
+ * ------------------------------------------------------------------------
+ */
+static void prodcons(thread_t *t) {
+	thread_t *n = t->next;
+	for(size_t i=0; i<t->ops; i++) {
+		uint32_t h = t->head;
+		if (h != __atomic_load_n(&t->tail, __ATOMIC_ACQUIRE)) {
+			void *p = t->ring[h%RING];
+			__atomic_store_n(&t->head, h+1, __ATOMIC_RELEASE);
+			timedfree(t, p);
+			continue;
+		}
+		void *p = timedget(t, FIXSIZE + xrand(t) % (8*FIXSIZE));
+		if (p == NULL) continue;
+		uint32_t x = n->tail;
+		if (x - __atomic_load_n(&n->head, __ATOMIC_ACQUIRE) < RING) {
+			n->ring[x%RING] = p;
+			__atomic_store_n(&n->tail, x+1, __ATOMIC_RELEASE);
+		} else {
+			timedfree(t, p);
+		}
+	}
+}
+
+/* ------------------------------------------------------------------------
+ * Drain the ring after all threads have finished
+ * ------------------------------------------------------------------------
+ */
+static void drainring(thread_t *t) {
+	while(t->head != t->tail) {
+		freeblock(t->ring[t->head%RING]); t->head++;
+	}
+}
+
+/* ------------------------------------------------------------------------
+ * Workload: realloc
+ * ------------------------------------------------------------------------
+ */
+static void growth(thread_t *t) {
+	void  *slots[RSLOTS];
+	size_t sizes[RSLOTS];
+	memset(slots, 0, sizeof(slots));
+	for(size_t i=0; i<t->ops; i++) {
+		int k = (int)(xrand(t) % RSLOTS);
+		if (slots[k] == NULL) {
+			sizes[k] = 16 + xrand(t) % 64;
+			slots[k] = timedget(t, sizes[k]);
+		} else if (sizes[k] >= MAXGROW) {
+			timedfree(t, slots[k]); slots[k] = NULL;
+		} else {
+			size_t s = sizes[k] + sizes[k]/2;
+			uint64_t t0 = now();
+			void *p = exblock(slots[k], s);
+			uint64_t t1 = now();
+			record(&t->lat[EXTEND], t0, t1, p != NULL);
+			if (p != NULL) {
+				slots[k] = p; sizes[k] = s;
+				((char*)p)[s-1] = 1;
+			}
+		}
+	}
+	for(int k=0; k<RSLOTS; k++) {
+		if (slots[k] != NULL) freeblock(slots[k]);
+	}
+}
+
+static void *run(void *arg) {
+	thread_t *t = arg;
+	switch(t->wl) {
+	case PRODCONS: prodcons(t); break;
+	case REALLOC: growth(t); break;
+	default: churn(t);
+	}
+	return NULL;
+}
+
+/* ------------------------------------------------------------------------
+ * Run one workload with n threads and print the results
+ * ------------------------------------------------------------------------
+ */
+static thread_t ts[MAXTHREADS];
+
+static int bench(int wl, int n, size_t ops) {
+	lat_t all[OPS];
+	memset(all, 0, sizeof(all));
+	memset(ts, 0, sizeof(ts));
+	for(int i=0; i<n; i++) {
+		ts[i].rnd  = 0x9e3779b97f4a7c15ULL * (uint64_t)(i+1);
+		ts[i].ops  = ops;
+		ts[i].wl   = wl;
+		ts[i].next = &ts[(i+1)%n];
+	}
+	for(int i=0; i<n; i++) {
+		if (pthread_create(&ts[i].tid, NULL, run, &ts[i]) != 0) {
+			fprintf(stderr, "cannot create thread\n");
+			return -1;
+		}
+	}
+	for(int i=0; i<n; i++) pthread_join(ts[i].tid, NULL);
+	for(int i=0; i<n; i++) {
+		drainring(&ts[i]);
+		for(int o=0; o<OPS; o++) {
+			all[o].cnt += ts[i].lat[o].cnt;
+			all[o].fails += ts[i].lat[o].fails;
+			all[o].sum += ts[i].lat[o].sum;
+			for(int b=0; b<BUCKETS; b++) {
+				all[o].hist[b] += ts[i].lat[o].hist[b];
+			}
+		}
+	}
+	for(int o=0; o<OPS; o++) {
+		if (all[o].cnt == 0) continue;
+		printf("%s,%s,%d,%s,%llu,%llu,%.1f,%llu,%llu,%llu\n",
+		       anames[a], wnames[wl], n, onames[o],
+		       (unsigned long long)all[o].cnt,
+		       (unsigned long long)all[o].fails,
+		       (double)all[o].sum / (double)all[o].cnt,
+		       (unsigned long long)percentile(&all[o], 0.5),
+		       (unsigned long long)percentile(&all[o], 0.99),
+		       (unsigned long long)percentile(&all[o], 0.999));
+	}
+	fflush(stdout);
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	long c = sysconf(_SC_NPROCESSORS_ONLN);
+	int n = c > 4 ? (int)c : 4;
+	size_t ops = 100000;
+
+	// by default, at most MAXTHREADS
+	if (n > MAXTHREADS) n = MAXTHREADS;
+
+	if (argc > 1) n = atoi(argv[1]);
+	if (argc > 2) ops = (size_t)atol(argv[2]);
+	if (n < 1 || n > MAXTHREADS || ops == 0) {
+		fprintf(stderr, "usage: %s [threads [ops]]\n", argv[0]);
+		return -1;
+	}
+	printf("allocator,workload,threads,op,count,fails,ns_op,p50,p99,p999\n");
+	for(int t=0; t<ALLOCATORS; t++) {
+		for(int wl=0; wl<WORKLOADS; wl++) {
+			for(int k=1; k<=n; k = k < n && 2*k > n ? n : 2*k) {
+				if (heapinit(t) != 0) {
+					fprintf(stderr, "cannot init %s\n", anames[t]);
+					return -1;
+				}
+				if (bench(wl, k, ops) != 0) return -1;
+			}
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,78 @@
+/* -----------------------------------------------------------------------
+ * Instrumentation
+ * ---------------
+ *
+ *  (c) Tobias Schoofs, 2010 -- 2020
+ *      This code is in the Public Domain.
+ *
+ * The counters of a thread are mapped on its first count
+ * (not with malloc, since they may count malloc itself)
+ * and pushed onto a list, which is never shrunk,
+ * so that the counters of terminated threads remain.
+ * -----------------------------------------------------------------------
+ */
+#define _GNU_SOURCE
+#include <meminst.h>
+#include <string.h>
+#include <sys/mman.h>
+
+__thread meminst_t *meminst_mine = NULL;
+
+static meminst_t *all = NULL;
+
+// counts of threads without counters (mapping failed)
+static meminst_t lost;
+
+/* ------------------------------------------------------------------------
+ * Map the counters of this thread
+ * ------------------------------------------------------------------------
+ */
+meminst_t *meminst_register(void) {
+	void *p = mmap(NULL, sizeof(meminst_t), PROT_READ | PROT_WRITE,
+	               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) return &lost;
+	meminst_t *m = p;
+	m->nxt = __atomic_load_n(&all, __ATOMIC_RELAXED);
+	while(!__atomic_compare_exchange_n(&all, &m->nxt, m, 1,
+	                         __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	meminst_mine = m;
+	return m;
+}
+
+/* ------------------------------------------------------------------------
+ * Add the counters of s to m
+ * ------------------------------------------------------------------------
+ */
+static void add(meminst_t *m, meminst_t *s) {
+	for(int i=0; i<MEMINST_COUNTERS; i++) m->cnt[i] += s->cnt[i];
+	for(int h=0; h<MEMINST_HEAPS; h++) {
+		for(int o=0; o<MEMINST_OPS; o++) {
+			for(int b=0; b<MEMINST_BUCKETS; b++) {
+				m->hist[h][o][b] += s->hist[h][o][b];
+			}
+		}
+	}
+}
+
+void meminst_get(meminst_t *m) {
+	memset(m, 0, sizeof(meminst_t));
+	for(meminst_t *s = __atomic_load_n(&all, __ATOMIC_ACQUIRE);
+	    s != NULL; s = s->nxt) add(m, s);
+	add(m, &lost);
+}
+
+void meminst_get_own(meminst_t *m) {
+	memset(m, 0, sizeof(meminst_t));
+	if (meminst_mine != NULL) add(m, meminst_mine);
+}
+
+void meminst_reset(void) {
+	for(meminst_t *s = __atomic_load_n(&all, __ATOMIC_ACQUIRE);
+	    s != NULL; s = s->nxt)
+	{
+		meminst_t *n = s->nxt;
+		memset(s, 0, sizeof(meminst_t));
+		s->nxt = n;
+	}
+	memset(&lost, 0, sizeof(meminst_t));
+}
@@ -0,0 +1,132 @@
+/* -----------------------------------------------------------------------
+ * Instrumentation
+ * ---------------
+ *
+ *  (c) Tobias Schoofs, 2010 -- 2020
+ *      This code is in the Public Domain.
+ *
+ * Compiled with MEMMAN_INSTRUMENT, buddy and ffit count what
+ * their hot paths do (list steps, splits, joins, reallocs)
+ * and the cycles each service takes.
+ * Without MEMMAN_INSTRUMENT, the hooks compile to nothing.
+ *
+ * Counters are kept per thread without locking or atomics;
+ * meminst_get adds up the counters of all threads
+ * (including threads that have terminated).
+ * Counters are shared by all heaps of a thread, the emergency
+ * heap of a buddy system counts as an ffit heap.
+ *
+ * Latencies are measured with the time stamp counter (on x86)
+ * or in nanoseconds (elsewhere) and kept in histograms
+ * with one bucket per power of two.
+ * Services calling other services (e.g. extend calling get
+ * or the buddy system calling its emergency heap)
+ * are measured in both.
+ * -----------------------------------------------------------------------
+ */
+#ifndef __MEMINST_H__
+#define __MEMINST_H__
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+/* ------------------------------------------------------------------------
+ * Counters
+ * ------------------------------------------------------------------------
+ */
+#define MEMINST_STEPS_INSERT  0 // list nodes visited on insert
+#define MEMINST_STEPS_REMOVE  1 // list nodes visited on remove
+#define MEMINST_STEPS_FIND    2 // lookups of available neighbours
+#define MEMINST_STEPS_FIT     3 // lists and nodes visited finding a fit
+#define MEMINST_STEPS_PENDING 4 // pending frees drained
+#define MEMINST_SPLITS        5 // blocks split
+#define MEMINST_JOINS         6 // blocks joined
+#define MEMINST_INPLACE       7 // extends performed in place
+#define MEMINST_MOVED         8 // extends that copied the block
+#define MEMINST_COUNTERS      9
+
+/* ------------------------------------------------------------------------
+ * Histograms: heaps and services
+ * ------------------------------------------------------------------------
+ */
+#define MEMINST_BUDDY   0
+#define MEMINST_FFIT    1
+#define MEMINST_HEAPS   2
+
+#define MEMINST_GET     0 // get and batch get
+#define MEMINST_FREE    1 // free, sized, batch and remote free
+#define MEMINST_EXTEND  2
+#define MEMINST_ALIGNED 3
+#define MEMINST_OPS     4
+
+#define MEMINST_BUCKETS 64 // bucket i: 2^i to 2^(i+1)-1 cycles
+
+/* ------------------------------------------------------------------------
+ * Counters and histograms
+ * ------------------------------------------------------------------------
+ */
+typedef struct meminst_s {
+  struct meminst_s *nxt; // next thread (internal)
+  uint64_t cnt[MEMINST_COUNTERS];
+  uint64_t hist[MEMINST_HEAPS][MEMINST_OPS][MEMINST_BUCKETS];
+} meminst_t;
+
+/* ------------------------------------------------------------------------
+ * Add up the counters of all threads.
+ * Threads running concurrently may be counted partially.
+ * ------------------------------------------------------------------------
+ */
+void meminst_get(meminst_t *m);
+
+/* ------------------------------------------------------------------------
+ * Get the counters of the calling thread
+ * ------------------------------------------------------------------------
+ */
+void meminst_get_own(meminst_t *m);
+
+/* ------------------------------------------------------------------------
+ * Reset the counters of all threads;
+ * should be called while no other thread uses a heap.
+ * ------------------------------------------------------------------------
+ */
+void meminst_reset(void);
+
+/* ------------------------------------------------------------------------
+ * Hooks (used by buddy and ffit)
+ * ------------------------------------------------------------------------
+ */
+extern __thread meminst_t *meminst_mine;
+meminst_t *meminst_register(void);
+
+static inline meminst_t *meminst_self(void) {
+	meminst_t *m = meminst_mine;
+	return m != NULL ? m : meminst_register();
+}
+
+static inline uint64_t meminst_cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000ULL + (uint64_t)t.tv_nsec;
+#endif
+}
+
+static inline void meminst_time(uint8_t hp, uint8_t op, uint64_t t) {
+	uint64_t d = meminst_cycles() - t;
+	uint8_t  b = (uint8_t)(63 - __builtin_clzll(d | 1));
+	meminst_self()->hist[hp][op][b]++;
+}
+
+#ifdef MEMMAN_INSTRUMENT
+#define MEMINST_COUNT(c,n) (meminst_self()->cnt[c] += (n))
+#define MEMINST_CLOCK(t) uint64_t t = meminst_cycles()
+#define MEMINST_TIME(hp,op,t) meminst_time(hp,op,t)
+#else
+#define MEMINST_COUNT(c,n)
+#define MEMINST_CLOCK(t)
+#define MEMINST_TIME(hp,op,t)
+#endif
+#endif
@@ -0,0 +1,120 @@
+/* -----------------------------------------------------------------------
+ * Locks for Dynamic Memory Management Systems
+ * -------------------------------------------
+ *
+ *  (c) Tobias Schoofs, 2010 -- 2020
+ *      This code is in the Public Domain.
+ *
+ * The spinlock is a test-and-test-and-set lock:
+ * we try to grab the lock and, if that fails,
+ * we wait until it appears to be free before we try again.
+ * While waiting we back off exponentially up to MAXBACKOFF
+ * and yield the processor from then on.
+ *
+ * The counters are updated while the lock is held;
+ * they, hence, need no further protection.
+ * -----------------------------------------------------------------------
+ */
+#include <memlock.h>
+#include <sched.h>
+#include <errno.h>
+
+/* ------------------------------------------------------------------------
+ * Max backoff in pause instructions
+ * ------------------------------------------------------------------------
+ */
+#define MAXBACKOFF 1024
+
+/* ------------------------------------------------------------------------
+ * Tell the processor that we are spinning
+ * ------------------------------------------------------------------------
+ */
+static inline void cpurelax() {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+/* ------------------------------------------------------------------------
+ * Spinlock
+ * ------------------------------------------------------------------------
+ */
+static inline void spinlock(memlock_t *l) {
+	uint32_t b = 1;
+	char     c = 0;
+	while (__atomic_exchange_n(&l->spin, 1, __ATOMIC_ACQUIRE)) {
+		c = 1;
+		while (__atomic_load_n(&l->spin, __ATOMIC_RELAXED)) {
+			if (b < MAXBACKOFF) {
+				for(uint32_t i=0; i<b; i++) cpurelax();
+				b <<= 1;
+			} else sched_yield();
+		}
+	}
+	l->acqs++;
+	if (c) l->cont++;
+}
+
+static inline void spinunlock(memlock_t *l) {
+	__atomic_store_n(&l->spin, 0, __ATOMIC_RELEASE);
+}
+
+/* ------------------------------------------------------------------------
+ * Mutex:
+ * we first try to obtain the lock without blocking
+ * to find out whether the lock is contended
+ * ------------------------------------------------------------------------
+ */
+static inline void mutexlock(memlock_t *l) {
+	char c = 0;
+	if (pthread_mutex_trylock(&l->mtx) == EBUSY) {
+		c = 1; pthread_mutex_lock(&l->mtx);
+	}
+	l->acqs++;
+	if (c) l->cont++;
+}
+
+/* ------------------------------------------------------------------------
+ * Init
+ * ------------------------------------------------------------------------
+ */
+int memlock_init(memlock_t *l) {
+	l->spin = 0;
+	l->acqs = 0;
+	l->cont = 0;
+	switch(l->t) {
+	case MEMLOCK_NONE:
+	case MEMLOCK_SPIN: return 0;
+	case MEMLOCK_MUTEX: return (pthread_mutex_init(&l->mtx, NULL) == 0 ?
+	                            0 : -1);
+	case MEMLOCK_USER: return (l->acquire != NULL &&
+	                           l->release != NULL ? 0 : -1);
+	default: return -1;
+	}
+}
+
+/* ------------------------------------------------------------------------
+ * Acquire
+ * ------------------------------------------------------------------------
+ */
+void memlock_acquire(memlock_t *l) {
+	switch(l->t) {
+	case MEMLOCK_SPIN: spinlock(l); break;
+	case MEMLOCK_MUTEX: mutexlock(l); break;
+	case MEMLOCK_USER: l->acquire(l); l->acqs++; break;
+	default: break;
+	}
+}
+
+/* ------------------------------------------------------------------------
+ * Release
+ * ------------------------------------------------------------------------
+ */
+void memlock_release(memlock_t *l) {
+	switch(l->t) {
+	case MEMLOCK_SPIN: spinunlock(l); break;
+	case MEMLOCK_MUTEX: pthread_mutex_unlock(&l->mtx); break;
+	case MEMLOCK_USER: l->release(l); break;
+	default: break;
+	}
+}
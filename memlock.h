@@ -0,0 +1,73 @@
+/* -----------------------------------------------------------------------
+ * Locks for Dynamic Memory Management Systems
+ * -------------------------------------------
+ *
+ *  (c) Tobias Schoofs, 2010 -- 2020
+ *      This code is in the Public Domain.
+ *
+ * Each heap descriptor contains a lock descriptor.
+ * The lock type is set by the user before the heap is initialised:
+ * - NONE : no locking at all (the heap is used by one thread only)
+ * - SPIN : a spinlock with exponential backoff
+ * - MUTEX: a pthread mutex
+ * - USER : a lock provided by the user through the acquire and
+ *          release callbacks; the callbacks receive the lock
+ *          descriptor, its member arg may be used freely.
+ *
+ * The lock counts acquisitions and contended acquisitions
+ * (i.e. those that had to wait). For user locks, contention
+ * is not known and, hence, not counted.
+ * -----------------------------------------------------------------------
+ */
+#ifndef __MEMLOCK_H__
+#define __MEMLOCK_H__
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define MEMLOCK_NONE  0
+#define MEMLOCK_SPIN  1
+#define MEMLOCK_MUTEX 2
+#define MEMLOCK_USER  3
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* ------------------------------------------------------------------------
+ * Lock Structure
+ * ------------------------------------------------------------------------
+ */
+typedef struct memlock_s {
+  uint8_t                     t; // lock type         (set by user)
+  void  (*acquire)(struct memlock_s*); // user lock   (set by user)
+  void  (*release)(struct memlock_s*); // user unlock (set by user)
+  void                     *arg; // user argument     (set by user)
+  uint32_t                 spin; // spinlock          (used internally)
+  pthread_mutex_t           mtx; // mutex             (used internally)
+  uint64_t                 acqs; // acquisitions      (computed internally)
+  uint64_t                 cont; // contended         (computed internally)
+} memlock_t;
+
+/* ------------------------------------------------------------------------
+ * Initialise the lock according to its type
+ * Returns 0 on success and -1 on error.
+ * ------------------------------------------------------------------------
+ */
+int memlock_init(memlock_t *l);
+
+/* ------------------------------------------------------------------------
+ * Acquire the lock
+ * ------------------------------------------------------------------------
+ */
+void memlock_acquire(memlock_t *l);
+
+/* ------------------------------------------------------------------------
+ * Release the lock
+ * ------------------------------------------------------------------------
+ */
+void memlock_release(memlock_t *l);
+#ifdef __cplusplus
+}
+#endif
+#endif
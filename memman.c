@@ -0,0 +1,220 @@
+/* -----------------------------------------------------------------------
+ * Multiple Heaps
+ * --------------
+ *
+ *  (c) Tobias Schoofs, 2010 -- 2020
+ *      This code is in the Public Domain.
+ *
+ * The region passed in by the user is split into
+ * - the descriptor area, an array of n heap descriptors and
+ * - n heaps of equal size.
+ *
+ *     +----+-----------+-----------+-----+-----------+
+ *     |    |           |           | ... |           |
+ *     +----+-----------+-----------+-----+-----------+
+ *     ^    ^           ^                 ^
+ *     |    |           |                 |
+ *     |    heap 0      heap 1            heap n-1
+ *     |
+ *     descriptors
+ *
+ * Since all heaps have the same size, the heap a block belongs to
+ * is found by dividing the distance of the block from the first heap
+ * by the heap size.
+ *
+ * A request is first directed to the heap selected for
+ * the invoking thread. If that heap cannot serve the request,
+ * the following heaps are asked in turn.
+ * -----------------------------------------------------------------------
+ */
+#define _GNU_SOURCE
+#include <memman.h>
+#include <sched.h>
+#include <string.h>
+#include <stdio.h>
+
+/* ------------------------------------------------------------------------
+ * Some shortcuts
+ * ------------------------------------------------------------------------
+ */
+#define OK       MEMMAN_HEAP_OK
+#define NOTFOUND MEMMAN_HEAP_NOTFOUND
+#define INTERNAL MEMMAN_HEAP_INTERNAL
+
+/* ------------------------------------------------------------------------
+ * Heaps are aligned to PAGESIZE
+ * ------------------------------------------------------------------------
+ */
+#define PAGESIZE 4096
+
+/* ------------------------------------------------------------------------
+ * Round up to the next multiple of a power of two
+ * ------------------------------------------------------------------------
+ */
+static inline uintptr_t alignup(uintptr_t n, uintptr_t a) {
+	return ((n + a - 1) & ~(a - 1));
+}
+
+/* ------------------------------------------------------------------------
+ * Thread numbers are assigned on the first request of each thread
+ * ------------------------------------------------------------------------
+ */
+static uint32_t nthreads = 0;
+static __thread uint32_t mythread = 0;
+
+static inline uint32_t threadnum() {
+	if (mythread == 0) {
+		mythread = __atomic_add_fetch(&nthreads, 1, __ATOMIC_RELAXED);
+	}
+	return (mythread - 1);
+}
+
+/* ------------------------------------------------------------------------
+ * Select the heap for the invoking thread
+ * ------------------------------------------------------------------------
+ */
+static inline uint16_t selectheap(memman_multi_t *m) {
+	if (m->sel == MEMMAN_SEL_CPU) {
+		int c = sched_getcpu();
+		if (c >= 0) return (uint16_t)(c % m->n);
+	}
+	return (uint16_t)(threadnum() % m->n);
+}
+
+/* ------------------------------------------------------------------------
+ * Find the heap the pointer belongs to (or -1)
+ * ------------------------------------------------------------------------
+ */
+static inline int ownerheap(memman_multi_t *m, void *ptr) {
+	uintptr_t p = (uintptr_t)ptr;
+	if (p < m->hh || p >= m->hh + m->n * m->hsize) return -1;
+	return (int)((p - m->hh) / m->hsize);
+}
+
+/* ------------------------------------------------------------------------
+ * Get a block from heap i
+ * ------------------------------------------------------------------------
+ */
+static inline void *getblock(memman_multi_t *m, uint16_t i, size_t sz) {
+	if (m->t == MEMMAN_FFIT) return ffit_get_block(&m->dh[i].f, sz);
+	return buddy_get_block(&m->dh[i].b, sz);
+}
+
+/* ------------------------------------------------------------------------
+ * Init:
+ * - the descriptors are placed at the beginning of the region
+ * - the heaps start at the next page
+ * - the remainder is divided into n heaps
+ * - each heap is initialised
+ * ------------------------------------------------------------------------
+ */
+int memman_init(memman_multi_t *m) {
+	if (m->mh == 0 || m->hs == 0 || m->n == 0) return -1;
+
+	m->dh = (memman_heap_t*)m->mh;
+	m->hh = alignup(m->mh + m->n * sizeof(memman_heap_t), PAGESIZE);
+
+	if (m->hh >= m->mh + m->hs) return -1;
+
+	m->hsize = (m->mh + m->hs - m->hh) / m->n;
+	m->hsize &= ~((size_t)PAGESIZE - 1);
+	if (m->hsize == 0) return -1;
+
+	memset(m->dh, 0, m->n * sizeof(memman_heap_t));
+	for(uint16_t i=0; i<m->n; i++) {
+		int rc;
+		uintptr_t a = m->hh + i * m->hsize;
+		if (m->t == MEMMAN_FFIT) {
+			m->dh[i].f.mh = a;
+			m->dh[i].f.hs = m->hsize;
+			m->dh[i].f.lck.t = m->lt;
+			rc = ffit_init(&m->dh[i].f);
+		} else {
+			m->dh[i].b.mh = a;
+			m->dh[i].b.hs = m->hsize;
+			m->dh[i].b.e  = m->t == MEMMAN_EBUDDY;
+			m->dh[i].b.el = m->el;
+			m->dh[i].b.lck.t = m->lt;
+			rc = buddy_init(&m->dh[i].b);
+		}
+		if (rc != 0) return rc;
+	}
+	return OK;
+}
+
+/* ------------------------------------------------------------------------
+ * malloc:
+ * try the selected heap and then its neighbours
+ * ------------------------------------------------------------------------
+ */
+void *memman_get_block(memman_multi_t *m, size_t sz) {
+	void *ret = NULL;
+	uint16_t k = selectheap(m);
+	for(uint16_t i=0; i<m->n && ret == NULL; i++) {
+		ret = getblock(m, (k+i)%m->n, sz);
+	}
+	return ret;
+}
+
+/* ------------------------------------------------------------------------
+ * free
+ * ------------------------------------------------------------------------
+ */
+int memman_free_block(memman_multi_t *m, void *ptr) {
+	int i = ownerheap(m, ptr);
+	if (i < 0) return NOTFOUND;
+	if (m->rf && i != selectheap(m)) {
+		if (m->t == MEMMAN_FFIT) return ffit_free_remote(&m->dh[i].f, ptr);
+		return buddy_free_remote(&m->dh[i].b, ptr);
+	}
+	if (m->t == MEMMAN_FFIT) return ffit_free_block(&m->dh[i].f, ptr);
+	return buddy_free_block(&m->dh[i].b, ptr);
+}
+
+/* ------------------------------------------------------------------------
+ * realloc
+ * ------------------------------------------------------------------------
+ */
+void *memman_extend_block(memman_multi_t *m,
+           void *ptr, size_t sz, int *rc) {
+	*rc = OK;
+	if (ptr == NULL) return memman_get_block(m, sz);
+	int i = ownerheap(m, ptr);
+	if (i < 0) {
+		*rc = NOTFOUND; return NULL;
+	}
+	if (m->t == MEMMAN_FFIT) {
+		return ffit_extend_block(&m->dh[i].f, ptr, sz, rc);
+	}
+	return buddy_extend_block(&m->dh[i].b, ptr, sz, rc);
+}
+
+/* ------------------------------------------------------------------------
+ * print (debug)
+ * ------------------------------------------------------------------------
+ */
+void memman_print_heap(memman_multi_t *m) {
+	for(uint16_t i=0; i<m->n; i++) {
+		printf("### HEAP %03u #################\n", i);
+		if (m->t == MEMMAN_FFIT) ffit_print_heap(&m->dh[i].f);
+		else buddy_print_heap(&m->dh[i].b);
+	}
+}
+
+/* ------------------------------------------------------------------------
+ * stats
+ * ------------------------------------------------------------------------
+ */
+void memman_get_stats(memman_multi_t *m,
+                      uint32_t *mem,
+                      uint32_t *usd,
+                      uint32_t *fre)
+{
+	*mem = 0; *usd = 0; *fre = 0;
+	for(uint16_t i=0; i<m->n; i++) {
+		uint32_t x=0, u=0, f=0;
+		if (m->t == MEMMAN_FFIT) ffit_get_stats(&m->dh[i].f, &x, &u, &f);
+		else buddy_get_stats(&m->dh[i].b, &x, &u, &f);
+		*mem += x; *usd += u; *fre += f;
+	}
+}
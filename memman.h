@@ -0,0 +1,132 @@
+/* -----------------------------------------------------------------------
+ * Multiple Heaps
+ * --------------
+ *
+ *  (c) Tobias Schoofs, 2010 -- 2020
+ *      This code is in the Public Domain.
+ *
+ * A front end that splits one memory region into n heaps
+ * of the same type (buddy, ebuddy or ffit) and selects the heap
+ * for a request according to the core on which the invoking thread
+ * is running or according to the thread itself.
+ * If the selected heap runs out of memory, the neighbouring heaps
+ * are tried one after the other.
+ * Blocks are freed and extended in the heap they belong to.
+ * -----------------------------------------------------------------------
+ */
+#ifndef __MEMMAN_H__
+#define __MEMMAN_H__
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <buddy.h>
+#include <ffit.h>
+
+#define MEMMAN_HEAP_OK       0x0
+#define MEMMAN_HEAP_NOTFOUND 0x4
+#define MEMMAN_HEAP_INTERNAL -1
+
+/* ------------------------------------------------------------------------
+ * Heap types
+ * ------------------------------------------------------------------------
+ */
+#define MEMMAN_BUDDY  0
+#define MEMMAN_EBUDDY 1
+#define MEMMAN_FFIT   2
+
+/* ------------------------------------------------------------------------
+ * Heap selection
+ * - CPU   : the heap is selected according to the core (sched_getcpu);
+ *           if the core cannot be determined, the thread is used.
+ * - THREAD: each thread is assigned a heap on its first request
+ *           in a round-robin fashion
+ * ------------------------------------------------------------------------
+ */
+#define MEMMAN_SEL_CPU    0
+#define MEMMAN_SEL_THREAD 1
+
+/* ------------------------------------------------------------------------
+ * Heap descriptor
+ * ------------------------------------------------------------------------
+ */
+typedef union {
+  buddy_heap_t b;
+  ffit_heap_t  f;
+} memman_heap_t;
+
+/* ------------------------------------------------------------------------
+ * Multi Heap Structure
+ * ------------------------------------------------------------------------
+ */
+typedef struct {
+  uintptr_t       mh; // region address           (set by user)
+  size_t          hs; // region size              (set by user)
+  uint8_t          t; // heap type                (set by user)
+  uint8_t        sel; // heap selection           (set by user)
+  uint16_t         n; // number of heaps          (set by user)
+  uint8_t         lt; // lock type of the heaps   (set by user)
+  uint8_t         el; // ebuddy: lock emergency   (set by user)
+                      // heaps independently, 0/1
+  uint8_t         rf; // defer remote frees, 0/1  (set by user)
+  memman_heap_t  *dh; // heap descriptors         (computed internally)
+  uintptr_t       hh; // first heap               (computed internally)
+  size_t       hsize; // size of one heap         (computed internally)
+} memman_multi_t;
+
+/* ------------------------------------------------------------------------
+ * Initialisation
+ * The descriptors of the heaps are stored at the beginning
+ * of the region, followed by the heaps themselves.
+ * Each heap is aligned to a page and its size is a multiple
+ * of the page size. Each heap gets its own lock of type lt
+ * (see memlock.h).
+ * Must be called once per process
+ * ------------------------------------------------------------------------
+ */
+int memman_init(memman_multi_t *m);
+
+/* ------------------------------------------------------------------------
+ * Get a block of size sz
+ * from the selected heap or one of its neighbours.
+ * Returns a pointer on success and NULL on failure
+ * ------------------------------------------------------------------------
+ */
+void *memman_get_block(memman_multi_t *m, size_t sz);
+
+/* ------------------------------------------------------------------------
+ * Free the block indicated by ptr in the heap it belongs to.
+ * With rf = 1, blocks that do not belong to the heap selected
+ * for the invoking thread are put on the pending list of their heap
+ * (see buddy_free_remote) instead of taking its lock.
+ * Returns 0 on success -1 or 4 on error.
+ * Fails if the address is unknown (4)
+ *       or if memory was corrupted (-1)
+ * ------------------------------------------------------------------------
+ */
+int memman_free_block(memman_multi_t *m, void *ptr);
+
+/* ------------------------------------------------------------------------
+ * Extend the block indicated by ptr to size sz
+ * in the heap it belongs to.
+ * The semantics are those of buddy_extend_block and ffit_extend_block
+ * respectively.
+ * ------------------------------------------------------------------------
+ */
+void *memman_extend_block(memman_multi_t *m,
+           void *ptr, size_t sz, int *rc);
+
+/* ------------------------------------------------------------------------
+ * Print all heaps to stdout
+ * ------------------------------------------------------------------------
+ */
+void memman_print_heap(memman_multi_t *m);
+
+/* ------------------------------------------------------------------------
+ * Retrieve statistics summed up over all heaps
+ * ------------------------------------------------------------------------
+ */
+void memman_get_stats(memman_multi_t *m,
+                      uint32_t     *mem,  // heap size
+                      uint32_t     *usd,  // used memory
+                      uint32_t     *fre); // available memory
+#endif
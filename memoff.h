@@ -0,0 +1,42 @@
+/* -----------------------------------------------------------------------
+ * Heap Offsets
+ * ------------
+ *
+ *  (c) Tobias Schoofs, 2010 -- 2020
+ *      This code is in the Public Domain.
+ *
+ * Both memory managers refer to blocks by their offset
+ * from the beginning of the heap (pseudo pointers).
+ * By default, offsets are 32-bit unsigned integers,
+ * which keeps the bookkeeping compact but limits
+ * the heap to 4 GiB and allocations to 2 GiB.
+ * Compiled with MEMMAN_OFFSET64, offsets are 64-bit unsigned integers.
+ * The minimal block sizes grow accordingly (see buddy.c and ffit.c).
+ *
+ * All objects using the memory managers must be compiled
+ * with the same setting.
+ * -----------------------------------------------------------------------
+ */
+#ifndef __MEMOFF_H__
+#define __MEMOFF_H__
+
+#include <stdint.h>
+
+#ifdef MEMMAN_OFFSET64
+typedef uint64_t memoff_t;
+#define MEMOFF_NONE 0xffffffffffffffffULL
+#ifdef __GNUC__
+#define memoff_clz __builtin_clzll
+#define memoff_ctz __builtin_ctzll
+#endif
+#else
+typedef uint32_t memoff_t;
+#define MEMOFF_NONE 0xffffffffU
+#ifdef __GNUC__
+#define memoff_clz __builtin_clz
+#define memoff_ctz __builtin_ctz
+#endif
+#endif
+
+#define MEMOFF_BITS (8*sizeof(memoff_t))
+#endif
@@ -0,0 +1,133 @@
+/* -----------------------------------------------------------------------
+ * Persistent Heaps
+ * ----------------
+ *
+ *  (c) Tobias Schoofs, 2010 -- 2020
+ *      This code is in the Public Domain.
+ *
+ * A heap refers to its blocks by offsets from its start,
+ * so that the memory of a heap is position-independent.
+ * A persistent heap lives in a region (e.g. a file mapped with
+ * MAP_SHARED) that starts with a header followed by the heap:
+ *
+ *   | header | snapshot of the descriptor | ... | heap             |
+ *   |<-------------- a multiple of 4096 ------->|                  |
+ *
+ * The header identifies the heap, the snapshot is a copy
+ * of the heap descriptor taken when the heap was detached.
+ * The checksum covers the snapshot and the bookkeeping the heap
+ * keeps in the region (the available lists and the size and free
+ * areas of the buddy system). It does not cover the blocks.
+ *
+ * A heap is formatted (buddy_format, ffit_format) once,
+ * detached (buddy_detach, ffit_detach) before the region
+ * is unmapped and then attached (buddy_attach, ffit_attach)
+ * again, possibly by another process and at another address.
+ * While attached, the header is marked open; a heap that was
+ * not detached (e.g. because the process crashed)
+ * cannot be attached anymore.
+ * -----------------------------------------------------------------------
+ */
+#ifndef __MEMPERS_H__
+#define __MEMPERS_H__
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#define MEMPERS_MAGIC   "MEMMANPH"
+#define MEMPERS_VERSION 1
+
+#define MEMPERS_BUDDY 1
+#define MEMPERS_FFIT  2
+
+#define MEMPERS_OPEN   1
+#define MEMPERS_CLOSED 2
+
+/* ------------------------------------------------------------------------
+ * Header
+ * ------------------------------------------------------------------------
+ */
+typedef struct {
+  char      magic[8]; // MEMPERS_MAGIC
+  uint32_t   version; // MEMPERS_VERSION
+  uint8_t       kind; // buddy or ffit
+  uint8_t       bits; // bits of an offset (MEMOFF_BITS)
+  uint8_t      flags; // compilation variant (e.g. bytemap)
+  uint8_t      state; // open or closed
+  uint64_t      size; // size of the region
+  uint64_t     dsize; // size of the snapshot
+  uint64_t      base; // address of the region when detached
+  uint64_t      root; // offset of the root block or 0
+  uint64_t       sum; // checksum
+} mempers_hdr_t;
+
+/* ------------------------------------------------------------------------
+ * Space for the header and the snapshot of a descriptor of dsize bytes
+ * ------------------------------------------------------------------------
+ */
+static inline size_t mempers_size(size_t dsize) {
+	return (sizeof(mempers_hdr_t) + dsize + 4095) & ~(size_t)4095;
+}
+
+/* ------------------------------------------------------------------------
+ * The snapshot follows the header
+ * ------------------------------------------------------------------------
+ */
+static inline void *mempers_snapshot(mempers_hdr_t *p) {
+	return (void*)((uintptr_t)p + sizeof(mempers_hdr_t));
+}
+
+/* ------------------------------------------------------------------------
+ * Checksum (mixing 8 bytes at a time, the rest byte by byte)
+ * ------------------------------------------------------------------------
+ */
+static inline uint64_t mempers_sum(uint64_t s, const void *p, size_t n) {
+	const uint8_t *b = p;
+	uint64_t w;
+	for(; n >= 8; n -= 8, b += 8) {
+		memcpy(&w, b, 8);
+		s = (s ^ w) * 0x100000001b3ULL;
+		s ^= s >> 29;
+	}
+	for(; n > 0; n--, b++) s = (s ^ *b) * 0x100000001b3ULL;
+	return s;
+}
+
+/* ------------------------------------------------------------------------
+ * Check the header of the region p of a heap of the given kind
+ * (all but the checksum); size is the size of the region or 0
+ * ------------------------------------------------------------------------
+ */
+static inline int mempers_valid(mempers_hdr_t *p, uint8_t kind,
+                                uint8_t bits, uint8_t flags,
+                                size_t size, size_t dsize)
+{
+	return (memcmp(p->magic, MEMPERS_MAGIC, 8) == 0 &&
+	        p->version == MEMPERS_VERSION &&
+	        p->kind == kind && p->bits == bits && p->flags == flags &&
+	        p->state == MEMPERS_CLOSED && p->dsize == dsize &&
+	        (size == 0 || p->size == size) &&
+	        p->size > mempers_size(dsize));
+}
+
+/* ------------------------------------------------------------------------
+ * Write a new header
+ * ------------------------------------------------------------------------
+ */
+static inline void mempers_format(mempers_hdr_t *p, uint8_t kind,
+                                  uint8_t bits, uint8_t flags,
+                                  size_t size, size_t dsize)
+{
+	memset(p, 0, sizeof(mempers_hdr_t));
+	memcpy(p->magic, MEMPERS_MAGIC, 8);
+	p->version = MEMPERS_VERSION;
+	p->kind  = kind;
+	p->bits  = bits;
+	p->flags = flags;
+	p->state = MEMPERS_OPEN;
+	p->size  = size;
+	p->dsize = dsize;
+	p->base  = (uint64_t)(uintptr_t)p;
+}
+#endif
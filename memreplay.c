@@ -0,0 +1,383 @@
+/* -----------------------------------------------------------------------
+ * Trace Replay
+ * ------------
+ *
+ * (c) Tobias Schoofs, 2010 -- 2020
+ *     This code is in the Public Domain.
+ *
+ * Plays a trace recorded with memtrace (see memtrace.h)
+ * against a buddy, ebuddy or ffit heap in one thread.
+ * The records are sorted by time first. Addresses in the trace
+ * are mapped to the blocks of the replay by a hash table.
+ *
+ * Usage: memreplay trace [buddy|ebuddy|ffit [heap size in MiB]]
+ *
+ * Reports the time spent in the heap, the peak of memory
+ * in use (granted) and requested, and the points where
+ * the heap failed (the first ones with their position in the trace).
+ * Requests that failed in the recorded run are not replayed.
+ * -----------------------------------------------------------------------
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include <buddy.h>
+#include <ffit.h>
+#include <memtrace.h>
+
+#define DEFSIZE 256
+#define MAXFAILS 10
+
+/* ------------------------------------------------------------------------
+ * Heaps
+ * ------------------------------------------------------------------------
+ */
+#define BUDDY  0
+#define EBUDDY 1
+#define FFIT   2
+
+static int a = EBUDDY;
+static buddy_heap_t bh;
+static ffit_heap_t  fh;
+
+static int heapinit(size_t hs) {
+	void *m = mmap(NULL, hs, PROT_READ | PROT_WRITE,
+	               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (m == MAP_FAILED) return -1;
+	if (a == FFIT) {
+		fh.mh = (uintptr_t)m;
+		fh.hs = hs;
+		fh.lck.t = MEMLOCK_NONE;
+		return ffit_init(&fh);
+	}
+	bh.mh = (uintptr_t)m;
+	bh.hs = hs;
+	bh.e  = a == EBUDDY;
+	bh.lck.t = MEMLOCK_NONE;
+	return buddy_init(&bh);
+}
+
+static inline void *getblock(size_t sz) {
+	if (a == FFIT) return ffit_get_block(&fh, sz);
+	return buddy_get_block(&bh, sz);
+}
+
+static inline void *alignblock(size_t align, size_t sz) {
+	if (a == FFIT) return ffit_get_aligned_block(&fh, align, sz);
+	return buddy_get_aligned_block(&bh, align, sz);
+}
+
+static inline void freeblock(void *ptr) {
+	if (a == FFIT) ffit_free_block(&fh, ptr);
+	else buddy_free_block(&bh, ptr);
+}
+
+static inline void *exblock(void *ptr, size_t sz) {
+	int rc;
+	if (a == FFIT) return ffit_extend_block(&fh, ptr, sz, &rc);
+	return buddy_extend_block(&bh, ptr, sz, &rc);
+}
+
+static inline size_t used() {
+	if (a == FFIT) return fh.st.usd;
+	return bh.st.usd + (bh.e ? bh.ffh.st.usd : 0);
+}
+
+/* ------------------------------------------------------------------------
+ * Hash table: trace address -> block and size requested
+ * (linear probing, deletion by backward shift)
+ * ------------------------------------------------------------------------
+ */
+typedef struct {
+	uint64_t key;
+	void    *ptr;
+	size_t    sz;
+} slot_t;
+
+static slot_t *tab = NULL;
+static size_t  cap = 0;
+static size_t  cnt = 0;
+
+static inline size_t hash(uint64_t k) {
+	return (size_t)((k * 0x9e3779b97f4a7c15ULL) >> 17) & (cap - 1);
+}
+
+static slot_t *lookup(uint64_t k) {
+	for(size_t i=hash(k);; i=(i+1)&(cap-1)) {
+		if (tab[i].key == k) return &tab[i];
+		if (tab[i].key == 0) return NULL;
+	}
+}
+
+static int grow();
+
+static int insert(uint64_t k, void *ptr, size_t sz) {
+	if (2*(cnt+1) > cap && grow() != 0) return -1;
+	size_t i = hash(k);
+	while(tab[i].key != 0 && tab[i].key != k) i = (i+1)&(cap-1);
+	if (tab[i].key == 0) cnt++;
+	tab[i].key = k; tab[i].ptr = ptr; tab[i].sz = sz;
+	return 0;
+}
+
+static int grow() {
+	slot_t *o = tab;
+	size_t  n = cap;
+	cap = cap == 0 ? 4096 : 2*cap;
+	tab = calloc(cap, sizeof(slot_t));
+	if (tab == NULL) return -1;
+	cnt = 0;
+	for(size_t i=0; i<n; i++) {
+		if (o[i].key != 0) insert(o[i].key, o[i].ptr, o[i].sz);
+	}
+	free(o);
+	return 0;
+}
+
+static void erase(slot_t *s) {
+	size_t i = (size_t)(s - tab);
+	size_t j = i;
+	tab[i].key = 0; cnt--;
+	for(;;) {
+		j = (j+1)&(cap-1);
+		if (tab[j].key == 0) break;
+		size_t h = hash(tab[j].key);
+		// move j to i, if its home is not in (i, j]
+		if ((j > i && (h <= i || h > j)) ||
+		    (j < i && (h <= i && h > j))) {
+			tab[i] = tab[j]; tab[j].key = 0; i = j;
+		}
+	}
+}
+
+/* ------------------------------------------------------------------------
+ * Read the trace
+ * ------------------------------------------------------------------------
+ */
+static memtrace_rec_t *readtrace(const char *path, size_t *n) {
+	memtrace_hdr_t hdr;
+	memtrace_rec_t *recs = NULL;
+	size_t k = 0, m = 0;
+
+	FILE *f = fopen(path, "rb");
+	if (f == NULL) {
+		fprintf(stderr, "cannot open %s\n", path); return NULL;
+	}
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    memcmp(hdr.magic, MEMTRACE_MAGIC, 8) != 0 ||
+	    hdr.version != MEMTRACE_VERSION ||
+	    hdr.recsize != sizeof(memtrace_rec_t))
+	{
+		fprintf(stderr, "%s is not a trace\n", path);
+		fclose(f); return NULL;
+	}
+	for(;;) {
+		if (k == m) {
+			m = m == 0 ? 65536 : 2*m;
+			memtrace_rec_t *r = realloc(recs, m*sizeof(memtrace_rec_t));
+			if (r == NULL) {
+				free(recs); fclose(f); return NULL;
+			}
+			recs = r;
+		}
+		size_t x = fread(recs+k, sizeof(memtrace_rec_t), m-k, f);
+		k += x;
+		if (k < m) break;
+	}
+	fclose(f);
+	*n = k;
+	return recs;
+}
+
+/* ------------------------------------------------------------------------
+ * Sort by time (stable, merge sort)
+ * ------------------------------------------------------------------------
+ */
+static int sorttrace(memtrace_rec_t *recs, size_t n) {
+	memtrace_rec_t *tmp = malloc(n*sizeof(memtrace_rec_t) + 1);
+	if (tmp == NULL) return -1;
+	memtrace_rec_t *src = recs, *dst = tmp;
+	for(size_t w=1; w<n; w*=2) {
+		for(size_t l=0; l<n; l+=2*w) {
+			size_t m = l+w < n ? l+w : n;
+			size_t r = l+2*w < n ? l+2*w : n;
+			size_t i = l, j = m, k = l;
+			while(i < m && j < r) {
+				if (src[j].ts < src[i].ts) dst[k++] = src[j++];
+				else dst[k++] = src[i++];
+			}
+			while(i < m) dst[k++] = src[i++];
+			while(j < r) dst[k++] = src[j++];
+		}
+		memtrace_rec_t *t = src; src = dst; dst = t;
+	}
+	if (src != recs) memcpy(recs, src, n*sizeof(memtrace_rec_t));
+	free(tmp);
+	return 0;
+}
+
+static inline uint64_t now() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000ULL + (uint64_t)t.tv_nsec;
+}
+
+/* ------------------------------------------------------------------------
+ * Replay
+ * ------------------------------------------------------------------------
+ */
+static uint64_t ops = 0, fails = 0, skipped = 0, unknown = 0;
+static uint64_t elapsed = 0;
+static size_t   peak = 0, live = 0, peaklive = 0;
+
+static void failed(size_t i, memtrace_rec_t *r) {
+	if (fails++ < MAXFAILS) {
+		fprintf(stdout, "failure %llu: record %zu, %s of %llu bytes, "
+		                "%zu bytes in use, %zu requested\n",
+		        (unsigned long long)fails, i,
+		        r->op == MEMTRACE_EXTEND ? "extend" : "get",
+		        (unsigned long long)r->sz, used(), live);
+	}
+}
+
+static void account() {
+	size_t u = used();
+	if (u > peak) peak = u;
+	if (live > peaklive) peaklive = live;
+}
+
+static int replay(memtrace_rec_t *recs, size_t n) {
+	for(size_t i=0; i<n; i++) {
+		memtrace_rec_t *r = recs+i;
+		slot_t *s;
+		void *p;
+		uint64_t t0, t1;
+
+		switch(r->op) {
+		case MEMTRACE_GET:
+		case MEMTRACE_ALIGNED:
+			if (r->ptr == 0) {
+				skipped++; break;
+			}
+			t0 = now();
+			p = r->op == MEMTRACE_GET ? getblock((size_t)r->sz) :
+			            alignblock((size_t)r->old, (size_t)r->sz);
+			t1 = now();
+			ops++; elapsed += t1 - t0;
+			if (p == NULL) {
+				failed(i, r); break;
+			}
+			if (insert(r->ptr, p, (size_t)r->sz) != 0) return -1;
+			live += (size_t)r->sz;
+			break;
+
+		case MEMTRACE_FREE:
+			s = r->ptr == 0 ? NULL : lookup(r->ptr);
+			if (s == NULL) {
+				unknown++; break;
+			}
+			t0 = now();
+			freeblock(s->ptr);
+			t1 = now();
+			ops++; elapsed += t1 - t0;
+			live -= s->sz;
+			erase(s);
+			break;
+
+		case MEMTRACE_EXTEND:
+			s = r->old == 0 ? NULL : lookup(r->old);
+			if (r->old != 0 && s == NULL) {
+				unknown++; break;
+			}
+			if (r->sz == 0) {
+				// realloc to zero: free
+				if (s != NULL) {
+					t0 = now();
+					freeblock(s->ptr);
+					t1 = now();
+					ops++; elapsed += t1 - t0;
+					live -= s->sz;
+					erase(s);
+				}
+				break;
+			}
+			if (r->ptr == 0) {
+				skipped++; break;
+			}
+			t0 = now();
+			p = exblock(s == NULL ? NULL : s->ptr, (size_t)r->sz);
+			t1 = now();
+			ops++; elapsed += t1 - t0;
+			if (p == NULL) {
+				failed(i, r); break;
+			}
+			if (s != NULL) {
+				live -= s->sz; erase(s);
+			}
+			if (insert(r->ptr, p, (size_t)r->sz) != 0) return -1;
+			live += (size_t)r->sz;
+			break;
+
+		default:
+			unknown++;
+		}
+		account();
+	}
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	size_t n = 0;
+	size_t hs = (size_t)DEFSIZE << 20;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s trace [buddy|ebuddy|ffit [MiB]]\n",
+		                                                   argv[0]);
+		return -1;
+	}
+	if (argc > 2) {
+		if (strcmp(argv[2], "buddy") == 0) a = BUDDY;
+		else if (strcmp(argv[2], "ebuddy") == 0) a = EBUDDY;
+		else if (strcmp(argv[2], "ffit") == 0) a = FFIT;
+		else {
+			fprintf(stderr, "unknown heap: %s\n", argv[2]);
+			return -1;
+		}
+	}
+	if (argc > 3) hs = (size_t)atol(argv[3]) << 20;
+
+	memtrace_rec_t *recs = readtrace(argv[1], &n);
+	if (recs == NULL) return -1;
+	if (sorttrace(recs, n) != 0 || grow() != 0) {
+		fprintf(stderr, "out of memory\n");
+		return -1;
+	}
+	if (heapinit(hs) != 0) {
+		fprintf(stderr, "cannot init heap of %zu bytes\n", hs);
+		return -1;
+	}
+	if (replay(recs, n) != 0) {
+		fprintf(stderr, "out of memory\n");
+		return -1;
+	}
+	printf("records : %zu\n", n);
+	printf("ops     : %llu\n", (unsigned long long)ops);
+	printf("time    : %llu ns (%.1f ns/op)\n",
+	       (unsigned long long)elapsed,
+	       ops == 0 ? 0.0 : (double)elapsed / (double)ops);
+	printf("peak    : %zu bytes in use (%zu%% of the heap)\n",
+	       peak, (peak * 100) / hs);
+	printf("request : %zu bytes at most\n", peaklive);
+	printf("failures: %llu\n", (unsigned long long)fails);
+	printf("skipped : %llu (failed in the trace)\n",
+	                                (unsigned long long)skipped);
+	printf("unknown : %llu (blocks not in the trace)\n",
+	                                (unsigned long long)unknown);
+	free(recs);
+	return 0;
+}
@@ -0,0 +1,419 @@
+/* -----------------------------------------------------------------------
+ * Growable Heaps
+ * --------------
+ *
+ *  (c) Tobias Schoofs, 2010 -- 2020
+ *      This code is in the Public Domain.
+ *
+ * On initialisation, address space for max segments is reserved
+ * without access rights and without swap space. Segments are
+ * mapped into that range one after the other:
+ *
+ *     +------+---------+------+---------+-----+- - - - - - - -+
+ *     |      |         |      |         | ... |   reserved    |
+ *     +------+---------+------+---------+-----+- - - - - - - -+
+ *     ^      ^         ^      ^               ^
+ *     |      |         |      |               |
+ *     |      heap 0    |      heap 1          segment n
+ *     |                |
+ *     descriptor 0     descriptor 1
+ *
+ * Since all segments have the same size, the segment a block
+ * belongs to is found by dividing the distance of the block
+ * from the first segment by the segment size (as in memman.c).
+ *
+ * Segments are only added, never removed; the number of segments
+ * is published after the new segment is initialised, so that
+ * get and free read it without taking the lock.
+ * The lock serialises growing and the list of huge blocks.
+ *
+ * Huge blocks start with a header linking them into a doubly
+ * linked list; a pointer is accepted as huge block only
+ * if it is found in that list.
+ * -----------------------------------------------------------------------
+ */
+#define _GNU_SOURCE
+#include <memseg.h>
+#include <string.h>
+#include <stdio.h>
+#include <sys/mman.h>
+
+/* ------------------------------------------------------------------------
+ * Some shortcuts
+ * ------------------------------------------------------------------------
+ */
+#define OK       MEMSEG_HEAP_OK
+#define NOTFOUND MEMSEG_HEAP_NOTFOUND
+#define INTERNAL MEMSEG_HEAP_INTERNAL
+
+/* ------------------------------------------------------------------------
+ * Segments and huge blocks are aligned to PAGESIZE
+ * ------------------------------------------------------------------------
+ */
+#define PAGESIZE 4096
+
+/* ------------------------------------------------------------------------
+ * Huge block header
+ * ------------------------------------------------------------------------
+ */
+typedef struct huge_s {
+	struct huge_s *nxt; // next huge block
+	struct huge_s *prv; // previous huge block
+	size_t         len; // size of the mapping
+	size_t         pad; // keeps the block 16-byte aligned
+} huge_t;
+
+#define HUGEHDR sizeof(huge_t)
+
+/* ------------------------------------------------------------------------
+ * Round up to the next multiple of a power of two
+ * ------------------------------------------------------------------------
+ */
+static inline uintptr_t alignup(uintptr_t n, uintptr_t a) {
+	return ((n + a - 1) & ~(a - 1));
+}
+
+/* ------------------------------------------------------------------------
+ * The descriptor of segment i
+ * ------------------------------------------------------------------------
+ */
+static inline buddy_heap_t *segment(memseg_heap_t *m, uint16_t i) {
+	return (buddy_heap_t*)(m->sh + i * m->ss);
+}
+
+/* ------------------------------------------------------------------------
+ * Segments in use
+ * ------------------------------------------------------------------------
+ */
+static inline uint16_t segments(memseg_heap_t *m) {
+	return __atomic_load_n(&m->n, __ATOMIC_ACQUIRE);
+}
+
+/* ------------------------------------------------------------------------
+ * Find the segment the pointer belongs to (or -1)
+ * ------------------------------------------------------------------------
+ */
+static inline int ownerseg(memseg_heap_t *m, void *ptr) {
+	uintptr_t p = (uintptr_t)ptr;
+	if (p < m->sh || p >= m->sh + segments(m) * m->ss) return -1;
+	return (int)((p - m->sh) / m->ss);
+}
+
+/* ------------------------------------------------------------------------
+ * Map and initialise the next segment (lock held)
+ * ------------------------------------------------------------------------
+ */
+static int addsegment(memseg_heap_t *m) {
+	if (m->n >= m->max) return -1;
+
+	void *s = mmap((void*)(m->sh + m->n * m->ss), m->ss,
+	               PROT_READ | PROT_WRITE,
+	               MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+	if (s == MAP_FAILED) return -1;
+
+	buddy_heap_t *h = (buddy_heap_t*)s;
+	uintptr_t a = alignup((uintptr_t)s + sizeof(buddy_heap_t), PAGESIZE);
+
+	h->mh = a;
+	h->hs = (uintptr_t)s + m->ss - a;
+	h->e  = 0;
+	h->rt = m->rt;
+	h->lck.t = m->lt;
+	if (buddy_init(h) != 0) return -1;
+
+	__atomic_store_n(&m->n, m->n + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* ------------------------------------------------------------------------
+ * Huge list operations (lock held)
+ * ------------------------------------------------------------------------
+ */
+static inline void hugeinsert(memseg_heap_t *m, huge_t *b) {
+	b->prv = NULL;
+	b->nxt = m->hl;
+	if (b->nxt != NULL) b->nxt->prv = b;
+	m->hl = b;
+}
+
+static inline void hugeremove(memseg_heap_t *m, huge_t *b) {
+	if (b->prv != NULL) b->prv->nxt = b->nxt;
+	else m->hl = b->nxt;
+	if (b->nxt != NULL) b->nxt->prv = b->prv;
+}
+
+static inline huge_t *hugefind(memseg_heap_t *m, void *ptr) {
+	for(huge_t *b = m->hl; b != NULL; b = b->nxt) {
+		if ((char*)b + HUGEHDR == ptr) return b;
+	}
+	return NULL;
+}
+
+/* ------------------------------------------------------------------------
+ * Huge block statistics (lock held)
+ * ------------------------------------------------------------------------
+ */
+static inline void hugeused(memseg_heap_t *m, size_t len) {
+	m->hst.mem += len;
+	m->hst.usd += len;
+	m->hst.blks++;
+	if (m->hst.usd > m->hst.wmark) m->hst.wmark = m->hst.usd;
+}
+
+static inline void hugefreed(memseg_heap_t *m, size_t len) {
+	m->hst.mem -= len;
+	m->hst.usd -= len;
+	m->hst.blks--;
+}
+
+/* ------------------------------------------------------------------------
+ * Map a huge block
+ * ------------------------------------------------------------------------
+ */
+static void *gethuge(memseg_heap_t *m, size_t sz) {
+	size_t len = alignup(sz + HUGEHDR, PAGESIZE);
+	if (len < sz) return NULL;
+
+	huge_t *b = mmap(NULL, len, PROT_READ | PROT_WRITE,
+	                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (b == MAP_FAILED) return NULL;
+
+	b->len = len;
+
+	memlock_acquire(&m->lck);
+	hugeinsert(m, b);
+	hugeused(m, len);
+	m->hst.rqst += sz;
+	m->hst.grnt += len - HUGEHDR;
+	memlock_release(&m->lck);
+
+	return ((char*)b + HUGEHDR);
+}
+
+/* ------------------------------------------------------------------------
+ * Unmap a huge block
+ * ------------------------------------------------------------------------
+ */
+static int freehuge(memseg_heap_t *m, void *ptr) {
+	memlock_acquire(&m->lck);
+	huge_t *b = hugefind(m, ptr);
+	if (b != NULL) {
+		hugeremove(m, b);
+		hugefreed(m, b->len);
+	}
+	memlock_release(&m->lck);
+
+	if (b == NULL) return NOTFOUND;
+	return (munmap(b, b->len) == 0 ? OK : INTERNAL);
+}
+
+/* ------------------------------------------------------------------------
+ * Remap a huge block;
+ * the block is unlinked while being moved, since its neighbours
+ * point to the old address
+ * ------------------------------------------------------------------------
+ */
+static void *extendhuge(memseg_heap_t *m, void *ptr, size_t sz, int *rc) {
+	size_t len = alignup(sz + HUGEHDR, PAGESIZE);
+	void *ret = NULL;
+
+	memlock_acquire(&m->lck);
+	huge_t *b = hugefind(m, ptr);
+	if (b == NULL) *rc = NOTFOUND;
+	else if (len >= sz) {
+		size_t old = b->len;
+		hugeremove(m, b);
+		huge_t *n = mremap(b, old, len, MREMAP_MAYMOVE);
+		if (n == MAP_FAILED) n = b; else {
+			n->len = len;
+			hugefreed(m, old);
+			hugeused(m, len);
+			m->hst.rqst += sz;
+			m->hst.grnt += len - HUGEHDR;
+			ret = (char*)n + HUGEHDR;
+		}
+		hugeinsert(m, n);
+	}
+	memlock_release(&m->lck);
+	return ret;
+}
+
+/* ------------------------------------------------------------------------
+ * Init:
+ * - reserve the address space
+ * - map the first segment
+ * - compute the huge threshold
+ * ------------------------------------------------------------------------
+ */
+int memseg_init(memseg_heap_t *m) {
+	if (m->ss == 0) return -1;
+	if (m->max == 0) m->max = MEMSEG_MAX;
+
+	m->ss = alignup(m->ss, PAGESIZE);
+	if (m->ss < 2 * PAGESIZE) return -1;
+
+	m->n  = 0;
+	m->hl = NULL;
+	memset(&m->hst, 0, sizeof(buddy_stats_t));
+
+	m->lck.t = m->lt;
+	if (memlock_init(&m->lck) != 0) return -1;
+
+	void *r = mmap(NULL, m->max * m->ss, PROT_NONE,
+	               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (r == MAP_FAILED) return -1;
+	m->sh = (uintptr_t)r;
+
+	if (addsegment(m) != 0) {
+		munmap(r, m->max * m->ss);
+		return -1;
+	}
+
+	size_t top = (size_t)1 << segment(m, 0)->AMAX;
+	if (m->hg == 0) m->hg = m->ss / 8;
+	if (m->hg > top) m->hg = top;
+	return OK;
+}
+
+/* ------------------------------------------------------------------------
+ * destroy
+ * ------------------------------------------------------------------------
+ */
+void memseg_destroy(memseg_heap_t *m) {
+	memlock_acquire(&m->lck);
+	while (m->hl != NULL) {
+		huge_t *b = m->hl;
+		hugeremove(m, b);
+		hugefreed(m, b->len);
+		munmap(b, b->len);
+	}
+	munmap((void*)m->sh, m->max * m->ss);
+	m->n = 0;
+	memlock_release(&m->lck);
+}
+
+/* ------------------------------------------------------------------------
+ * malloc:
+ * - huge requests get their own mapping
+ * - try the segments from the most recent one backwards
+ * - take the lock, try the segments added in the meantime
+ *   and, if none of them can serve the request, add a segment
+ * ------------------------------------------------------------------------
+ */
+void *memseg_get_block(memseg_heap_t *m, size_t sz) {
+	if (sz > m->hg) return gethuge(m, sz);
+
+	void *ret = NULL;
+	uint16_t n = segments(m);
+	for(uint16_t i=n; i>0 && ret == NULL; i--) {
+		ret = buddy_get_block(segment(m, i-1), sz);
+	}
+	if (ret != NULL) return ret;
+
+	memlock_acquire(&m->lck);
+	for(uint16_t i=n; i<m->n && ret == NULL; i++) {
+		ret = buddy_get_block(segment(m, i), sz);
+	}
+	if (ret == NULL && addsegment(m) == 0) {
+		ret = buddy_get_block(segment(m, m->n-1), sz);
+	}
+	memlock_release(&m->lck);
+	return ret;
+}
+
+/* ------------------------------------------------------------------------
+ * free
+ * ------------------------------------------------------------------------
+ */
+int memseg_free_block(memseg_heap_t *m, void *ptr) {
+	int i = ownerseg(m, ptr);
+	if (i < 0) return freehuge(m, ptr);
+	return buddy_free_block(segment(m, i), ptr);
+}
+
+/* ------------------------------------------------------------------------
+ * Move a block of segment h to a block of size sz
+ * from another segment, a new segment or a mapping of its own
+ * ------------------------------------------------------------------------
+ */
+static void *moveblock(memseg_heap_t *m, buddy_heap_t *h,
+                       void *ptr, size_t sz, int *rc) {
+	size_t old = buddy_usable_size(h, ptr);
+	if (old == 0) return NULL;
+
+	void *ret = memseg_get_block(m, sz);
+	if (ret == NULL) return NULL;
+
+	memcpy(ret, ptr, old < sz ? old : sz);
+	*rc = buddy_free_block(h, ptr);
+	return ret;
+}
+
+/* ------------------------------------------------------------------------
+ * realloc:
+ * - blocks growing beyond the huge threshold leave their segment
+ * - blocks that cannot grow in their segment are moved
+ * ------------------------------------------------------------------------
+ */
+void *memseg_extend_block(memseg_heap_t *m,
+           void *ptr, size_t sz, int *rc) {
+	*rc = OK;
+	if (ptr == NULL) return memseg_get_block(m, sz);
+	int i = ownerseg(m, ptr);
+	if (i >= 0) {
+		buddy_heap_t *h = segment(m, i);
+		if (sz == 0) return buddy_extend_block(h, ptr, sz, rc);
+		if (sz <= m->hg) {
+			void *ret = buddy_extend_block(h, ptr, sz, rc);
+			if (ret != NULL || *rc != OK) return ret;
+		}
+		return moveblock(m, h, ptr, sz, rc);
+	}
+	if (sz == 0) {
+		*rc = freehuge(m, ptr);
+		return NULL;
+	}
+	return extendhuge(m, ptr, sz, rc);
+}
+
+/* ------------------------------------------------------------------------
+ * print (debug)
+ * ------------------------------------------------------------------------
+ */
+void memseg_print_heap(memseg_heap_t *m) {
+	uint16_t n = segments(m);
+	for(uint16_t i=0; i<n; i++) {
+		printf("### SEGMENT %03u ##############\n", i);
+		buddy_print_heap(segment(m, i));
+	}
+	printf("### HUGE ###################\n");
+	memlock_acquire(&m->lck);
+	for(huge_t *b = m->hl; b != NULL; b = b->nxt) {
+		printf("\033[31m%zu\033[0m|", b->len);
+	}
+	printf("\nTotal    : %09zu\n", m->hst.mem);
+	memlock_release(&m->lck);
+}
+
+/* ------------------------------------------------------------------------
+ * stats
+ * ------------------------------------------------------------------------
+ */
+void memseg_get_counters(memseg_heap_t *m, buddy_stats_t *st,
+                                           buddy_stats_t *hst)
+{
+	memset(st, 0, sizeof(buddy_stats_t));
+	uint16_t n = segments(m);
+	for(uint16_t i=0; i<n; i++) {
+		buddy_stats_t s;
+		buddy_get_counters(segment(m, i), &s);
+		st->mem += s.mem; st->usd += s.usd; st->fre += s.fre;
+		st->wmark += s.wmark; st->blks += s.blks;
+		st->rqst += s.rqst; st->grnt += s.grnt;
+	}
+	if (hst != NULL) {
+		memlock_acquire(&m->lck);
+		memcpy(hst, &m->hst, sizeof(buddy_stats_t));
+		memlock_release(&m->lck);
+	}
+}
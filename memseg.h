@@ -0,0 +1,131 @@
+/* -----------------------------------------------------------------------
+ * Growable Heaps
+ * --------------
+ *
+ *  (c) Tobias Schoofs, 2010 -- 2020
+ *      This code is in the Public Domain.
+ *
+ * A front end that obtains its memory from the OS instead of
+ * a region passed in by the user. The heap consists of segments,
+ * buddy heaps of the same size that are mapped one after the other
+ * into an address range reserved on initialisation.
+ * The first segment is mapped on initialisation; another one is
+ * mapped whenever none of the existing segments can serve a request.
+ * Requests greater than the huge threshold bypass the segments
+ * and get a mapping of their own, which is unmapped on free.
+ * Available blocks in the segments of rt bytes or more
+ * return their pages to the OS (see buddy_init), so that
+ * the resident set shrinks again after a peak.
+ * Segments themselves are never unmapped.
+ * -----------------------------------------------------------------------
+ */
+#ifndef __MEMSEG_H__
+#define __MEMSEG_H__
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <buddy.h>
+#include <memlock.h>
+
+#define MEMSEG_HEAP_OK       0x0
+#define MEMSEG_HEAP_NOTFOUND 0x4
+#define MEMSEG_HEAP_INTERNAL -1
+
+/* ------------------------------------------------------------------------
+ * Default number of segments
+ * ------------------------------------------------------------------------
+ */
+#define MEMSEG_MAX 64
+
+/* ------------------------------------------------------------------------
+ * Segmented Heap Structure
+ * ------------------------------------------------------------------------
+ */
+typedef struct {
+  size_t          ss; // segment size             (set by user)
+  uint16_t       max; // max number of segments   (set by user)
+                      // or 0 for MEMSEG_MAX
+  size_t          hg; // huge threshold           (set by user)
+                      // or 0 for the default
+  size_t          rt; // release threshold of     (set by user)
+                      // the segments (see buddy_heap_t)
+  uint8_t         lt; // lock type                (set by user)
+  memlock_t      lck; // lock for growing and     (computed internally)
+                      // for huge blocks
+  uintptr_t       sh; // first segment            (computed internally)
+  uint16_t         n; // segments in use          (computed internally)
+  void           *hl; // list of huge blocks      (computed internally)
+  buddy_stats_t  hst; // huge block statistics    (computed internally)
+} memseg_heap_t;
+
+/* ------------------------------------------------------------------------
+ * Initialisation
+ * Reserves address space for max segments of size ss,
+ * maps the first segment and initialises its buddy heap.
+ * The segment size is rounded up to a multiple of the page size;
+ * each segment starts with its heap descriptor and the heap
+ * takes the remainder from the next page on.
+ * Without huge threshold, requests greater than one eighth
+ * of the segment size are huge; the threshold is limited to
+ * the largest block of a segment.
+ * All locks are of type lt (see memlock.h).
+ * Returns 0 on success and -1 on error.
+ * ------------------------------------------------------------------------
+ */
+int memseg_init(memseg_heap_t *m);
+
+/* ------------------------------------------------------------------------
+ * Unmap all segments and huge blocks.
+ * All blocks are invalid afterwards.
+ * ------------------------------------------------------------------------
+ */
+void memseg_destroy(memseg_heap_t *m);
+
+/* ------------------------------------------------------------------------
+ * Get a block of size sz
+ * from the most recent segment able to serve it,
+ * from a new segment or, if sz is huge, from a mapping of its own.
+ * Returns a pointer on success and NULL on failure
+ * ------------------------------------------------------------------------
+ */
+void *memseg_get_block(memseg_heap_t *m, size_t sz);
+
+/* ------------------------------------------------------------------------
+ * Free the block indicated by ptr.
+ * Blocks in segments are freed in their segment,
+ * huge blocks are unmapped.
+ * Returns 0 on success -1 or 4 on error
+ * (see buddy_free_block).
+ * ------------------------------------------------------------------------
+ */
+int memseg_free_block(memseg_heap_t *m, void *ptr);
+
+/* ------------------------------------------------------------------------
+ * Extend the block indicated by ptr to size sz.
+ * Blocks in segments are extended in their segment
+ * (see buddy_extend_block). If sz exceeds the huge threshold
+ * or the segment cannot serve it, the block is moved
+ * to a block obtained as with memseg_get_block
+ * (another segment, a new segment or a mapping of its own);
+ * the data are copied and the old block is freed in its segment.
+ * Huge blocks are remapped.
+ * ------------------------------------------------------------------------
+ */
+void *memseg_extend_block(memseg_heap_t *m,
+           void *ptr, size_t sz, int *rc);
+
+/* ------------------------------------------------------------------------
+ * Print all segments to stdout
+ * ------------------------------------------------------------------------
+ */
+void memseg_print_heap(memseg_heap_t *m);
+
+/* ------------------------------------------------------------------------
+ * Retrieve the counters summed up over all segments in st
+ * and those of the huge blocks in hst (if not NULL).
+ * The watermark in st is the sum of the segments' watermarks.
+ * ------------------------------------------------------------------------
+ */
+void memseg_get_counters(memseg_heap_t *m, buddy_stats_t *st,
+                                           buddy_stats_t *hst);
+#endif
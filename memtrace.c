@@ -0,0 +1,259 @@
+/* -----------------------------------------------------------------------
+ * Allocation Traces
+ * -----------------
+ *
+ *  (c) Tobias Schoofs, 2010 -- 2020
+ *      This code is in the Public Domain.
+ *
+ * Rings are mapped on the first record of a thread
+ * (not with malloc, since they may trace malloc itself)
+ * and pushed onto a list, which is never shrunk.
+ * When a thread exits, its ring is retired (thread-specific key)
+ * and taken over by the next new thread, so the list grows
+ * only with the number of threads alive at the same time.
+ * Each ring has one writer (the thread) and one reader
+ * (the background thread or memtrace_stop):
+ * the writer advances tail, the reader head;
+ * records not yet written when the ring is taken over
+ * keep the number of the thread that recorded them.
+ * -----------------------------------------------------------------------
+ */
+#define _GNU_SOURCE
+#include <memtrace.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+/* ------------------------------------------------------------------------
+ * Records per ring and flush interval
+ * ------------------------------------------------------------------------
+ */
+#define RINGSIZE 65536
+#define INTERVAL 1000000
+
+/* ------------------------------------------------------------------------
+ * Ring
+ * ------------------------------------------------------------------------
+ */
+typedef struct ring_s {
+	struct ring_s *nxt;
+	uint32_t thr;
+	uint8_t  ret; // retired
+	uint64_t head;
+	uint64_t tail;
+	memtrace_rec_t recs[RINGSIZE];
+} ring_t;
+
+static int       fd = -1;
+static uint8_t   on = 0;
+static uint8_t   running = 0;
+static uint64_t  start = 0;
+static uint64_t  dropped = 0;
+static uint32_t  nrings = 0;
+static ring_t   *rings = NULL;
+static pthread_t flusher;
+static pthread_key_t  key;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+static __thread ring_t  *myring = NULL;
+static __thread uint32_t depth = 0;
+static __thread uint64_t entered = 0;
+
+static inline uint64_t now() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000ULL + (uint64_t)t.tv_nsec;
+}
+
+/* ------------------------------------------------------------------------
+ * Retire the ring of an exiting thread
+ * ------------------------------------------------------------------------
+ */
+static void retire(void *ring) {
+	ring_t *r = ring;
+	if (myring == r) myring = NULL;
+	__atomic_store_n(&r->ret, 1, __ATOMIC_RELEASE);
+}
+
+static void mkkey() {
+	pthread_key_create(&key, retire);
+}
+
+/* ------------------------------------------------------------------------
+ * Take over a retired ring
+ * ------------------------------------------------------------------------
+ */
+static ring_t *reuse() {
+	for(ring_t *r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+	    r != NULL; r = r->nxt)
+	{
+		uint8_t x = 1;
+		if (__atomic_load_n(&r->ret, __ATOMIC_RELAXED) &&
+		    __atomic_compare_exchange_n(&r->ret, &x, 0, 0,
+		                 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return r;
+	}
+	return NULL;
+}
+
+/* ------------------------------------------------------------------------
+ * Get the ring of this thread, taking over a retired one
+ * or mapping a new one on first use
+ * ------------------------------------------------------------------------
+ */
+static ring_t *getring() {
+	if (myring != NULL) return myring;
+	pthread_once(&once, mkkey);
+	ring_t *r = reuse();
+	if (r == NULL) {
+		void *m = mmap(NULL, sizeof(ring_t), PROT_READ | PROT_WRITE,
+		               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (m == MAP_FAILED) return NULL;
+		r = m;
+		r->nxt = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+		while(!__atomic_compare_exchange_n(&rings, &r->nxt, r, 1,
+		                         __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	}
+	r->thr = __atomic_add_fetch(&nrings, 1, __ATOMIC_RELAXED);
+	pthread_setspecific(key, r);
+	myring = r;
+	return r;
+}
+
+/* ------------------------------------------------------------------------
+ * Append a record to the ring of this thread
+ * ------------------------------------------------------------------------
+ */
+static void push(uint8_t op, void *ptr, void *old, size_t sz, uint64_t ts) {
+	ring_t *r = getring();
+	if (r == NULL) {
+		__atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED); return;
+	}
+	uint64_t t = r->tail;
+	if (t - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) >= RINGSIZE) {
+		__atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED); return;
+	}
+	memtrace_rec_t *x = &r->recs[t%RINGSIZE];
+	x->ts  = ts - start;
+	x->ptr = (uint64_t)(uintptr_t)ptr;
+	x->old = (uint64_t)(uintptr_t)old;
+	x->sz  = (uint64_t)sz;
+	x->thr = r->thr;
+	x->op  = op;
+	__atomic_store_n(&r->tail, t+1, __ATOMIC_RELEASE);
+}
+
+/* ------------------------------------------------------------------------
+ * Write n bytes to the file
+ * ------------------------------------------------------------------------
+ */
+static int writeall(const void *buf, size_t n) {
+	const char *p = buf;
+	while(n > 0) {
+		ssize_t k = write(fd, p, n);
+		if (k <= 0) return -1;
+		p += k; n -= (size_t)k;
+	}
+	return 0;
+}
+
+/* ------------------------------------------------------------------------
+ * Write all rings to the file
+ * ------------------------------------------------------------------------
+ */
+static void flushall() {
+	for(ring_t *r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+	    r != NULL; r = r->nxt)
+	{
+		uint64_t h = r->head;
+		uint64_t t = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+		while(h < t) {
+			uint64_t e = t;
+			if (e/RINGSIZE != h/RINGSIZE) e = (h/RINGSIZE + 1)*RINGSIZE;
+			writeall(&r->recs[h%RINGSIZE], (e-h)*sizeof(memtrace_rec_t));
+			h = e;
+		}
+		__atomic_store_n(&r->head, h, __ATOMIC_RELEASE);
+	}
+}
+
+static void *flush(void *ignore) {
+	struct timespec t = {0, INTERVAL};
+	while(__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+		flushall();
+		nanosleep(&t, NULL);
+	}
+	return NULL;
+}
+
+/* ------------------------------------------------------------------------
+ * Start
+ * ------------------------------------------------------------------------
+ */
+int memtrace_start(const char *path) {
+	memtrace_hdr_t hdr;
+
+	if (fd >= 0) return MEMTRACE_INTERNAL;
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) return MEMTRACE_INTERNAL;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, MEMTRACE_MAGIC, 8);
+	hdr.version = MEMTRACE_VERSION;
+	hdr.recsize = sizeof(memtrace_rec_t);
+	if (writeall(&hdr, sizeof(hdr)) != 0) {
+		close(fd); fd = -1; return MEMTRACE_INTERNAL;
+	}
+	start = now();
+	running = 1;
+	if (pthread_create(&flusher, NULL, flush, NULL) != 0) {
+		running = 0; close(fd); fd = -1; return MEMTRACE_INTERNAL;
+	}
+	__atomic_store_n(&on, 1, __ATOMIC_RELEASE);
+	return MEMTRACE_OK;
+}
+
+/* ------------------------------------------------------------------------
+ * Stop
+ * ------------------------------------------------------------------------
+ */
+uint64_t memtrace_stop(void) {
+	if (fd < 0) return 0;
+	__atomic_store_n(&on, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+	pthread_join(flusher, NULL);
+	flushall();
+	close(fd); fd = -1;
+	return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
+
+/* ------------------------------------------------------------------------
+ * Hooks
+ * ------------------------------------------------------------------------
+ */
+void memtrace_enter(void) {
+	if (depth++ == 0 && __atomic_load_n(&on, __ATOMIC_RELAXED)) {
+		entered = now();
+	}
+}
+
+void memtrace_leave(uint8_t op, void *ptr, void *old, size_t sz) {
+	if (--depth == 0 && __atomic_load_n(&on, __ATOMIC_RELAXED) &&
+	    entered != 0)
+	{
+		push(op, ptr, old, sz, op == MEMTRACE_FREE ? entered : now());
+	}
+	if (depth == 0) entered = 0;
+}
+
+void memtrace_leaven(uint8_t op, void **ptrs, size_t n, size_t sz) {
+	if (--depth == 0 && __atomic_load_n(&on, __ATOMIC_RELAXED) &&
+	    entered != 0)
+	{
+		uint64_t ts = op == MEMTRACE_FREE ? entered : now();
+		for(size_t i=0; i<n; i++) push(op, ptrs[i], NULL, sz, ts);
+	}
+	if (depth == 0) entered = 0;
+}
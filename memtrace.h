@@ -0,0 +1,110 @@
+/* -----------------------------------------------------------------------
+ * Allocation Traces
+ * -----------------
+ *
+ *  (c) Tobias Schoofs, 2010 -- 2020
+ *      This code is in the Public Domain.
+ *
+ * Compiled with MEMMAN_TRACE, the services of buddy and ffit
+ * (get, aligned get, free, remote free, extend and their batch
+ * variants) record each call while tracing is active.
+ * Without MEMMAN_TRACE, the hooks compile to nothing.
+ *
+ * Each thread writes its records into a ring buffer of its own
+ * without locking; a background thread writes the rings to the
+ * trace file. If a ring is full, the record is dropped (and counted),
+ * the calling thread never waits for the file.
+ * Calls of the emergency heap made by the buddy system
+ * are not recorded separately.
+ *
+ * The trace file starts with a header (memtrace_hdr_t)
+ * followed by records (memtrace_rec_t) in the order they were
+ * written, which is ordered by time per thread, but not overall.
+ * Frees are stamped with the time they started,
+ * all others with the time they ended; sorted by time,
+ * a block is therefore always freed after it was obtained.
+ * memreplay plays a trace against a heap.
+ * -----------------------------------------------------------------------
+ */
+#ifndef __MEMTRACE_H__
+#define __MEMTRACE_H__
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#define MEMTRACE_OK        0x0
+#define MEMTRACE_INTERNAL  -1
+
+#define MEMTRACE_MAGIC   "MEMTRACE"
+#define MEMTRACE_VERSION 1
+
+/* ------------------------------------------------------------------------
+ * Operations
+ * ------------------------------------------------------------------------
+ */
+#define MEMTRACE_GET     1 // ptr = block or 0 on failure
+#define MEMTRACE_FREE    2 // ptr = block
+#define MEMTRACE_EXTEND  3 // ptr = new block or 0 on failure, old = block
+#define MEMTRACE_ALIGNED 4 // ptr = block or 0 on failure, old = alignment
+
+/* ------------------------------------------------------------------------
+ * Trace Header
+ * ------------------------------------------------------------------------
+ */
+typedef struct {
+  char      magic[8]; // MEMTRACE_MAGIC
+  uint32_t   version; // MEMTRACE_VERSION
+  uint32_t   recsize; // sizeof(memtrace_rec_t)
+} memtrace_hdr_t;
+
+/* ------------------------------------------------------------------------
+ * Trace Record
+ * ------------------------------------------------------------------------
+ */
+typedef struct {
+  uint64_t   ts; // nanoseconds since the trace started
+  uint64_t  ptr; // block address
+  uint64_t  old; // previous address or alignment
+  uint64_t   sz; // size requested
+  uint32_t  thr; // thread (numbered from 1)
+  uint8_t    op; // operation
+  uint8_t pad[3];
+} memtrace_rec_t;
+
+/* ------------------------------------------------------------------------
+ * Start tracing into the file at path (truncating it)
+ * and start the background thread.
+ * Returns 0 on success and -1 on error.
+ * ------------------------------------------------------------------------
+ */
+int memtrace_start(const char *path);
+
+/* ------------------------------------------------------------------------
+ * Stop tracing, write what remains in the rings and close the file.
+ * Calls in progress while stopping may not be recorded.
+ * Returns the number of records dropped because rings were full.
+ * ------------------------------------------------------------------------
+ */
+uint64_t memtrace_stop(void);
+
+/* ------------------------------------------------------------------------
+ * Hooks (used by buddy and ffit)
+ * memtrace_enter is called when a service starts and
+ * memtrace_leave (or memtrace_leaven for batches) when it ends;
+ * only the outermost service of a thread is recorded.
+ * ------------------------------------------------------------------------
+ */
+void memtrace_enter(void);
+void memtrace_leave(uint8_t op, void *ptr, void *old, size_t sz);
+void memtrace_leaven(uint8_t op, void **ptrs, size_t n, size_t sz);
+
+#ifdef MEMMAN_TRACE
+#define MEMTRACE_ENTER() memtrace_enter()
+#define MEMTRACE_LEAVE(op,p,o,s) memtrace_leave(op,p,o,s)
+#define MEMTRACE_LEAVEN(op,p,n,s) memtrace_leaven(op,p,n,s)
+#else
+#define MEMTRACE_ENTER()
+#define MEMTRACE_LEAVE(op,p,o,s)
+#define MEMTRACE_LEAVEN(op,p,n,s)
+#endif
+#endif
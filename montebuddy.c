@@ -11,7 +11,22 @@
  * In the allocation cycle memory is allocated and a random turn
  * is generated that determines the life time of this particular memory.
  * In the free cycle blocks of memory whose life time ends in this turn
- * is freed. Every 2000 iterations, the heap is printed on stdout.
+ * is freed.
+ *
+ * Slots for blocks are taken from a freelist and blocks are
+ * queued under the turn of their release, so each turn costs
+ * O(1) plus the blocks released in it, independent of the number
+ * of live blocks.
+ *
+ * Each run has its own heap and its own PRNG seeded with
+ * the seed of the simulation plus the number of the run,
+ * so that a run is reproduced by its seed alone.
+ * Runs are distributed over threads:
+ *
+ *   montebuddy [runs [threads [seed [turns [KiB ...]]]]]
+ *
+ * KiB are heap sizes; each seed is run with each heap size.
+ * With one run, the heap is printed on stdout every 2000 turns.
  *
  * Currently, only alloc and free are used;
  * realloc still needs to be added.
@@ -23,26 +38,26 @@
 #include <string.h>
 #include <time.h>
 #include <math.h>
+#include <pthread.h>
 
 #ifdef USEKFFIT
-char _fheap[1048576];
 #include <ffit.h>
-ffit_heap_t h;
+#define H 1048576
+typedef ffit_heap_t heap_t;
 
-#define heapinit() \
-	h.mh = (uintptr_t)_fheap; \
-	h.hs = 1048576; \
-	ffit_init(&h)
+static inline int heapinit(heap_t *h, void *m, size_t sz) {
+	memset(h, 0, sizeof(heap_t));
+	h->mh = (uintptr_t)m;
+	h->hs = sz;
+	return ffit_init(h);
+}
 
-#define getblock(n) ffit_get_block(&h,n)
-#define freeblock(n) ffit_free_block(&h,n)
-#define exblock(n,s,r) ffit_extend_block(&h,n,s,r)
-#define printheap() ffit_print_heap(&h)
+#define getblock(h,n) ffit_get_block(h,n)
+#define freeblock(h,n) ffit_free_block(h,n)
+#define printheap(h) ffit_print_heap(h)
 
 #else
 #include <buddy.h>
-char _bheap[2097152];
-#include <buddy.h>
 #ifdef WITH_EMERGENCY
 #define H 1048576
 #define E 1
@@ -50,252 +65,276 @@ char _bheap[2097152];
 #define H 2097152
 #define E 0
 #endif
-buddy_heap_t h;
-#define heapinit() \
-	h.mh = (uintptr_t)_bheap; \
-        h.hs = H; \
-        h.e  = E; \
-        rc = buddy_init(&h)
-#define getblock(n) buddy_get_block(&h,n)
-#define freeblock(n) buddy_free_block(&h,n)
-#define exblock(n,s,r) buddy_extend_block(&h,n,s,r)
-#define printheap() buddy_print_heap(&h)
-#endif
+typedef buddy_heap_t heap_t;
 
-// compute number of iterations
-// compute number of pointers
-// obtain statics periodically
-// remember max heap usage
-// pass in heap size
-// write script to call it n times
+static inline int heapinit(heap_t *h, void *m, size_t sz) {
+	memset(h, 0, sizeof(heap_t));
+	h->mh = (uintptr_t)m;
+	h->hs = sz;
+	h->e  = E;
+	return buddy_init(h);
+}
 
-#define MINALLOC 8
-#define ALLOCSPERCYCLE 1
-#define MAXALLOC 8192
-#define PTRS 100000
+#define getblock(h,n) buddy_get_block(h,n)
+#define freeblock(h,n) buddy_free_block(h,n)
+#define printheap(h) buddy_print_heap(h)
+#endif
 
-// pointers == iterations
+#define MAXALLOC 8192
+#define ALLOCSPERCYCLE 1
+#define MAXTHREADS 256
+#define MAXSIZES 16
 
 typedef uint32_t it_t;
 
-it_t its = 1048576 / 100;
-it_t inow=0;
+#define NOSLOT ((uint32_t)-1)
 
+/* ------------------------------------------------------------------------
+ * Slot: a block in use or, if ptr is NULL, a free slot;
+ * nxt links free slots (in the freelist)
+ * and blocks released in the same turn (in the queue)
+ * ------------------------------------------------------------------------
+ */
 typedef struct {
-	char *ptr;
-	size_t sz;
-	it_t   it;
-} pointer_t;
-
-pointer_t ps[PTRS];
+	char    *ptr;
+	size_t    sz;
+	uint32_t nxt;
+} slot_t;
 
-void *_heap;
+/* ------------------------------------------------------------------------
+ * Run
+ * ------------------------------------------------------------------------
+ */
+typedef struct {
+	uint64_t seed;
+	size_t     hs;    // heap size
+	uint64_t  rnd;    // PRNG state
+	heap_t      h;
+	slot_t    *ps;    // slots
+	uint32_t  *ev;    // queue: first block released in turn i
+	uint32_t   fs;    // freelist
+	it_t      its;    // turns
+	it_t     inow;    // current turn
+	size_t    usd;    // bytes requested by blocks in use
+	size_t   peak;    // maximum of usd
+	uint32_t allocs;
+	uint32_t frees;
+	int        rc;
+} run_t;
 
-int allocs = 0;
-int frees  = 0;
-int reallocs = 0;
-int preservd = 0;
+/* ------------------------------------------------------------------------
+ * PRNG (xorshift), the state is set by splitmix,
+ * such that close seeds give unrelated sequences
+ * ------------------------------------------------------------------------
+ */
+static inline void xseed(run_t *r, uint64_t seed) {
+	uint64_t z = seed + 0x9e3779b97f4a7c15ULL;
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	r->rnd = (z ^ (z >> 31)) | 1;
+}
 
-static inline uint32_t nextpow2(uint32_t sz) {
-	sz--;
-	sz |= sz >> 1;
-	sz |= sz >> 2;
-	sz |= sz >> 4;
-	sz |= sz >> 8;
-	sz |= sz >> 16;
-	return (sz+1);
+static inline uint32_t xrand(run_t *r) {
+	r->rnd ^= r->rnd << 13;
+	r->rnd ^= r->rnd >> 7;
+	r->rnd ^= r->rnd << 17;
+	return (uint32_t)(r->rnd >> 32);
 }
 
-int freecycle() {
-        if (inow == 0) return 0;
-	for(int i=0;i<PTRS;i++) {
-		if (ps[i].it > 0 && ps[i].it <= inow) {
-			// printf("freeing %d\n", idx);
-			int rc = freeblock(ps[i].ptr);
-			ps[i].ptr = NULL;
-			ps[i].sz  = 0;
-			ps[i].it  = 0;
-			if (rc != 0) return -1;
-			frees++;
+/* ------------------------------------------------------------------------
+ * free cycle: free the blocks queued for this turn
+ * ------------------------------------------------------------------------
+ */
+int freecycle(run_t *r) {
+	uint32_t p = r->ev[r->inow];
+	r->ev[r->inow] = NOSLOT;
+	while (p != NOSLOT) {
+		slot_t *s = r->ps+p;
+		uint32_t n = s->nxt;
+		int rc = freeblock(&r->h, s->ptr);
+		if (rc != 0) {
+			printf("cannot free %p: %d\n", (void*)s->ptr, rc);
+			return -1;
 		}
+		r->usd -= s->sz;
+		s->ptr = NULL; s->sz = 0;
+		s->nxt = r->fs; r->fs = p;
+		r->frees++;
+		p = n;
 	}
-	// printf("%d frees on %d allocs\n", frees, allocs);
 	return 0;
 }
 
-/*
-void fillRandom(char *mem, size_t size) {
-	for(size_t i=0;i<size;i++) {
-		mem[i] = (rand()%25) + 65;
-	}
-}
-*/
-
-int doalloc() {
-	int p = 0;
+/* ------------------------------------------------------------------------
+ * allocate one block and queue it for its release
+ * ------------------------------------------------------------------------
+ */
+int doalloc(run_t *r) {
 	size_t s;
-	uint16_t b = rand()%10;
+	uint16_t b = xrand(r)%10;
 	switch(b) {
-	case 0: s = rand()%MAXALLOC; break;
-	case 1: s = rand()%1024; break;
-	case 2: s = rand()%512; break;
-	case 3: s = rand()%256; break;
-	case 4: s = rand()%128; break;
-	default: s = rand()%64;
+	case 0: s = xrand(r)%MAXALLOC; break;
+	case 1: s = xrand(r)%1024; break;
+	case 2: s = xrand(r)%512; break;
+	case 3: s = xrand(r)%256; break;
+	case 4: s = xrand(r)%128; break;
+	default: s = xrand(r)%64;
 	}
 	if (s == 0) s++;
 
-	it_t t = its-inow;
+	it_t t = r->its-r->inow;
 	for(;t>0;t>>=1) {
 		it_t k = (it_t)log2((double)t);
-		if (k == 0 || (rand()%k) == 0) break;
-	}
-	t += inow;
-	if (t >= its) t=its-1;
-
-	/*
-	it_t t = 0;
-	while (t == 0) t = rand()%its;
-	*/
-
-	/*
-	if (t < inow) {
-		printf("release is in the past\n");
-	} else if (t >= its) {
-		printf("release is after doomsday\n");
+		if (k == 0 || (xrand(r)%k) == 0) break;
 	}
-	*/
+	t += r->inow;
+	if (t >= r->its) t=r->its-1;
 
-	for(;p<PTRS;p++) {
-		if (ps[p].ptr == NULL) break;
-	}
-	if (p == PTRS) {
+	uint32_t p = r->fs;
+	if (p == NOSLOT) {
 		printf("no room left\n"); return -1;
 	}
-	ps[p].ptr = getblock(s);
-	ps[p].sz  = s;
-	ps[p].it  = t;
-	// printf("address of size %04zu: %p (%u)\n", s, ps[p].ptr, (uint32_t)((uintptr_t)ps[p].ptr - (uintptr_t)_heap));
-	if (ps[p].ptr == NULL) {
-		size_t allocd = s;
-		for(int z=0; z<p; z++) {
-			allocd += ps[z].sz;
-		}
-		printf("out of memory: %zu\n", allocd);
+	slot_t *x = r->ps+p;
+	x->ptr = getblock(&r->h, s);
+	if (x->ptr == NULL) {
+		printf("out of memory: %zu\n", r->usd + s);
 		return -1;
 	}
-	// fillRandom(ps[p].ptr, ps[p].sz);
-	allocs++;
+	r->fs = x->nxt;
+	x->sz  = s;
+	x->nxt = r->ev[t]; r->ev[t] = p;
+	r->usd += s;
+	if (r->usd > r->peak) r->peak = r->usd;
+	r->allocs++;
 	return 0;
 }
 
-int allocationcycle() {
-	/*
-	int c = rand()%ALLOCSPERCYCLE;
-	if (c == 0) c++;
-	*/
-	int c = ALLOCSPERCYCLE;
-
-	for(int i=0; i<c; i++) {
-		if (doalloc() != 0) return -1;
+int allocationcycle(run_t *r) {
+	for(int i=0; i<ALLOCSPERCYCLE; i++) {
+		if (doalloc(r) != 0) return -1;
 	}
 	return 0;
 }
 
-/*
-
-// reallocation cycle
-int myreallocate() {
-	int p=0;
-	for(;p<PTRS;p++) {
-		if (ps[p].ptr == NULL) break;
+/* ------------------------------------------------------------------------
+ * one run: a private heap, slots for all blocks allocated
+ * and a queue entry for each turn
+ * ------------------------------------------------------------------------
+ */
+void simulate(run_t *r, char verbose) {
+	uint32_t n = r->its * ALLOCSPERCYCLE;
+	void *m = malloc(r->hs);
+	r->ps = calloc(n, sizeof(slot_t));
+	r->ev = malloc(r->its * sizeof(uint32_t));
+	if (m == NULL || r->ps == NULL || r->ev == NULL) {
+		printf("cannot allocate simulation\n");
+		r->rc = -1; goto cleanup;
 	}
-	if (p == PTRS) {
-		printf("no room left\n"); return -1;
+	if (heapinit(&r->h, m, r->hs) != 0) {
+		printf("cannot init heap of %zu bytes\n", r->hs);
+		r->rc = -1; goto cleanup;
 	}
-	int mx = PTRS/10;
-	if (mx < 2) mx = 2;
-	for(int i=0;i<mx;i++) {
-		int idx = rand()%PTRS;
-		if (ps[idx].ptr != NULL) {
-			int rc = 0;
-			uint8_t x = rand()%4;
-			uint32_t l = nextpow2(ps[idx].sz);
-			size_t s = x == 0 ? ps[idx].sz : l << x;
-			while (s >= MAXALLOC) s >>= 1;
-			void *ptr = buddy_extend_block(ps[idx].ptr, s, &rc);
-			if (ptr == NULL) {
-				if (s > 0) {
-					size_t allocd = s;
-					for(int z=0; z<p; z++) {
-						allocd += ps[z].sz;
-					}
-					printf("out of memory: %zu\n", allocd);
-				} else {
-					frees++;
-				}
-				ps[idx].ptr = NULL;
-				ps[idx].sz  = 0;
-				if (s > 0 || rc != BUDDY_HEAP_OK) return -1;
-			} else {
-				if (s != ps[idx].sz) {
-					reallocs++;
-					if (ptr == ps[idx].ptr) preservd++;
-					else {
-						size_t k = s > ps[idx].sz ?
-						               ps[idx].sz : s;
-						if (memcmp(ps[idx].ptr, ptr, k) != 0) {
-							printf("content not preserved!\n");
-							return -1;
-						}
-					}
-					if (s > ps[idx].sz) {
-						fillRandom(ps[idx].ptr+
-						           ps[idx].sz,
-                                                           s-ps[idx].sz);
-					}
-				}
-				ps[idx].ptr = ptr;
-				ps[idx].sz  = s;
-			}
-			break;
-		}
+	for(uint32_t i=0; i<n; i++) r->ps[i].nxt = i+1 < n ? i+1 : NOSLOT;
+	memset(r->ev, 0xff, r->its * sizeof(uint32_t));
+	r->fs = 0;
+	xseed(r, r->seed);
+
+	for(r->inow=0; r->inow<r->its; r->inow++) {
+		if (r->rc == 0) r->rc = allocationcycle(r);
+		if (r->rc == 0) r->rc = freecycle(r);
+		if (verbose && r->inow%2000 == 0) printheap(&r->h);
+		if (r->rc != 0) break;
 	}
-	return 0;
+	if (verbose) printheap(&r->h);
+
+cleanup:
+	free(r->ev); free(r->ps); free(m);
 }
-*/
 
-int main() {
-	int rc = 0;
-	memset(ps, 0, PTRS*sizeof(pointer_t));
-	heapinit();
-	// find heap:
-	_heap = getblock(MINALLOC); freeblock(_heap);
-	// printheap();
-	srand(time(NULL));
+/* ------------------------------------------------------------------------
+ * threads take the next run until all runs are done
+ * ------------------------------------------------------------------------
+ */
+typedef struct {
+	run_t   *runs;
+	uint32_t   nr;
+	uint32_t next;
+	char  verbose;
+} sim_t;
 
-	for(inow=0; inow<its; inow++) {
-		if (rc == 0) rc = allocationcycle();
-		if (rc == 0) rc = freecycle();
-		if (inow%2000 == 0) printheap();
-		if (rc != 0) break;
+void *worker(void *arg) {
+	sim_t *sim = arg;
+	for(;;) {
+		uint32_t i = __atomic_fetch_add(&sim->next, 1, __ATOMIC_RELAXED);
+		if (i >= sim->nr) break;
+		simulate(sim->runs+i, sim->verbose);
 	}
-	/*
-	for(int i=0; i<PTRS; i++) {
-		if (ps[i].it != 0) {
-			printf("%d\n", ps[i].it);
+	return NULL;
+}
+
+int main(int argc, char **argv) {
+	uint32_t nr = 1;
+	int      nt = 1;
+	uint64_t seed = (uint64_t)time(NULL);
+	it_t     its = 1048576 / 100;
+	size_t   sizes[MAXSIZES] = {H};
+	int      ns = 1;
+
+	if (argc > 1) nr = (uint32_t)atol(argv[1]);
+	if (argc > 2) nt = atoi(argv[2]);
+	if (argc > 3) seed = (uint64_t)strtoull(argv[3], NULL, 10);
+	if (argc > 4) its = (it_t)atol(argv[4]);
+	if (argc > 5) {
+		ns = 0;
+		for(int i=5; i<argc && ns < MAXSIZES; i++) {
+			sizes[ns++] = (size_t)atol(argv[i]) << 10;
 		}
 	}
-	*/
+	if (nr == 0 || nt < 1 || nt > MAXTHREADS || its == 0) {
+		fprintf(stderr, "usage: %s [runs [threads [seed [turns [KiB ...]]]]]\n",
+		                                                           argv[0]);
+		return -1;
+	}
 
-	printheap();
-	printf("allocs   : %d\n", allocs);
-	printf("frees    : %d\n", frees);
-	printf("reallocs : %d\n", reallocs);
-	if (reallocs > 0) {
-		printf("preserved: %d (= %d%%)\n", preservd, (100*preservd)/reallocs);
+	sim_t sim;
+	sim.nr = nr * (uint32_t)ns;
+	sim.next = 0;
+	sim.verbose = (sim.nr == 1);
+	sim.runs = calloc(sim.nr, sizeof(run_t));
+	if (sim.runs == NULL) {
+		fprintf(stderr, "cannot allocate %u runs\n", sim.nr);
+		return -1;
+	}
+	for(uint32_t i=0; i<sim.nr; i++) {
+		sim.runs[i].seed = seed + i/(uint32_t)ns;
+		sim.runs[i].hs   = sizes[i%(uint32_t)ns];
+		sim.runs[i].its  = its;
+	}
+
+	pthread_t tids[MAXTHREADS];
+	if ((uint32_t)nt > sim.nr) nt = (int)sim.nr;
+	for(int i=0; i<nt; i++) {
+		if (pthread_create(tids+i, NULL, worker, &sim) != 0) {
+			fprintf(stderr, "cannot create thread %d\n", i);
+			return -1;
+		}
+	}
+	for(int i=0; i<nt; i++) pthread_join(tids[i], NULL);
+
+	int rc = 0;
+	uint32_t failed = 0;
+	printf("seed,heap,allocs,frees,peak,turn,result\n");
+	for(uint32_t i=0; i<sim.nr; i++) {
+		run_t *r = sim.runs+i;
+		printf("%lu,%zu,%u,%u,%zu,%u,%s\n",
+		       (unsigned long)r->seed, r->hs, r->allocs, r->frees,
+		       r->peak, r->inow, r->rc == 0 ? "passed" : "FAILED");
+		if (r->rc != 0) {
+			rc = -1; failed++;
+		}
 	}
-	if (rc) printf("FAILED in round %u!!!\n", inow);
-	else printf("PASSED after %u iterations!\n", its);
+	free(sim.runs);
+	if (rc) printf("FAILED in %u of %u runs!!!\n", failed, sim.nr);
+	else printf("PASSED %u runs of %u iterations!\n", sim.nr, its);
 	return rc;
 }
@@ -0,0 +1,298 @@
+/* -----------------------------------------------------------------------
+ * Slabs on top of the Buddy System
+ * --------------------------------
+ *
+ *  (c) Tobias Schoofs, 2010 -- 2020
+ *      This code is in the Public Domain.
+ *
+ * A slab is a buddy block of size ssize. It starts with a header
+ * followed by a bitmap with one bit per object (1 = free)
+ * and the objects themselves:
+ *
+ *     +--------+------+-----+-----+-----+-----+
+ *     |        |      |     |     | ... |     |
+ *     +--------+------+-----+-----+-----+-----+
+ *     ^        ^      ^
+ *     |        |      |_ objects (from off)
+ *     |        |
+ *     |        |_ bitmap
+ *     |
+ *     |_ header
+ *
+ * Buddy blocks are aligned to their size (relative to the heap).
+ * The slab an object belongs to is therefore found by cutting off
+ * the lower bits of the object's address. The header points back
+ * to the cache, which lets us reject addresses that do not belong
+ * to the cache; the bitmap lets us reject objects that are free.
+ *
+ * An object is found using find-first-set on the bitmap.
+ *
+ * Slabs are kept in two doubly linked lists: the partial list holds
+ * slabs with free objects, the full list holds slabs without.
+ * A slab that becomes empty is kept as spare, if there is none yet,
+ * and returned to the heap otherwise.
+ * -----------------------------------------------------------------------
+ */
+#include <slab.h>
+#include <string.h>
+
+/* ------------------------------------------------------------------------
+ * Some shortcuts
+ * ------------------------------------------------------------------------
+ */
+#define OK       BUDDY_SLAB_OK
+#define NOTFOUND BUDDY_SLAB_NOTFOUND
+
+/* ------------------------------------------------------------------------
+ * Objects are aligned to ALIGN
+ * The default slab has at least MINSLAB bytes and MINOBJ objects
+ * ------------------------------------------------------------------------
+ */
+#define ALIGN   8
+#define MINSLAB 4096
+#define MINOBJ  8
+
+/* ------------------------------------------------------------------------
+ * Slab header
+ * ------------------------------------------------------------------------
+ */
+typedef struct slab_s {
+	buddy_slab_t  *c;   // the cache
+	struct slab_s *nxt; // next slab in list
+	struct slab_s *prv; // previous slab in list
+	uint32_t    nfree;  // free objects
+	uint32_t    words;  // words in bitmap
+	uint64_t    map[];  // bitmap
+} slab_t;
+
+/* ------------------------------------------------------------------------
+ * find first set (ffs)
+ * ------------------------------------------------------------------------
+ */
+#ifdef __GNUC__
+#define ffs64 __builtin_ctzll
+#endif
+
+/* ------------------------------------------------------------------------
+ * Round up to the next multiple of a power of two
+ * ------------------------------------------------------------------------
+ */
+static inline uint32_t alignup(uint32_t n, uint32_t a) {
+	return ((n + a - 1) & ~(a - 1));
+}
+
+/* ------------------------------------------------------------------------
+ * Words needed for n bits
+ * ------------------------------------------------------------------------
+ */
+static inline uint32_t mapwords(uint32_t n) {
+	return ((n + 63) / 64);
+}
+
+/* ------------------------------------------------------------------------
+ * Offset of the first object for n objects
+ * ------------------------------------------------------------------------
+ */
+static inline uint32_t objoffset(uint32_t n) {
+	return alignup(sizeof(slab_t) + mapwords(n) * sizeof(uint64_t), ALIGN);
+}
+
+/* ------------------------------------------------------------------------
+ * Number of objects of size o fitting into a slab of size s
+ * ------------------------------------------------------------------------
+ */
+static uint32_t fitobjs(uint32_t s, uint32_t o) {
+	if (s <= sizeof(slab_t) + sizeof(uint64_t) + o) return 0;
+	uint32_t n = (s - sizeof(slab_t)) / o;
+	while (n > 0 && objoffset(n) + n * o > s) n--;
+	return n;
+}
+
+/* ------------------------------------------------------------------------
+ * List operations
+ * ------------------------------------------------------------------------
+ */
+static inline void slabinsert(void **list, slab_t *s) {
+	s->prv = NULL;
+	s->nxt = *list;
+	if (s->nxt != NULL) s->nxt->prv = s;
+	*list = s;
+}
+
+static inline void slabremove(void **list, slab_t *s) {
+	if (s->prv != NULL) s->prv->nxt = s->nxt;
+	else *list = s->nxt;
+	if (s->nxt != NULL) s->nxt->prv = s->prv;
+	s->nxt = NULL;
+	s->prv = NULL;
+}
+
+/* ------------------------------------------------------------------------
+ * Prepare a new slab: all objects are free
+ * ------------------------------------------------------------------------
+ */
+static void slabinit(buddy_slab_t *c, slab_t *s) {
+	s->c = c;
+	s->nxt = NULL;
+	s->prv = NULL;
+	s->nfree = c->nobj;
+	s->words = mapwords(c->nobj);
+	memset(s->map, 0xff, s->words * sizeof(uint64_t));
+	if (c->nobj % 64 != 0) {
+		s->map[s->words-1] = ((uint64_t)1 << (c->nobj % 64)) - 1;
+	}
+}
+
+/* ------------------------------------------------------------------------
+ * Get a new slab: the spare or a block from the main heap
+ * ------------------------------------------------------------------------
+ */
+static slab_t *newslab(buddy_slab_t *c) {
+	slab_t *s = c->spare;
+	if (s != NULL) {
+		c->spare = NULL;
+	} else {
+		s = buddy_get_block(c->h, c->ssize);
+		if (s == NULL) return NULL;
+		// no slabs in the emergency heap
+		if ((uintptr_t)s >= c->h->eh) {
+			buddy_free_block(c->h, s);
+			return NULL;
+		}
+		c->slabs++;
+	}
+	slabinit(c, s);
+	return s;
+}
+
+/* ------------------------------------------------------------------------
+ * Init
+ * ------------------------------------------------------------------------
+ */
+int buddy_slab_init(buddy_slab_t *c) {
+	if (c->h == NULL || c->osize == 0) return -1;
+
+	c->osize = alignup(c->osize, ALIGN);
+	if (c->ssize == 0) {
+		c->ssize = MINSLAB;
+		while (fitobjs(c->ssize, c->osize) < MINOBJ &&
+		       c->ssize < c->h->msize) c->ssize <<= 1;
+	}
+	if ((c->ssize & (c->ssize - 1)) != 0 ||
+	     c->ssize >= c->h->msize) return -1;
+
+	c->nobj = fitobjs(c->ssize, c->osize);
+	if (c->nobj == 0) return -1;
+
+	c->off = objoffset(c->nobj);
+	c->slabs = 0;
+	c->used = 0;
+	c->partial = NULL;
+	c->full = NULL;
+	c->spare = NULL;
+	return memlock_init(&c->lck);
+}
+
+/* ------------------------------------------------------------------------
+ * malloc:
+ * - take the first slab with free objects (or get a new one)
+ * - find the first free object in the bitmap and mark it as used
+ * - if the slab is now full, move it to the full list
+ * ------------------------------------------------------------------------
+ */
+void *buddy_slab_get_block(buddy_slab_t *c) {
+	void *ret = NULL;
+
+	memlock_acquire(&c->lck);
+	slab_t *s = c->partial;
+	if (s == NULL) {
+		s = newslab(c);
+		if (s != NULL) slabinsert(&c->partial, s);
+	}
+	if (s != NULL) {
+		uint32_t w = 0;
+		while (s->map[w] == 0) w++;
+		uint32_t b = ffs64(s->map[w]);
+		s->map[w] &= ~((uint64_t)1 << b);
+		s->nfree--;
+		c->used++;
+		if (s->nfree == 0) {
+			slabremove(&c->partial, s);
+			slabinsert(&c->full, s);
+		}
+		ret = (char*)s + c->off + (w * 64 + b) * c->osize;
+	}
+	memlock_release(&c->lck);
+	return ret;
+}
+
+/* ------------------------------------------------------------------------
+ * free:
+ * - find the slab and verify that it belongs to this cache
+ * - verify that ptr is the start of an object in use
+ * - mark the object as free
+ * - if the slab was full, move it to the partial list
+ * - if the slab is now empty, keep it as spare or return it
+ * ------------------------------------------------------------------------
+ */
+int buddy_slab_free_block(buddy_slab_t *c, void *ptr) {
+	buddy_heap_t *h = c->h;
+	int rc = NOTFOUND;
+
+	if ((uintptr_t)ptr < h->hb || (uintptr_t)ptr >= h->eh) return rc;
+
+	uintptr_t a = (uintptr_t)ptr - h->hb;
+	slab_t *s = (slab_t*)(h->hb + (a & ~((uintptr_t)c->ssize - 1)));
+	uint32_t o = (uint32_t)((uintptr_t)ptr - (uintptr_t)s);
+
+	if (o < c->off || (o - c->off) % c->osize != 0) return rc;
+
+	uint32_t i = (o - c->off) / c->osize;
+	if (i >= c->nobj) return rc;
+
+	memlock_acquire(&c->lck);
+	if (s->c == c && (s->map[i/64] & ((uint64_t)1 << (i%64))) == 0) {
+		s->map[i/64] |= ((uint64_t)1 << (i%64));
+		if (s->nfree == 0) {
+			slabremove(&c->full, s);
+			slabinsert(&c->partial, s);
+		}
+		s->nfree++;
+		c->used--;
+		if (s->nfree == c->nobj) {
+			slabremove(&c->partial, s);
+			if (c->spare == NULL) c->spare = s;
+			else {
+				s->c = NULL;
+				buddy_free_block(h, s);
+				c->slabs--;
+			}
+		}
+		rc = OK;
+	}
+	memlock_release(&c->lck);
+	return rc;
+}
+
+/* ------------------------------------------------------------------------
+ * destroy: return all slabs
+ * ------------------------------------------------------------------------
+ */
+void buddy_slab_destroy(buddy_slab_t *c) {
+	void **lists[3] = {&c->partial, &c->full, &c->spare};
+
+	memlock_acquire(&c->lck);
+	for(int i=0; i<3; i++) {
+		slab_t *s = *lists[i];
+		while (s != NULL) {
+			slab_t *n = i < 2 ? s->nxt : NULL;
+			s->c = NULL;
+			buddy_free_block(c->h, s);
+			c->slabs--;
+			s = n;
+		}
+		*lists[i] = NULL;
+	}
+	c->used = 0;
+	memlock_release(&c->lck);
+}
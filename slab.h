@@ -0,0 +1,81 @@
+/* -----------------------------------------------------------------------
+ * Slabs on top of the Buddy System
+ * --------------------------------
+ *
+ *  (c) Tobias Schoofs, 2010 -- 2020
+ *      This code is in the Public Domain.
+ *
+ * A slab cache serves objects of one fixed size
+ * (which needs not be a power of two) from slabs,
+ * i.e. buddy blocks holding many objects of that size.
+ * Compared to allocating each object from the buddy system
+ * directly, this reduces the waste caused by rounding up
+ * to the next power of two and the number of splits and joins.
+ * Objects of the same size are, in addition, close to each other.
+ *
+ * Slabs are always taken from the main heap of the buddy system,
+ * never from the emergency heap.
+ * -----------------------------------------------------------------------
+ */
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <buddy.h>
+#include <memlock.h>
+
+#define BUDDY_SLAB_OK       0x0
+#define BUDDY_SLAB_NOTFOUND 0x4
+
+/* ------------------------------------------------------------------------
+ * Slab Cache Structure
+ * ------------------------------------------------------------------------
+ */
+typedef struct {
+  buddy_heap_t   *h; // the heap                  (set by user)
+  uint32_t    osize; // object size               (set by user)
+  uint32_t    ssize; // slab size, power of 2     (set by user)
+                     // or 0 for the default
+  memlock_t     lck; // lock (type set by user)
+  uint32_t     nobj; // objects per slab          (computed internally)
+  uint32_t      off; // offset of first object    (computed internally)
+  uint32_t    slabs; // slabs in use              (computed internally)
+  uint32_t     used; // objects in use            (computed internally)
+  void     *partial; // slabs with free objects   (computed internally)
+  void        *full; // slabs without free objs   (computed internally)
+  void       *spare; // one empty slab            (computed internally)
+} buddy_slab_t;
+
+/* ------------------------------------------------------------------------
+ * Slab Cache Initialisation
+ * The object size is rounded up to a multiple of 8.
+ * If no slab size is given, the slab size is the smallest
+ * power of two from 4 KiB upwards that holds at least 8 objects.
+ * Returns 0 on success and -1 on error.
+ * ------------------------------------------------------------------------
+ */
+int buddy_slab_init(buddy_slab_t *c);
+
+/* ------------------------------------------------------------------------
+ * Get an object
+ * Returns a pointer on success and NULL on failure
+ * ------------------------------------------------------------------------
+ */
+void *buddy_slab_get_block(buddy_slab_t *c);
+
+/* ------------------------------------------------------------------------
+ * Free the object indicated by ptr
+ * Returns 0 on success and 4 if the object is unknown
+ * (not an object of this cache or already free).
+ * ------------------------------------------------------------------------
+ */
+int buddy_slab_free_block(buddy_slab_t *c, void *ptr);
+
+/* ------------------------------------------------------------------------
+ * Return all slabs to the heap.
+ * All objects of the cache are invalid afterwards.
+ * ------------------------------------------------------------------------
+ */
+void buddy_slab_destroy(buddy_slab_t *c);
+#endif
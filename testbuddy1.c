@@ -6,14 +6,24 @@
  *     This code is in the Public Domain.
  * -----------------------------------------------------------------------
  */
+#if defined(USESEG) || defined(LAZY) || defined(MEMMAN_OFFSET64)
+#define _GNU_SOURCE // mincore, clock_gettime, MAP_NORESERVE
+#endif
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#ifdef MEMMAN_INSTRUMENT
+#include <meminst.h>
+#endif
+#ifdef MEMMAN_OFFSET64
+#include <sys/mman.h>
+#endif
 
 #ifdef USEKFFIT
 char _fheap[1048576];
+#define heapbase _fheap
 #include <ffit.h>
 ffit_heap_t h;
 
@@ -26,26 +36,129 @@ ffit_heap_t h;
 #define getblock(n) ffit_get_block(&h,n)
 #define freeblock(n) ffit_free_block(&h,n)
 #define exblock(n,s,r) ffit_extend_block(&h,n,s,r)
+#define stats_t ffit_stats_t
+#define getcounters(s) ffit_get_counters(&h,s)
+#define alignblock(a,n) ffit_get_aligned_block(&h,a,n)
+#define getblocks(n,k,o) ffit_get_blocks(&h,n,k,o)
+#define freeblocks(p,k) ffit_free_blocks(&h,p,k)
+#define usable(p) ffit_usable_size(&h,p)
+#define frag_t ffit_frag_t
+#define getfraginfo(f) ffit_get_frag_info(&h,f)
+
+#elif defined(USEMULTI)
+char _mheap[4259840];
+#define heapbase _mheap
+#include <memman.h>
+memman_multi_t h;
+
+#define heapinit() \
+	h.mh = (uintptr_t)_mheap; \
+	h.hs = 4259840; \
+	h.t  = MEMMAN_BUDDY; \
+	h.sel = MEMMAN_SEL_CPU; \
+	h.n  = 4; \
+	h.lt = MEMLOCK_SPIN; \
+	rc = memman_init(&h)
+
+#define OK MEMMAN_HEAP_OK
+#define getblock(n) memman_get_block(&h,n)
+#define freeblock(n) memman_free_block(&h,n)
+#define exblock(n,s,r) memman_extend_block(&h,n,s,r)
+
+#elif defined(USESEG)
+#include <memseg.h>
+#include <sys/mman.h>
+memseg_heap_t h;
+#define heapbase ((char*)h.sh)
+
+#define heapinit() \
+	h.ss = 262144; \
+	h.max = 64; \
+	h.hg = MAXALLOC; \
+	h.rt = 8192; \
+	h.lt = MEMLOCK_SPIN; \
+	rc = memseg_init(&h)
+
+#define OK MEMSEG_HEAP_OK
+#define getblock(n) memseg_get_block(&h,n)
+#define freeblock(n) memseg_free_block(&h,n)
+#define exblock(n,s,r) memseg_extend_block(&h,n,s,r)
+#define stats_t buddy_stats_t
+#define getcounters(s) memseg_get_counters(&h,s,NULL)
+#define ownerseg(p) ((uintptr_t)(p) >= h.sh && \
+                     (uintptr_t)(p) <  h.sh + h.n * h.ss)
+#define PAGESIZE 4096
 
 #else
 char _bheap[2097152];
+#define heapbase _bheap
 #include <buddy.h>
 buddy_heap_t h;
 #ifdef WITH_EMERGENCY
 #define E 1
 #define H 1048576
+#define L MEMLOCK_MUTEX
 #else
 #define E 0
 #define H 2097152
+#define L MEMLOCK_SPIN
+#endif
+#ifdef LAZY
+#define LT LAZY
+#else
+#define LT 0
 #endif
+#ifdef USECACHE
+buddy_cache_t c;
 #define heapinit() \
 	h.mh = (uintptr_t)_bheap; \
 	h.hs = H; \
 	h.e  = E; \
+	h.el = E; \
+	h.lck.t = L; \
+	rc = buddy_init(&h); \
+	c.h = &h; \
+	c.cmax = 12; \
+	c.depth = 16; \
+	c.bytes = 65536; \
+	if (rc == 0) rc = buddy_cache_init(&c)
+#define getblock(n) buddy_cache_get_block(&c,n)
+#define freeblock(n) buddy_cache_free_block(&c,n)
+#elif defined(USEREMOTE)
+#define heapinit() \
+	h.mh = (uintptr_t)_bheap; \
+	h.hs = H; \
+	h.e  = E; \
+	h.el = E; \
+	h.es = H/4; \
+	h.lck.t = L; \
+	rc = buddy_init(&h)
+#define getblock(n) buddy_get_block(&h,n)
+#define freeblock(n) buddy_free_remote(&h,n)
+#else
+#define heapinit() \
+	h.mh = (uintptr_t)_bheap; \
+	h.hs = H; \
+	h.e  = E; \
+	h.el = E; \
+	h.lt = LT; \
+	h.lck.t = L; \
 	rc = buddy_init(&h)
-#define OK BUDDY_HEAP_OK
 #define getblock(n) buddy_get_block(&h,n)
 #define freeblock(n) buddy_free_block(&h,n)
+#endif
+#ifndef USECACHE
+#define stats_t buddy_stats_t
+#define getcounters(s) buddy_get_counters(&h,s)
+#define alignblock(a,n) buddy_get_aligned_block(&h,a,n)
+#define getblocks(n,k,o) buddy_get_blocks(&h,n,k,o)
+#define freeblocks(p,k) buddy_free_blocks(&h,p,k)
+#define usable(p) buddy_usable_size(&h,p)
+#define freesized(p,n) buddy_free_sized(&h,p,n)
+#define frag_t buddy_frag_t
+#define getfraginfo(f) buddy_get_frag_info(&h,f)
+#endif
+#define OK BUDDY_HEAP_OK
 #define exblock(n,s,r) buddy_extend_block(&h,n,s,r)
 #endif
 
@@ -259,7 +372,7 @@ int testSimpleRealloc() {
 	memcpy(testbuf, ptr, s);
 
 	size_t n = randomBlockSize();
-	ptr = exblock(ptr, s, &rc);
+	ptr = exblock(ptr, n, &rc);
 	if (ptr == NULL) {
 		fprintf(stderr, "cannot reallocate %zu -> %zu bytes\n", s, n);
 		return -1;
@@ -282,6 +395,96 @@ int testSimpleRealloc() {
 	return 0;
 }
 
+/* ------------------------------------------------------------------------
+ * Test: Shrinking a block and growing it back to its size
+ *       does not move it (the tail is free after shrinking)
+ * ------------------------------------------------------------------------
+ */
+int testInPlaceRealloc() {
+	int rc;
+	size_t s = 1024 + rand()%(MAXALLOC-1024);
+	size_t n = 1 + rand()%512;
+
+	char *ptr = getblock(s);
+	if (ptr == NULL) {
+		fprintf(stderr, "cannot allocate %zu bytes\n", s);
+		return -1;
+	}
+	allocs++;
+	memset(ptr, 'r', s);
+
+	char *p = exblock(ptr, n, &rc);
+	if (p != ptr || rc != OK) {
+		fprintf(stderr, "%p shrunk to %zu bytes moved to %p\n", ptr, n, p);
+		return -1;
+	}
+	p = exblock(ptr, s, &rc);
+	if (p != ptr || rc != OK) {
+		fprintf(stderr, "%p grown to %zu bytes moved to %p\n", ptr, s, p);
+		return -1;
+	}
+	reallocs += 2;
+	for(size_t i=0; i<n; i++) {
+		if (ptr[i] != 'r') {
+			fprintf(stderr, "content not preserved\n");
+			return -1;
+		}
+	}
+	if (freeblock(ptr) != OK) {
+		fprintf(stderr, "cannot free pointer %p\n", ptr);
+		return -1;
+	}
+	frees++;
+	return 0;
+}
+
+/* ------------------------------------------------------------------------
+ * Test: A block whose left buddy is free grows into it
+ *       and its content is moved down
+ * ------------------------------------------------------------------------
+ */
+int testLeftRealloc() {
+#if defined(getblocks) && !defined(USEKFFIT)
+	void *blks[2];
+	int rc;
+
+	if (getblocks(1024, 2, blks) != 2) {
+		fprintf(stderr, "cannot allocate 2 blocks of 1024 bytes\n");
+		return -1;
+	}
+	allocs += 2;
+	char *l = blks[0], *r = blks[1];
+	if (r != l + 1024 || (((uintptr_t)l - h.hb) & 2047) != 0) {
+		// not buddies
+		frees += 2;
+		return (freeblocks(blks, 2) == OK ? 0 : -1);
+	}
+	memset(r, 'l', 1024);
+	if (freeblock(l) != OK) {
+		fprintf(stderr, "cannot free pointer %p\n", l);
+		return -1;
+	}
+	char *p = exblock(r, 2048, &rc);
+	if (p != l || rc != OK) {
+		fprintf(stderr, "%p grown to 2048 bytes moved to %p\n", r, p);
+		return -1;
+	}
+	reallocs++;
+	for(int i=0; i<1024; i++) {
+		if (p[i] != 'l') {
+			fprintf(stderr, "content not preserved\n");
+			return -1;
+		}
+	}
+	if (freeblock(p) != OK) {
+		fprintf(stderr, "cannot free pointer %p\n", p);
+		return -1;
+	}
+	frees += 2;
+#endif
+	return 0;
+}
+
 /* ------------------------------------------------------------------------
  * Test: Realloc as free
  * ------------------------------------------------------------------------
@@ -411,6 +614,822 @@ int testAllocWrongFree() {
 	return 0;
 }
 
+/* ------------------------------------------------------------------------
+ * Test: Aligned blocks are aligned, do not overlap other blocks
+ *       and are freed like any other block
+ * ------------------------------------------------------------------------
+ */
+int testAlignedAlloc() {
+#ifdef alignblock
+	size_t as[4] = {16, 32, 64, 4096};
+	for(int k=0; k<16; k++) {
+		size_t a = as[rand()%4];
+		size_t s = randomBlockSize();
+		char *ptr = alignblock(a, s);
+		if (ptr == NULL) {
+			fprintf(stderr, "cannot allocate %zu bytes aligned to %zu\n",
+			                                                    s, a);
+			return -1;
+		}
+		if (((uintptr_t)ptr & (a - 1)) != 0) {
+			fprintf(stderr, "%p is not aligned to %zu\n", ptr, a);
+			return -1;
+		}
+		memset(ptr, 'a', s);
+		int i = 0;
+		for(;i<PTRS;i++) {
+			if (ps[i].ptr == NULL) {
+				ps[i].ptr = ptr;
+				ps[i].sz  = s;
+				allocs++;
+				break;
+			}
+		}
+		if (i == PTRS) {
+			freeblock(ptr);
+			break;
+		}
+	}
+	if (validateptrs() != 0) return -1;
+	return cleanptrs();
+#else
+	return 0;
+#endif
+}
+
+/* ------------------------------------------------------------------------
+ * Test: Get a batch of blocks, verify that they do not overlap
+ *       and free them in two batches (the second one shuffled,
+ *       with an address freed twice)
+ * ------------------------------------------------------------------------
+ */
+#define BATCH 64
+
+int testBatch() {
+#ifdef getblocks
+	void *blks[BATCH+1];
+	size_t s = randomBlockSize();
+	size_t n = 1 + rand()%BATCH;
+
+	size_t k = getblocks(s, n, blks);
+	if (k != n) {
+		fprintf(stderr, "got %zu of %zu blocks of %zu bytes\n", k, n, s);
+		return -1;
+	}
+	allocs += k;
+	for(size_t i=0; i<k; i++) memset(blks[i], (char)i, s);
+	for(size_t i=0; i<k; i++) {
+		for(size_t j=0; j<s; j++) {
+			if (((char*)blks[i])[j] != (char)i) {
+				fprintf(stderr, "block %p overwritten\n", blks[i]);
+				return -1;
+			}
+		}
+	}
+	size_t m = k/2;
+	if (freeblocks(blks, m) != OK) {
+		fprintf(stderr, "cannot free %zu blocks\n", m);
+		return -1;
+	}
+	for(size_t i=m; i<k; i++) {
+		size_t j = m + rand()%(k-m);
+		void *t = blks[i]; blks[i] = blks[j]; blks[j] = t;
+	}
+#ifndef NOFREEPROTECT
+	if (m > 0) {
+		blks[k] = blks[0]; k++;
+		if (freeblocks(blks+m, k-m) == OK) {
+			fprintf(stderr, "freed block %p twice\n", blks[0]);
+			return -1;
+		}
+	} else
+#endif
+	if (freeblocks(blks+m, k-m) != OK) {
+		fprintf(stderr, "cannot free %zu blocks\n", k-m);
+		return -1;
+	}
+	frees += n;
+#endif
+	return 0;
+}
+
+/* ------------------------------------------------------------------------
+ * Test: The usable size is at least the size requested
+ *       and all of it can be used; sized frees with a wrong size
+ *       are rejected in debug builds
+ * ------------------------------------------------------------------------
+ */
+int testUsableSize() {
+#ifdef usable
+	size_t s = randomBlockSize();
+	char *ptr = getblock(s);
+	if (ptr == NULL) {
+		fprintf(stderr, "cannot allocate %zu bytes\n", s);
+		return -1;
+	}
+	allocs++;
+	size_t u = usable(ptr);
+	if (u < s) {
+		fprintf(stderr, "usable size of %p is %zu < %zu\n", ptr, u, s);
+		return -1;
+	}
+	memset(ptr, 'u', u);
+	if (usable(testheap+1) != 0) {
+		fprintf(stderr, "usable size of invalid pointer %p\n", testheap+1);
+		return -1;
+	}
+#ifdef freesized
+#if !defined(NDEBUG) && !defined(WITH_EMERGENCY)
+	if (freesized(ptr, 2*u) == OK) {
+		fprintf(stderr, "freed %p of size %zu with size %zu\n", ptr, u, 2*u);
+		return -1;
+	}
+#endif
+	if (freesized(ptr, s) != OK) {
+		fprintf(stderr, "cannot free pointer %p of size %zu\n", ptr, s);
+		return -1;
+	}
+#else
+	if (freeblock(ptr) != OK) {
+		fprintf(stderr, "cannot free pointer %p\n", ptr);
+		return -1;
+	}
+#endif
+	frees++;
+#endif
+	return 0;
+}
+
+/* ------------------------------------------------------------------------
+ * Test: Counters are consistent after all pointers are released
+ * ------------------------------------------------------------------------
+ */
+int testCounters() {
+#ifdef getcounters
+	stats_t st;
+	if (cleanptrs() != 0) return -1;
+	getcounters(&st);
+	if (st.usd != 0 || st.blks != 0 || st.fre != st.mem) {
+		fprintf(stderr, "%u blocks with %zu bytes still in use\n",
+		                                       st.blks, st.usd);
+		return -1;
+	}
+	if (st.wmark == 0 || st.wmark > st.mem || st.grnt < st.rqst) {
+		fprintf(stderr, "wrong counters: %zu, %lu, %lu\n",
+		        st.wmark, (unsigned long)st.rqst,
+		                  (unsigned long)st.grnt);
+		return -1;
+	}
+#endif
+	return 0;
+}
+
+/* ------------------------------------------------------------------------
+ * Test: Fragmentation information is consistent with the counters
+ * ------------------------------------------------------------------------
+ */
+int testFragInfo() {
+#ifdef getfraginfo
+	frag_t fi;
+	stats_t st;
+	size_t fre = 0, blks = 0;
+	getfraginfo(&fi);
+	getcounters(&st);
+	for(int i=0; i<(int)(sizeof(fi.cnt)/sizeof(size_t)); i++) {
+		blks += fi.cnt[i];
+#ifndef USEKFFIT
+		fre += fi.cnt[i] << i;
+#endif
+		if (fi.cnt[i] > 0 && fi.lrg < ((size_t)1 << i)) {
+			fprintf(stderr, "block of 2^%d greater than %zu\n", i, fi.lrg);
+			return -1;
+		}
+	}
+#ifdef USEKFFIT
+	fre = fi.fre; // classes are not exact
+#endif
+	if (fi.fre != fre || fi.fre != st.fre || fi.blks != blks) {
+		fprintf(stderr, "wrong fragmentation: %zu, %zu, %zu, %zu\n",
+		                fi.fre, fre, (size_t)st.fre, fi.blks);
+		return -1;
+	}
+	if (fi.lrg > fi.fre || fi.frag > 1000 ||
+	   (fi.fre > 0 && fi.lrg == 0))
+	{
+		fprintf(stderr, "wrong largest block: %zu, %zu, %u\n",
+		                fi.lrg, fi.fre, fi.frag);
+		return -1;
+	}
+#endif
+	return 0;
+}
+
+/* ------------------------------------------------------------------------
+ * Test: Instrumentation has counted what we did
+ * ------------------------------------------------------------------------
+ */
+int testInstrument() {
+#ifdef MEMMAN_INSTRUMENT
+	meminst_t m;
+	uint64_t n[MEMINST_HEAPS][MEMINST_OPS];
+	memset(n, 0, sizeof(n));
+	meminst_get(&m);
+	for(int i=0; i<MEMINST_HEAPS; i++) {
+		for(int o=0; o<MEMINST_OPS; o++) {
+			for(int b=0; b<MEMINST_BUCKETS; b++) {
+				n[i][o] += m.hist[i][o][b];
+			}
+		}
+	}
+	if (m.cnt[MEMINST_SPLITS] == 0 || m.cnt[MEMINST_JOINS] == 0 ||
+	    m.cnt[MEMINST_STEPS_INSERT] == 0 ||
+	    m.cnt[MEMINST_STEPS_REMOVE] == 0 ||
+	    m.cnt[MEMINST_INPLACE] + m.cnt[MEMINST_MOVED] == 0)
+	{
+		fprintf(stderr, "counters missing: %lu splits, %lu joins\n",
+		        (unsigned long)m.cnt[MEMINST_SPLITS],
+		        (unsigned long)m.cnt[MEMINST_JOINS]);
+		return -1;
+	}
+	if (n[MEMINST_BUDDY][MEMINST_GET] == 0 ||
+	    n[MEMINST_BUDDY][MEMINST_FREE] == 0 ||
+	    n[MEMINST_BUDDY][MEMINST_EXTEND] == 0 ||
+	    n[MEMINST_BUDDY][MEMINST_ALIGNED] == 0)
+	{
+		fprintf(stderr, "latencies missing: %lu gets, %lu extends\n",
+		        (unsigned long)n[MEMINST_BUDDY][MEMINST_GET],
+		        (unsigned long)n[MEMINST_BUDDY][MEMINST_EXTEND]);
+		return -1;
+	}
+	meminst_reset();
+	meminst_get(&m);
+	if (m.cnt[MEMINST_SPLITS] != 0) {
+		fprintf(stderr, "counters not reset\n");
+		return -1;
+	}
+#endif
+	return 0;
+}
+
+/* ------------------------------------------------------------------------
+ * Test: Huge blocks get their own mapping, are remapped on realloc
+ *       and unmapped on free
+ * ------------------------------------------------------------------------
+ */
+int testHugeBlocks() {
+#ifdef USESEG
+	int rc;
+	size_t s = MAXALLOC + 1 + rand()%1048576;
+	size_t n = MAXALLOC + 1 + rand()%1048576;
+	buddy_stats_t st;
+
+	char *ptr = getblock(s);
+	if (ptr == NULL) {
+		fprintf(stderr, "cannot allocate %zu bytes\n", s);
+		return -1;
+	}
+	if (ownerseg(ptr)) {
+		fprintf(stderr, "huge block %p in segment\n", ptr);
+		return -1;
+	}
+	memset(ptr, 'h', s);
+	ptr = exblock(ptr, n, &rc);
+	if (ptr == NULL || rc != OK) {
+		fprintf(stderr, "cannot reallocate %zu -> %zu bytes\n", s, n);
+		return -1;
+	}
+	for(size_t i=0; i<(n > s ? s : n); i++) {
+		if (ptr[i] != 'h') {
+			fprintf(stderr, "content not preserved\n");
+			return -1;
+		}
+	}
+	memseg_get_counters(&h, &st, &st);
+	if (st.blks != 1 || st.usd < n) {
+		fprintf(stderr, "%u huge blocks with %zu bytes\n", st.blks, st.usd);
+		return -1;
+	}
+	if (freeblock(ptr+PAGESIZE) == OK) {
+		fprintf(stderr, "freed address inside huge block %p\n", ptr);
+		return -1;
+	}
+	if (freeblock(ptr) != OK) {
+		fprintf(stderr, "cannot free huge block %p\n", ptr);
+		return -1;
+	}
+	if (freeblock(ptr) == OK) {
+		fprintf(stderr, "freed huge block %p twice\n", ptr);
+		return -1;
+	}
+#endif
+	return 0;
+}
+
+/* ------------------------------------------------------------------------
+ * Test: Blocks in segments growing beyond the huge threshold
+ *       or beyond the segment size leave their segment
+ * ------------------------------------------------------------------------
+ */
+int testSegmentRealloc() {
+#ifdef USESEG
+	int rc;
+	size_t ns[2] = {MAXALLOC + 1 + rand()%MAXALLOC,
+	                h.ss + 1 + rand()%h.ss};
+
+	for(int i=0; i<2; i++) {
+		size_t s = 1 + rand()%64;
+		char *ptr = getblock(s);
+		if (ptr == NULL || !ownerseg(ptr)) {
+			fprintf(stderr, "cannot allocate %zu bytes in segment\n", s);
+			return -1;
+		}
+		memset(ptr, 'g', s);
+		char *n = exblock(ptr, ns[i], &rc);
+		if (n == NULL || rc != OK) {
+			fprintf(stderr, "cannot reallocate %zu -> %zu bytes\n", s, ns[i]);
+			return -1;
+		}
+		if (ownerseg(n)) {
+			fprintf(stderr, "block of %zu bytes in segment\n", ns[i]);
+			return -1;
+		}
+		for(size_t k=0; k<s; k++) {
+			if (n[k] != 'g') {
+				fprintf(stderr, "content not preserved\n");
+				return -1;
+			}
+		}
+		memset(n, 'g', ns[i]);
+		if (freeblock(ptr) == OK) {
+			fprintf(stderr, "moved block %p freed again\n", ptr);
+			return -1;
+		}
+		if (freeblock(n) != OK) {
+			fprintf(stderr, "cannot free %p\n", n);
+			return -1;
+		}
+	}
+	// the huge threshold itself is served in place by the segments
+	char *ptr = getblock(h.hg);
+	char *n = exblock(ptr, h.hg, &rc);
+	if (ptr == NULL || !ownerseg(ptr) || n != ptr || rc != OK) {
+		fprintf(stderr, "block of %zu bytes moved to %p\n", h.hg, n);
+		return -1;
+	}
+	if (freeblock(n) != OK) {
+		fprintf(stderr, "cannot free %p\n", n);
+		return -1;
+	}
+#endif
+	return 0;
+}
+
+/* ------------------------------------------------------------------------
+ * Lazy coalescing: nanoseconds to free n blocks of 64 bytes
+ * in checkerboard order (no block can be joined) with lt
+ * or -1 on error
+ * ------------------------------------------------------------------------
+ */
+#ifdef LAZY
+static int64_t lazyfrees(uint32_t lt, int n) {
+	buddy_heap_t r;
+	struct timespec t0, t1;
+	int64_t d = -1;
+
+	size_t hs = (size_t)n * 64 * 2;
+	char *mem = malloc(hs);
+	char **blks = calloc(n, sizeof(char*));
+	if (mem == NULL || blks == NULL) goto cleanup;
+
+	memset(&r, 0, sizeof(r));
+	r.mh = (uintptr_t)mem;
+	r.hs = hs;
+	r.lt = lt;
+	if (buddy_init(&r) != OK) goto cleanup;
+	for(int i=0; i<n; i++) {
+		blks[i] = buddy_get_block(&r, 64);
+		if (blks[i] == NULL) goto cleanup;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for(int i=0; i<n; i+=2) {
+		if (buddy_free_block(&r, blks[i]) != OK) goto cleanup;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	d = (int64_t)(t1.tv_sec - t0.tv_sec) * 1000000000 +
+	             (t1.tv_nsec - t0.tv_nsec);
+
+cleanup:
+	free(blks); free(mem);
+	return d;
+}
+#endif
+
+/* ------------------------------------------------------------------------
+ * Test: In lazy mode, a request for the largest block
+ *       joins all deferred blocks
+ * ------------------------------------------------------------------------
+ */
+int testLazy() {
+#ifdef LAZY
+	// frees do not walk the list of their size:
+	// as fast as immediate joins (with a generous margin)
+	int64_t e = lazyfrees(0, 262144);
+	int64_t l = lazyfrees(LAZY, 262144);
+	if (e < 0 || l < 0) {
+		fprintf(stderr, "cannot run lazy frees\n");
+		return -1;
+	}
+	if (l > 10 * e + 20000000) {
+		fprintf(stderr, "lazy frees too slow: %lldns (eager: %lldns)\n",
+		        (long long)l, (long long)e);
+		return -1;
+	}
+
+	static char mem[262144];
+	static char *blks[2048];
+	buddy_heap_t r;
+
+	// buddies in use: the list of 64-byte blocks stays long,
+	// it is joined only every LAZY frees
+	memset(&r, 0, sizeof(r));
+	r.mh = (uintptr_t)mem;
+	r.hs = sizeof(mem);
+	r.lt = LAZY;
+	if (buddy_init(&r) != OK) {
+		fprintf(stderr, "cannot init lazy heap\n");
+		return -1;
+	}
+	for(int i=0; i<2048; i++) {
+		blks[i] = buddy_get_block(&r, 64);
+		if (blks[i] == NULL) {
+			fprintf(stderr, "cannot allocate block %d\n", i);
+			return -1;
+		}
+	}
+	// the heap may end in a spare block of 64 bytes
+	memoff_t f = r.fc[6];
+	for(int i=0; i<2048; i+=2) {
+		if (buddy_free_block(&r, blks[i]) != OK) {
+			fprintf(stderr, "cannot free block %d\n", i);
+			return -1;
+		}
+		if (r.lf[6] > LAZY) {
+			fprintf(stderr, "%u deferred frees of 64 bytes\n", r.lf[6]);
+			return -1;
+		}
+	}
+	if (r.fc[6] != f + 1024) {
+		fprintf(stderr, "%u available blocks of 64 bytes\n", r.fc[6]);
+		return -1;
+	}
+	for(int i=1; i<2048; i+=2) {
+		if (buddy_free_block(&r, blks[i]) != OK) {
+			fprintf(stderr, "cannot free block %d\n", i);
+			return -1;
+		}
+	}
+	if (buddy_get_block(&r, (size_t)1 << r.AMAX) == NULL) {
+		fprintf(stderr, "lazy heap not joined\n");
+		return -1;
+	}
+
+	if (cleanptrs() != 0) return -1;
+	size_t s = (size_t)1 << h.AMAX;
+	char *ptr = getblock(s);
+	if (ptr == NULL) {
+		fprintf(stderr, "deferred blocks not joined for %zu bytes\n", s);
+		return -1;
+	}
+	if (freeblock(ptr) != OK) {
+		fprintf(stderr, "cannot free %p\n", ptr);
+		return -1;
+	}
+#endif
+	return 0;
+}
+
+/* ------------------------------------------------------------------------
+ * Test: With 64-bit offsets, a heap of more than 4 GiB
+ *       (a sparse mapping) holds blocks beyond the offset 4 GiB
+ * ------------------------------------------------------------------------
+ */
+#ifdef MEMMAN_OFFSET64
+#define GIB ((size_t)1 << 30)
+#define BIGHEAP (5*GIB)
+#define BIGBLKS 8
+#endif
+
+int testLargeHeap() {
+#ifdef MEMMAN_OFFSET64
+	char *blks[BIGBLKS];
+	size_t sz[BIGBLKS];
+	int k = 0, rc = 0;
+
+	char *m = mmap(NULL, BIGHEAP, PROT_READ | PROT_WRITE,
+	               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (m == MAP_FAILED) {
+		fprintf(stderr, "cannot map %zu bytes\n", BIGHEAP);
+		return -1;
+	}
+#ifdef USEKFFIT
+	ffit_heap_t r;
+#define biginit() ffit_init(&r)
+#define bigstats(m,u,f) ffit_get_stats(&r,m,u,f)
+#define biggetblock(n) ffit_get_block(&r,n)
+#define bigfreeblock(p) ffit_free_block(&r,p)
+#else
+	buddy_heap_t r;
+#define biginit() buddy_init(&r)
+#define bigstats(m,u,f) buddy_get_stats(&r,m,u,f)
+#define biggetblock(n) buddy_get_block(&r,n)
+#define bigfreeblock(p) buddy_free_block(&r,p)
+#endif
+	memset(&r, 0, sizeof(r));
+	r.mh = (uintptr_t)m;
+	r.hs = BIGHEAP;
+#ifndef USEKFFIT
+	r.e  = E;
+	r.es = E ? GIB/16 : 0;
+#endif
+	if (biginit() != OK) {
+		fprintf(stderr, "cannot init heap of %zu bytes\n", BIGHEAP);
+		munmap(m, BIGHEAP);
+		return -1;
+	}
+
+	// one block of 3 GiB, then blocks of 256 MiB
+	// until one starts beyond 4 GiB
+	for(; k<BIGBLKS; k++) {
+		sz[k] = k == 0 ? 3*GIB : GIB/4;
+		blks[k] = biggetblock(sz[k]);
+		if (blks[k] == NULL) break;
+		blks[k][0] = 'b'; blks[k][sz[k]-1] = 'b';
+		if ((size_t)(blks[k] - m) >= 4*GIB) {
+			k++; break;
+		}
+	}
+	if (k == 0 || blks[k-1] == NULL || (size_t)(blks[k-1] - m) < 4*GIB) {
+		fprintf(stderr, "no block beyond 4 GiB\n");
+		rc = -1;
+	}
+
+	// 32-bit statistics saturate
+	uint32_t mem, usd, fre;
+	bigstats(&mem, &usd, &fre);
+	if (mem != UINT32_MAX || usd < 3*GIB) {
+		fprintf(stderr, "32-bit statistics wrapped: %u, %u\n", mem, usd);
+		rc = -1;
+	}
+	for(int i=0; i<k; i++) {
+		if (blks[i] == NULL) break;
+		if (blks[i][0] != 'b' || blks[i][sz[i]-1] != 'b') {
+			fprintf(stderr, "block %p overwritten\n", blks[i]);
+			rc = -1;
+		}
+		if (bigfreeblock(blks[i]) != OK) {
+			fprintf(stderr, "cannot free block %p\n", blks[i]);
+			rc = -1;
+		}
+	}
+
+	// all is joined again
+	if (rc == 0) {
+		char *p = biggetblock(4*GIB);
+		char *q = biggetblock(GIB/2);
+		if (p == NULL || q == NULL) {
+			fprintf(stderr, "cannot allocate 4 GiB and 512 MiB\n");
+			rc = -1;
+		}
+		if (p != NULL && bigfreeblock(p) != OK) rc = -1;
+		if (q != NULL && bigfreeblock(q) != OK) rc = -1;
+	}
+	munmap(m, BIGHEAP);
+	return rc;
+#else
+	return 0;
+#endif
+}
+
+/* ------------------------------------------------------------------------
+ * Test: buddy_init aligns the heap in hb
+ *       and leaves mh and hs as they were given
+ * ------------------------------------------------------------------------
+ */
+int testInitLayout() {
+#if !defined(USEKFFIT) && !defined(USEMULTI) && !defined(USESEG)
+	static char mem[262144+4096];
+	buddy_heap_t r;
+
+	uintptr_t m = (uintptr_t)mem | 8;
+	memset(&r, 0, sizeof(r));
+	r.mh = m;
+	r.hs = 262144;
+	if (buddy_init(&r) != OK) {
+		fprintf(stderr, "cannot init unaligned heap\n");
+		return -1;
+	}
+	if (r.mh != m || r.hs != 262144) {
+		fprintf(stderr, "heap changed to %p and %zu\n", (void*)r.mh, r.hs);
+		return -1;
+	}
+	if (r.hb < m || (r.hb & 4095) != 0) {
+		fprintf(stderr, "heap not aligned: %p\n", (void*)r.hb);
+		return -1;
+	}
+	char *p = buddy_get_block(&r, 4096);
+	if (p == NULL || ((uintptr_t)p & 4095) != 0) {
+		fprintf(stderr, "block %p not aligned\n", p);
+		return -1;
+	}
+	if (buddy_free_block(&r, p) != OK) {
+		fprintf(stderr, "cannot free %p\n", p);
+		return -1;
+	}
+#endif
+	return 0;
+}
+
+/* ------------------------------------------------------------------------
+ * Test: buddy_check_heap walks the size and free area;
+ *       the smallest blocks put codes in every slot,
+ *       across byte boundaries and in the last byte
+ * ------------------------------------------------------------------------
+ */
+int testCheckHeap() {
+#if !defined(USEKFFIT) && !defined(USEMULTI) && !defined(USESEG)
+	static char mem[67584+4096];
+	static void *blks[8192];
+	buddy_heap_t r;
+	int k = 0;
+
+	// 66 KiB on a page: the packed size area ends in a partial word
+	memset(&r, 0, sizeof(r));
+	r.mh = ((uintptr_t)mem + 4095) & ~(uintptr_t)4095;
+	r.hs = 67584;
+	r.lt = LT;
+	if (buddy_init(&r) != OK) {
+		fprintf(stderr, "cannot init heap\n");
+		return -1;
+	}
+	if (buddy_check_heap(&r) != OK) {
+		fprintf(stderr, "empty heap inconsistent\n");
+		return -1;
+	}
+	while (k < 8192 && (blks[k] = buddy_get_block(&r, 1)) != NULL) k++;
+	if (k < 2 || buddy_check_heap(&r) != OK) {
+		fprintf(stderr, "full heap (%d blocks) inconsistent\n", k);
+		return -1;
+	}
+	for(int i=0; i<k; i+=2) {
+		if (buddy_free_block(&r, blks[i]) != OK) {
+			fprintf(stderr, "cannot free %p\n", blks[i]);
+			return -1;
+		}
+	}
+	if (buddy_check_heap(&r) != OK) {
+		fprintf(stderr, "half-empty heap inconsistent\n");
+		return -1;
+	}
+	// keep the last block: its code is in the last (partial) word
+	int l = 1;
+	for(int i=1; i<k; i+=2) if (blks[i] > blks[l]) l = i;
+	for(int i=1; i<k; i+=2) {
+		if (i == l) continue;
+		if (buddy_free_block(&r, blks[i]) != OK) {
+			fprintf(stderr, "cannot free %p\n", blks[i]);
+			return -1;
+		}
+	}
+	if (buddy_check_heap(&r) != OK) {
+		fprintf(stderr, "heap with last block inconsistent\n");
+		return -1;
+	}
+	if (buddy_free_block(&r, blks[l]) != OK) {
+		fprintf(stderr, "cannot free %p\n", blks[l]);
+		return -1;
+	}
+	if (buddy_check_heap(&r) != OK) {
+		fprintf(stderr, "freed heap inconsistent\n");
+		return -1;
+	}
+	// a block the counters do not know of is found
+	r.st.blks++;
+	if (buddy_check_heap(&r) == OK) {
+		fprintf(stderr, "wrong counter not detected\n");
+		return -1;
+	}
+	r.st.blks--;
+#endif
+	return 0;
+}
+
+/* ------------------------------------------------------------------------
+ * Test: Wasteful requests go to the emergency heap first
+ *       and overflow into the main heap (in a heap of its own)
+ * ------------------------------------------------------------------------
+ */
+int testRouting() {
+#if defined(WITH_EMERGENCY) && !defined(USECACHE)
+	static char mem[262144];
+	static void *blks[256];
+	buddy_heap_t r;
+	buddy_stats_t st;
+	int k = 0, m = 0;
+
+	memset(&r, 0, sizeof(r));
+	r.mh = (uintptr_t)mem;
+	r.hs = sizeof(mem);
+	r.e  = 1;
+	r.wr = 250;
+	r.ws = 64;
+	if (buddy_init(&r) != OK) {
+		fprintf(stderr, "cannot init routing heap\n");
+		return -1;
+	}
+	blks[k++] = buddy_get_block(&r, 4096);
+	blks[k++] = buddy_get_block(&r, 20);
+	blks[k++] = buddy_get_aligned_block(&r, 64, 5000);
+	if (blks[0] == NULL || (uintptr_t)blks[0] >= r.eh ||
+	    blks[1] == NULL || (uintptr_t)blks[1] >= r.eh ||
+	    blks[2] == NULL || (uintptr_t)blks[2] <  r.eh ||
+	    ((uintptr_t)blks[2] & 63) != 0)
+	{
+		fprintf(stderr, "wrong routing: %p, %p, %p (%p)\n",
+		        blks[0], blks[1], blks[2], (void*)r.eh);
+		return -1;
+	}
+	for(; k<256; k++) {
+		blks[k] = buddy_get_block(&r, 5000);
+		if (blks[k] == NULL) break;
+		if ((uintptr_t)blks[k] < r.eh) m++;
+	}
+	if (m == 0 || k - m < 3) {
+		fprintf(stderr, "no overflow: %d in main heap, %d in emergency\n",
+		                                                    m, k - m);
+		return -1;
+	}
+	for(int i=0; i<k; i++) {
+		if (buddy_free_block(&r, blks[i]) != OK) {
+			fprintf(stderr, "cannot free routed block %p\n", blks[i]);
+			return -1;
+		}
+	}
+	buddy_get_counters(&r, &st);
+	if (st.usd != 0 || r.ffh.st.usd != 0) {
+		fprintf(stderr, "routing heap not empty: %zu, %zu\n",
+		                (size_t)st.usd, (size_t)r.ffh.st.usd);
+		return -1;
+	}
+#endif
+	return 0;
+}
+
+/* ------------------------------------------------------------------------
+ * Test: A new segment is mapped when the others are full
+ *       and the pages of the full one are returned when it is free again
+ * ------------------------------------------------------------------------
+ */
+int testSegments() {
+#ifdef USESEG
+	static char *blks[PTRS];
+	uint16_t n = h.n;
+	int k = 0;
+
+	for(; k<PTRS && h.n == n; k++) {
+		blks[k] = getblock(PAGESIZE);
+		if (blks[k] == NULL) {
+			fprintf(stderr, "cannot allocate %d bytes\n", PAGESIZE);
+			return -1;
+		}
+		memset(blks[k], 's', PAGESIZE);
+	}
+	if (h.n == n) {
+		fprintf(stderr, "no new segment after %d blocks\n", k);
+		return -1;
+	}
+	for(int i=0; i<k; i++) {
+		if (freeblock(blks[i]) != OK) {
+			fprintf(stderr, "cannot free pointer %p\n", blks[i]);
+			return -1;
+		}
+	}
+	buddy_heap_t *sg = (buddy_heap_t*)(h.sh + (n-1) * h.ss);
+	size_t pages = sg->msize / PAGESIZE;
+	unsigned char vec[pages];
+	if (mincore((void*)sg->hb, sg->msize, vec) != 0) {
+		fprintf(stderr, "mincore failed\n");
+		return -1;
+	}
+	size_t res = 0;
+	for(size_t i=0; i<pages; i++) res += vec[i] & 1;
+	if (res > pages / 4) {
+		fprintf(stderr, "%zu of %zu pages still resident\n", res, pages);
+		return -1;
+	}
+#endif
+	return 0;
+}
+
 int main() {
 	int rc = 0;
 	memset(ps, 0, PTRS*sizeof(pointer_t));
@@ -429,13 +1448,23 @@ int main() {
 		fprintf(stderr, "FAILED: cannot free buddyheap\n");
 		return -1;
 	}
+	// invalid pointers are derived from the start of the heap
+	testheap = heapbase;
 	srand(time(NULL));
  	for(int i=0; i<ITERS; i++) {
 		if (rc == 0) rc = testSimpleAlloc();
 		if (rc == 0) rc = testSimpleRealloc();
+		if (rc == 0) rc = testInPlaceRealloc();
+		if (rc == 0) rc = testLeftRealloc();
 		if (rc == 0) rc = testFreeByRealloc();
 		if (rc == 0) rc = testAllocByRealloc();
 		if (rc == 0) rc = testAllocWrongFree();
+		if (rc == 0 && i%10 == 0) rc = testHugeBlocks();
+		if (rc == 0 && i%10 == 0) rc = testSegmentRealloc();
+		if (rc == 0) rc = testAlignedAlloc();
+		if (rc == 0) rc = testBatch();
+		if (rc == 0) rc = testUsableSize();
+		if (rc == 0) rc = testFragInfo();
 		if (rc == 0) rc = testNAllocs(100, 100);
 		if (rc == 0) rc = testNAllocs(100, 50);
 		if (rc == 0) rc = testNAllocs(100, 0);
@@ -443,6 +1472,14 @@ int main() {
 		if (rc == 0) rc = validateptrs();
 		if (rc != 0) break;
 	}
+	if (rc == 0) rc = testCounters();
+	if (rc == 0) rc = testSegments();
+	if (rc == 0) rc = testRouting();
+	if (rc == 0) rc = testInitLayout();
+	if (rc == 0) rc = testCheckHeap();
+	if (rc == 0) rc = testLargeHeap();
+	if (rc == 0) rc = testLazy();
+	if (rc == 0) rc = testInstrument();
 	if (rc != 0) {
 		fprintf(stderr, "FAILED!\n");
 		return -1;
@@ -0,0 +1,214 @@
+/* -----------------------------------------------------------------------
+ * Basis tests for the C++ Allocators
+ * ----------------------------------
+ *
+ * (c) Tobias Schoofs, 2010 -- 2020
+ *     This code is in the Public Domain.
+ *
+ * Standard and pmr containers are filled, verified and
+ * destroyed on buddy, ebuddy and ffit heaps; afterwards
+ * no memory may be in use.
+ * -----------------------------------------------------------------------
+ */
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <list>
+#include <map>
+#include <array>
+#include <vector>
+#include <string>
+#include <memory_resource>
+#include <memalloc.hpp>
+
+#define HEAPSIZE 4194304
+#define ELEMENTS 10000
+
+#define BUDDY  0
+#define EBUDDY 1
+#define FFIT   2
+
+const char *names[] = {"buddy", "ebuddy", "ffit"};
+
+static_assert(memman::order(1) == BUDDY_MINORDER, "wrong minimal order");
+static_assert(memman::order(24) == 5, "wrong order of 24");
+static_assert(memman::order(32) == 5, "wrong order of 32");
+static_assert(memman::order(33) == 6, "wrong order of 33");
+
+unsigned char mem[HEAPSIZE];
+
+buddy_heap_t bh;
+ffit_heap_t  fh;
+
+/* ------------------------------------------------------------------------
+ * Helper: init the heap and check that nothing is left in use
+ * ------------------------------------------------------------------------
+ */
+static int init(int t) {
+	if (t == FFIT) {
+		memset(&fh, 0, sizeof(fh));
+		fh.mh = (uintptr_t)mem; fh.hs = HEAPSIZE;
+		return ffit_init(&fh);
+	}
+	memset(&bh, 0, sizeof(bh));
+	bh.mh = (uintptr_t)mem; bh.hs = HEAPSIZE;
+	bh.e = (t == EBUDDY);
+	return buddy_init(&bh);
+}
+
+static size_t inuse(int t) {
+	if (t == FFIT) {
+		ffit_stats_t st;
+		ffit_get_counters(&fh, &st);
+		return (size_t)st.usd;
+	}
+	buddy_stats_t st;
+	buddy_get_counters(&bh, &st);
+	return (size_t)st.usd + (size_t)bh.ffh.st.usd;
+}
+
+/* ------------------------------------------------------------------------
+ * Test: list and map with the typed allocator
+ * ------------------------------------------------------------------------
+ */
+template <class H>
+int testAllocator(H *h) {
+	typedef memman::allocator<int,H> ia;
+	typedef memman::allocator<std::pair<const int,uint64_t>,H> pa;
+	{
+		std::list<int,ia> l{ia(h)};
+		std::map<int,uint64_t,std::less<int>,pa> m{pa(h)};
+		std::vector<uint64_t,memman::allocator<uint64_t,H>> v{
+		                          memman::allocator<uint64_t,H>(h)};
+		for(int i=0; i<ELEMENTS; i++) {
+			l.push_back(i);
+			m[i] = (uint64_t)i*i;
+			v.push_back((uint64_t)i);
+		}
+		for(int i=0; i<ELEMENTS; i+=2) m.erase(i);
+		int k = 0;
+		for(int x : l) {
+			if (x != k++) {
+				fprintf(stderr, "list: %d instead of %d\n", x, k-1);
+				return -1;
+			}
+		}
+		for(auto &x : m) {
+			if (x.first%2 == 0 || x.second != (uint64_t)x.first*x.first) {
+				fprintf(stderr, "map: wrong entry %d\n", x.first);
+				return -1;
+			}
+		}
+		if (m.size() != ELEMENTS/2 || v.size() != ELEMENTS ||
+		    v[ELEMENTS-1] != ELEMENTS-1)
+		{
+			fprintf(stderr, "wrong sizes: %zu, %zu\n", m.size(), v.size());
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* ------------------------------------------------------------------------
+ * Test: pmr containers and aligned requests on the memory resource
+ * ------------------------------------------------------------------------
+ */
+template <class H>
+int testResource(H *h) {
+	memman::resource<H> r(h);
+	memman::resource<H> o(h);
+	if (!r.is_equal(o) || r.is_equal(*std::pmr::new_delete_resource())) {
+		fprintf(stderr, "wrong equality\n");
+		return -1;
+	}
+	{
+		std::pmr::vector<std::pmr::string> v(&r);
+		for(int i=0; i<ELEMENTS/10; i++) {
+			v.emplace_back(std::string(100 + i%50, (char)('a' + i%26)));
+		}
+		for(int i=0; i<ELEMENTS/10; i++) {
+			if (v[i].size() != (size_t)(100 + i%50) ||
+			    v[i][99] != (char)('a' + i%26))
+			{
+				fprintf(stderr, "string %d is wrong\n", i);
+				return -1;
+			}
+		}
+	}
+	void *ps[64];
+	size_t sz[64], al[64];
+	for(int i=0; i<64; i++) {
+		al[i] = (size_t)1 << (i%14);
+		sz[i] = 1 + rand()%3000;
+		ps[i] = r.allocate(sz[i], al[i]);
+		if (((uintptr_t)ps[i] & (al[i]-1)) != 0) {
+			fprintf(stderr, "%p not aligned to %zu\n", ps[i], al[i]);
+			return -1;
+		}
+		memset(ps[i], i, sz[i]);
+	}
+	for(int i=0; i<64; i++) r.deallocate(ps[i], sz[i], al[i]);
+	return 0;
+}
+
+/* ------------------------------------------------------------------------
+ * Test: a full heap throws bad_alloc (and the emergency heap
+ *       serves single objects beyond the main heap)
+ * ------------------------------------------------------------------------
+ */
+template <class H>
+int testExhaust(H *h) {
+	typedef std::array<char,100> obj_t;
+	memman::allocator<obj_t,H> a(h);
+	std::vector<obj_t*> v;
+	v.reserve(HEAPSIZE/64);
+	bool thrown = false;
+	try {
+		for(;;) v.push_back(a.allocate(1));
+	} catch(std::bad_alloc&) {
+		thrown = true;
+	}
+	for(obj_t *x : v) {
+		if (((uintptr_t)x & (alignof(obj_t)-1)) != 0) {
+			fprintf(stderr, "%p not aligned\n", (void*)x);
+			return -1;
+		}
+		a.deallocate(x, 1);
+	}
+	if (!thrown || v.size() < HEAPSIZE/256) {
+		fprintf(stderr, "only %zu objects\n", v.size());
+		return -1;
+	}
+	return 0;
+}
+
+template <class H>
+int run(int t, H *h) {
+	if (init(t) != 0) {
+		fprintf(stderr, "cannot init %s heap\n", names[t]);
+		return -1;
+	}
+	if (testAllocator(h) != 0 || testResource(h) != 0 ||
+	    testExhaust(h) != 0) return -1;
+	if (inuse(t) != 0) {
+		fprintf(stderr, "%s: %zu bytes still in use\n", names[t], inuse(t));
+		return -1;
+	}
+	return 0;
+}
+
+int main() {
+	int rc = 0;
+	srand(time(NULL));
+	if (rc == 0) rc = run(BUDDY, &bh);
+	if (rc == 0) rc = run(EBUDDY, &bh);
+	if (rc == 0) rc = run(FFIT, &fh);
+	if (rc != 0) {
+		fprintf(stderr, "FAILED!\n");
+		return -1;
+	}
+	fprintf(stderr, "PASSED!\n");
+	return 0;
+}
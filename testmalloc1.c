@@ -0,0 +1,297 @@
+/* -----------------------------------------------------------------------
+ * Basis tests for the Drop-in malloc
+ * ----------------------------------
+ *
+ * (c) Tobias Schoofs, 2010 -- 2020
+ *     This code is in the Public Domain.
+ *
+ * Linked against libmemman.a, so that the standard services
+ * are those of malloc.c. The heap is chosen by MEMMAN_HEAP.
+ * -----------------------------------------------------------------------
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+size_t malloc_usable_size(void *ptr);
+
+#define ITERS 100
+#define PTRS 1000
+#define MAXALLOC 16384
+
+typedef struct {
+	unsigned char *ptr;
+	size_t sz;
+} pointer_t;
+
+pointer_t ps[PTRS];
+
+size_t huge = SIZE_MAX/2;
+
+int allocs   = 0;
+int frees    = 0;
+int reallocs = 0;
+
+/* ------------------------------------------------------------------------
+ * Helper: random size (mostly small)
+ * ------------------------------------------------------------------------
+ */
+static inline size_t randomSize() {
+	if (rand()%8 == 0) return rand()%MAXALLOC;
+	return rand()%256;
+}
+
+/* ------------------------------------------------------------------------
+ * Helper: verify the pattern of pointer i
+ * ------------------------------------------------------------------------
+ */
+static int verify(int i) {
+	for(size_t k=0; k<ps[i].sz; k++) {
+		if (ps[i].ptr[k] != (unsigned char)i) {
+			fprintf(stderr, "pointer %p overwritten\n", ps[i].ptr);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* ------------------------------------------------------------------------
+ * Helper: verify that blocks are aligned for any type
+ * ------------------------------------------------------------------------
+ */
+static int aligned(void *ptr) {
+	if (((uintptr_t)ptr & 15) != 0) {
+		fprintf(stderr, "pointer %p is not aligned\n", ptr);
+		return -1;
+	}
+	return 0;
+}
+
+/* ------------------------------------------------------------------------
+ * Test: malloc, realloc and free randomly,
+ *       verify that no block overwrites another one
+ * ------------------------------------------------------------------------
+ */
+int testRandom() {
+	for(int k=0; k<PTRS; k++) {
+		int i = rand()%PTRS;
+		if (ps[i].ptr != NULL && verify(i) != 0) return -1;
+		if (ps[i].ptr == NULL) {
+			ps[i].sz = randomSize();
+			ps[i].ptr = malloc(ps[i].sz);
+			if (ps[i].ptr == NULL) {
+				fprintf(stderr, "cannot allocate %zu bytes\n", ps[i].sz);
+				return -1;
+			}
+			allocs++;
+		} else if (rand()%2) {
+			size_t s = randomSize();
+			if (s == 0) s = 1;
+			unsigned char *p = realloc(ps[i].ptr, s);
+			if (p == NULL) {
+				fprintf(stderr, "cannot reallocate %zu bytes\n", s);
+				return -1;
+			}
+			ps[i].ptr = p;
+			if (s < ps[i].sz) ps[i].sz = s;
+			if (verify(i) != 0) return -1;
+			ps[i].sz = s;
+			reallocs++;
+		} else {
+			free(ps[i].ptr);
+			ps[i].ptr = NULL;
+			frees++;
+			continue;
+		}
+		if (aligned(ps[i].ptr) != 0) return -1;
+		memset(ps[i].ptr, (unsigned char)i, ps[i].sz);
+	}
+	return 0;
+}
+
+/* ------------------------------------------------------------------------
+ * Test: calloc returns zeroed memory, also for blocks
+ *       that were used before
+ * ------------------------------------------------------------------------
+ */
+int testCalloc() {
+	size_t n = 1 + rand()%64;
+	size_t s = 1 + rand()%(4*MAXALLOC);
+	if (rand()%10 == 0) {
+		n = 1; s *= 64;
+	}
+	unsigned char *p = malloc(n*s);
+	if (p == NULL) {
+		fprintf(stderr, "cannot allocate %zu bytes\n", n*s);
+		return -1;
+	}
+	memset(p, 0xff, n*s);
+	free(p);
+	p = calloc(n, s);
+	if (p == NULL) {
+		fprintf(stderr, "cannot allocate %zu x %zu bytes\n", n, s);
+		return -1;
+	}
+	allocs++;
+	for(size_t i=0; i<n*s; i++) {
+		if (p[i] != 0) {
+			fprintf(stderr, "calloc: byte %zu of %p not zero\n", i, p);
+			return -1;
+		}
+	}
+	free(p);
+	frees++;
+	if (calloc(huge, 4) != NULL) {
+		fprintf(stderr, "calloc: overflow not detected\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* ------------------------------------------------------------------------
+ * Test: aligned allocation and the usable size
+ * ------------------------------------------------------------------------
+ */
+int testAligned() {
+	void *p = NULL;
+	size_t a = (size_t)8 << rand()%10;
+	size_t s = randomSize();
+	if (posix_memalign(&p, a, s) != 0) {
+		fprintf(stderr, "cannot allocate %zu bytes aligned to %zu\n", s, a);
+		return -1;
+	}
+	if (((uintptr_t)p & (a - 1)) != 0) {
+		fprintf(stderr, "pointer %p is not aligned to %zu\n", p, a);
+		return -1;
+	}
+	size_t u = malloc_usable_size(p);
+	if (u < s) {
+		fprintf(stderr, "usable size of %p is %zu < %zu\n", p, u, s);
+		return -1;
+	}
+	memset(p, 'a', u);
+	free(p);
+	if (posix_memalign(&p, 24, s) != EINVAL) {
+		fprintf(stderr, "alignment to 24 bytes accepted\n");
+		return -1;
+	}
+	if (malloc_usable_size(&p) != 0) {
+		fprintf(stderr, "usable size of unknown pointer %p\n", (void*)&p);
+		return -1;
+	}
+	return 0;
+}
+
+/* ------------------------------------------------------------------------
+ * Test: a realloc that finds no block fails with ENOMEM
+ *       and leaves the block as it was
+ * ------------------------------------------------------------------------
+ */
+int testReallocFail() {
+	size_t s = 1 + randomSize();
+	unsigned char *p = malloc(s);
+	if (p == NULL) {
+		fprintf(stderr, "cannot allocate %zu bytes\n", s);
+		return -1;
+	}
+	memset(p, 'r', s);
+	errno = 0;
+	if (realloc(p, huge) != NULL || errno != ENOMEM) {
+		fprintf(stderr, "realloc of %zu bytes did not fail\n", huge);
+		return -1;
+	}
+	for(size_t k=0; k<s; k++) {
+		if (p[k] != 'r') {
+			fprintf(stderr, "pointer %p lost by realloc\n", (void*)p);
+			return -1;
+		}
+	}
+	free(p);
+	return 0;
+}
+
+/* ------------------------------------------------------------------------
+ * Test: fork while another thread allocates;
+ *       the child must be able to allocate (and not hang on a lock)
+ * ------------------------------------------------------------------------
+ */
+#define FORKS 20
+
+static volatile int stop = 0;
+
+static void *churn(void *arg) {
+	while(!stop) {
+		void *p = malloc(1 + rand()%MAXALLOC);
+		free(p);
+	}
+	return NULL;
+}
+
+int testFork() {
+	pthread_t t;
+	int rc = 0;
+	if (pthread_create(&t, NULL, churn, NULL) != 0) {
+		fprintf(stderr, "cannot create thread\n");
+		return -1;
+	}
+	for(int i=0; i<FORKS && rc == 0; i++) {
+		pid_t pid = fork();
+		if (pid < 0) {
+			fprintf(stderr, "cannot fork\n");
+			rc = -1; break;
+		}
+		if (pid == 0) {
+			alarm(5);
+			for(int k=0; k<100; k++) {
+				void *p = malloc(1 + k*64);
+				if (p == NULL) _exit(1);
+				free(p);
+			}
+			_exit(0);
+		}
+		int st;
+		if (waitpid(pid, &st, 0) != pid || !WIFEXITED(st) ||
+		    WEXITSTATUS(st) != 0)
+		{
+			fprintf(stderr, "child %d failed\n", i);
+			rc = -1;
+		}
+	}
+	stop = 1;
+	pthread_join(t, NULL);
+	return rc;
+}
+
+int main() {
+	int rc = 0;
+	memset(ps, 0, PTRS*sizeof(pointer_t));
+	srand(time(NULL));
+	for(int i=0; i<ITERS; i++) {
+		if (rc == 0) rc = testRandom();
+		if (rc == 0) rc = testCalloc();
+		if (rc == 0) rc = testAligned();
+		if (rc == 0) rc = testReallocFail();
+		if (rc != 0) break;
+	}
+	for(int i=0; i<PTRS; i++) {
+		if (rc == 0 && ps[i].ptr != NULL) rc = verify(i);
+		free(ps[i].ptr);
+	}
+	if (rc == 0) rc = testFork();
+	if (rc != 0) {
+		fprintf(stderr, "FAILED!\n");
+		return -1;
+	}
+	fprintf(stderr, "PASSED!\n");
+	fprintf(stderr, "allocs  : %07d\n", allocs);
+	fprintf(stderr, "reallocs: %07d\n", reallocs);
+	fprintf(stderr, "frees   : %07d\n", frees);
+	return 0;
+}
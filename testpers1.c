@@ -0,0 +1,303 @@
+/* -----------------------------------------------------------------------
+ * Basis tests for Persistent Heaps
+ * --------------------------------
+ *
+ * (c) Tobias Schoofs, 2010 -- 2020
+ *     This code is in the Public Domain.
+ *
+ * A heap is formatted in a file, filled with linked blocks,
+ * detached and unmapped and then mapped again at another address,
+ * attached and verified; this is done for buddy, ebuddy and ffit.
+ * -----------------------------------------------------------------------
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <mempers.h>
+#include <buddy.h>
+
+#define REGION 4194304
+#define BLOCKS 1000
+#define MAXALLOC 2048
+
+#define BUDDY  0
+#define EBUDDY 1
+#define FFIT   2
+
+const char *names[] = {"buddy", "ebuddy", "ffit"};
+
+char path[] = "/tmp/testpers1XXXXXX";
+int  fd = -1;
+
+buddy_heap_t bh;
+ffit_heap_t  fh;
+
+/* ------------------------------------------------------------------------
+ * Blocks are linked by their offset in the region
+ * and filled with their number
+ * ------------------------------------------------------------------------
+ */
+typedef struct {
+	uint64_t nxt; // offset of the next block or 0
+	uint32_t n;
+	uint32_t sz;
+	unsigned char data[];
+} node_t;
+
+#define NODE(m,o) ((node_t*)((char*)(m) + (o)))
+#define OFF(m,x)  ((uint64_t)((char*)(x) - (char*)(m)))
+
+/* ------------------------------------------------------------------------
+ * Helper: map the file (at another address than before,
+ *         if there is an 'old' address to avoid)
+ * ------------------------------------------------------------------------
+ */
+static void *map(void *old) {
+	void *x = NULL;
+	if (old != NULL) {
+		x = mmap(old, REGION, PROT_NONE,
+		         MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+		if (x == MAP_FAILED) x = NULL;
+	}
+	void *m = mmap(NULL, REGION, PROT_READ | PROT_WRITE,
+	               MAP_SHARED, fd, 0);
+	if (x != NULL) munmap(x, REGION);
+	return m == MAP_FAILED ? NULL : m;
+}
+
+static void *get(int t, size_t sz) {
+	return t == FFIT ? ffit_get_block(&fh, sz) : buddy_get_block(&bh, sz);
+}
+
+static int release(int t, void *p) {
+	return t == FFIT ? ffit_free_block(&fh, p) : buddy_free_block(&bh, p);
+}
+
+static int format(int t, void *m) {
+	if (t == FFIT) {
+		memset(&fh, 0, sizeof(fh));
+		fh.mh = (uintptr_t)m; fh.hs = REGION;
+		fh.lck.t = MEMLOCK_SPIN;
+		return ffit_format(&fh);
+	}
+	memset(&bh, 0, sizeof(bh));
+	bh.mh = (uintptr_t)m; bh.hs = REGION;
+	bh.e = (t == EBUDDY);
+	bh.lck.t = MEMLOCK_SPIN;
+	return buddy_format(&bh);
+}
+
+static int detach(int t) {
+	return t == FFIT ? ffit_detach(&fh) : buddy_detach(&bh);
+}
+
+static int attach(int t, void *m) {
+	if (t == FFIT) {
+		memset(&fh, 0, sizeof(fh));
+		fh.lck.t = MEMLOCK_SPIN;
+		return ffit_attach(&fh, m);
+	}
+	memset(&bh, 0, sizeof(bh));
+	bh.hs = REGION;
+	bh.lck.t = MEMLOCK_SPIN;
+	return buddy_attach(&bh, m);
+}
+
+/* ------------------------------------------------------------------------
+ * Helper: verify the n blocks in the list of region m
+ * ------------------------------------------------------------------------
+ */
+static int verify(void *m, node_t *root, uint32_t n) {
+	uint32_t k = 0;
+	for(node_t *x = root; x != NULL; k++) {
+		if (x->n != n - k) {
+			fprintf(stderr, "block %u found as %u\n", n - k, x->n);
+			return -1;
+		}
+		for(uint32_t i=0; i<x->sz; i++) {
+			if (x->data[i] != (unsigned char)x->n) {
+				fprintf(stderr, "block %u overwritten\n", x->n);
+				return -1;
+			}
+		}
+		x = x->nxt == 0 ? NULL : NODE(m, x->nxt);
+	}
+	if (k != n) {
+		fprintf(stderr, "%u blocks found instead of %u\n", k, n);
+		return -1;
+	}
+	return 0;
+}
+
+/* ------------------------------------------------------------------------
+ * Helper: add the blocks f to f+n-1 in front of the list
+ * ------------------------------------------------------------------------
+ */
+static node_t *fill(int t, void *m, node_t *root, uint32_t f, uint32_t n) {
+	for(uint32_t i=f; i<f+n; i++) {
+		uint32_t sz = (uint32_t)(rand()%MAXALLOC);
+		node_t *x = get(t, sizeof(node_t) + sz);
+		if (x == NULL) {
+			fprintf(stderr, "cannot allocate block %u\n", i);
+			return NULL;
+		}
+		x->n = i; x->sz = sz;
+		memset(x->data, (unsigned char)i, sz);
+		x->nxt = root == NULL ? 0 : OFF(m, root);
+		root = x;
+	}
+	return root;
+}
+
+/* ------------------------------------------------------------------------
+ * Test: a heap survives detach, unmap, map and attach
+ * ------------------------------------------------------------------------
+ */
+int testReopen(int t) {
+	void *m = map(NULL);
+	if (m == NULL) {
+		fprintf(stderr, "cannot map %s\n", path);
+		return -1;
+	}
+	if (format(t, m) != 0) {
+		fprintf(stderr, "cannot format %s heap\n", names[t]);
+		return -1;
+	}
+	node_t *root = fill(t, m, NULL, 1, BLOCKS/2);
+	if (root == NULL) return -1;
+	if (t == FFIT) ffit_set_root(&fh, root); else buddy_set_root(&bh, root);
+	if (detach(t) != 0) {
+		fprintf(stderr, "cannot detach %s heap\n", names[t]);
+		return -1;
+	}
+	if (detach(t) == 0) {
+		fprintf(stderr, "%s heap detached twice\n", names[t]);
+		return -1;
+	}
+	munmap(m, REGION);
+
+	void *old = m;
+	m = map(old);
+	if (m == NULL) {
+		fprintf(stderr, "cannot map %s again\n", path);
+		return -1;
+	}
+	if (attach(t, m) != 0) {
+		fprintf(stderr, "cannot attach %s heap\n", names[t]);
+		return -1;
+	}
+	buddy_heap_t b = bh;
+	ffit_heap_t  f = fh;
+	if (attach(t, m) == 0) {
+		fprintf(stderr, "open %s heap attached\n", names[t]);
+		return -1;
+	}
+	bh = b; fh = f;
+	root = t == FFIT ? ffit_get_root(&fh) : buddy_get_root(&bh);
+	if (root == NULL || (char*)root < (char*)m ||
+	    (char*)root >= (char*)m + REGION) {
+		fprintf(stderr, "wrong root: %p\n", (void*)root);
+		return -1;
+	}
+	if (verify(m, root, BLOCKS/2) != 0) return -1;
+
+	// the heap still works: add blocks, free all
+	root = fill(t, m, root, BLOCKS/2+1, BLOCKS/2);
+	if (root == NULL || verify(m, root, BLOCKS) != 0) return -1;
+	for(node_t *x = root; x != NULL;) {
+		node_t *n = x->nxt == 0 ? NULL : NODE(m, x->nxt);
+		if (release(t, x) != 0) {
+			fprintf(stderr, "cannot free block %u\n", x->n);
+			return -1;
+		}
+		x = n;
+	}
+	if (t == FFIT) {
+		ffit_stats_t st;
+		ffit_get_counters(&fh, &st);
+		if (st.usd != 0) {
+			fprintf(stderr, "%zu bytes still in use\n", (size_t)st.usd);
+			return -1;
+		}
+	} else {
+		buddy_stats_t st;
+		buddy_get_counters(&bh, &st);
+		if (st.usd != 0 || bh.ffh.st.usd != 0) {
+			fprintf(stderr, "%zu bytes still in use\n", (size_t)st.usd);
+			return -1;
+		}
+	}
+	if (detach(t) != 0) {
+		fprintf(stderr, "cannot detach %s heap\n", names[t]);
+		return -1;
+	}
+	munmap(m, REGION);
+	return 0;
+}
+
+/* ------------------------------------------------------------------------
+ * Test: damaged and foreign heaps are not attached
+ * ------------------------------------------------------------------------
+ */
+int testReject(int t) {
+	void *m = map(NULL);
+	if (m == NULL) return -1;
+	mempers_hdr_t *p = m;
+	int o = t == FFIT ? BUDDY : FFIT;
+
+	if (attach(o, m) == 0) {
+		fprintf(stderr, "%s heap attached as %s\n", names[t], names[o]);
+		return -1;
+	}
+	// damage the snapshot
+	unsigned char *c = mempers_snapshot(p);
+	c[sizeof(uintptr_t)] ^= 1;
+	if (attach(t, m) == 0) {
+		fprintf(stderr, "damaged %s heap attached\n", names[t]);
+		return -1;
+	}
+	c[sizeof(uintptr_t)] ^= 1;
+	if (attach(t, m) != 0) {
+		fprintf(stderr, "cannot attach %s heap\n", names[t]);
+		return -1;
+	}
+	// crash: not detached
+	munmap(m, REGION);
+	m = map(NULL);
+	if (m == NULL) return -1;
+	if (attach(t, m) == 0) {
+		fprintf(stderr, "open %s heap attached after crash\n", names[t]);
+		return -1;
+	}
+	munmap(m, REGION);
+	return 0;
+}
+
+int main() {
+	int rc = 0;
+	srand(time(NULL));
+	fd = mkstemp(path);
+	if (fd < 0 || ftruncate(fd, REGION) != 0) {
+		fprintf(stderr, "cannot create %s\n", path);
+		return -1;
+	}
+	for(int t=BUDDY; t<=FFIT; t++) {
+		if (rc == 0) rc = testReopen(t);
+		if (rc == 0) rc = testReject(t);
+		if (rc != 0) break;
+	}
+	close(fd);
+	unlink(path);
+	if (rc != 0) {
+		fprintf(stderr, "FAILED!\n");
+		return -1;
+	}
+	fprintf(stderr, "PASSED!\n");
+	return 0;
+}
@@ -0,0 +1,230 @@
+/* -----------------------------------------------------------------------
+ * Basis tests for Slabs on top of the Buddy System
+ * -----------------------------------------------------------
+ *
+ * (c) Tobias Schoofs, 2010 -- 2020
+ *     This code is in the Public Domain.
+ * -----------------------------------------------------------------------
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <slab.h>
+
+char _bheap[2097152];
+buddy_heap_t h;
+
+#define CLASSES 5
+#define ITERS 100
+#define PTRS 1000
+
+uint32_t sizes[CLASSES] = {24, 40, 100, 520, 1000};
+
+buddy_slab_t cs[CLASSES];
+
+typedef struct {
+	unsigned char *ptr;
+	int cls;
+} pointer_t;
+
+pointer_t ps[PTRS];
+
+int allocs = 0;
+int frees  = 0;
+
+/* ------------------------------------------------------------------------
+ * Helper: fill object of pointer i with a pattern
+ * ------------------------------------------------------------------------
+ */
+static inline void fill(int i) {
+	memset(ps[i].ptr, (unsigned char)i, sizes[ps[i].cls]);
+}
+
+/* ------------------------------------------------------------------------
+ * Helper: verify the pattern of pointer i
+ * ------------------------------------------------------------------------
+ */
+static inline int verify(int i) {
+	for(uint32_t k=0; k<sizes[ps[i].cls]; k++) {
+		if (ps[i].ptr[k] != (unsigned char)i) {
+			fprintf(stderr, "object %p overwritten\n", ps[i].ptr);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* ------------------------------------------------------------------------
+ * Helper: allocate an object for pointer i
+ * ------------------------------------------------------------------------
+ */
+int allocptr(int i) {
+	int c = rand()%CLASSES;
+	ps[i].ptr = buddy_slab_get_block(&cs[c]);
+	if (ps[i].ptr == NULL) {
+		fprintf(stderr, "cannot allocate object of size %u\n", sizes[c]);
+		return -1;
+	}
+	ps[i].cls = c;
+	fill(i);
+	allocs++;
+	return 0;
+}
+
+/* ------------------------------------------------------------------------
+ * Helper: free the object of pointer i
+ * ------------------------------------------------------------------------
+ */
+int freeptr(int i) {
+	if (verify(i) != 0) return -1;
+	if (buddy_slab_free_block(&cs[ps[i].cls], ps[i].ptr) != BUDDY_SLAB_OK) {
+		fprintf(stderr, "cannot free object %p\n", ps[i].ptr);
+		return -1;
+	}
+	ps[i].ptr = NULL;
+	frees++;
+	return 0;
+}
+
+/* ------------------------------------------------------------------------
+ * Test: fill all pointers, free and reallocate them randomly
+ *       and verify that no object overwrites another one
+ * ------------------------------------------------------------------------
+ */
+int testRandomAllocs() {
+	for(int i=0; i<PTRS; i++) {
+		if (ps[i].ptr == NULL && allocptr(i) != 0) return -1;
+	}
+	for(int i=0; i<PTRS; i++) {
+		int p = rand()%PTRS;
+		if (ps[p].ptr != NULL) {
+			if (freeptr(p) != 0) return -1;
+		} else {
+			if (allocptr(p) != 0) return -1;
+		}
+	}
+	for(int i=0; i<PTRS; i++) {
+		if (ps[i].ptr != NULL && verify(i) != 0) return -1;
+	}
+	return 0;
+}
+
+/* ------------------------------------------------------------------------
+ * Test: invalid frees are rejected
+ * - an address inside an object
+ * - an object of another cache
+ * - an object freed twice
+ * ------------------------------------------------------------------------
+ */
+int testWrongFree() {
+	int c = rand()%CLASSES;
+	int o = (c+1)%CLASSES;
+	unsigned char *ptr = buddy_slab_get_block(&cs[c]);
+	if (ptr == NULL) {
+		fprintf(stderr, "cannot allocate object of size %u\n", sizes[c]);
+		return -1;
+	}
+	if (buddy_slab_free_block(&cs[c], ptr+8) == BUDDY_SLAB_OK) {
+		fprintf(stderr, "freed address inside object %p\n", ptr);
+		return -1;
+	}
+	if (buddy_slab_free_block(&cs[o], ptr) == BUDDY_SLAB_OK) {
+		fprintf(stderr, "freed object %p in wrong cache\n", ptr);
+		return -1;
+	}
+	if (buddy_slab_free_block(&cs[c], ptr) != BUDDY_SLAB_OK) {
+		fprintf(stderr, "cannot free object %p\n", ptr);
+		return -1;
+	}
+	if (buddy_slab_free_block(&cs[c], ptr) == BUDDY_SLAB_OK) {
+		fprintf(stderr, "freed object %p twice\n", ptr);
+		return -1;
+	}
+	return 0;
+}
+
+/* ------------------------------------------------------------------------
+ * Test: free everything, all slabs but the spare are returned
+ * ------------------------------------------------------------------------
+ */
+int testFreeAll() {
+	for(int i=0; i<PTRS; i++) {
+		if (ps[i].ptr != NULL && freeptr(i) != 0) return -1;
+	}
+	for(int c=0; c<CLASSES; c++) {
+		if (cs[c].used != 0 || cs[c].slabs > 1) {
+			fprintf(stderr, "cache %d: %u objects in %u slabs\n",
+			                c, cs[c].used, cs[c].slabs);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* ------------------------------------------------------------------------
+ * Test: 24-byte objects use less memory than 32-byte buddy blocks
+ * ------------------------------------------------------------------------
+ */
+int testPacking() {
+	uint32_t mem = 0, usd = 0, fre = 0;
+	buddy_get_stats(&h, &mem, &usd, &fre);
+	uint32_t before = usd;
+	for(int i=0; i<PTRS; i++) {
+		ps[i].ptr = buddy_slab_get_block(&cs[0]);
+		if (ps[i].ptr == NULL) return -1;
+		ps[i].cls = 0; fill(i);
+		allocs++;
+	}
+	mem = 0; usd = 0; fre = 0;
+	buddy_get_stats(&h, &mem, &usd, &fre);
+	if (usd - before >= PTRS * 32) {
+		fprintf(stderr, "%d objects of size 24 use %u bytes\n",
+		                                  PTRS, usd - before);
+		return -1;
+	}
+	return testFreeAll();
+}
+
+int main() {
+	int rc = 0;
+	memset(ps, 0, PTRS*sizeof(pointer_t));
+	h.mh = (uintptr_t)_bheap;
+	h.hs = 2097152;
+	h.e  = 0;
+	h.lck.t = MEMLOCK_SPIN;
+	if (buddy_init(&h) != 0) {
+		fprintf(stderr, "FAILED: cannot init heap\n");
+		return -1;
+	}
+	for(int c=0; c<CLASSES; c++) {
+		cs[c].h = &h;
+		cs[c].osize = sizes[c];
+		cs[c].ssize = 0;
+		cs[c].lck.t = MEMLOCK_SPIN;
+		if (buddy_slab_init(&cs[c]) != 0) {
+			fprintf(stderr, "FAILED: cannot init cache %d\n", c);
+			return -1;
+		}
+	}
+	srand(time(NULL));
+	for(int i=0; i<ITERS; i++) {
+		if (rc == 0) rc = testRandomAllocs();
+		if (rc == 0) rc = testWrongFree();
+		if (rc == 0 && i%10 == 0) rc = testFreeAll();
+		if (rc != 0) break;
+	}
+	if (rc == 0) rc = testFreeAll();
+	if (rc == 0) rc = testPacking();
+	for(int c=0; c<CLASSES; c++) buddy_slab_destroy(&cs[c]);
+	if (rc != 0) {
+		fprintf(stderr, "FAILED!\n");
+		return -1;
+	}
+	fprintf(stderr, "PASSED!\n");
+	fprintf(stderr, "allocs  : %07d\n", allocs);
+	fprintf(stderr, "frees   : %07d\n", frees);
+	return 0;
+}
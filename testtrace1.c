@@ -0,0 +1,198 @@
+/* -----------------------------------------------------------------------
+ * Tests for allocation traces
+ * ---------------------------
+ *
+ * (c) Tobias Schoofs, 2010 -- 2020
+ *     This code is in the Public Domain.
+ *
+ * The test runs itself with libmemmantrace.so preloaded:
+ * many short-lived threads, a few at a time, so that the rings
+ * of exited threads are taken over by new ones. It then checks
+ * the trace file and replays it with memreplay.
+ * Run it in the directory where make built both.
+ * -----------------------------------------------------------------------
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <memtrace.h>
+
+#define THREADS 512
+#define BATCH   8
+#define PAIRS   100
+#define SIZE    4999 // rarely requested by the libc
+#define MAXTHR  (4*THREADS) // rings, numbered by owner
+
+/* ------------------------------------------------------------------------
+ * Traced child: PAIRS mallocs and frees of SIZE per thread
+ * ------------------------------------------------------------------------
+ */
+static void *work(void *ignore) {
+	for(int i=0; i<PAIRS; i++) {
+		void * volatile p = malloc(SIZE);
+		if (p == NULL) return (void*)1;
+		free(p);
+	}
+	return NULL;
+}
+
+static int runthreads() {
+	pthread_t tids[BATCH];
+	for(int i=0; i<THREADS; i+=BATCH) {
+		for(int k=0; k<BATCH; k++) {
+			if (pthread_create(tids+k, NULL, work, NULL) != 0) {
+				fprintf(stderr, "cannot create thread %d\n", i+k);
+				return -1;
+			}
+		}
+		for(int k=0; k<BATCH; k++) {
+			void *r;
+			pthread_join(tids[k], &r);
+			if (r != NULL) {
+				fprintf(stderr, "malloc failed in thread %d\n", i+k);
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+/* ------------------------------------------------------------------------
+ * Helper: run this program traced into path
+ * ------------------------------------------------------------------------
+ */
+static int trace(const char *self, const char *path) {
+	pid_t pid = fork();
+	if (pid < 0) return -1;
+	if (pid == 0) {
+		setenv("MEMMAN_TRACE", path, 1);
+		setenv("LD_PRELOAD", "./libmemmantrace.so", 1);
+		execl(self, self, "child", (char*)NULL);
+		_exit(127);
+	}
+	int st;
+	if (waitpid(pid, &st, 0) != pid) return -1;
+	return WIFEXITED(st) && WEXITSTATUS(st) == 0 ? 0 : -1;
+}
+
+/* ------------------------------------------------------------------------
+ * Test: the trace has a valid header and all records of the threads
+ * ------------------------------------------------------------------------
+ */
+static int testTraceFile(const char *path) {
+	struct stat s;
+	memtrace_hdr_t hdr;
+	memtrace_rec_t rec;
+	static uint64_t pending[MAXTHR];
+	size_t n = 0, gets = 0, frees = 0;
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &s) != 0) {
+		fprintf(stderr, "cannot open trace %s\n", path);
+		return -1;
+	}
+	if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    memcmp(hdr.magic, MEMTRACE_MAGIC, 8) != 0 ||
+	    hdr.version != MEMTRACE_VERSION ||
+	    hdr.recsize != sizeof(memtrace_rec_t)) {
+		fprintf(stderr, "bad trace header\n");
+		close(fd); return -1;
+	}
+	if ((s.st_size - sizeof(hdr)) % sizeof(memtrace_rec_t) != 0) {
+		fprintf(stderr, "trace of %zu bytes ends in a partial record\n",
+		                                              (size_t)s.st_size);
+		close(fd); return -1;
+	}
+	// per thread, the records are in order:
+	// each free of a block of SIZE follows its malloc
+	while (read(fd, &rec, sizeof(rec)) == sizeof(rec)) {
+		n++;
+		if (rec.thr == 0 || rec.thr >= MAXTHR) continue;
+		// malloc obtains aligned blocks
+		if ((rec.op == MEMTRACE_GET || rec.op == MEMTRACE_ALIGNED) &&
+		    rec.sz == SIZE) {
+			pending[rec.thr] = rec.ptr; gets++;
+		} else if (rec.op == MEMTRACE_FREE && rec.ptr != 0 &&
+		           rec.ptr == pending[rec.thr]) {
+			pending[rec.thr] = 0; frees++;
+		}
+	}
+	close(fd);
+	if (n != (s.st_size - sizeof(hdr)) / sizeof(memtrace_rec_t)) {
+		fprintf(stderr, "cannot read all records\n");
+		return -1;
+	}
+	if (gets != (size_t)THREADS * PAIRS) {
+		fprintf(stderr, "%zu of %d mallocs in the trace\n",
+		                     gets, THREADS * PAIRS);
+		return -1;
+	}
+	if (frees != gets) {
+		fprintf(stderr, "%zu of %zu frees in the trace\n", frees, gets);
+		return -1;
+	}
+	return 0;
+}
+
+/* ------------------------------------------------------------------------
+ * Test: memreplay frees only blocks it has seen obtained
+ * ------------------------------------------------------------------------
+ */
+static int testReplay(const char *path) {
+	char cmd[256], line[256];
+	unsigned long long unknown = 1, fails = 1;
+
+	snprintf(cmd, sizeof(cmd), "./memreplay %s", path);
+	FILE *p = popen(cmd, "r");
+	if (p == NULL) {
+		fprintf(stderr, "cannot run %s\n", cmd);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), p) != NULL) {
+		sscanf(line, "unknown : %llu", &unknown);
+		sscanf(line, "failures: %llu", &fails);
+	}
+	if (pclose(p) != 0) {
+		fprintf(stderr, "%s failed\n", cmd);
+		return -1;
+	}
+	if (unknown != 0 || fails != 0) {
+		fprintf(stderr, "replay: %llu unknown frees, %llu failures\n",
+		                                                unknown, fails);
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	if (argc > 1 && strcmp(argv[1], "child") == 0) return runthreads();
+
+	char path[] = "/tmp/testtrace1.XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		fprintf(stderr, "cannot create trace file\n");
+		return -1;
+	}
+	close(fd);
+
+	int rc = trace(argv[0], path);
+	if (rc != 0) fprintf(stderr, "cannot trace %s\n", argv[0]);
+	if (rc == 0) rc = testTraceFile(path);
+	if (rc == 0) rc = testReplay(path);
+	unlink(path);
+	if (rc != 0) {
+		fprintf(stderr, "FAILED!\n");
+		return -1;
+	}
+	fprintf(stderr, "PASSED!\n");
+	fprintf(stderr, "threads : %07d\n", THREADS);
+	fprintf(stderr, "records : %07d\n", 2 * THREADS * PAIRS);
+	return 0;
+}